@@ -0,0 +1,697 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "muxerbench"
+#include <utils/Log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <binder/ProcessState.h>
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/MediaBuffer.h>
+#include <media/stagefright/MediaBufferGroup.h>
+#include <media/stagefright/MediaCodec.h>
+#include <media/stagefright/MediaDefs.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/MediaMuxer.h>
+#include <media/stagefright/MediaSource.h>
+#include <media/stagefright/MetaData.h>
+#include <media/stagefright/MPEG2TSWriter.h>
+#include <media/stagefright/MPEG4Writer.h>
+#include <media/stagefright/Utils.h>
+
+static void usage(const char *me) {
+    fprintf(stderr, "usage: %s [-f mp4|ts|muxer] [-v <video tracks>]"
+                    " [-a <audio tracks>] [-s <video sample size>]"
+                    " [-S <audio sample size>] [-r <frame rate>]"
+                    " [-g <gop size>] [-d <duration>] [-F <fragment duration>]"
+                    " [-p <programs>] [-c] [-o <output file>]\n", me);
+    fprintf(stderr, "       -h help\n");
+    fprintf(stderr, "       -f output through MPEG4Writer (mp4, default),"
+                    " MPEG2TSWriter (ts) or MediaMuxer (muxer)\n");
+    fprintf(stderr, "       -v number of AVC video tracks, default 1\n");
+    fprintf(stderr, "       -a number of AAC audio tracks, default 1\n");
+    fprintf(stderr, "       -s average video sample size in bytes,"
+                    " default 50000\n");
+    fprintf(stderr, "       -S average audio sample size in bytes,"
+                    " default 400\n");
+    fprintf(stderr, "       -r video frame rate, default 30\n");
+    fprintf(stderr, "       -g frames between video sync frames, default 30\n");
+    fprintf(stderr, "       -d duration of the streams in seconds,"
+                    " default 60\n");
+    fprintf(stderr, "       -F fragment duration in milli-seconds (mp4 only),"
+                    " default 0 (not fragmented)\n");
+    fprintf(stderr, "       -p number of programs (ts only), default 1\n");
+    fprintf(stderr, "       -c constant sample sizes instead of +/-50%%\n");
+    fprintf(stderr, "       -o output file name."
+                    " Default is /sdcard/muxerbench.<mp4|ts>\n");
+
+    exit(1);
+}
+
+using namespace android;
+
+// Generates "durationUs" worth of samples as fast as they are read, so that
+// the throughput measured is that of whatever consumes them. The payload is
+// random and not meant to be decodable; only the sizes and timestamps matter
+// to the writers.
+struct SyntheticSource : public MediaSource {
+    SyntheticSource(
+            bool isVideo, size_t sampleSize, bool constantSize,
+            int32_t frameRate, int32_t gopSize, int64_t durationUs,
+            unsigned seed);
+
+    virtual status_t start(MetaData *params = NULL);
+    virtual status_t stop();
+
+    virtual sp<MetaData> getFormat();
+
+    virtual status_t read(
+            MediaBuffer **out, const ReadOptions *options = NULL);
+
+    // Only to be called once the source is no longer being read.
+    size_t numSamplesRead() const { return mNumSamplesRead; }
+    int64_t numBytesRead() const { return mNumBytesRead; }
+
+protected:
+    virtual ~SyntheticSource();
+
+private:
+    enum {
+        kAudioSampleRate = 44100,
+        kAudioFrameSize  = 1024,
+        kNumBuffers      = 2,
+    };
+
+    bool mStarted;
+    bool mIsVideo;
+    size_t mSampleSize;
+    bool mConstantSize;
+    int32_t mFrameRate;
+    int32_t mGopSize;
+    int64_t mDurationUs;
+    unsigned mSeed;
+
+    size_t mNumSamplesRead;
+    int64_t mNumBytesRead;
+
+    MediaBufferGroup *mGroup;
+
+    size_t maxSampleSize() const;
+
+    DISALLOW_EVIL_CONSTRUCTORS(SyntheticSource);
+};
+
+SyntheticSource::SyntheticSource(
+        bool isVideo, size_t sampleSize, bool constantSize,
+        int32_t frameRate, int32_t gopSize, int64_t durationUs,
+        unsigned seed)
+    : mStarted(false),
+      mIsVideo(isVideo),
+      mSampleSize(sampleSize > 0 ? sampleSize : 1),
+      mConstantSize(constantSize),
+      mFrameRate(frameRate),
+      mGopSize(gopSize > 0 ? gopSize : 1),
+      mDurationUs(durationUs),
+      mSeed(seed),
+      mNumSamplesRead(0),
+      mNumBytesRead(0),
+      mGroup(NULL) {
+    CHECK_GT(frameRate, 0);
+}
+
+SyntheticSource::~SyntheticSource() {
+    if (mStarted) {
+        stop();
+    }
+}
+
+size_t SyntheticSource::maxSampleSize() const {
+    return mConstantSize ? mSampleSize : mSampleSize + mSampleSize / 2;
+}
+
+status_t SyntheticSource::start(MetaData *params) {
+    CHECK(!mStarted);
+
+    // The content is made up once, the buffers are recycled as is.
+    mGroup = new MediaBufferGroup;
+    for (size_t i = 0; i < kNumBuffers; ++i) {
+        MediaBuffer *buffer = new MediaBuffer(maxSampleSize());
+        uint8_t *ptr = (uint8_t *)buffer->data();
+        for (size_t j = 0; j < buffer->size(); ++j) {
+            ptr[j] = rand_r(&mSeed) & 0xff;
+        }
+        // Keep the writers from mistaking the payload for a start code.
+        ptr[0] = 0xff;
+        mGroup->add_buffer(buffer);
+    }
+
+    mNumSamplesRead = 0;
+    mNumBytesRead = 0;
+    mStarted = true;
+
+    return OK;
+}
+
+status_t SyntheticSource::stop() {
+    CHECK(mStarted);
+
+    delete mGroup;
+    mGroup = NULL;
+
+    mStarted = false;
+
+    return OK;
+}
+
+sp<MetaData> SyntheticSource::getFormat() {
+    // Baseline profile, level 4.0, a single SPS and PPS.
+    static const uint8_t kAVCC[] = {
+        0x01, 0x42, 0xc0, 0x28, 0xff, 0xe1,
+        0x00, 0x08, 0x67, 0x42, 0xc0, 0x28, 0xda, 0x01, 0xe0, 0x08,
+        0x01,
+        0x00, 0x04, 0x68, 0xce, 0x3c, 0x80
+    };
+
+    // ES_Descriptor with an AAC LC, 44.1kHz, stereo AudioSpecificConfig.
+    static const uint8_t kESDS[] = {
+        0x03, 0x19, 0x00, 0x00, 0x00,
+        0x04, 0x11, 0x40, 0x15, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00,
+        0x05, 0x02, 0x12, 0x10,
+        0x06, 0x01, 0x02
+    };
+
+    sp<MetaData> meta = new MetaData;
+    if (mIsVideo) {
+        meta->setCString(kKeyMIMEType, MEDIA_MIMETYPE_VIDEO_AVC);
+        meta->setInt32(kKeyWidth, 1920);
+        meta->setInt32(kKeyHeight, 1080);
+        meta->setInt32(kKeyFrameRate, mFrameRate);
+        meta->setData(kKeyAVCC, kTypeAVCC, kAVCC, sizeof(kAVCC));
+    } else {
+        meta->setCString(kKeyMIMEType, MEDIA_MIMETYPE_AUDIO_AAC);
+        meta->setInt32(kKeyChannelCount, 2);
+        meta->setInt32(kKeySampleRate, kAudioSampleRate);
+        meta->setData(kKeyESDS, kTypeESDS, kESDS, sizeof(kESDS));
+    }
+    meta->setInt32(kKeyMaxInputSize, maxSampleSize());
+    meta->setInt64(kKeyDuration, mDurationUs);
+
+    return meta;
+}
+
+status_t SyntheticSource::read(
+        MediaBuffer **out, const ReadOptions *options) {
+    *out = NULL;
+
+    int64_t timeUs;
+    if (mIsVideo) {
+        timeUs = (int64_t)mNumSamplesRead * 1000000ll / mFrameRate;
+    } else {
+        timeUs = (int64_t)mNumSamplesRead * kAudioFrameSize * 1000000ll
+                    / kAudioSampleRate;
+    }
+
+    if (timeUs >= mDurationUs) {
+        return ERROR_END_OF_STREAM;
+    }
+
+    MediaBuffer *buffer;
+    status_t err = mGroup->acquire_buffer(&buffer);
+    if (err != OK) {
+        return err;
+    }
+
+    size_t size = mSampleSize;
+    if (!mConstantSize) {
+        size = mSampleSize / 2 + rand_r(&mSeed) % (mSampleSize + 1);
+        if (size == 0) {
+            size = 1;
+        }
+    }
+    buffer->set_range(0, size);
+
+    sp<MetaData> meta = buffer->meta_data();
+    meta->clear();
+    meta->setInt64(kKeyTime, timeUs);
+    if (mIsVideo) {
+        meta->setInt64(kKeyDecodingTime, timeUs);
+        if ((mNumSamplesRead % mGopSize) == 0) {
+            meta->setInt32(kKeyIsSyncFrame, true);
+        }
+    } else {
+        meta->setInt32(kKeyIsSyncFrame, true);
+    }
+
+    ++mNumSamplesRead;
+    mNumBytesRead += size;
+
+    *out = buffer;
+
+    return OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Counters from /proc/self/io, which cover all the threads of the process.
+// Not every kernel has them, hence "valid".
+struct IOStats {
+    bool mValid;
+    int64_t mReadSyscalls;
+    int64_t mWriteSyscalls;
+    int64_t mBytesWritten;
+};
+
+static void getIOStats(IOStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    FILE *file = fopen("/proc/self/io", "r");
+    if (file == NULL) {
+        return;
+    }
+
+    char name[32];
+    long long value;
+    size_t found = 0;
+    while (fscanf(file, "%31[^:]: %lld\n", name, &value) == 2) {
+        if (!strcmp(name, "syscr")) {
+            stats->mReadSyscalls = value;
+            ++found;
+        } else if (!strcmp(name, "syscw")) {
+            stats->mWriteSyscalls = value;
+            ++found;
+        } else if (!strcmp(name, "wchar")) {
+            stats->mBytesWritten = value;
+            ++found;
+        }
+    }
+    fclose(file);
+
+    stats->mValid = (found == 3);
+}
+
+static long getPeakMemoryKB() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        return -1;
+    }
+    return usage.ru_maxrss;
+}
+
+static status_t runWriter(
+        const sp<MediaWriter> &writer, const sp<MetaData> &params) {
+    status_t err = writer->start(params.get());
+    if (err != OK) {
+        return err;
+    }
+
+    while (!writer->reachedEOS()) {
+        usleep(10000);
+    }
+
+    return writer->stop();
+}
+
+// Interleaves the samples of all sources by timestamp, the way an
+// application feeding MediaMuxer from encoders would.
+static status_t runMuxer(
+        const char *outputFileName,
+        const Vector<sp<SyntheticSource> > &sources) {
+    sp<MediaMuxer> muxer = new MediaMuxer(outputFileName,
+                                          MediaMuxer::OUTPUT_FORMAT_MPEG_4);
+
+    Vector<ssize_t> trackIndices;
+    Vector<sp<ABuffer> > buffers;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        sp<MetaData> meta = sources.itemAt(i)->getFormat();
+
+        sp<AMessage> format;
+        status_t err = convertMetaDataToMessage(meta, &format);
+        CHECK_EQ(err, (status_t)OK);
+
+        ssize_t trackIndex = muxer->addTrack(format);
+        if (trackIndex < 0) {
+            return trackIndex;
+        }
+        trackIndices.push(trackIndex);
+
+        int32_t maxInputSize;
+        CHECK(meta->findInt32(kKeyMaxInputSize, &maxInputSize));
+        buffers.push(new ABuffer(maxInputSize));
+    }
+
+    for (size_t i = 0; i < sources.size(); ++i) {
+        CHECK_EQ(sources.itemAt(i)->start(), (status_t)OK);
+    }
+
+    status_t err = muxer->start();
+    if (err != OK) {
+        return err;
+    }
+
+    // Samples read ahead from each source, NULL once it reached EOS.
+    Vector<MediaBuffer *> pending;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        MediaBuffer *buffer;
+        if (sources.itemAt(i)->read(&buffer) != OK) {
+            buffer = NULL;
+        }
+        pending.push(buffer);
+    }
+
+    for (;;) {
+        ssize_t next = -1;
+        int64_t nextTimeUs = 0;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            if (pending.itemAt(i) == NULL) {
+                continue;
+            }
+
+            int64_t timeUs;
+            CHECK(pending.itemAt(i)->meta_data()->findInt64(
+                        kKeyTime, &timeUs));
+            if (next < 0 || timeUs < nextTimeUs) {
+                next = i;
+                nextTimeUs = timeUs;
+            }
+        }
+
+        if (next < 0) {
+            break;
+        }
+
+        MediaBuffer *buffer = pending.itemAt(next);
+        const sp<ABuffer> &copy = buffers.itemAt(next);
+        memcpy(copy->base(),
+               (const uint8_t *)buffer->data() + buffer->range_offset(),
+               buffer->range_length());
+        copy->setRange(0, buffer->range_length());
+
+        uint32_t sampleFlags = 0;
+        int32_t isSync;
+        if (buffer->meta_data()->findInt32(kKeyIsSyncFrame, &isSync)
+                && isSync) {
+            sampleFlags |= MediaCodec::BUFFER_FLAG_SYNCFRAME;
+        }
+
+        buffer->release();
+        buffer = NULL;
+
+        err = muxer->writeSampleData(
+                copy, trackIndices.itemAt(next), nextTimeUs, sampleFlags);
+        if (err != OK) {
+            break;
+        }
+
+        if (sources.itemAt(next)->read(&buffer) != OK) {
+            buffer = NULL;
+        }
+        pending.editItemAt(next) = buffer;
+    }
+
+    for (size_t i = 0; i < pending.size(); ++i) {
+        if (pending.itemAt(i) != NULL) {
+            pending.itemAt(i)->release();
+        }
+    }
+
+    status_t stopErr = muxer->stop();
+
+    for (size_t i = 0; i < sources.size(); ++i) {
+        sources.itemAt(i)->stop();
+    }
+
+    return err != OK ? err : stopErr;
+}
+
+int main(int argc, char **argv) {
+    const char *me = argv[0];
+
+    const char *format = "mp4";
+    int numVideoTracks = 1;
+    int numAudioTracks = 1;
+    int videoSampleSize = 50000;
+    int audioSampleSize = 400;
+    int frameRate = 30;
+    int gopSize = 30;
+    int durationSecs = 60;
+    int fragmentDurationMs = 0;
+    int numPrograms = 1;
+    bool constantSize = false;
+    const char *outputFileName = NULL;
+
+    int res;
+    while ((res = getopt(argc, argv, "h?f:v:a:s:S:r:g:d:F:p:co:")) >= 0) {
+        switch (res) {
+            case 'f':
+            {
+                format = optarg;
+                break;
+            }
+
+            case 'v':
+            {
+                numVideoTracks = atoi(optarg);
+                break;
+            }
+
+            case 'a':
+            {
+                numAudioTracks = atoi(optarg);
+                break;
+            }
+
+            case 's':
+            {
+                videoSampleSize = atoi(optarg);
+                break;
+            }
+
+            case 'S':
+            {
+                audioSampleSize = atoi(optarg);
+                break;
+            }
+
+            case 'r':
+            {
+                frameRate = atoi(optarg);
+                break;
+            }
+
+            case 'g':
+            {
+                gopSize = atoi(optarg);
+                break;
+            }
+
+            case 'd':
+            {
+                durationSecs = atoi(optarg);
+                break;
+            }
+
+            case 'F':
+            {
+                fragmentDurationMs = atoi(optarg);
+                break;
+            }
+
+            case 'p':
+            {
+                numPrograms = atoi(optarg);
+                break;
+            }
+
+            case 'c':
+            {
+                constantSize = true;
+                break;
+            }
+
+            case 'o':
+            {
+                outputFileName = optarg;
+                break;
+            }
+
+            case '?':
+            case 'h':
+            default:
+            {
+                usage(me);
+            }
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 0) {
+        usage(me);
+    }
+
+    bool useTS = !strcmp(format, "ts");
+    bool useMuxer = !strcmp(format, "muxer");
+    if (!useTS && !useMuxer && strcmp(format, "mp4")) {
+        fprintf(stderr, "ERROR: unknown output format %s\n", format);
+        return 1;
+    }
+
+    if (numVideoTracks < 0 || numAudioTracks < 0
+            || numVideoTracks + numAudioTracks == 0) {
+        fprintf(stderr, "ERROR: no track to mux.\n");
+        return 1;
+    }
+
+    if (videoSampleSize <= 0 || audioSampleSize <= 0 || frameRate <= 0
+            || gopSize <= 0 || durationSecs <= 0 || fragmentDurationMs < 0
+            || numPrograms <= 0) {
+        fprintf(stderr, "ERROR: invalid argument.\n");
+        return 1;
+    }
+
+    if (outputFileName == NULL) {
+        outputFileName = useTS ? "/sdcard/muxerbench.ts"
+                               : "/sdcard/muxerbench.mp4";
+    }
+
+    ProcessState::self()->startThreadPool();
+
+    int64_t durationUs = durationSecs * 1000000ll;
+
+    Vector<sp<SyntheticSource> > sources;
+    for (int i = 0; i < numVideoTracks + numAudioTracks; ++i) {
+        bool isVideo = i < numVideoTracks;
+        sources.push(new SyntheticSource(
+                    isVideo, isVideo ? videoSampleSize : audioSampleSize,
+                    constantSize, frameRate, gopSize, durationUs, i + 1));
+    }
+
+    long startPeakMemoryKB = getPeakMemoryKB();
+    IOStats startStats;
+    getIOStats(&startStats);
+    int64_t startTimeUs = ALooper::GetNowUs();
+
+    status_t err;
+    if (useMuxer) {
+        err = runMuxer(outputFileName, sources);
+    } else {
+        sp<MediaWriter> writer;
+        sp<MetaData> params = new MetaData;
+
+        if (useTS) {
+            sp<MPEG2TSWriter> tsWriter = new MPEG2TSWriter(outputFileName);
+            err = OK;
+            for (size_t i = 0; err == OK && i < sources.size(); ++i) {
+                err = tsWriter->addSource(
+                        sources.itemAt(i), 1 + i % numPrograms);
+            }
+            writer = tsWriter;
+        } else {
+            writer = new MPEG4Writer(outputFileName);
+            err = OK;
+            for (size_t i = 0; err == OK && i < sources.size(); ++i) {
+                err = writer->addSource(sources.itemAt(i));
+            }
+
+            params->setInt32(kKeyRealTimeRecording, false);
+            if (fragmentDurationMs > 0) {
+                params->setInt64(
+                        kKeyFragmentDurationUs, fragmentDurationMs * 1000ll);
+            }
+        }
+
+        if (err != OK) {
+            fprintf(stderr, "ERROR: unable to add %d tracks (%d)\n",
+                    sources.size(), err);
+            return 1;
+        }
+
+        err = runWriter(writer, params);
+
+        // Some writers only release the output when destroyed.
+        writer.clear();
+    }
+
+    int64_t elapsedTimeUs = ALooper::GetNowUs() - startTimeUs;
+    IOStats endStats;
+    getIOStats(&endStats);
+    long peakMemoryKB = getPeakMemoryKB();
+
+    if (err != OK) {
+        fprintf(stderr, "ERROR: muxing failed (%d)\n", err);
+        return 1;
+    }
+
+    size_t numSamples = 0;
+    int64_t numBytes = 0;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        numSamples += sources.itemAt(i)->numSamplesRead();
+        numBytes += sources.itemAt(i)->numBytesRead();
+    }
+
+    struct stat st;
+    int64_t fileSize = stat(outputFileName, &st) == 0 ? st.st_size : -1;
+
+    double elapsedSecs = elapsedTimeUs / 1E6;
+    if (elapsedSecs <= 0) {
+        elapsedSecs = 1E-6;
+    }
+
+    printf("format: %s, %d video + %d audio tracks, %d s\n",
+           format, numVideoTracks, numAudioTracks, durationSecs);
+    printf("elapsed: %lld ms\n", elapsedTimeUs / 1000);
+    printf("samples: %d (%.1f samples/s)\n",
+           numSamples, numSamples / elapsedSecs);
+    printf("payload: %lld bytes (%.2f MB/s)\n",
+           numBytes, numBytes / elapsedSecs / 1E6);
+    printf("output: %lld bytes (%.4f of payload)\n",
+           fileSize, numBytes > 0 ? (double)fileSize / numBytes : 0.0);
+
+    if (startStats.mValid && endStats.mValid) {
+        int64_t writeSyscalls =
+            endStats.mWriteSyscalls - startStats.mWriteSyscalls;
+        int64_t bytesWritten =
+            endStats.mBytesWritten - startStats.mBytesWritten;
+
+        printf("syscalls: %lld write, %lld read (%.3f write/sample)\n",
+               writeSyscalls,
+               endStats.mReadSyscalls - startStats.mReadSyscalls,
+               numSamples > 0 ? (double)writeSyscalls / numSamples : 0.0);
+        printf("written: %lld bytes (write amplification %.4f)\n",
+               bytesWritten,
+               numBytes > 0 ? (double)bytesWritten / numBytes : 0.0);
+    } else {
+        printf("syscalls: n/a\n");
+        printf("written: n/a\n");
+    }
+
+    printf("peak memory: %ld KB (%ld KB before muxing)\n",
+           peakMemoryKB, startPeakMemoryKB);
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Implementation of NBAIO_Source that wraps another NBAIO_Source whose producer runs on an
+// independent clock, and compensates for the clock drift with a variable rate resampler
+
+#ifndef ANDROID_AUDIO_DRIFT_COMPENSATING_SOURCE_H
+#define ANDROID_AUDIO_DRIFT_COMPENSATING_SOURCE_H
+
+#include "NBAIO.h"
+#include <media/SingleStateQueue.h>
+
+namespace android {
+
+typedef SingleStateQueue<AudioTimestamp> AudioTimestampSingleStateQueue;
+
+// Typical use is between a pipe filled at the rate of one device, such as a remote submix or
+// USB output, and a consumer paced by another device:
+//      new SourceAudioBufferProvider(new DriftCompensatingSource(new MonoPipeReader(pipe), N))
+// The ratio of input to output frames is estimated from the consumer timestamps received by
+// onTimestamp() and from the rate at which the wrapped source is filled, and is then trimmed
+// to keep the number of frames buffered in the wrapped source near a target level.
+// The ratio never deviates from unity by more than kMaxDriftPpm, so the pitch change is inaudible.
+// Only 16-bit PCM is supported, as for all NBAIO formats.
+// DriftCompensatingSource is safe for only a single reader thread, but onTimestamp() may be
+// called from another thread.
+class DriftCompensatingSource : public NBAIO_Source {
+
+public:
+    // Construct a DriftCompensatingSource which reads from 'source', and attempts to keep about
+    // 'targetFrames' frames available to read in 'source'; typically half of its capacity.
+    DriftCompensatingSource(const sp<NBAIO_Source>& source, size_t targetFrames);
+    virtual ~DriftCompensatingSource();
+
+    // maximum deviation of the resampling ratio from unity, in parts per million
+    static const uint32_t kMaxDriftPpm = 2000;
+
+    // NBAIO_Port interface
+
+    //virtual ssize_t negotiate(const NBAIO_Format offers[], size_t numOffers,
+    //                          NBAIO_Format counterOffers[], size_t& numCounterOffers);
+    //virtual NBAIO_Format format() const;
+
+    // NBAIO_Source interface
+
+    //virtual size_t framesRead() const;
+    virtual size_t  framesOverrun();
+    virtual size_t  overruns();
+    virtual ssize_t availableToRead();
+    virtual ssize_t read(void *buffer, size_t count, int64_t readPTS);
+    virtual void    onTimestamp(const AudioTimestamp& timestamp);
+
+    // NBAIO_Source end
+
+    // Current deviation of the ratio of input to output frames from unity, in parts per million.
+    // Positive means the producer is faster than the consumer.  Not thread-safe; for dump only.
+    int32_t         driftPpm() const;
+
+protected:
+    // Current CLOCK_MONOTONIC time, used as the producer clock; overridden by the unit test.
+    virtual void    getMonotonicTime(struct timespec *now) const;
+
+private:
+    void            updateRatio(ssize_t available);
+    void            updateRateEstimate(const AudioTimestamp& timestamp, ssize_t available);
+
+    const sp<NBAIO_Source> mSource;     // the wrapped source
+    const size_t    mChannelCount;
+    const size_t    mTargetFrames;      // desired availableToRead() of mSource
+
+    // input frames read from mSource but not yet fully consumed by the resampler
+    int16_t*        mInput;
+    size_t          mInputSize;         // capacity of mInput in frames
+    size_t          mInputCount;        // number of valid frames in mInput
+    size_t          mInputIndex;        // index in mInput of the frame being interpolated
+    uint32_t        mPhaseFraction;     // position between mInputIndex and mInputIndex + 1
+    uint64_t        mPhaseIncrement;    // input frames per output frame, unsigned Q32.32
+    uint32_t        mInputConsumed;     // total input frames consumed, for timestamp translation
+
+    // rate estimation from consumer timestamps, see updateRateEstimate()
+    double          mRateRatio;         // estimated producer rate / consumer rate
+    double          mLevel;             // smoothed available frames, including those in mInput
+    bool            mRefValid;          // whether mRef* below is the start of a window
+    AudioTimestamp  mRefTimestamp;      // consumer timestamp at start of window
+    uint32_t        mRefProduced;       // frames produced into mSource at start of window
+    struct timespec mRefTime;           // CLOCK_MONOTONIC at start of window
+
+    // timestamps are passed from onTimestamp() to read() without locks
+    AudioTimestampSingleStateQueue::Shared      mTimestampShared;
+    AudioTimestampSingleStateQueue::Mutator     mTimestampMutator;
+    AudioTimestampSingleStateQueue::Observer    mTimestampObserver;
+};
+
+}   // namespace android
+
+#endif  // ANDROID_AUDIO_DRIFT_COMPENSATING_SOURCE_H
@@ -49,6 +49,10 @@ public:
 
     // NBAIO_Source end
 
+    // Discard all frames currently in the pipe, e.g. stale data left over from before
+    // the writer was paused.  Not multi-thread safe w.r.t. read().
+    void flush();
+
 #if 0   // until necessary
     Pipe& pipe() const { return mPipe; }
 #endif
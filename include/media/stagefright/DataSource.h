@@ -82,6 +82,9 @@ public:
 
     static void RegisterDefaultSniffers();
 
+    // Appends the number of calls, matches and the time spent per sniffer.
+    static void DumpSnifferStats(String8 *result);
+
     // for DRM
     virtual sp<DecryptHandle> DrmInitialization(const char *mime = NULL) {
         return NULL;
@@ -92,17 +95,41 @@ public:
         return String8();
     }
 
+    // Returns a string that changes whenever the content of the source may
+    // have changed, for use as the key of persistent caches, see
+    // ExtractorIndexCache. May return ERROR_UNSUPPORTED.
+    virtual status_t getFileIdentity(String8 *identity) {
+        return ERROR_UNSUPPORTED;
+    }
+
     virtual String8 getMIMEType() const;
 
 protected:
     virtual ~DataSource() {}
 
 private:
+    struct Sniffer {
+        SnifferFunc mFunc;
+        const char *mName;
+
+        // The highest confidence the sniffer can report. Sniffers are run
+        // by decreasing maximum confidence, so that once a match is at
+        // least as confident as the maximum of the remaining ones, these
+        // don't need to run.
+        float mMaxConfidence;
+
+        // Protected by gSnifferMutex.
+        uint32_t mNumCalls;
+        uint32_t mNumMatches;
+        int64_t mTotalTimeUs;
+    };
+
     static Mutex gSnifferMutex;
-    static List<SnifferFunc> gSniffers;
+    static List<Sniffer> gSniffers;
     static bool gSniffersRegistered;
 
-    static void RegisterSniffer_l(SnifferFunc func);
+    static void RegisterSniffer_l(
+            SnifferFunc func, const char *name, float maxConfidence);
 
     DataSource(const DataSource &);
     DataSource &operator=(const DataSource &);
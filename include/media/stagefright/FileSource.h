@@ -38,6 +38,8 @@ public:
 
     virtual status_t getSize(off64_t *size);
 
+    virtual status_t getFileIdentity(String8 *identity);
+
     virtual sp<DecryptHandle> DrmInitialization(const char *mime);
 
     virtual void getDrmInfo(sp<DecryptHandle> &handle, DrmManagerClient **client);
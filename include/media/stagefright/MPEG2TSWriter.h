@@ -23,6 +23,8 @@
 #include <media/stagefright/foundation/ALooper.h>
 #include <media/stagefright/MediaWriter.h>
 
+struct iovec;
+
 namespace android {
 
 struct ABuffer;
@@ -35,7 +37,13 @@ struct MPEG2TSWriter : public MediaWriter {
             void *cookie,
             ssize_t (*write)(void *cookie, const void *data, size_t size));
 
+    // Sources added without a program number belong to program 1.
     virtual status_t addSource(const sp<MediaSource> &source);
+
+    // Each program gets its own PMT, listed in the PAT. Up to
+    // kMaxProgramStreams sources can be added to each of up to
+    // kMaxPrograms programs.
+    status_t addSource(const sp<MediaSource> &source, unsigned programNumber);
     virtual status_t start(MetaData *param = NULL);
     virtual status_t stop() { return reset(); }
     virtual status_t pause();
@@ -44,6 +52,11 @@ struct MPEG2TSWriter : public MediaWriter {
 
     void onMessageReceived(const sp<AMessage> &msg);
 
+    enum {
+        kMaxPrograms        = 42,  // PAT fits in a single TS packet
+        kMaxProgramStreams  = 15,  // PIDs of a program are PMT PID + 1..15
+    };
+
 protected:
     virtual ~MPEG2TSWriter();
 
@@ -54,7 +67,14 @@ private:
 
     struct SourceInfo;
 
-    FILE *mFile;
+    struct ProgramInfo {
+        unsigned mProgramNumber;
+        unsigned mPMTPID;
+        unsigned mPMTContinuityCounter;
+        Vector<size_t> mSourceIndices;  // Into mSources
+    };
+
+    int mFd;
 
     void *mWriteCookie;
     ssize_t (*mWriteFunc)(void *cookie, const void *data, size_t size);
@@ -65,24 +85,32 @@ private:
     bool mStarted;
 
     Vector<sp<SourceInfo> > mSources;
+    Vector<unsigned> mSourcePIDs;
+    Vector<ProgramInfo> mPrograms;
     size_t mNumSourcesDone;
 
     int64_t mNumTSPacketsWritten;
     int64_t mNumTSPacketsBeforeMeta;
     int mPATContinuityCounter;
-    int mPMTContinuityCounter;
     uint32_t mCrcTable[256];
 
+    // Scratch space for writeAccessUnit(), only ever grown.
+    uint8_t *mPacketHeaders;
+    size_t mPacketHeadersCapacity;
+    struct iovec *mIovecs;
+    size_t mIovecsCapacity;
+
     void init();
 
     void writeTS();
     void writeProgramAssociationTable();
-    void writeProgramMap();
+    void writeProgramMap(ProgramInfo *program);
     void writeAccessUnit(int32_t sourceIndex, const sp<ABuffer> &buffer);
     void initCrcTable();
     uint32_t crc32(const uint8_t *start, size_t length);
 
     ssize_t internalWrite(const void *data, size_t size);
+    ssize_t internalWritev(const struct iovec *iov, size_t count);
     status_t reset();
 
     DISALLOW_EVIL_CONSTRUCTORS(MPEG2TSWriter);
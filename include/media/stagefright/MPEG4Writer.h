@@ -24,6 +24,8 @@
 #include <utils/List.h>
 #include <utils/threads.h>
 
+struct iovec;
+
 namespace android {
 
 class MediaBuffer;
@@ -97,6 +99,13 @@ private:
     bool mAreGeoTagsAvailable;
     int32_t mStartTimeOffsetMs;
 
+    // Fragmented files get their moov box as soon as all tracks have
+    // buffered their first fragment, so that it survives a crash.
+    bool mFragmented;
+    int64_t mFragmentDurationUs;
+    bool mMoovWritten;
+    uint32_t mFragmentSequenceNumber;
+
     Mutex mLock;
 
     List<Track *> mTracks;
@@ -109,19 +118,41 @@ private:
     size_t numTracks();
     int64_t estimateMoovBoxSize(int32_t bitRate);
 
+    // Sample description carried in the trun box of a movie fragment
+    struct FragmentSample {
+        uint32_t mSize;
+        uint32_t mDurationTicks;            // In track timescale
+        int32_t  mCompositionOffsetTicks;   // In track timescale, signed
+        bool     mIsSync;
+    };
+
     struct Chunk {
         Track               *mTrack;        // Owner
         int64_t             mTimeStampUs;   // Timestamp of the 1st sample
         List<MediaBuffer *> mSamples;       // Sample data
 
+        // Only used for fragmented files: the decoding time of the 1st
+        // sample in track timescale, and one entry per sample.
+        int64_t              mDecodingTimeTicks;
+        List<FragmentSample> mFragmentSamples;
+
         // Convenient constructor
-        Chunk(): mTrack(NULL), mTimeStampUs(0) {}
+        Chunk(): mTrack(NULL), mTimeStampUs(0), mDecodingTimeTicks(0) {}
 
         Chunk(Track *track, int64_t timeUs, List<MediaBuffer *> samples)
-            : mTrack(track), mTimeStampUs(timeUs), mSamples(samples) {
+            : mTrack(track), mTimeStampUs(timeUs), mSamples(samples),
+              mDecodingTimeTicks(0) {
         }
 
     };
+
+    // Random access point recorded in the trailing mfra box
+    struct FragmentEntry {
+        Track   *mTrack;
+        int64_t mTimeTicks;                 // In track timescale
+        off64_t mMoofOffset;
+    };
+    List<FragmentEntry> mFragmentEntries;  // Written out in the mfra box
     struct ChunkInfo {
         Track               *mTrack;        // Owner
         List<Chunk>         mChunks;        // Remaining chunks to be written
@@ -159,6 +190,9 @@ private:
     // Actually write the given chunk to the file.
     void writeChunkToFile(Chunk* chunk);
 
+    // Write the given chunk as a moof box followed by its mdat box.
+    void writeFragment(Chunk* chunk);
+
     // Adjust other track media clock (presumably wall clock)
     // based on audio track media clock with the drift time.
     int64_t mDriftTimeUs;
@@ -176,12 +210,20 @@ private:
     // By default, real time recording is on.
     bool isRealTimeRecording() const;
 
+    // Return whether samples are written in movie fragments, and
+    // the approximate duration of each fragment.
+    bool isFragmented() const { return mFragmented; }
+    int64_t fragmentDuration() const { return mFragmentDurationUs; }
+
     void lock();
     void unlock();
 
     // Acquire lock before calling these methods
     off64_t addSample_l(MediaBuffer *buffer);
     off64_t addLengthPrefixedSample_l(MediaBuffer *buffer);
+    void writeVectors_l(struct iovec *iov, size_t count);
+    size_t makeNalLengthPrefix(size_t length, uint8_t *prefix) const;
+    size_t writeChunkSamples_l(Chunk *chunk);
 
     bool exceedsFileSizeLimit();
     bool use32BitFileOffset() const;
@@ -191,6 +233,8 @@ private:
     void writeCompositionMatrix(int32_t degrees);
     void writeMvhdBox(int64_t durationUs);
     void writeMoovBox(int64_t durationUs);
+    void writeMvexBox();
+    void writeMfraBox();
     void writeFtypBox(MetaData *param);
     void writeUdtaBox();
     void writeGeoDataBox();
@@ -82,15 +82,27 @@ struct MediaSource : public virtual RefBase {
         void setLateBy(int64_t lateness_us);
         int64_t getLateBy() const;
 
+        // Offers memory that the source may read the next buffer into,
+        // saving a copy when the caller would copy the data there anyway,
+        // e.g. into a codec input buffer. The source honours it by
+        // returning a buffer whose data() is "data", which must remain valid
+        // until that buffer is released. Sources are free to ignore it.
+        void setTargetBuffer(void *data, size_t size);
+        void clearTargetBuffer();
+        bool getTargetBuffer(void **data, size_t *size) const;
+
     private:
         enum Options {
-            kSeekTo_Option      = 1,
+            kSeekTo_Option       = 1,
+            kTargetBuffer_Option = 2,
         };
 
         uint32_t mOptions;
         int64_t mSeekTimeUs;
         SeekMode mSeekMode;
         int64_t mLatenessUs;
+        void *mTargetData;
+        size_t mTargetSize;
     };
 
     // Causes this source to suspend pulling data from its upstream source
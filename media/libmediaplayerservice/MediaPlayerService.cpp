@@ -54,6 +54,7 @@
 #include <media/MemoryLeakTrackUtil.h>
 #include <media/stagefright/MediaErrors.h>
 #include <media/stagefright/AudioPlayer.h>
+#include <media/stagefright/DataSource.h>
 #include <media/stagefright/foundation/ADebug.h>
 
 #include <system/audio.h>
@@ -409,6 +410,8 @@ status_t MediaPlayerService::dump(int fd, const Vector<String16>& args)
             }
         }
 
+        DataSource::DumpSnifferStats(&result);
+
         result.append(" Files opened and/or mapped:\n");
         snprintf(buffer, SIZE, "/proc/%d/maps", gettid());
         FILE *f = fopen(buffer, "r");
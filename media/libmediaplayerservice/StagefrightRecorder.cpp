@@ -474,6 +474,17 @@ status_t StagefrightRecorder::setParamTrackTimeStatus(int64_t timeDurationUs) {
     return OK;
 }
 
+// If durationUs > 0, MPEG-4 files are written in movie fragments of
+// about this duration, otherwise with a single moov box at the end.
+status_t StagefrightRecorder::setParamFragmentDuration(int64_t durationUs) {
+    ALOGV("setParamFragmentDuration: %lld us", durationUs);
+    if (durationUs < 0) {
+        return BAD_VALUE;
+    }
+    mFragmentDurationUs = durationUs;
+    return OK;
+}
+
 status_t StagefrightRecorder::setParamVideoEncoderProfile(int32_t profile) {
     ALOGV("setParamVideoEncoderProfile: %d", profile);
 
@@ -619,6 +630,11 @@ status_t StagefrightRecorder::setParameter(
         if (safe_strtoi64(value.string(), &timeDurationUs)) {
             return setParamTrackTimeStatus(timeDurationUs);
         }
+    } else if (key == "param-fragment-duration-us") {
+        int64_t durationUs;
+        if (safe_strtoi64(value.string(), &durationUs)) {
+            return setParamFragmentDuration(durationUs);
+        }
     } else if (key == "audio-param-sampling-rate") {
         int32_t sampling_rate;
         if (safe_strtoi32(value.string(), &sampling_rate)) {
@@ -1571,6 +1587,9 @@ void StagefrightRecorder::setupMPEG4MetaData(int64_t startTimeUs, int32_t totalB
     if (mTrackEveryTimeDurationUs > 0) {
         (*meta)->setInt64(kKeyTrackTimeStatus, mTrackEveryTimeDurationUs);
     }
+    if (mFragmentDurationUs > 0) {
+        (*meta)->setInt64(kKeyFragmentDurationUs, mFragmentDurationUs);
+    }
     if (mRotationDegrees != 0) {
         (*meta)->setInt32(kKeyRotation, mRotationDegrees);
     }
@@ -1699,6 +1718,7 @@ status_t StagefrightRecorder::reset() {
     mMaxFileDurationUs = 0;
     mMaxFileSizeBytes = 0;
     mTrackEveryTimeDurationUs = 0;
+    mFragmentDurationUs = 0;
     mCaptureTimeLapse = false;
     mTimeBetweenTimeLapseFrameCaptureUs = -1;
     mCameraSourceTimeLapse = NULL;
@@ -1757,6 +1777,8 @@ status_t StagefrightRecorder::dump(
     result.append(buffer);
     snprintf(buffer, SIZE, "     Progress notification: %lld us\n", mTrackEveryTimeDurationUs);
     result.append(buffer);
+    snprintf(buffer, SIZE, "     Fragment duration (us): %lld\n", mFragmentDurationUs);
+    result.append(buffer);
     snprintf(buffer, SIZE, "   Audio\n");
     result.append(buffer);
     snprintf(buffer, SIZE, "     Source: %d\n", mAudioSource);
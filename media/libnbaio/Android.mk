@@ -6,6 +6,7 @@ LOCAL_SRC_FILES := \
     AudioBufferProviderSource.cpp   \
     AudioStreamOutSink.cpp          \
     AudioStreamInSource.cpp         \
+    DriftCompensatingSource.cpp     \
     NBAIO.cpp                       \
     MonoPipe.cpp                    \
     MonoPipeReader.cpp              \
@@ -37,3 +38,5 @@ LOCAL_SHARED_LIBRARIES := \
 # Consider a separate a library for SingleStateQueueInstantiations.
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DriftCompensatingSource"
+//#define LOG_NDEBUG 0
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cutils/compiler.h>
+#include <utils/Log.h>
+#include <media/nbaio/DriftCompensatingSource.h>
+
+namespace android {
+
+// unity in the Q32.32 format of mPhaseIncrement
+static const double kUnity = 4294967296.0;
+
+// minimum duration of a rate measurement window, in nanoseconds of consumer time
+static const int64_t kRateWindowNs = 2000000000LL;
+
+// measurements deviating from unity by more than this are assumed to be discontinuities,
+// such as a pause or a seek of the consumer, and are discarded
+static const double kMaxMeasuredDrift = 0.01;
+
+// weight of a new measurement in mRateRatio
+static const double kRateSmoothing = 0.25;
+
+// weight of a new available frame count in mLevel; the level is sampled once per read()
+static const double kLevelSmoothing = 1.0 / 32;
+
+// ratio correction when the level differs from the target by the target itself
+static const double kLevelGain = 500e-6;
+
+// negotiate with the wrapped source, and return the format it proposes
+static NBAIO_Format negotiateWithSource(const sp<NBAIO_Source>& source)
+{
+    ALOG_ASSERT(source != 0);
+    NBAIO_Format counterOffers[1];
+    size_t numCounterOffers = 1;
+    ssize_t index = source->negotiate(NULL, 0, counterOffers, numCounterOffers);
+    ALOG_ASSERT(index == (ssize_t) NEGOTIATE && numCounterOffers > 0);
+    numCounterOffers = 0;
+    index = source->negotiate(counterOffers, 1, NULL, numCounterOffers);
+    ALOG_ASSERT(index == 0);
+    return source->format();
+}
+
+static int64_t diffNs(const struct timespec& later, const struct timespec& earlier)
+{
+    return (later.tv_sec - earlier.tv_sec) * 1000000000LL + (later.tv_nsec - earlier.tv_nsec);
+}
+
+DriftCompensatingSource::DriftCompensatingSource(const sp<NBAIO_Source>& source,
+        size_t targetFrames) :
+        NBAIO_Source(negotiateWithSource(source)),
+        mSource(source),
+        mChannelCount(Format_channelCount(mFormat)),
+        mTargetFrames(targetFrames > 0 ? targetFrames : 1),
+        mInput(NULL), mInputSize(0), mInputCount(0), mInputIndex(0),
+        mPhaseFraction(0), mPhaseIncrement((uint64_t) kUnity), mInputConsumed(0),
+        mRateRatio(1.0), mLevel((double) mTargetFrames), mRefValid(false),
+        // mRefTimestamp, mRefProduced, mRefTime are valid only if mRefValid
+        // mTimestampShared
+        mTimestampMutator(&mTimestampShared),
+        mTimestampObserver(&mTimestampShared)
+{
+}
+
+DriftCompensatingSource::~DriftCompensatingSource()
+{
+    free(mInput);
+}
+
+size_t DriftCompensatingSource::framesOverrun()
+{
+    return mSource->framesOverrun();
+}
+
+size_t DriftCompensatingSource::overruns()
+{
+    return mSource->overruns();
+}
+
+ssize_t DriftCompensatingSource::availableToRead()
+{
+    if (CC_UNLIKELY(!mNegotiated)) {
+        return NEGOTIATE;
+    }
+    ssize_t avail = mSource->availableToRead();
+    if (avail < 0) {
+        return avail;
+    }
+    // input frames available now, less the one frame needed ahead for interpolation
+    size_t frames = avail + mInputCount - mInputIndex;
+    if (frames <= 1) {
+        return 0;
+    }
+    return (ssize_t) (((uint64_t) (frames - 1) << 32) / mPhaseIncrement);
+}
+
+ssize_t DriftCompensatingSource::read(void *buffer, size_t count, int64_t readPTS)
+{
+    if (CC_UNLIKELY(!mNegotiated)) {
+        return NEGOTIATE;
+    }
+    ssize_t avail = mSource->availableToRead();
+    AudioTimestamp timestamp;
+    if (mTimestampObserver.poll(timestamp)) {
+        updateRateEstimate(timestamp, avail);
+    }
+    updateRatio(avail);
+
+    // discard the input frames already consumed
+    if (mInputIndex > 0) {
+        mInputCount -= mInputIndex;
+        memmove(mInput, mInput + mInputIndex * mChannelCount,
+                mInputCount * mChannelCount * sizeof(int16_t));
+        mInputIndex = 0;
+    }
+
+    // number of input frames needed to produce 'count' output frames, including the frame
+    // after the last one for interpolation
+    size_t needed = (size_t) (((uint64_t) mPhaseFraction +
+            (uint64_t) count * mPhaseIncrement) >> 32) + 2;
+    if (needed > mInputSize) {
+        // only grows, and only when read() is called with a larger count than before
+        int16_t *input = (int16_t *) realloc(mInput, needed * mChannelCount * sizeof(int16_t));
+        if (input == NULL) {
+            return NO_MEMORY;
+        }
+        mInput = input;
+        mInputSize = needed;
+    }
+    ssize_t status = OK;
+    if (needed > mInputCount) {
+        status = mSource->read(mInput + mInputCount * mChannelCount, needed - mInputCount,
+                readPTS);
+        if (status > 0) {
+            mInputCount += status;
+        }
+    }
+
+    // linear interpolation at a variable rate
+    int16_t *out = (int16_t *) buffer;
+    const uint32_t incrementInteger = (uint32_t) (mPhaseIncrement >> 32);
+    const uint32_t incrementFraction = (uint32_t) mPhaseIncrement;
+    size_t produced = 0;
+    while (produced < count && mInputIndex + 1 < mInputCount) {
+        const int16_t *x0 = mInput + mInputIndex * mChannelCount;
+        const int16_t *x1 = x0 + mChannelCount;
+        const int32_t fraction = mPhaseFraction >> 17;  // Q15
+        for (size_t i = 0; i < mChannelCount; i++) {
+            *out++ = x0[i] + (((x1[i] - x0[i]) * fraction) >> 15);
+        }
+        uint32_t phaseFraction = mPhaseFraction + incrementFraction;
+        mInputIndex += incrementInteger + (phaseFraction < mPhaseFraction ? 1 : 0);
+        mPhaseFraction = phaseFraction;
+        produced++;
+    }
+    mInputConsumed += mInputIndex;
+
+    if (produced == 0) {
+        return status < 0 ? status : 0;
+    }
+    mFramesRead += produced;
+    return produced;
+}
+
+void DriftCompensatingSource::onTimestamp(const AudioTimestamp& timestamp)
+{
+    mTimestampMutator.push(timestamp);
+}
+
+void DriftCompensatingSource::getMonotonicTime(struct timespec *now) const
+{
+    clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+int32_t DriftCompensatingSource::driftPpm() const
+{
+    return (int32_t) ((mPhaseIncrement / kUnity - 1.0) * 1e6);
+}
+
+// called by read() only, to trim mRateRatio so that the wrapped source stays near the target
+void DriftCompensatingSource::updateRatio(ssize_t available)
+{
+    if (available >= 0) {
+        double level = available + (double) (mInputCount - mInputIndex);
+        mLevel += (level - mLevel) * kLevelSmoothing;
+    }
+    double error = (mLevel - mTargetFrames) / mTargetFrames;
+    if (error > 1.0) {
+        error = 1.0;
+    } else if (error < -1.0) {
+        error = -1.0;
+    }
+    // more frames than the target means the producer is ahead, so consume input faster
+    double ratio = mRateRatio * (1.0 + error * kLevelGain);
+    const double maxDrift = kMaxDriftPpm * 1e-6;
+    if (ratio > 1.0 + maxDrift) {
+        ratio = 1.0 + maxDrift;
+    } else if (ratio < 1.0 - maxDrift) {
+        ratio = 1.0 - maxDrift;
+    }
+    mPhaseIncrement = (uint64_t) (ratio * kUnity);
+}
+
+// called by read() only, when a new consumer timestamp is available
+void DriftCompensatingSource::updateRateEstimate(const AudioTimestamp& timestamp,
+        ssize_t available)
+{
+    // forward the timestamp to the wrapped source, translated to input frames
+    uint32_t pending = (uint32_t) mFramesRead - timestamp.mPosition;
+    AudioTimestamp translated = timestamp;
+    translated.mPosition = mInputConsumed - (uint32_t) (pending * (mPhaseIncrement / kUnity));
+    mSource->onTimestamp(translated);
+
+    if (available < 0) {
+        mRefValid = false;
+        return;
+    }
+    // total frames produced into the wrapped source, whether read by us or not
+    uint32_t produced = (uint32_t) mSource->framesRead() + (uint32_t) available;
+    struct timespec now;
+    getMonotonicTime(&now);
+    if (!mRefValid) {
+        mRefTimestamp = timestamp;
+        mRefProduced = produced;
+        mRefTime = now;
+        mRefValid = true;
+        return;
+    }
+    int64_t consumerNs = diffNs(timestamp.mTime, mRefTimestamp.mTime);
+    if (consumerNs < kRateWindowNs) {
+        return;
+    }
+    int64_t producerNs = diffNs(now, mRefTime);
+    uint32_t consumerFrames = timestamp.mPosition - mRefTimestamp.mPosition;
+    uint32_t producerFrames = produced - mRefProduced;
+    mRefTimestamp = timestamp;
+    mRefProduced = produced;
+    mRefTime = now;
+    if (producerNs <= 0 || consumerFrames == 0 || producerFrames == 0) {
+        return;
+    }
+    double measured = ((double) producerFrames / producerNs) /
+            ((double) consumerFrames / consumerNs);
+    if (measured > 1.0 + kMaxMeasuredDrift || measured < 1.0 - kMaxMeasuredDrift) {
+        ALOGV("discarding rate ratio %f", measured);
+        return;
+    }
+    mRateRatio += (measured - mRateRatio) * kRateSmoothing;
+    ALOGV("rate ratio measured %f smoothed %f", measured, mRateRatio);
+}
+
+}   // namespace android
@@ -92,4 +92,9 @@ ssize_t PipeReader::read(void *buffer, size_t count, int64_t readPTS)
     return red;
 }
 
+void PipeReader::flush()
+{
+    mFront = android_atomic_acquire_load(&mPipe.mRear);
+}
+
 }   // namespace android
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DriftCompensatingSource_test"
+#include <utils/Log.h>
+
+#include <gtest/gtest.h>
+
+#include <media/AudioBufferProvider.h>
+#include <media/nbaio/DriftCompensatingSource.h>
+#include <media/nbaio/Pipe.h>
+#include <media/nbaio/PipeReader.h>
+
+namespace android {
+namespace test {
+
+static const unsigned kSampleRate = 48000;
+static const unsigned kChannelCount = 2;
+static const size_t kPipeFrames = 8192;
+static const size_t kTargetFrames = 2048;
+static const size_t kPeriodFrames = 480;            // 10 ms
+static const int64_t kPeriodNs = 10000000LL;
+
+// Runs the producer clock off the simulated time of the test instead of CLOCK_MONOTONIC.
+class SimulatedClockSource : public DriftCompensatingSource {
+public:
+    SimulatedClockSource(const sp<NBAIO_Source>& source, const struct timespec *now)
+        : DriftCompensatingSource(source, kTargetFrames), mNow(now) {}
+
+protected:
+    virtual void getMonotonicTime(struct timespec *now) const {
+        *now = *mNow;
+    }
+
+private:
+    const struct timespec *mNow;
+};
+
+class DriftCompensatingSourceTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        const NBAIO_Format offers[1] = {Format_from_SR_C(kSampleRate, kChannelCount)};
+        size_t numCounterOffers = 0;
+        mPipe = new Pipe(kPipeFrames, offers[0]);
+        ASSERT_EQ(0, mPipe->negotiate(offers, 1, NULL, numCounterOffers));
+        mReader = new PipeReader(*mPipe);
+        numCounterOffers = 0;
+        ASSERT_EQ(0, mReader->negotiate(offers, 1, NULL, numCounterOffers));
+
+        mNow.tv_sec = 1000;
+        mNow.tv_nsec = 0;
+        mSource = new SimulatedClockSource(mReader, &mNow);
+        numCounterOffers = 0;
+        ASSERT_EQ(0, mSource->negotiate(offers, 1, NULL, numCounterOffers));
+
+        mProducerPosition = 0.0;
+        mProduced = 0;
+        memset(mBuffer, 0, sizeof(mBuffer));
+
+        // start at the target level
+        write(kTargetFrames);
+        mProducerPosition = kTargetFrames;
+    }
+
+    virtual void TearDown() {
+        // the reader refers to the pipe, and must go first
+        mSource.clear();
+        mReader.clear();
+        mPipe.clear();
+    }
+
+    void write(size_t frames) {
+        while (frames > 0) {
+            size_t count = frames < kPeriodFrames * 2 ? frames : kPeriodFrames * 2;
+            ASSERT_EQ((ssize_t) count, mPipe->write(mBuffer, count));
+            frames -= count;
+            mProduced += count;
+        }
+    }
+
+    // Runs the producer 'driftPpm' faster than the consumer for 'seconds' of simulated time.
+    // The consumer reads a period every 10 ms and reports a timestamp for it.
+    // Returns the number of periods that could not be read in full.
+    int run(int driftPpm, int seconds) {
+        int shortReads = 0;
+        const double producerRatio = 1.0 + driftPpm * 1e-6;
+        for (int period = 0; period < seconds * 100; ++period) {
+            mProducerPosition += kPeriodFrames * producerRatio;
+            write((size_t) mProducerPosition - mProduced);
+
+            mNow.tv_nsec += kPeriodNs;
+            if (mNow.tv_nsec >= 1000000000L) {
+                mNow.tv_nsec -= 1000000000L;
+                mNow.tv_sec++;
+            }
+
+            ssize_t n = mSource->read(mBuffer, kPeriodFrames, AudioBufferProvider::kInvalidPTS);
+            if (n != (ssize_t) kPeriodFrames) {
+                ++shortReads;
+            }
+
+            AudioTimestamp timestamp;
+            timestamp.mPosition = mSource->framesRead();
+            timestamp.mTime = mNow;
+            mSource->onTimestamp(timestamp);
+        }
+        return shortReads;
+    }
+
+    // Frames left in the pipe after the last read.  The level is sampled by read() just after
+    // a period was written, so it settles a period below the target.  The level trim alone
+    // cannot keep it there when the rates differ, only with the rate measured from timestamps.
+    void expectLevelAtTarget() {
+        EXPECT_NEAR((double) (kTargetFrames - kPeriodFrames), (double) mReader->availableToRead(),
+                kPeriodFrames / 4);
+    }
+
+    sp<Pipe> mPipe;
+    sp<PipeReader> mReader;
+    sp<DriftCompensatingSource> mSource;
+    struct timespec mNow;
+    double mProducerPosition;
+    size_t mProduced;
+    int16_t mBuffer[kPeriodFrames * 2 * kChannelCount];
+};
+
+// The rate is measured over 2 s windows, while the level trim pulls the wrapped source back to
+// its target over a couple of minutes, so the ratio is checked after 5 minutes.
+static const int kSettleSeconds = 300;
+
+TEST_F(DriftCompensatingSourceTest, NoDrift) {
+    EXPECT_EQ(0, run(0, kSettleSeconds));
+    EXPECT_NEAR(0, mSource->driftPpm(), 25);
+    expectLevelAtTarget();
+    EXPECT_EQ(0u, mSource->overruns());
+}
+
+TEST_F(DriftCompensatingSourceTest, FasterProducer) {
+    run(500, kSettleSeconds);
+    EXPECT_NEAR(500, mSource->driftPpm(), 50);
+    expectLevelAtTarget();
+    EXPECT_EQ(0, run(500, 60));
+    EXPECT_EQ(0u, mSource->overruns());
+}
+
+TEST_F(DriftCompensatingSourceTest, SlowerProducer) {
+    run(-500, kSettleSeconds);
+    EXPECT_NEAR(-500, mSource->driftPpm(), 50);
+    expectLevelAtTarget();
+    EXPECT_EQ(0, run(-500, 60));
+    EXPECT_EQ(0u, mSource->overruns());
+}
+
+TEST_F(DriftCompensatingSourceTest, DriftIsClamped) {
+    run(5000, 30);
+    EXPECT_LE(mSource->driftPpm(), (int32_t) DriftCompensatingSource::kMaxDriftPpm);
+    EXPECT_GE(mSource->driftPpm(), (int32_t) DriftCompensatingSource::kMaxDriftPpm - 10);
+}
+
+}  // namespace test
+}  // namespace android
@@ -17,6 +17,7 @@ LOCAL_SRC_FILES:=                         \
         DataSource.cpp                    \
         DRMExtractor.cpp                  \
         ESDS.cpp                          \
+        ExtractorIndexCache.cpp           \
         FileSource.cpp                    \
         FLACExtractor.cpp                 \
         HTTPBase.cpp                      \
@@ -14,6 +14,10 @@
  * limitations under the License.
  */
 
+//#define LOG_NDEBUG 0
+#define LOG_TAG "DataSource"
+#include <utils/Log.h>
+
 #include "include/AMRExtractor.h"
 
 #if CHROMIUM_AVAILABLE
@@ -40,6 +44,7 @@
 #include <media/stagefright/FileSource.h>
 #include <media/stagefright/MediaErrors.h>
 #include <utils/String8.h>
+#include <utils/Timers.h>
 
 #include <cutils/properties.h>
 
@@ -106,9 +111,129 @@ status_t DataSource::getSize(off64_t *size) {
 ////////////////////////////////////////////////////////////////////////////////
 
 Mutex DataSource::gSnifferMutex;
-List<DataSource::SnifferFunc> DataSource::gSniffers;
+List<DataSource::Sniffer> DataSource::gSniffers;
 bool DataSource::gSniffersRegistered = false;
 
+// Serves the sniffers' reads from a single read of the start of the source,
+// where most of them only look, and passes the others through.
+struct SniffPrefixSource : public DataSource {
+    SniffPrefixSource(const sp<DataSource> &source);
+
+    virtual status_t initCheck() const;
+    virtual ssize_t readAt(off64_t offset, void *data, size_t size);
+    virtual status_t getSize(off64_t *size);
+    virtual uint32_t flags();
+    virtual status_t reconnectAtOffset(off64_t offset);
+    virtual sp<DecryptHandle> DrmInitialization(const char *mime);
+    virtual void getDrmInfo(sp<DecryptHandle> &handle, DrmManagerClient **client);
+    virtual String8 getUri();
+    virtual String8 getMIMEType() const;
+    virtual status_t getFileIdentity(String8 *identity);
+
+protected:
+    virtual ~SniffPrefixSource();
+
+private:
+    enum {
+        kPrefixSize = 32 * 1024,
+    };
+
+    sp<DataSource> mSource;
+    uint8_t *mPrefix;
+    ssize_t mPrefixSize;    // < 0 until read
+    bool mPrefixReachedEOS; // the prefix is all there is to the source
+
+    DISALLOW_EVIL_CONSTRUCTORS(SniffPrefixSource);
+};
+
+SniffPrefixSource::SniffPrefixSource(const sp<DataSource> &source)
+    : mSource(source),
+      mPrefix(new uint8_t[kPrefixSize]),
+      mPrefixSize(-1),
+      mPrefixReachedEOS(false) {
+}
+
+SniffPrefixSource::~SniffPrefixSource() {
+    delete[] mPrefix;
+    mPrefix = NULL;
+}
+
+status_t SniffPrefixSource::initCheck() const {
+    return mSource->initCheck();
+}
+
+ssize_t SniffPrefixSource::readAt(off64_t offset, void *data, size_t size) {
+    if (offset < 0 || offset + size > kPrefixSize) {
+        return mSource->readAt(offset, data, size);
+    }
+
+    if (mPrefixSize < 0) {
+        ssize_t n = mSource->readAt(0, mPrefix, kPrefixSize);
+        if (n < 0) {
+            return n;
+        }
+        mPrefixSize = n;
+
+        // A short read need not be the end of the source, e.g. for network
+        // sources, only trust it if the size of the source agrees.
+        off64_t sourceSize;
+        mPrefixReachedEOS = n < kPrefixSize
+                && mSource->getSize(&sourceSize) == OK
+                && sourceSize <= n;
+    }
+
+    if ((ssize_t)(offset + size) > mPrefixSize) {
+        if (!mPrefixReachedEOS) {
+            return mSource->readAt(offset, data, size);
+        }
+        if (offset >= mPrefixSize) {
+            return 0;
+        }
+        size = mPrefixSize - offset;
+    }
+
+    memcpy(data, mPrefix + offset, size);
+    return size;
+}
+
+status_t SniffPrefixSource::getSize(off64_t *size) {
+    return mSource->getSize(size);
+}
+
+uint32_t SniffPrefixSource::flags() {
+    return mSource->flags();
+}
+
+status_t SniffPrefixSource::reconnectAtOffset(off64_t offset) {
+    return mSource->reconnectAtOffset(offset);
+}
+
+sp<DecryptHandle> SniffPrefixSource::DrmInitialization(const char *mime) {
+    sp<DecryptHandle> handle = mSource->DrmInitialization(mime);
+    if (handle != NULL) {
+        // The source now returns decrypted data.
+        mPrefixSize = -1;
+    }
+    return handle;
+}
+
+void SniffPrefixSource::getDrmInfo(
+        sp<DecryptHandle> &handle, DrmManagerClient **client) {
+    mSource->getDrmInfo(handle, client);
+}
+
+String8 SniffPrefixSource::getUri() {
+    return mSource->getUri();
+}
+
+String8 SniffPrefixSource::getMIMEType() const {
+    return mSource->getMIMEType();
+}
+
+status_t SniffPrefixSource::getFileIdentity(String8 *identity) {
+    return mSource->getFileIdentity(identity);
+}
+
 bool DataSource::sniff(
         String8 *mimeType, float *confidence, sp<AMessage> *meta) {
     *mimeType = "";
@@ -122,12 +247,34 @@ bool DataSource::sniff(
         }
     }
 
-    for (List<SnifferFunc>::iterator it = gSniffers.begin();
+    sp<DataSource> source = new SniffPrefixSource(this);
+
+    for (List<Sniffer>::iterator it = gSniffers.begin();
          it != gSniffers.end(); ++it) {
+        if (*confidence > 0.0f && *confidence >= it->mMaxConfidence) {
+            // Neither this sniffer nor the ones after it can do better.
+            ALOGV("%s is a definitive match", mimeType->string());
+            break;
+        }
+
         String8 newMimeType;
         float newConfidence;
         sp<AMessage> newMeta;
-        if ((*it)(this, &newMimeType, &newConfidence, &newMeta)) {
+        int64_t startUs = systemTime() / 1000ll;
+        bool matched =
+            it->mFunc(source, &newMimeType, &newConfidence, &newMeta);
+        int64_t elapsedUs = systemTime() / 1000ll - startUs;
+
+        {
+            Mutex::Autolock autoLock(gSnifferMutex);
+            ++it->mNumCalls;
+            it->mTotalTimeUs += elapsedUs;
+            if (matched) {
+                ++it->mNumMatches;
+            }
+        }
+
+        if (matched) {
             if (newConfidence > *confidence) {
                 *mimeType = newMimeType;
                 *confidence = newConfidence;
@@ -140,15 +287,46 @@ bool DataSource::sniff(
 }
 
 // static
-void DataSource::RegisterSniffer_l(SnifferFunc func) {
-    for (List<SnifferFunc>::iterator it = gSniffers.begin();
+void DataSource::DumpSnifferStats(String8 *result) {
+    Mutex::Autolock autoLock(gSnifferMutex);
+
+    result->append(" Sniffers:\n");
+    for (List<Sniffer>::iterator it = gSniffers.begin();
+         it != gSniffers.end(); ++it) {
+        result->appendFormat(
+                "  %-10s calls=%u matches=%u total=%lld us mean=%lld us\n",
+                it->mName, it->mNumCalls, it->mNumMatches,
+                it->mTotalTimeUs,
+                it->mNumCalls > 0 ? it->mTotalTimeUs / it->mNumCalls : 0ll);
+    }
+}
+
+// static
+void DataSource::RegisterSniffer_l(
+        SnifferFunc func, const char *name, float maxConfidence) {
+    List<Sniffer>::iterator pos = gSniffers.end();
+    for (List<Sniffer>::iterator it = gSniffers.begin();
          it != gSniffers.end(); ++it) {
-        if (*it == func) {
+        if (it->mFunc == func) {
             return;
         }
+
+        // Sniffers with the same maximum confidence keep the order in
+        // which they are registered, which decides between equal matches.
+        if (pos == gSniffers.end() && it->mMaxConfidence < maxConfidence) {
+            pos = it;
+        }
     }
 
-    gSniffers.push_back(func);
+    Sniffer sniffer;
+    sniffer.mFunc = func;
+    sniffer.mName = name;
+    sniffer.mMaxConfidence = maxConfidence;
+    sniffer.mNumCalls = 0;
+    sniffer.mNumMatches = 0;
+    sniffer.mTotalTimeUs = 0;
+
+    gSniffers.insert(pos, sniffer);
 }
 
 // static
@@ -158,22 +336,22 @@ void DataSource::RegisterDefaultSniffers() {
         return;
     }
 
-    RegisterSniffer_l(SniffMPEG4);
-    RegisterSniffer_l(SniffMatroska);
-    RegisterSniffer_l(SniffOgg);
-    RegisterSniffer_l(SniffWAV);
-    RegisterSniffer_l(SniffFLAC);
-    RegisterSniffer_l(SniffAMR);
-    RegisterSniffer_l(SniffMPEG2TS);
-    RegisterSniffer_l(SniffMP3);
-    RegisterSniffer_l(SniffAAC);
-    RegisterSniffer_l(SniffMPEG2PS);
-    RegisterSniffer_l(SniffWVM);
+    RegisterSniffer_l(SniffMPEG4, "MPEG4", 0.4f);
+    RegisterSniffer_l(SniffMatroska, "Matroska", 0.6f);
+    RegisterSniffer_l(SniffOgg, "Ogg", 0.2f);
+    RegisterSniffer_l(SniffWAV, "WAV", 0.3f);
+    RegisterSniffer_l(SniffFLAC, "FLAC", 0.5f);
+    RegisterSniffer_l(SniffAMR, "AMR", 0.5f);
+    RegisterSniffer_l(SniffMPEG2TS, "MPEG2TS", 0.1f);
+    RegisterSniffer_l(SniffMP3, "MP3", 0.2f);
+    RegisterSniffer_l(SniffAAC, "AAC", 0.2f);
+    RegisterSniffer_l(SniffMPEG2PS, "MPEG2PS", 0.25f);
+    RegisterSniffer_l(SniffWVM, "WVM", 10.0f);
 
     char value[PROPERTY_VALUE_MAX];
     if (property_get("drm.service.enabled", value, NULL)
             && (!strcmp(value, "1") || !strcasecmp(value, "true"))) {
-        RegisterSniffer_l(SniffDRM);
+        RegisterSniffer_l(SniffDRM, "DRM", 10.0f);
     }
     gSniffersRegistered = true;
 }
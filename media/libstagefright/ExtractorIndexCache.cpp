@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ExtractorIndexCache"
+#include <utils/Log.h>
+
+#include "include/ExtractorIndexCache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/properties.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/DataSource.h>
+#include <media/stagefright/MediaErrors.h>
+#include <utils/String8.h>
+
+namespace android {
+
+const char *ExtractorIndexCache::kDefaultDirectory =
+    "/data/misc/media/extractor-index";
+
+// Layout of a cache file: the header, then the key, then the payload, each
+// starting on a multiple of 8 bytes so that the payload can be used in place.
+struct CacheFileHeader {
+    uint32_t mMagic;
+    uint32_t mVersion;
+    uint32_t mTag;
+    uint32_t mKeySize;
+    uint64_t mPayloadSize;
+    uint32_t mPayloadChecksum;
+    uint32_t mReserved;
+};
+
+static const uint32_t kMagic = 0x73666978;  // 'sfix'
+static const uint32_t kVersion = 1;
+
+// Temporary files older than this are left over from a writer that died.
+static const time_t kStaleTempFileAgeSecs = 600;
+
+static size_t align8(size_t x) {
+    return (x + 7) & ~(size_t)7;
+}
+
+// Adler-32, to catch entries that were damaged after being written.
+static uint32_t checksum(const void *data, size_t size) {
+    const uint8_t *ptr = (const uint8_t *)data;
+    uint32_t a = 1, b = 0;
+    while (size > 0) {
+        size_t n = size < 4096 ? size : 4096;
+        size -= n;
+        while (n-- > 0) {
+            a += *ptr++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+static bool getDirectory(String8 *dir) {
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get("media.stagefright.index-cache", value, NULL)) {
+        if (value[0] == '\0') {
+            return false;
+        }
+        dir->setTo(value);
+    } else {
+        dir->setTo(ExtractorIndexCache::kDefaultDirectory);
+    }
+    return true;
+}
+
+// Entries are named after a hash of the key and tag. Collisions are resolved
+// by comparing the key stored in the entry, a colliding store simply
+// replaces the previous entry.
+static String8 getPath(const String8 &dir, const String8 &key, uint32_t tag) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for (size_t i = 0; i < key.size(); ++i) {
+        hash = (hash ^ (uint8_t)key.string()[i]) * 1099511628211ull;
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        hash = (hash ^ ((tag >> (8 * i)) & 0xff)) * 1099511628211ull;
+    }
+
+    String8 path(dir);
+    path.appendFormat("/%016llx.idx", (unsigned long long)hash);
+    return path;
+}
+
+ExtractorIndexCache::Entry::Entry(
+        void *mapping, size_t mappingSize, const void *data, size_t size)
+    : mMapping(mapping),
+      mMappingSize(mappingSize),
+      mData(data),
+      mSize(size) {
+}
+
+ExtractorIndexCache::Entry::~Entry() {
+    munmap(mMapping, mMappingSize);
+}
+
+// static
+sp<ExtractorIndexCache::Entry> ExtractorIndexCache::Lookup(
+        const sp<DataSource> &source, uint32_t tag) {
+    String8 dir, key;
+    if (!getDirectory(&dir) || source->getFileIdentity(&key) != OK) {
+        return NULL;
+    }
+
+    String8 path = getPath(dir, key, tag);
+    int fd = open(path.string(), O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(CacheFileHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t mappingSize = st.st_size;
+    void *mapping = mmap(NULL, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        ALOGW("failed to map %s (%s)", path.string(), strerror(errno));
+        return NULL;
+    }
+
+    const CacheFileHeader *header = (const CacheFileHeader *)mapping;
+    const uint8_t *keyData = (const uint8_t *)mapping + sizeof(*header);
+    const uint8_t *payload = keyData + align8(header->mKeySize);
+
+    if (header->mMagic != kMagic
+            || header->mVersion != kVersion
+            || header->mTag != tag
+            || header->mKeySize != key.size()
+            || header->mPayloadSize > kMaxPayloadSize
+            || sizeof(*header) + align8(header->mKeySize)
+                    + header->mPayloadSize != mappingSize
+            || memcmp(keyData, key.string(), key.size())
+            || checksum(payload, header->mPayloadSize)
+                    != header->mPayloadChecksum) {
+        ALOGV("no valid entry in %s", path.string());
+        munmap(mapping, mappingSize);
+        return NULL;
+    }
+
+    ALOGV("found %llu bytes for '%s' in %s",
+          header->mPayloadSize, key.string(), path.string());
+
+    return new Entry(mapping, mappingSize, payload, header->mPayloadSize);
+}
+
+// Removes the least recently modified entries so that at most
+// kMaxEntries - 1 remain before a new one is added, as well as stale
+// temporary files ("<entry>.idx.XXXXXX") left behind by a writer that died.
+static void trimDirectory(const String8 &dir, size_t maxEntries) {
+    DIR *d = opendir(dir.string());
+    if (d == NULL) {
+        return;
+    }
+
+    time_t now = time(NULL);
+
+    for (;;) {
+        size_t count = 0;
+        String8 oldestPath;
+        time_t oldestTime = 0;
+
+        rewinddir(d);
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL) {
+            size_t len = strlen(ent->d_name);
+            bool isEntry = len >= 4 && !strcmp(&ent->d_name[len - 4], ".idx");
+            bool isTempFile = !isEntry && strstr(ent->d_name, ".idx.") != NULL;
+            if (!isEntry && !isTempFile) {
+                continue;
+            }
+
+            String8 path(dir);
+            path.appendFormat("/%s", ent->d_name);
+
+            struct stat st;
+            if (stat(path.string(), &st) < 0) {
+                continue;
+            }
+
+            if (isTempFile) {
+                // Leave files that may still be written by another process.
+                if (now - st.st_mtime > kStaleTempFileAgeSecs) {
+                    ALOGV("removing stale %s", path.string());
+                    unlink(path.string());
+                }
+                continue;
+            }
+
+            if (count == 0 || st.st_mtime < oldestTime) {
+                oldestPath = path;
+                oldestTime = st.st_mtime;
+            }
+            ++count;
+        }
+
+        if (count < maxEntries) {
+            break;
+        }
+
+        ALOGV("evicting %s", oldestPath.string());
+        if (unlink(oldestPath.string()) < 0) {
+            break;
+        }
+    }
+
+    closedir(d);
+}
+
+// static
+status_t ExtractorIndexCache::Store(
+        const sp<DataSource> &source, uint32_t tag,
+        const void *data, size_t size) {
+    if (size > kMaxPayloadSize) {
+        return ERROR_UNSUPPORTED;
+    }
+
+    String8 dir, key;
+    if (!getDirectory(&dir)) {
+        return ERROR_UNSUPPORTED;
+    }
+
+    status_t err = source->getFileIdentity(&key);
+    if (err != OK) {
+        return err;
+    }
+
+    if (mkdir(dir.string(), 0700) < 0 && errno != EEXIST) {
+        // Expected for clients that may not write to the cache.
+        if (errno == EACCES) {
+            ALOGV("failed to create %s (%s)", dir.string(), strerror(errno));
+        } else {
+            ALOGW("failed to create %s (%s)", dir.string(), strerror(errno));
+        }
+        return -errno;
+    }
+
+    trimDirectory(dir, kMaxEntries);
+
+    CacheFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.mMagic = kMagic;
+    header.mVersion = kVersion;
+    header.mTag = tag;
+    header.mKeySize = key.size();
+    header.mPayloadSize = size;
+    header.mPayloadChecksum = checksum(data, size);
+
+    size_t keySize = align8(key.size());
+    uint8_t *keyData = new uint8_t[keySize];
+    memset(keyData, 0, keySize);
+    memcpy(keyData, key.string(), key.size());
+
+    // Write to a temporary file first so that readers never see a partial
+    // entry, even if we die while writing it.
+    String8 path = getPath(dir, key, tag);
+    String8 tmpPath(path);
+    tmpPath.append(".XXXXXX");
+
+    err = OK;
+    int fd = mkstemp(tmpPath.lockBuffer(tmpPath.size()));
+    tmpPath.unlockBuffer();
+    if (fd < 0) {
+        err = -errno;
+    } else {
+        if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)
+                || write(fd, keyData, keySize) != (ssize_t)keySize
+                || write(fd, data, size) != (ssize_t)size) {
+            err = ERROR_IO;
+        }
+        close(fd);
+
+        if (err == OK && rename(tmpPath.string(), path.string()) < 0) {
+            err = -errno;
+        }
+        if (err != OK) {
+            unlink(tmpPath.string());
+        }
+    }
+
+    delete[] keyData;
+    keyData = NULL;
+
+    if (err == -EACCES) {
+        ALOGV("failed to store %s (%d)", path.string(), err);
+        return err;
+    } else if (err != OK) {
+        ALOGW("failed to store %s (%d)", path.string(), err);
+        return err;
+    }
+
+    ALOGV("stored %zu bytes for '%s' in %s", size, key.string(), path.string());
+
+    return OK;
+}
+
+}  // namespace android
@@ -16,6 +16,7 @@
 
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/FileSource.h>
+#include <utils/String8.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -105,13 +106,13 @@ ssize_t FileSource::readAt(off64_t offset, void *data, size_t size) {
             == mDecryptHandle->decryptApiType) {
         return readAtDRM(offset, data, size);
    } else {
-        off64_t result = lseek64(mFd, offset + mOffset, SEEK_SET);
-        if (result == -1) {
-            ALOGE("seek to %lld failed", offset + mOffset);
+        ssize_t n = pread64(mFd, data, size, offset + mOffset);
+        if (n < 0) {
+            ALOGE("read at %lld failed (%s)", offset + mOffset, strerror(errno));
             return UNKNOWN_ERROR;
         }
 
-        return ::read(mFd, data, size);
+        return n;
     }
 }
 
@@ -127,6 +128,49 @@ status_t FileSource::getSize(off64_t *size) {
     return OK;
 }
 
+// Sub-second part of the modification time, so that a file rewritten
+// within the same second with the same size gets a new identity.
+static unsigned long getMtimeNsec(const struct stat &st) {
+#ifdef __BIONIC__
+    return st.st_mtime_nsec;
+#else
+    return st.st_mtim.tv_nsec;
+#endif
+}
+
+status_t FileSource::getFileIdentity(String8 *identity) {
+    Mutex::Autolock autoLock(mLock);
+
+    if (mFd < 0) {
+        return NO_INIT;
+    }
+
+    if (mDecryptHandle != NULL) {
+        // The content read depends on the DRM session, don't let it be cached.
+        return ERROR_UNSUPPORTED;
+    }
+
+    struct stat st;
+    if (fstat(mFd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return ERROR_UNSUPPORTED;
+    }
+
+    // The range covered by this source is part of the identity, as the same
+    // file may hold several media, e.g. resources packed in an apk.
+    identity->setTo("");
+    identity->appendFormat(
+            "%llx:%llx:%lld:%lld:%lld:%ld.%09lu",
+            (unsigned long long)st.st_dev,
+            (unsigned long long)st.st_ino,
+            (long long)st.st_size,
+            (long long)mOffset,
+            (long long)mLength,
+            (long)st.st_mtime,
+            getMtimeNsec(st));
+
+    return OK;
+}
+
 sp<DecryptHandle> FileSource::DrmInitialization(const char *mime) {
     if (mDrmManagerClient == NULL) {
         mDrmManagerClient = new DrmManagerClient();
@@ -36,6 +36,8 @@
 #include <media/stagefright/MetaData.h>
 #include <media/stagefright/Utils.h>
 #include <utils/String8.h>
+#include <utils/threads.h>
+#include <utils/Vector.h>
 
 namespace android {
 
@@ -45,6 +47,33 @@ namespace android {
 // Yes ... there are things that must indeed match...
 static const uint32_t kMask = 0xfffe0c00;
 
+// Returns the offset of the first byte in "data" that may start a frame
+// header, i.e. a 0xff byte followed by a byte with its 3 top bits set, or
+// "size - 1" if there is none. memchr() is much faster than testing every
+// byte, and most bytes of a stream that lost sync can be skipped this way.
+static size_t FindSyncCandidate(const uint8_t *data, size_t size) {
+    if (size < 2) {
+        return 0;
+    }
+
+    const uint8_t *ptr = data;
+    const uint8_t *end = data + size - 1;
+    while (ptr < end) {
+        ptr = (const uint8_t *)memchr(ptr, 0xff, end - ptr);
+        if (ptr == NULL) {
+            break;
+        }
+
+        if ((ptr[1] & 0xe0) == 0xe0) {
+            return ptr - data;
+        }
+
+        ++ptr;
+    }
+
+    return size - 1;
+}
+
 static bool Resync(
         const sp<DataSource> &source, uint32_t match_header,
         off64_t *inout_pos, off64_t *post_id3_pos, uint32_t *out_header) {
@@ -135,6 +164,14 @@ static bool Resync(
             }
         }
 
+        size_t skip = FindSyncCandidate(tmp, remainingBytes);
+        if (skip > 0) {
+            pos += skip;
+            tmp += skip;
+            remainingBytes -= skip;
+            continue;
+        }
+
         uint32_t header = U32_AT(tmp);
 
         if (match_header != 0 && (header & kMask) != (match_header & kMask)) {
@@ -209,12 +246,218 @@ static bool Resync(
     return valid;
 }
 
+// Offsets of every mInterval-th frame of the stream, recorded as frames are
+// read and extended a few frames ahead of playback on each read, by scanning
+// frame headers. Unlike the XING and VBRI tables of contents this locates the
+// exact frame containing the seek target, even for variable bitrate streams,
+// which is why it is only used for sources on which reading ahead is cheap.
+// Seeks past the part of the stream indexed so far are left to the
+// XING/VBRI/CBR seeker, the seek path never scans the stream itself.
+struct MP3FrameIndex : public RefBase {
+    MP3FrameIndex(
+            const sp<DataSource> &source,
+            off64_t first_frame_pos, uint32_t fixed_header);
+
+    // Called by MP3Source for each frame it reads, only frames immediately
+    // following the part of the stream already indexed are added. Then
+    // indexes at most kFramesToIndexPerRead frames further.
+    void addFrame(off64_t pos, size_t frame_size, int num_samples);
+
+    // Same semantics as MP3Seeker::getOffsetForTime(), fails if the stream
+    // is not indexed up to "*timeUs" yet.
+    bool getOffsetForTime(int64_t *timeUs, off64_t *pos);
+
+protected:
+    virtual ~MP3FrameIndex();
+
+private:
+    enum {
+        kMaxEntries = 16384,
+        kBufferSize = 16384,
+        kFramesToIndexPerRead = 32,
+    };
+
+    struct Entry {
+        off64_t mPos;
+        int64_t mSample;
+    };
+
+    Mutex mLock;
+    sp<DataSource> mDataSource;
+    uint32_t mFixedHeader;
+    int mSampleRate;
+
+    Vector<Entry> mEntries;
+    size_t mInterval;
+    size_t mNumFrames;
+    off64_t mNextPos;
+    int64_t mNextSample;
+    bool mComplete;
+
+    // Read cache for scanning frame headers.
+    uint8_t *mBuffer;
+    off64_t mBufferPos;
+    size_t mBufferSize;
+
+    void addFrame_l(off64_t pos, size_t frame_size, int num_samples);
+    bool readFrame_l(off64_t pos, size_t *frame_size, int *num_samples);
+
+    DISALLOW_EVIL_CONSTRUCTORS(MP3FrameIndex);
+};
+
+MP3FrameIndex::MP3FrameIndex(
+        const sp<DataSource> &source,
+        off64_t first_frame_pos, uint32_t fixed_header)
+    : mDataSource(source),
+      mFixedHeader(fixed_header),
+      mSampleRate(0),
+      mInterval(1),
+      mNumFrames(0),
+      mNextPos(first_frame_pos),
+      mNextSample(0),
+      mComplete(false),
+      mBuffer(new uint8_t[kBufferSize]),
+      mBufferPos(0),
+      mBufferSize(0) {
+    size_t frame_size;
+    GetMPEGAudioFrameSize(fixed_header, &frame_size, &mSampleRate);
+}
+
+MP3FrameIndex::~MP3FrameIndex() {
+    delete[] mBuffer;
+    mBuffer = NULL;
+}
+
+void MP3FrameIndex::addFrame(off64_t pos, size_t frame_size, int num_samples) {
+    Mutex::Autolock autoLock(mLock);
+
+    if (pos == mNextPos && !mComplete) {
+        addFrame_l(pos, frame_size, num_samples);
+    }
+
+    // A bounded amount of work per frame read, about one read of the
+    // header cache, so that the index gets ahead of playback quickly
+    // without delaying any single read.
+    for (size_t i = 0; i < kFramesToIndexPerRead && !mComplete; ++i) {
+        size_t next_frame_size;
+        int next_num_samples;
+        if (!readFrame_l(mNextPos, &next_frame_size, &next_num_samples)) {
+            // Either the end of the stream, or garbage we don't try to
+            // resync over, the index simply ends there.
+            ALOGV("frame index complete after %zu frames", mNumFrames);
+            mComplete = true;
+            break;
+        }
+
+        addFrame_l(mNextPos, next_frame_size, next_num_samples);
+    }
+}
+
+void MP3FrameIndex::addFrame_l(
+        off64_t pos, size_t frame_size, int num_samples) {
+    if (mNumFrames % mInterval == 0) {
+        if (mEntries.size() >= kMaxEntries) {
+            // Thin out the index evenly to bound its size.
+            size_t j = 0;
+            for (size_t i = 0; i < mEntries.size(); i += 2) {
+                mEntries.editItemAt(j++) = mEntries.itemAt(i);
+            }
+            mEntries.removeItemsAt(j, mEntries.size() - j);
+            mInterval *= 2;
+        }
+
+        if (mNumFrames % mInterval == 0) {
+            Entry entry;
+            entry.mPos = pos;
+            entry.mSample = mNextSample;
+            mEntries.push(entry);
+        }
+    }
+
+    ++mNumFrames;
+    mNextPos = pos + frame_size;
+    mNextSample += num_samples;
+}
+
+bool MP3FrameIndex::readFrame_l(
+        off64_t pos, size_t *frame_size, int *num_samples) {
+    if (pos < mBufferPos || pos + 4 > mBufferPos + (off64_t)mBufferSize) {
+        ssize_t n = mDataSource->readAt(pos, mBuffer, kBufferSize);
+        if (n < 4) {
+            mBufferSize = 0;
+            return false;
+        }
+        mBufferPos = pos;
+        mBufferSize = n;
+    }
+
+    uint32_t header = U32_AT(&mBuffer[pos - mBufferPos]);
+
+    return (header & kMask) == (mFixedHeader & kMask)
+        && GetMPEGAudioFrameSize(
+                header, frame_size, NULL, NULL, NULL, num_samples);
+}
+
+bool MP3FrameIndex::getOffsetForTime(int64_t *timeUs, off64_t *pos) {
+    Mutex::Autolock autoLock(mLock);
+
+    if (mSampleRate <= 0) {
+        return false;
+    }
+
+    int64_t targetSample = *timeUs * mSampleRate / 1000000ll;
+
+    // A target beyond the indexed frames is left to the XING/VBRI/CBR
+    // seeker rather than clamped to the last indexed frame, or indexed
+    // here, which would stall the seek while the stream is scanned.
+    if (mEntries.isEmpty() || mNextSample <= targetSample) {
+        return false;
+    }
+
+    // Find the last indexed frame starting at or before the target...
+    size_t left = 0;
+    size_t right = mEntries.size();
+    while (left < right) {
+        size_t center = left + (right - left) / 2;
+        if (mEntries.itemAt(center).mSample <= targetSample) {
+            left = center + 1;
+        } else {
+            right = center;
+        }
+    }
+
+    const Entry &entry = mEntries.itemAt(left > 0 ? left - 1 : 0);
+    off64_t framePos = entry.mPos;
+    int64_t frameSample = entry.mSample;
+
+    // ...then the frame actually containing it, which is at most
+    // mInterval - 1 frames further.
+    while (framePos < mNextPos) {
+        size_t frame_size;
+        int num_samples;
+        if (!readFrame_l(framePos, &frame_size, &num_samples)
+                || frameSample + num_samples > targetSample
+                || framePos + (off64_t)frame_size >= mNextPos) {
+            break;
+        }
+
+        framePos += frame_size;
+        frameSample += num_samples;
+    }
+
+    *pos = framePos;
+    *timeUs = frameSample * 1000000ll / mSampleRate;
+
+    return true;
+}
+
 class MP3Source : public MediaSource {
 public:
     MP3Source(
             const sp<MetaData> &meta, const sp<DataSource> &source,
             off64_t first_frame_pos, uint32_t fixed_header,
-            const sp<MP3Seeker> &seeker);
+            const sp<MP3Seeker> &seeker,
+            const sp<MP3FrameIndex> &frameIndex);
 
     virtual status_t start(MetaData *params = NULL);
     virtual status_t stop();
@@ -237,6 +480,7 @@ private:
     int64_t mCurrentTimeUs;
     bool mStarted;
     sp<MP3Seeker> mSeeker;
+    sp<MP3FrameIndex> mFrameIndex;
     MediaBufferGroup *mGroup;
 
     int64_t mBasisTimeUs;
@@ -348,6 +592,13 @@ MP3Extractor::MP3Extractor(
         mMeta->setInt64(kKeyDuration, durationUs);
     }
 
+    off64_t fileSize;
+    if (!(mDataSource->flags() & DataSource::kIsCachingDataSource)
+            && mDataSource->getSize(&fileSize) == OK) {
+        mFrameIndex = new MP3FrameIndex(
+                mDataSource, mFirstFramePos, mFixedHeader);
+    }
+
     mInitCheck = OK;
 
     // Get iTunes-style gapless info if present.
@@ -395,7 +646,7 @@ sp<MediaSource> MP3Extractor::getTrack(size_t index) {
 
     return new MP3Source(
             mMeta, mDataSource, mFirstFramePos, mFixedHeader,
-            mSeeker);
+            mSeeker, mFrameIndex);
 }
 
 sp<MetaData> MP3Extractor::getTrackMetaData(size_t index, uint32_t flags) {
@@ -418,7 +669,8 @@ const size_t MP3Source::kMaxFrameSize = (1 << 12); /* 4096 bytes */
 MP3Source::MP3Source(
         const sp<MetaData> &meta, const sp<DataSource> &source,
         off64_t first_frame_pos, uint32_t fixed_header,
-        const sp<MP3Seeker> &seeker)
+        const sp<MP3Seeker> &seeker,
+        const sp<MP3FrameIndex> &frameIndex)
     : mMeta(meta),
       mDataSource(source),
       mFirstFramePos(first_frame_pos),
@@ -427,6 +679,7 @@ MP3Source::MP3Source(
       mCurrentTimeUs(0),
       mStarted(false),
       mSeeker(seeker),
+      mFrameIndex(frameIndex),
       mGroup(NULL),
       mBasisTimeUs(0),
       mSamplesRead(0) {
@@ -481,7 +734,11 @@ status_t MP3Source::read(
 
     if (options != NULL && options->getSeekTo(&seekTimeUs, &mode)) {
         int64_t actualSeekTimeUs = seekTimeUs;
-        if (mSeeker == NULL
+        if (mFrameIndex != NULL
+                && mFrameIndex->getOffsetForTime(
+                        &actualSeekTimeUs, &mCurrentPos)) {
+            mCurrentTimeUs = actualSeekTimeUs;
+        } else if (mSeeker == NULL
                 || !mSeeker->getOffsetForTime(&actualSeekTimeUs, &mCurrentPos)) {
             int32_t bitrate;
             if (!mMeta->findInt32(kKeyBitRate, &bitrate)) {
@@ -570,6 +827,10 @@ status_t MP3Source::read(
     buffer->meta_data()->setInt64(kKeyTime, mCurrentTimeUs);
     buffer->meta_data()->setInt32(kKeyIsSyncFrame, 1);
 
+    if (mFrameIndex != NULL) {
+        mFrameIndex->addFrame(mCurrentPos, frame_size, num_samples);
+    }
+
     mCurrentPos += frame_size;
 
     mSamplesRead += num_samples;
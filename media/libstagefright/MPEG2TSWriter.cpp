@@ -29,6 +29,11 @@
 #include <media/stagefright/MetaData.h>
 #include <media/stagefright/Utils.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "include/ESDS.h"
 
@@ -468,7 +473,7 @@ bool MPEG2TSWriter::SourceInfo::eosReceived() const {
 ////////////////////////////////////////////////////////////////////////////////
 
 MPEG2TSWriter::MPEG2TSWriter(int fd)
-    : mFile(fdopen(dup(fd), "wb")),
+    : mFd(dup(fd)),
       mWriteCookie(NULL),
       mWriteFunc(NULL),
       mStarted(false),
@@ -476,12 +481,16 @@ MPEG2TSWriter::MPEG2TSWriter(int fd)
       mNumTSPacketsWritten(0),
       mNumTSPacketsBeforeMeta(0),
       mPATContinuityCounter(0),
-      mPMTContinuityCounter(0) {
+      mPacketHeaders(NULL),
+      mPacketHeadersCapacity(0),
+      mIovecs(NULL),
+      mIovecsCapacity(0) {
     init();
 }
 
 MPEG2TSWriter::MPEG2TSWriter(const char *filename)
-    : mFile(fopen(filename, "wb")),
+    : mFd(open(filename, O_CREAT | O_LARGEFILE | O_TRUNC | O_WRONLY,
+               S_IRUSR | S_IWUSR)),
       mWriteCookie(NULL),
       mWriteFunc(NULL),
       mStarted(false),
@@ -489,14 +498,17 @@ MPEG2TSWriter::MPEG2TSWriter(const char *filename)
       mNumTSPacketsWritten(0),
       mNumTSPacketsBeforeMeta(0),
       mPATContinuityCounter(0),
-      mPMTContinuityCounter(0) {
+      mPacketHeaders(NULL),
+      mPacketHeadersCapacity(0),
+      mIovecs(NULL),
+      mIovecsCapacity(0) {
     init();
 }
 
 MPEG2TSWriter::MPEG2TSWriter(
         void *cookie,
         ssize_t (*write)(void *cookie, const void *data, size_t size))
-    : mFile(NULL),
+    : mFd(-1),
       mWriteCookie(cookie),
       mWriteFunc(write),
       mStarted(false),
@@ -504,12 +516,15 @@ MPEG2TSWriter::MPEG2TSWriter(
       mNumTSPacketsWritten(0),
       mNumTSPacketsBeforeMeta(0),
       mPATContinuityCounter(0),
-      mPMTContinuityCounter(0) {
+      mPacketHeaders(NULL),
+      mPacketHeadersCapacity(0),
+      mIovecs(NULL),
+      mIovecsCapacity(0) {
     init();
 }
 
 void MPEG2TSWriter::init() {
-    CHECK(mFile != NULL || mWriteFunc != NULL);
+    CHECK(mFd >= 0 || mWriteFunc != NULL);
 
     initCrcTable();
 
@@ -530,15 +545,30 @@ MPEG2TSWriter::~MPEG2TSWriter() {
     mLooper->unregisterHandler(mReflector->id());
     mLooper->stop();
 
-    if (mFile != NULL) {
-        fclose(mFile);
-        mFile = NULL;
+    if (mFd >= 0) {
+        close(mFd);
+        mFd = -1;
     }
+
+    delete[] mPacketHeaders;
+    mPacketHeaders = NULL;
+    delete[] mIovecs;
+    mIovecs = NULL;
 }
 
 status_t MPEG2TSWriter::addSource(const sp<MediaSource> &source) {
+    return addSource(source, 1);
+}
+
+status_t MPEG2TSWriter::addSource(
+        const sp<MediaSource> &source, unsigned programNumber) {
     CHECK(!mStarted);
 
+    // Program number 0 is reserved for the network PID in the PAT.
+    if (programNumber == 0 || programNumber > 0xffff) {
+        return BAD_VALUE;
+    }
+
     sp<MetaData> meta = source->getFormat();
     const char *mime;
     CHECK(meta->findCString(kKeyMIMEType, &mime));
@@ -548,8 +578,35 @@ status_t MPEG2TSWriter::addSource(const sp<MediaSource> &source) {
         return ERROR_UNSUPPORTED;
     }
 
+    size_t programIndex = 0;
+    while (programIndex < mPrograms.size()
+            && mPrograms.itemAt(programIndex).mProgramNumber != programNumber) {
+        ++programIndex;
+    }
+
+    if (programIndex == mPrograms.size()) {
+        if (mPrograms.size() == kMaxPrograms) {
+            return ERROR_UNSUPPORTED;
+        }
+
+        // The first program keeps the PIDs used before there could be
+        // more than one: PMT on 0x1e0 and elementary streams from 0x1e1.
+        ProgramInfo program;
+        program.mProgramNumber = programNumber;
+        program.mPMTPID = 0x1e0 + 0x10 * programIndex;
+        program.mPMTContinuityCounter = 0;
+        mPrograms.push(program);
+    }
+
+    ProgramInfo *program = &mPrograms.editItemAt(programIndex);
+    if (program->mSourceIndices.size() == kMaxProgramStreams) {
+        return ERROR_UNSUPPORTED;
+    }
+
     sp<SourceInfo> info = new SourceInfo(source);
 
+    program->mSourceIndices.push(mSources.size());
+    mSourcePIDs.push(program->mPMTPID + program->mSourceIndices.size());
     mSources.push(info);
 
     return OK;
@@ -717,26 +774,24 @@ void MPEG2TSWriter::writeProgramAssociationTable() {
     // section_syntax_indicator = b1
     // must_be_zero = b0
     // reserved = b11
-    // section_length = 0x00d
+    // section_length = 0x???
     // transport_stream_id = 0x0000
     // reserved = b11
     // version_number = b00001
     // current_next_indicator = b1
     // section_number = 0x00
     // last_section_number = 0x00
-    //   one program follows:
-    //   program_number = 0x0001
+    //   one or more programs follow:
+    //   program_number = 0x????
     //   reserved = b111
-    //   program_map_PID = 0x01e0 (13 bits!)
+    //   program_map_PID = b? ???? ???? ???? (13 bits)
     // CRC = 0x????????
 
     static const uint8_t kData[] = {
         0x47,
         0x40, 0x00, 0x10, 0x00,  // b0100 0000 0000 0000 0001 ???? 0000 0000
-        0x00, 0xb0, 0x0d, 0x00,  // b0000 0000 1011 0000 0000 1101 0000 0000
+        0x00, 0xb0, 0x00, 0x00,  // b0000 0000 1011 ???? ???? ???? 0000 0000
         0x00, 0xc3, 0x00, 0x00,  // b0000 0000 1100 0011 0000 0000 0000 0000
-        0x00, 0x01, 0xe1, 0xe0,  // b0000 0000 0000 0001 1110 0001 1110 0000
-        0x00, 0x00, 0x00, 0x00   // b???? ???? ???? ???? ???? ???? ???? ????
     };
 
     sp<ABuffer> buffer = new ABuffer(188);
@@ -748,18 +803,33 @@ void MPEG2TSWriter::writeProgramAssociationTable() {
     }
     buffer->data()[3] |= mPATContinuityCounter;
 
-    uint32_t crc = htonl(crc32(&buffer->data()[5], 12));
-    memcpy(&buffer->data()[17], &crc, sizeof(crc));
+    size_t section_length = 4 * mPrograms.size() + 4 + 5;
+    buffer->data()[6] |= section_length >> 8;
+    buffer->data()[7] = section_length & 0xff;
+
+    uint8_t *ptr = &buffer->data()[sizeof(kData)];
+    for (size_t i = 0; i < mPrograms.size(); ++i) {
+        const ProgramInfo &program = mPrograms.itemAt(i);
+
+        *ptr++ = program.mProgramNumber >> 8;
+        *ptr++ = program.mProgramNumber & 0xff;
+        *ptr++ = 0xe0 | (program.mPMTPID >> 8);
+        *ptr++ = program.mPMTPID & 0xff;
+    }
+
+    uint32_t crc = htonl(crc32(&buffer->data()[5], ptr - &buffer->data()[5]));
+    memcpy(ptr, &crc, sizeof(crc));
 
     CHECK_EQ(internalWrite(buffer->data(), buffer->size()), buffer->size());
+    ++mNumTSPacketsWritten;
 }
 
-void MPEG2TSWriter::writeProgramMap() {
+void MPEG2TSWriter::writeProgramMap(ProgramInfo *program) {
     // 0x47
     // transport_error_indicator = b0
     // payload_unit_start_indicator = b1
     // transport_priority = b0
-    // PID = b0 0001 1110 0000 (13 bits) [0x1e0]
+    // PID = b? ???? ???? ???? (13 bits) [0x1e0 for the first program]
     // transport_scrambling_control = b00
     // adaptation_field_control = b01 (no adaptation field, payload only)
     // continuity_counter = b????
@@ -770,7 +840,7 @@ void MPEG2TSWriter::writeProgramMap() {
     // must_be_zero = b0
     // reserved = b11
     // section_length = 0x???
-    // program_number = 0x0001
+    // program_number = 0x????
     // reserved = b11
     // version_number = b00001
     // current_next_indicator = b1
@@ -790,9 +860,9 @@ void MPEG2TSWriter::writeProgramMap() {
 
     static const uint8_t kData[] = {
         0x47,
-        0x41, 0xe0, 0x10, 0x00,  // b0100 0001 1110 0000 0001 ???? 0000 0000
-        0x02, 0xb0, 0x00, 0x00,  // b0000 0010 1011 ???? ???? ???? 0000 0000
-        0x01, 0xc3, 0x00, 0x00,  // b0000 0001 1100 0011 0000 0000 0000 0000
+        0x40, 0x00, 0x10, 0x00,  // b010? ???? ???? ???? 0001 ???? 0000 0000
+        0x02, 0xb0, 0x00, 0x00,  // b0000 0010 1011 ???? ???? ???? ???? ????
+        0x00, 0xc3, 0x00, 0x00,  // b???? ???? 1100 0011 0000 0000 0000 0000
         0xe0, 0x00, 0xf0, 0x00   // b111? ???? ???? ???? 1111 0000 0000 0000
     };
 
@@ -800,34 +870,44 @@ void MPEG2TSWriter::writeProgramMap() {
     memset(buffer->data(), 0xff, buffer->size());
     memcpy(buffer->data(), kData, sizeof(kData));
 
-    if (++mPMTContinuityCounter == 16) {
-        mPMTContinuityCounter = 0;
+    buffer->data()[1] |= (program->mPMTPID >> 8) & 0x1f;
+    buffer->data()[2] = program->mPMTPID & 0xff;
+
+    if (++program->mPMTContinuityCounter == 16) {
+        program->mPMTContinuityCounter = 0;
     }
-    buffer->data()[3] |= mPMTContinuityCounter;
+    buffer->data()[3] |= program->mPMTContinuityCounter;
 
-    size_t section_length = 5 * mSources.size() + 4 + 9;
+    const size_t numStreams = program->mSourceIndices.size();
+    size_t section_length = 5 * numStreams + 4 + 9;
     buffer->data()[6] |= section_length >> 8;
     buffer->data()[7] = section_length & 0xff;
 
-    static const unsigned kPCR_PID = 0x1e1;
-    buffer->data()[13] |= (kPCR_PID >> 8) & 0x1f;
-    buffer->data()[14] = kPCR_PID & 0xff;
+    buffer->data()[8] = program->mProgramNumber >> 8;
+    buffer->data()[9] = program->mProgramNumber & 0xff;
+
+    // The first elementary stream of the program carries its PCR.
+    const unsigned PCR_PID = program->mPMTPID + 1;
+    buffer->data()[13] |= (PCR_PID >> 8) & 0x1f;
+    buffer->data()[14] = PCR_PID & 0xff;
 
     uint8_t *ptr = &buffer->data()[sizeof(kData)];
-    for (size_t i = 0; i < mSources.size(); ++i) {
-        *ptr++ = mSources.editItemAt(i)->streamType();
+    for (size_t i = 0; i < numStreams; ++i) {
+        size_t sourceIndex = program->mSourceIndices.itemAt(i);
+        *ptr++ = mSources.editItemAt(sourceIndex)->streamType();
 
-        const unsigned ES_PID = 0x1e0 + i + 1;
+        const unsigned ES_PID = mSourcePIDs.itemAt(sourceIndex);
         *ptr++ = 0xe0 | (ES_PID >> 8);
         *ptr++ = ES_PID & 0xff;
         *ptr++ = 0xf0;
         *ptr++ = 0x00;
     }
 
-    uint32_t crc = htonl(crc32(&buffer->data()[5], 12+mSources.size()*5));
-    memcpy(&buffer->data()[17+mSources.size()*5], &crc, sizeof(crc));
+    uint32_t crc = htonl(crc32(&buffer->data()[5], 12+numStreams*5));
+    memcpy(&buffer->data()[17+numStreams*5], &crc, sizeof(crc));
 
     CHECK_EQ(internalWrite(buffer->data(), buffer->size()), buffer->size());
+    ++mNumTSPacketsWritten;
 }
 
 void MPEG2TSWriter::writeAccessUnit(
@@ -836,7 +916,7 @@ void MPEG2TSWriter::writeAccessUnit(
     // transport_error_indicator = b0
     // payload_unit_start_indicator = b1
     // transport_priority = b0
-    // PID = b0 0001 1110 ???? (13 bits) [0x1e0 + 1 + sourceIndex]
+    // PID = b? ???? ???? ???? (13 bits) [mSourcePIDs[sourceIndex]]
     // transport_scrambling_control = b00
     // adaptation_field_control = b??
     // continuity_counter = b????
@@ -867,13 +947,7 @@ void MPEG2TSWriter::writeAccessUnit(
     // reserved = b1
     // the first fragment of "buffer" follows
 
-    sp<ABuffer> buffer = new ABuffer(188);
-    memset(buffer->data(), 0xff, buffer->size());
-
-    const unsigned PID = 0x1e0 + sourceIndex + 1;
-
-    const unsigned continuity_counter =
-        mSources.editItemAt(sourceIndex)->incrementContinuityCounter();
+    const unsigned PID = mSourcePIDs.itemAt(sourceIndex);
 
     // XXX if there are multiple streams of a kind (more than 1 audio or
     // more than 1 video) they need distinct stream_ids.
@@ -896,7 +970,34 @@ void MPEG2TSWriter::writeAccessUnit(
         PES_packet_length = 0;
     }
 
-    uint8_t *ptr = buffer->data();
+    // The TS packet headers are built in a scratch buffer and written out
+    // along with slices of the access unit, which is never copied. Only
+    // the first and last packets may need more than 4 bytes of header.
+    size_t firstPayloadSize = padding ? accessUnit->size() : 188 - 18;
+    size_t numPackets = 1 + (accessUnit->size() - firstPayloadSize + 183) / 184;
+
+    size_t headersSize = 2 * 188 + 4 * numPackets;
+    if (headersSize > mPacketHeadersCapacity) {
+        delete[] mPacketHeaders;
+        mPacketHeaders = new uint8_t[headersSize];
+        mPacketHeadersCapacity = headersSize;
+    }
+    if (2 * numPackets > mIovecsCapacity) {
+        delete[] mIovecs;
+        mIovecs = new struct iovec[2 * numPackets];
+        mIovecsCapacity = 2 * numPackets;
+    }
+
+    uint8_t *headers = mPacketHeaders;
+    struct iovec *iov = mIovecs;
+    size_t iovCount = 0;
+
+    uint8_t *ptr = headers;
+    memset(ptr, 0xff, 188);
+
+    const unsigned continuity_counter =
+        mSources.editItemAt(sourceIndex)->incrementContinuityCounter();
+
     *ptr++ = 0x47;
     *ptr++ = 0x40 | (PID >> 8);
     *ptr++ = PID & 0xff;
@@ -924,17 +1025,14 @@ void MPEG2TSWriter::writeAccessUnit(
     *ptr++ = (PTS >> 7) & 0xff;
     *ptr++ = ((PTS & 0x7f) << 1) | 1;
 
-    size_t sizeLeft = buffer->data() + buffer->size() - ptr;
-    size_t copy = accessUnit->size();
-    if (copy > sizeLeft) {
-        copy = sizeLeft;
-    }
-
-    memcpy(ptr, accessUnit->data(), copy);
-
-    CHECK_EQ(internalWrite(buffer->data(), buffer->size()), buffer->size());
+    iov[iovCount].iov_base = headers;
+    iov[iovCount].iov_len = ptr - headers;
+    ++iovCount;
+    iov[iovCount].iov_base = accessUnit->data();
+    iov[iovCount].iov_len = firstPayloadSize;
+    ++iovCount;
 
-    size_t offset = copy;
+    size_t offset = firstPayloadSize;
     while (offset < accessUnit->size()) {
         bool lastAccessUnit = ((accessUnit->size() - offset) < 184);
         // for subsequent fragments of "buffer":
@@ -942,18 +1040,16 @@ void MPEG2TSWriter::writeAccessUnit(
         // transport_error_indicator = b0
         // payload_unit_start_indicator = b0
         // transport_priority = b0
-        // PID = b0 0001 1110 ???? (13 bits) [0x1e0 + 1 + sourceIndex]
+        // PID = b? ???? ???? ???? (13 bits)
         // transport_scrambling_control = b00
         // adaptation_field_control = b??
         // continuity_counter = b????
         // the fragment of "buffer" follows.
 
-        memset(buffer->data(), 0xff, buffer->size());
-
         const unsigned continuity_counter =
             mSources.editItemAt(sourceIndex)->incrementContinuityCounter();
 
-        ptr = buffer->data();
+        uint8_t *header = ptr;
         *ptr++ = 0x47;
         *ptr++ = 0x00 | (PID >> 8);
         *ptr++ = PID & 0xff;
@@ -963,6 +1059,7 @@ void MPEG2TSWriter::writeAccessUnit(
             // Pad packet using an adaptation field
             // Adaptation header all to 0 execpt size
             uint8_t paddingSize = (uint8_t)184 - (accessUnit->size() - offset);
+            memset(ptr, 0xff, paddingSize);
             *ptr++ = paddingSize - 1;
             if (paddingSize >= 2) {
                 *ptr++ = 0x00;
@@ -970,24 +1067,28 @@ void MPEG2TSWriter::writeAccessUnit(
             }
         }
 
-        size_t sizeLeft = buffer->data() + buffer->size() - ptr;
-        size_t copy = accessUnit->size() - offset;
-        if (copy > sizeLeft) {
-            copy = sizeLeft;
-        }
+        size_t copy = 188 - (ptr - header);
 
-        memcpy(ptr, accessUnit->data() + offset, copy);
-        CHECK_EQ(internalWrite(buffer->data(), buffer->size()),
-                 buffer->size());
+        iov[iovCount].iov_base = header;
+        iov[iovCount].iov_len = ptr - header;
+        ++iovCount;
+        iov[iovCount].iov_base = accessUnit->data() + offset;
+        iov[iovCount].iov_len = copy;
+        ++iovCount;
 
         offset += copy;
     }
+
+    CHECK_EQ(internalWritev(iov, iovCount), 188 * numPackets);
+    mNumTSPacketsWritten += numPackets;
 }
 
 void MPEG2TSWriter::writeTS() {
     if (mNumTSPacketsWritten >= mNumTSPacketsBeforeMeta) {
         writeProgramAssociationTable();
-        writeProgramMap();
+        for (size_t i = 0; i < mPrograms.size(); ++i) {
+            writeProgramMap(&mPrograms.editItemAt(i));
+        }
 
         mNumTSPacketsBeforeMeta = mNumTSPacketsWritten + 2500;
     }
@@ -1021,12 +1122,56 @@ uint32_t MPEG2TSWriter::crc32(const uint8_t *p_start, size_t length) {
 }
 
 ssize_t MPEG2TSWriter::internalWrite(const void *data, size_t size) {
-    if (mFile != NULL) {
-        return fwrite(data, 1, size, mFile);
+    if (mFd >= 0) {
+        return ::write(mFd, data, size);
     }
 
     return (*mWriteFunc)(mWriteCookie, data, size);
 }
 
+// Writes out "count" vectors with as few system calls as IOV_MAX allows,
+// or with a single call to the write function after gathering them.
+ssize_t MPEG2TSWriter::internalWritev(const struct iovec *iov, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        total += iov[i].iov_len;
+    }
+
+    if (mFd < 0) {
+        sp<ABuffer> buffer = new ABuffer(total);
+        uint8_t *ptr = buffer->data();
+        for (size_t i = 0; i < count; ++i) {
+            memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+            ptr += iov[i].iov_len;
+        }
+
+        return (*mWriteFunc)(mWriteCookie, buffer->data(), buffer->size());
+    }
+
+    ssize_t written = 0;
+    while (count > 0) {
+        size_t n = count < IOV_MAX ? count : IOV_MAX;
+
+        size_t expected = 0;
+        for (size_t i = 0; i < n; ++i) {
+            expected += iov[i].iov_len;
+        }
+
+        ssize_t result = ::writev(mFd, iov, n);
+        if (result < 0) {
+            return result;
+        }
+        written += result;
+        if ((size_t)result != expected) {
+            break;
+        }
+
+        iov += n;
+        count -= n;
+    }
+
+    return written;
+}
+
 }  // namespace android
 
@@ -37,6 +37,7 @@
 #include <media/stagefright/MediaSource.h>
 #include <media/stagefright/MetaData.h>
 #include <utils/String8.h>
+#include <cutils/properties.h>
 
 namespace android {
 
@@ -48,6 +49,7 @@ public:
                 int32_t timeScale,
                 const sp<SampleTable> &sampleTable,
                 Vector<SidxEntry> &sidx,
+                const Vector<FragmentEntry> &fragments,
                 off64_t firstMoofOffset);
 
     virtual status_t start(MetaData *params = NULL);
@@ -71,6 +73,7 @@ private:
     uint32_t mCurrentSampleIndex;
     uint32_t mCurrentFragmentIndex;
     Vector<SidxEntry> &mSegments;
+    Vector<FragmentEntry> mFragments;   // sorted by time
     off64_t mFirstMoofOffset;
     off64_t mCurrentMoofOffset;
     off64_t mNextMoofOffset;
@@ -105,7 +108,12 @@ private:
     uint8_t *mSrcBuffer;
 
     size_t parseNALSize(const uint8_t *data) const;
+    size_t getStartCodePrefixedSize(const uint8_t *data, size_t size) const;
     status_t parseChunk(off64_t *offset);
+    status_t parseFragment(off64_t moofOffset, uint64_t *duration);
+    void skipToNextMoof(off64_t *offset);
+    void addFragment(off64_t moofOffset, uint64_t time);
+    status_t seekToFragment(int64_t seekTimeUs, ReadOptions::SeekMode mode);
     status_t parseTrackFragmentHeader(off64_t offset, off64_t size);
     status_t parseTrackFragmentRun(off64_t offset, off64_t size);
     status_t parseSampleAuxiliaryInformationSizes(off64_t offset, off64_t size);
@@ -341,12 +349,18 @@ MPEG4Extractor::MPEG4Extractor(const sp<DataSource> &source)
       mDataSource(source),
       mInitCheck(NO_INIT),
       mHasVideo(false),
+      mLazySampleTables(true),
       mHeaderTimescale(0),
       mFirstTrack(NULL),
       mLastTrack(NULL),
       mFileMetaData(new MetaData),
       mFirstSINF(NULL),
       mIsDrm(false) {
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get("media.stagefright.lazy-moov", value, NULL)
+            && (!strcmp(value, "0") || !strcasecmp(value, "false"))) {
+        mLazySampleTables = false;
+    }
 }
 
 MPEG4Extractor::~MPEG4Extractor() {
@@ -374,9 +388,9 @@ MPEG4Extractor::~MPEG4Extractor() {
 }
 
 uint32_t MPEG4Extractor::flags() const {
-    return CAN_PAUSE |
-            ((mMoofOffset == 0 || mSidxEntries.size() != 0) ?
-                    (CAN_SEEK_BACKWARD | CAN_SEEK_FORWARD | CAN_SEEK) : 0);
+    // Fragmented files can be seeked without a segment index, by walking
+    // the fragments, see MPEG4Source::seekToFragment().
+    return CAN_PAUSE | CAN_SEEK_BACKWARD | CAN_SEEK_FORWARD | CAN_SEEK;
 }
 
 sp<MetaData> MPEG4Extractor::getMetaData() {
@@ -441,7 +455,7 @@ sp<MetaData> MPEG4Extractor::getTrackMetaData(
                     track->meta->setInt64(
                             kKeyThumbnailTime, duration / 4);
                 }
-            } else {
+            } else if (materializeSampleTable(track) == OK) {
                 uint32_t sampleIndex;
                 uint32_t sampleTime;
                 if (track->sampleTable->findThumbnailSample(&sampleIndex) == OK
@@ -488,6 +502,12 @@ status_t MPEG4Extractor::readMetaData() {
         if (chunk_type == FOURCC('s', 'i', 'd', 'x')) {
             // parse the sidx box too
             continue;
+        } else if (chunk_type == FOURCC('s', 't', 'y', 'p')
+                || chunk_type == FOURCC('f', 'r', 'e', 'e')
+                || chunk_type == FOURCC('s', 'k', 'i', 'p')
+                || chunk_type == FOURCC('p', 'r', 'f', 't')) {
+            // a DASH media segment may start with these before its sidx/moof
+            continue;
         } else if (chunk_type == FOURCC('m', 'o', 'o', 'f')) {
             // store the offset of the first segment
             mMoofOffset = offset;
@@ -496,6 +516,13 @@ status_t MPEG4Extractor::readMetaData() {
     }
 
     if (mInitCheck == OK) {
+        if (mMoofOffset != 0 && mSidxEntries.isEmpty()) {
+            // Without a segment index, the random access box at the end of
+            // the file, if any, tells where the fragments start. Otherwise
+            // the sources index the fragments as they find them.
+            parseMovieFragmentRandomAccess();
+        }
+
         if (mHasVideo) {
             mFileMetaData->setCString(
                     kKeyMIMEType, MEDIA_MIMETYPE_CONTAINER_MPEG4);
@@ -732,6 +759,25 @@ static void convertTimeToDate(int64_t time_1904, String8 *s) {
     s->setTo(tmp);
 }
 
+static status_t setSampleTableParams(
+        const sp<SampleTable> &sampleTable,
+        uint32_t type, off64_t data_offset, size_t data_size) {
+    switch (type) {
+        case FOURCC('s', 't', 's', 'c'):
+            return sampleTable->setSampleToChunkParams(data_offset, data_size);
+        case FOURCC('s', 't', 't', 's'):
+            return sampleTable->setTimeToSampleParams(data_offset, data_size);
+        case FOURCC('c', 't', 't', 's'):
+            return sampleTable->setCompositionTimeToSampleParams(
+                    data_offset, data_size);
+        case FOURCC('s', 't', 's', 's'):
+            return sampleTable->setSyncSampleParams(data_offset, data_size);
+        default:
+            TRESPASS();
+            return ERROR_MALFORMED;
+    }
+}
+
 status_t MPEG4Extractor::parseChunk(off64_t *offset, int depth) {
     ALOGV("entering parseChunk %lld/%d", *offset, depth);
     uint32_t hdr[2];
@@ -1337,13 +1383,27 @@ status_t MPEG4Extractor::parseChunk(off64_t *offset, int depth) {
         }
 
         case FOURCC('s', 't', 's', 'c'):
+        case FOURCC('s', 't', 't', 's'):
+        case FOURCC('c', 't', 't', 's'):
+        case FOURCC('s', 't', 's', 's'):
         {
-            status_t err =
-                mLastTrack->sampleTable->setSampleToChunkParams(
-                        data_offset, chunk_data_size);
+            if (mLazySampleTables) {
+                // These tables are read in full when parsed, which makes
+                // opening files with long tracks slow. Only note where they
+                // are, and parse them once the track is actually used.
+                SampleTableBox box;
+                box.type = chunk_type;
+                box.offset = data_offset;
+                box.size = chunk_data_size;
+                mLastTrack->sampleTableBoxes.push(box);
+            } else {
+                status_t err = setSampleTableParams(
+                        mLastTrack->sampleTable,
+                        chunk_type, data_offset, chunk_data_size);
 
-            if (err != OK) {
-                return err;
+                if (err != OK) {
+                    return err;
+                }
             }
 
             *offset += chunk_size;
@@ -1419,48 +1479,6 @@ status_t MPEG4Extractor::parseChunk(off64_t *offset, int depth) {
             break;
         }
 
-        case FOURCC('s', 't', 't', 's'):
-        {
-            status_t err =
-                mLastTrack->sampleTable->setTimeToSampleParams(
-                        data_offset, chunk_data_size);
-
-            if (err != OK) {
-                return err;
-            }
-
-            *offset += chunk_size;
-            break;
-        }
-
-        case FOURCC('c', 't', 't', 's'):
-        {
-            status_t err =
-                mLastTrack->sampleTable->setCompositionTimeToSampleParams(
-                        data_offset, chunk_data_size);
-
-            if (err != OK) {
-                return err;
-            }
-
-            *offset += chunk_size;
-            break;
-        }
-
-        case FOURCC('s', 't', 's', 's'):
-        {
-            status_t err =
-                mLastTrack->sampleTable->setSyncSampleParams(
-                        data_offset, chunk_data_size);
-
-            if (err != OK) {
-                return err;
-            }
-
-            *offset += chunk_size;
-            break;
-        }
-
         // @xyz
         case FOURCC('\xA9', 'x', 'y', 'z'):
         {
@@ -1904,6 +1922,212 @@ status_t MPEG4Extractor::parseSegmentIndex(off64_t offset, size_t size) {
     return OK;
 }
 
+status_t MPEG4Extractor::parseMovieFragmentRandomAccess() {
+    off64_t fileSize;
+    if ((mDataSource->flags() & DataSource::kIsCachingDataSource)
+            || mDataSource->getSize(&fileSize) != OK
+            || fileSize < 16) {
+        // Don't fetch the end of streamed content just for this.
+        return ERROR_UNSUPPORTED;
+    }
+
+    // The mfro box, which closes the mfra box, holds the size of the latter.
+    uint8_t mfro[16];
+    if (mDataSource->readAt(fileSize - 16, mfro, 16) < 16) {
+        return ERROR_IO;
+    }
+
+    if (U32_AT(mfro) != 16 || U32_AT(&mfro[4]) != FOURCC('m', 'f', 'r', 'o')) {
+        return ERROR_UNSUPPORTED;
+    }
+
+    uint32_t mfraSize = U32_AT(&mfro[12]);
+    if (mfraSize < 8 + 16 || mfraSize > fileSize) {
+        return ERROR_MALFORMED;
+    }
+
+    off64_t offset = fileSize - mfraSize;
+    uint32_t hdr[2];
+    if (mDataSource->readAt(offset, hdr, 8) < 8) {
+        return ERROR_IO;
+    }
+
+    if (ntohl(hdr[0]) != mfraSize || ntohl(hdr[1]) != FOURCC('m', 'f', 'r', 'a')) {
+        return ERROR_MALFORMED;
+    }
+
+    off64_t stopOffset = fileSize - 16;
+    offset += 8;
+    while (offset + 8 <= stopOffset) {
+        if (mDataSource->readAt(offset, hdr, 8) < 8) {
+            return ERROR_IO;
+        }
+
+        uint32_t chunkSize = ntohl(hdr[0]);
+        if (chunkSize < 8 || offset + chunkSize > stopOffset) {
+            return ERROR_MALFORMED;
+        }
+
+        if (ntohl(hdr[1]) == FOURCC('t', 'f', 'r', 'a')) {
+            status_t err = parseTrackFragmentRandomAccess(
+                    offset + 8, chunkSize - 8);
+            if (err != OK) {
+                return err;
+            }
+        }
+
+        offset += chunkSize;
+    }
+
+    return OK;
+}
+
+// Reads a big endian number of 1 to 4 bytes.
+static uint32_t readNumber(const uint8_t *ptr, size_t size) {
+    uint32_t x = 0;
+    for (size_t i = 0; i < size; ++i) {
+        x = (x << 8) | ptr[i];
+    }
+    return x;
+}
+
+status_t MPEG4Extractor::parseTrackFragmentRandomAccess(
+        off64_t offset, off64_t size) {
+    if (size < 16) {
+        return ERROR_MALFORMED;
+    }
+
+    uint8_t header[16];
+    if (mDataSource->readAt(offset, header, 16) < 16) {
+        return ERROR_IO;
+    }
+
+    uint32_t version = header[0];
+    uint32_t trackID = U32_AT(&header[4]);
+    uint32_t lengths = U32_AT(&header[8]);
+    uint32_t numEntries = U32_AT(&header[12]);
+
+    size_t trafNumberSize = ((lengths >> 4) & 3) + 1;
+    size_t trunNumberSize = ((lengths >> 2) & 3) + 1;
+    size_t sampleNumberSize = (lengths & 3) + 1;
+    size_t timeSize = (version == 1) ? 8 : 4;
+    size_t entrySize = 2 * timeSize
+            + trafNumberSize + trunNumberSize + sampleNumberSize;
+
+    offset += 16;
+    size -= 16;
+
+    if ((uint64_t)numEntries * entrySize > (uint64_t)size) {
+        return ERROR_MALFORMED;
+    }
+
+    Track *track = mFirstTrack;
+    while (track != NULL) {
+        int32_t id;
+        if (track->meta->findInt32(kKeyTrackID, &id) && (uint32_t)id == trackID) {
+            break;
+        }
+        track = track->next;
+    }
+
+    if (track == NULL || numEntries == 0) {
+        return OK;
+    }
+
+    // The fragments past the last entry kept are found by walking.
+    static const uint32_t kMaxEntries = 65536;
+    if (numEntries > kMaxEntries) {
+        ALOGW("track %u: only indexing %u of %u fragments",
+              trackID, kMaxEntries, numEntries);
+        numEntries = kMaxEntries;
+    }
+
+    // The entries are read a block at a time, the box size is up to the file.
+    static const uint32_t kEntriesPerBlock = 256;
+    uint8_t *data = new uint8_t[kEntriesPerBlock * entrySize];
+
+    track->fragments.clear();
+
+    // tfra times are presentation times, but the times of the fragments
+    // found by walking start at 0 with the first moof. The entries are
+    // rebased on the one for the first moof, without it they are unusable.
+    bool haveBaseTime = false;
+    uint64_t baseTime = 0;
+
+    const uint8_t *ptr = data;
+    for (uint32_t i = 0; i < numEntries; ++i, ptr += entrySize) {
+        if ((i % kEntriesPerBlock) == 0) {
+            uint32_t n = numEntries - i;
+            if (n > kEntriesPerBlock) {
+                n = kEntriesPerBlock;
+            }
+            if (mDataSource->readAt(offset + (off64_t)i * entrySize,
+                        data, n * entrySize) < (ssize_t)(n * entrySize)) {
+                delete[] data;
+                track->fragments.clear();
+                return ERROR_IO;
+            }
+            ptr = data;
+        }
+
+        FragmentEntry entry;
+        if (version == 1) {
+            entry.mTime = U64_AT(ptr);
+            entry.mMoofOffset = U64_AT(&ptr[8]);
+        } else {
+            entry.mTime = U32_AT(ptr);
+            entry.mMoofOffset = U32_AT(&ptr[4]);
+        }
+
+        // Only entries for the first sample of a fragment give its start
+        // time, the fragments holding other entries are found by walking.
+        const uint8_t *numbers = ptr + 2 * timeSize;
+        uint32_t trafNumber = readNumber(numbers, trafNumberSize);
+        numbers += trafNumberSize;
+        uint32_t trunNumber = readNumber(numbers, trunNumberSize);
+        numbers += trunNumberSize;
+        uint32_t sampleNumber = readNumber(numbers, sampleNumberSize);
+        bool isFirstSample =
+            trafNumber == 1 && trunNumber == 1 && sampleNumber == 1;
+
+        if (!isFirstSample || entry.mMoofOffset < mMoofOffset) {
+            continue;
+        }
+
+        if (!haveBaseTime) {
+            if (entry.mMoofOffset != mMoofOffset) {
+                ALOGV("track %u: no entry for the first fragment", trackID);
+                break;
+            }
+            baseTime = entry.mTime;
+            haveBaseTime = true;
+        }
+
+        if (entry.mTime < baseTime) {
+            continue;
+        }
+        entry.mTime -= baseTime;
+
+        if (!track->fragments.isEmpty()) {
+            const FragmentEntry &last = track->fragments.top();
+            if (entry.mTime <= last.mTime || entry.mMoofOffset <= last.mMoofOffset) {
+                // Only increasing entries are of any use.
+                continue;
+            }
+        }
+
+        track->fragments.push(entry);
+    }
+
+    delete[] data;
+    data = NULL;
+
+    ALOGV("track %u: %d fragments indexed out of %u entries",
+          trackID, track->fragments.size(), numEntries);
+
+    return OK;
+}
+
 
 
 status_t MPEG4Extractor::parseTrackHeader(
@@ -2204,9 +2428,13 @@ sp<MediaSource> MPEG4Extractor::getTrack(size_t index) {
 
     ALOGV("getTrack called, pssh: %d", mPssh.size());
 
+    if (materializeSampleTable(track) != OK) {
+        return NULL;
+    }
+
     return new MPEG4Source(
             track->meta, mDataSource, track->timescale, track->sampleTable,
-            mSidxEntries, mMoofOffset);
+            mSidxEntries, track->fragments, mMoofOffset);
 }
 
 // static
@@ -2230,8 +2458,58 @@ status_t MPEG4Extractor::verifyTrack(Track *track) {
         }
     }
 
+    if (track->sampleTableBoxes.isEmpty()) {
+        if (!track->sampleTable->isValid()) {
+            // Make sure we have all the metadata we need.
+            return ERROR_MALFORMED;
+        }
+        return OK;
+    }
+
+    // Some tables have not been parsed yet, make sure at least that they
+    // are present. The rest is checked by materializeSampleTable().
+    bool hasSampleToChunk = false;
+    bool hasTimeToSample = false;
+    for (size_t i = 0; i < track->sampleTableBoxes.size(); ++i) {
+        switch (track->sampleTableBoxes[i].type) {
+            case FOURCC('s', 't', 's', 'c'):
+                hasSampleToChunk = true;
+                break;
+            case FOURCC('s', 't', 't', 's'):
+                hasTimeToSample = true;
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (!hasSampleToChunk || !hasTimeToSample) {
+        return ERROR_MALFORMED;
+    }
+
+    return OK;
+}
+
+status_t MPEG4Extractor::materializeSampleTable(Track *track) {
+    if (track->sampleTableBoxes.isEmpty()) {
+        return OK;
+    }
+
+    for (size_t i = 0; i < track->sampleTableBoxes.size(); ++i) {
+        const SampleTableBox &box = track->sampleTableBoxes[i];
+        status_t err = setSampleTableParams(
+                track->sampleTable, box.type, box.offset, box.size);
+
+        if (err != OK) {
+            // The boxes are kept, so that later calls fail as well.
+            ALOGE("failed to parse sample table box at offset %lld",
+                  (long long)box.offset);
+            return err;
+        }
+    }
+    track->sampleTableBoxes.clear();
+
     if (!track->sampleTable->isValid()) {
-        // Make sure we have all the metadata we need.
         return ERROR_MALFORMED;
     }
 
@@ -2364,6 +2642,7 @@ MPEG4Source::MPEG4Source(
         int32_t timeScale,
         const sp<SampleTable> &sampleTable,
         Vector<SidxEntry> &sidx,
+        const Vector<FragmentEntry> &fragments,
         off64_t firstMoofOffset)
     : mFormat(format),
       mDataSource(dataSource),
@@ -2372,8 +2651,10 @@ MPEG4Source::MPEG4Source(
       mCurrentSampleIndex(0),
       mCurrentFragmentIndex(0),
       mSegments(sidx),
+      mFragments(fragments),
       mFirstMoofOffset(firstMoofOffset),
       mCurrentMoofOffset(firstMoofOffset),
+      mNextMoofOffset(firstMoofOffset),
       mCurrentTime(0),
       mCurrentSampleInfoAllocSize(0),
       mCurrentSampleInfoSizes(NULL),
@@ -2530,7 +2811,7 @@ status_t MPEG4Source::parseChunk(off64_t *offset) {
             }
             if (chunk_type == FOURCC('m', 'o', 'o', 'f')) {
                 // *offset points to the mdat box following this moof
-                parseChunk(offset); // doesn't actually parse it, just updates offset
+                skipToNextMoof(offset);
                 mNextMoofOffset = *offset;
             }
             break;
@@ -3033,6 +3314,29 @@ size_t MPEG4Source::parseNALSize(const uint8_t *data) const {
     return 0;
 }
 
+// Returns the size of a sample once its NAL units are prefixed by start
+// codes, or (size_t)-1 if it is malformed.
+size_t MPEG4Source::getStartCodePrefixedSize(
+        const uint8_t *data, size_t size) const {
+    size_t srcOffset = 0;
+    size_t dstSize = 0;
+    while (srcOffset < size) {
+        if (srcOffset + mNALLengthSize > size) {
+            return (size_t)-1;
+        }
+        size_t nalLength = parseNALSize(&data[srcOffset]);
+        srcOffset += mNALLengthSize;
+        if (srcOffset + nalLength > size) {
+            return (size_t)-1;
+        }
+        if (nalLength > 0) {
+            dstSize += 4 + nalLength;
+        }
+        srcOffset += nalLength;
+    }
+    return dstSize;
+}
+
 status_t MPEG4Source::read(
         MediaBuffer **out, const ReadOptions *options) {
     Mutex::Autolock autoLock(mLock);
@@ -3045,6 +3349,12 @@ status_t MPEG4Source::read(
 
     *out = NULL;
 
+    void *targetData = NULL;
+    size_t targetSize = 0;
+    if (options != NULL) {
+        options->getTargetBuffer(&targetData, &targetSize);
+    }
+
     int64_t targetSampleTimeUs = -1;
 
     int64_t seekTimeUs;
@@ -3155,6 +3465,12 @@ status_t MPEG4Source::read(
 
     if (!mIsAVC || mWantsNALFragments) {
         if (newBuffer) {
+            if (!mIsAVC && targetData != NULL && size <= targetSize) {
+                // Read straight into the memory offered by the caller.
+                mBuffer->release();
+                mBuffer = new MediaBuffer(targetData, targetSize);
+            }
+
             ssize_t num_bytes_read =
                 mDataSource->readAt(offset, (uint8_t *)mBuffer->data(), size);
 
@@ -3231,6 +3547,7 @@ status_t MPEG4Source::read(
         ssize_t num_bytes_read = 0;
         int32_t drm = 0;
         bool usesDRM = (mFormat->findInt32(kKeyIsDRM, &drm) && drm != 0);
+        const uint8_t *srcData = mSrcBuffer;
         if (usesDRM) {
             num_bytes_read =
                 mDataSource->readAt(offset, (uint8_t*)mBuffer->data(), size);
@@ -3250,6 +3567,13 @@ status_t MPEG4Source::read(
             mBuffer->set_range(0, size);
 
         } else {
+            if (targetData != NULL
+                    && getStartCodePrefixedSize(srcData, size) <= targetSize) {
+                // Convert straight into the memory offered by the caller.
+                mBuffer->release();
+                mBuffer = new MediaBuffer(targetData, targetSize);
+            }
+
             uint8_t *dstData = (uint8_t *)mBuffer->data();
             size_t srcOffset = 0;
             size_t dstOffset = 0;
@@ -3258,7 +3582,7 @@ status_t MPEG4Source::read(
                 bool isMalFormed = (srcOffset + mNALLengthSize > size);
                 size_t nalLength = 0;
                 if (!isMalFormed) {
-                    nalLength = parseNALSize(&mSrcBuffer[srcOffset]);
+                    nalLength = parseNALSize(&srcData[srcOffset]);
                     srcOffset += mNALLengthSize;
                     isMalFormed = srcOffset + nalLength > size;
                 }
@@ -3280,7 +3604,7 @@ status_t MPEG4Source::read(
                 dstData[dstOffset++] = 0;
                 dstData[dstOffset++] = 0;
                 dstData[dstOffset++] = 1;
-                memcpy(&dstData[dstOffset], &mSrcBuffer[srcOffset], nalLength);
+                memcpy(&dstData[dstOffset], &srcData[srcOffset], nalLength);
                 srcOffset += nalLength;
                 dstOffset += nalLength;
             }
@@ -3311,6 +3635,158 @@ status_t MPEG4Source::read(
     }
 }
 
+// Advances "offset" over the top level boxes following a moof box, i.e.
+// the mdat box and, in concatenated segments, the styp, sidx, free, prft...
+// boxes of the next segment, up to the next moof box or the end of the data.
+void MPEG4Source::skipToNextMoof(off64_t *offset) {
+    for (;;) {
+        uint32_t hdr[2];
+        if (mDataSource->readAt(*offset, hdr, 8) < 8) {
+            return;
+        }
+        uint64_t chunk_size = ntohl(hdr[0]);
+        uint32_t chunk_type = ntohl(hdr[1]);
+
+        if (chunk_type == FOURCC('m', 'o', 'o', 'f')) {
+            return;
+        }
+
+        if (chunk_size == 1) {
+            if (mDataSource->readAt(*offset + 8, &chunk_size, 8) < 8) {
+                return;
+            }
+            chunk_size = ntoh64(chunk_size);
+            if (chunk_size < 16) {
+                return;
+            }
+        } else if (chunk_size < 8) {
+            // 0 extends to the end of the file, anything else is malformed,
+            // either way there is no further fragment.
+            return;
+        }
+
+        ALOGV("skipping top level box %c%c%c%c at %lld",
+                chunk_type >> 24, (chunk_type >> 16) & 0xff,
+                (chunk_type >> 8) & 0xff, chunk_type & 0xff, *offset);
+        *offset += chunk_size;
+    }
+}
+
+// Parses the fragment at "moofOffset", which becomes the current one.
+// On return mNextMoofOffset is past mCurrentMoofOffset only if there may be
+// another fragment after it.
+status_t MPEG4Source::parseFragment(off64_t moofOffset, uint64_t *duration) {
+    mCurrentMoofOffset = moofOffset;
+    mNextMoofOffset = moofOffset;
+    mCurrentSamples.clear();
+    mCurrentSampleIndex = 0;
+
+    off64_t offset = moofOffset;
+    status_t err = parseChunk(&offset);
+    if (err != OK) {
+        mCurrentSamples.clear();
+        mNextMoofOffset = moofOffset;
+        return err;
+    }
+
+    *duration = 0;
+    for (size_t i = 0; i < mCurrentSamples.size(); ++i) {
+        *duration += mCurrentSamples[i].duration;
+    }
+
+    return OK;
+}
+
+// Remembers where a fragment starts, so that seeking to it later does not
+// require walking the fragments before it again.
+void MPEG4Source::addFragment(off64_t moofOffset, uint64_t time) {
+    size_t left = 0;
+    size_t right = mFragments.size();
+    while (left < right) {
+        size_t center = left + (right - left) / 2;
+        if (mFragments[center].mMoofOffset < moofOffset) {
+            left = center + 1;
+        } else {
+            right = center;
+        }
+    }
+
+    if (left < mFragments.size() && mFragments[left].mMoofOffset == moofOffset) {
+        return;
+    }
+
+    FragmentEntry entry;
+    entry.mMoofOffset = moofOffset;
+    entry.mTime = time;
+    mFragments.insertAt(entry, left);
+}
+
+// Seeks to the fragment covering "seekTimeUs", starting from the closest
+// known fragment before it. Only the moof boxes are read while walking, the
+// media data in between is skipped.
+status_t MPEG4Source::seekToFragment(
+        int64_t seekTimeUs, ReadOptions::SeekMode mode) {
+    int64_t target = seekTimeUs < 0 ? 0 : seekTimeUs * mTimescale / 1000000ll;
+
+    off64_t moofOffset = mFirstMoofOffset;
+    int64_t time = 0;
+
+    // The fragments are sorted by both offset and time.
+    size_t left = 0;
+    size_t right = mFragments.size();
+    while (left < right) {
+        size_t center = left + (right - left) / 2;
+        if ((int64_t)mFragments[center].mTime <= target) {
+            left = center + 1;
+        } else {
+            right = center;
+        }
+    }
+    if (left > 0) {
+        moofOffset = mFragments[left - 1].mMoofOffset;
+        time = mFragments[left - 1].mTime;
+    }
+
+    for (;;) {
+        uint64_t duration;
+        status_t err = parseFragment(moofOffset, &duration);
+        if (err != OK) {
+            ALOGE("failed to parse fragment at offset %lld", moofOffset);
+            return err;
+        }
+
+        int64_t end = time + duration;
+        bool hasNext = mNextMoofOffset > moofOffset;
+        if (hasNext) {
+            addFragment(mNextMoofOffset, end);
+        }
+
+        if (!hasNext) {
+            break;
+        }
+
+        if (target < end) {
+            // Fragments start with a sync sample, so the target is between
+            // the sync samples starting this fragment and the next one.
+            bool useNext =
+                (mode == ReadOptions::SEEK_NEXT_SYNC && target > time)
+                || (mode == ReadOptions::SEEK_CLOSEST_SYNC
+                        && target - time > end - target);
+            if (!useNext) {
+                break;
+            }
+            // The next fragment starts after the target, the loop stops there.
+        }
+
+        moofOffset = mNextMoofOffset;
+        time = end;
+    }
+
+    mCurrentTime = time;
+
+    return OK;
+}
+
 status_t MPEG4Source::fragmentedRead(
         MediaBuffer **out, const ReadOptions *options) {
 
@@ -3352,6 +3828,11 @@ status_t MPEG4Source::fragmentedRead(
         mCurrentSampleIndex = 0;
         parseChunk(&totalOffset);
         mCurrentTime = totalTime * mTimescale / 1000000ll;
+        } else {
+            status_t err = seekToFragment(seekTimeUs, mode);
+            if (err != OK) {
+                return err;
+            }
         }
 
         if (mBuffer != NULL) {
@@ -3370,17 +3851,18 @@ status_t MPEG4Source::fragmentedRead(
     if (mBuffer == NULL) {
         newBuffer = true;
 
-        if (mCurrentSampleIndex >= mCurrentSamples.size()) {
-            // move to next fragment
-            Sample lastSample = mCurrentSamples[mCurrentSamples.size() - 1];
-            off64_t nextMoof = mNextMoofOffset; // lastSample.offset + lastSample.size;
-            mCurrentMoofOffset = nextMoof;
-            mCurrentSamples.clear();
-            mCurrentSampleIndex = 0;
-            parseChunk(&nextMoof);
-                if (mCurrentSampleIndex >= mCurrentSamples.size()) {
-                    return ERROR_END_OF_STREAM;
-                }
+        // move to the next fragment holding samples of this track
+        while (mCurrentSampleIndex >= mCurrentSamples.size()) {
+            off64_t nextMoof = mNextMoofOffset;
+            if (nextMoof <= mCurrentMoofOffset) {
+                return ERROR_END_OF_STREAM;
+            }
+            addFragment(nextMoof, mCurrentTime);
+
+            uint64_t duration;
+            if (parseFragment(nextMoof, &duration) != OK) {
+                return ERROR_END_OF_STREAM;
+            }
         }
 
         const Sample *smpl = &mCurrentSamples[mCurrentSampleIndex];
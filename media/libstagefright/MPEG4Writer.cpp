@@ -35,7 +35,11 @@
 #include <cutils/properties.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "include/ESDS.h"
@@ -48,6 +52,28 @@ static const uint8_t kNalUnitTypeSeqParamSet = 0x07;
 static const uint8_t kNalUnitTypePicParamSet = 0x08;
 static const int64_t kInitialDelayTimeUs     = 700000LL;
 
+// Returns an unlinked temporary file in the directory named by the
+// "media.stagefright.table-spill-dir" property, or -1 if sample tables
+// are to be kept in memory.
+static int openTableSpillFile() {
+    char dir[PROPERTY_VALUE_MAX];
+    if (!property_get("media.stagefright.table-spill-dir", dir, NULL) ||
+        dir[0] == '\0') {
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/MPEG4Writer.XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        ALOGW("Failed to create table spill file in %s (%s)",
+                dir, strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
 class MPEG4Writer::Track {
 public:
     Track(MPEG4Writer *owner, const sp<MediaSource> &source, size_t trackId);
@@ -62,7 +88,9 @@ public:
     int64_t getDurationUs() const;
     int64_t getEstimatedTrackSizeBytes() const;
     void writeTrackHeader(bool use32BitOffset = true);
+    bool hasTableIOError() const;
     void bufferChunk(int64_t timestampUs);
+    void bufferFragment(int64_t timestampUs);
     bool isAvc() const { return mIsAvc; }
     bool isAudio() const { return mIsAudio; }
     bool isMPEG4() const { return mIsMPEG4; }
@@ -74,9 +102,15 @@ private:
     enum {
         kMaxCttsOffsetTimeUs = 1000000LL,  // 1 second
         kSampleArraySize = 1000,
+        kMaxTableElementsInMemory = 32,
     };
 
     // A helper class to handle faster write box with table entries
+    //
+    // Entries are stored in fixed size elements. Once a table has more
+    // than kMaxTableElementsInMemory elements, the full ones other than
+    // the first are moved to a temporary file if openTableSpillFile()
+    // provides one, so that long recordings use bounded memory.
     template<class TYPE>
     struct ListTableEntries {
         ListTableEntries(uint32_t elementCapacity, uint32_t entryCapacity)
@@ -84,7 +118,11 @@ private:
             mEntryCapacity(entryCapacity),
             mTotalNumTableEntries(0),
             mNumValuesInCurrEntry(0),
-            mCurrTableEntriesElement(NULL) {
+            mCurrTableEntriesElement(NULL),
+            mSpillFd(-1),
+            mSpillFailed(false),
+            mNumSpilledElements(0),
+            mIOError(false) {
             CHECK_GT(mElementCapacity, 0);
             CHECK_GT(mEntryCapacity, 0);
         }
@@ -96,6 +134,10 @@ private:
                 delete[] (*it);
                 mTableEntryList.erase(it);
             }
+            if (mSpillFd >= 0) {
+                close(mSpillFd);
+                mSpillFd = -1;
+            }
         }
 
         // Replace the value at the given position by the given value.
@@ -105,16 +147,19 @@ private:
         void set(const TYPE& value, uint32_t pos) {
             CHECK_LT(pos, mTotalNumTableEntries * mEntryCapacity);
 
-            typename List<TYPE *>::iterator it = mTableEntryList.begin();
-            uint32_t iterations = (pos / (mElementCapacity * mEntryCapacity));
-            while (it != mTableEntryList.end() && iterations > 0) {
-                ++it;
-                --iterations;
+            TYPE *element;
+            off64_t spillOffset;
+            uint32_t index = locate(pos, &element, &spillOffset);
+            if (element == NULL) {
+                if (pwrite64(mSpillFd, &value, sizeof(TYPE), spillOffset)
+                        != (ssize_t)sizeof(TYPE)) {
+                    ALOGE("Failed to update spilled sample table (%s)",
+                            strerror(errno));
+                    mIOError = true;
+                }
+            } else {
+                element[index] = value;
             }
-            CHECK(it != mTableEntryList.end());
-            CHECK_EQ(iterations, 0);
-
-            (*it)[(pos % (mElementCapacity * mEntryCapacity))] = value;
         }
 
         // Get the value at the given position by the given value.
@@ -126,16 +171,20 @@ private:
                 return false;
             }
 
-            typename List<TYPE *>::iterator it = mTableEntryList.begin();
-            uint32_t iterations = (pos / (mElementCapacity * mEntryCapacity));
-            while (it != mTableEntryList.end() && iterations > 0) {
-                ++it;
-                --iterations;
+            TYPE *element;
+            off64_t spillOffset;
+            uint32_t index = locate(pos, &element, &spillOffset);
+            if (element == NULL) {
+                if (pread64(mSpillFd, &value, sizeof(TYPE), spillOffset)
+                        != (ssize_t)sizeof(TYPE)) {
+                    ALOGE("Failed to read spilled sample table (%s)",
+                            strerror(errno));
+                    mIOError = true;
+                    return false;
+                }
+            } else {
+                value = element[index];
             }
-            CHECK(it != mTableEntryList.end());
-            CHECK_EQ(iterations, 0);
-
-            value = (*it)[(pos % (mElementCapacity * mEntryCapacity))];
             return true;
         }
 
@@ -158,6 +207,11 @@ private:
             if ((mNumValuesInCurrEntry % mEntryCapacity) == 0) {
                 ++mTotalNumTableEntries;
                 mNumValuesInCurrEntry = 0;
+
+                if (mTotalNumTableEntries % mElementCapacity == 0 &&
+                    mTableEntryList.size() > kMaxTableElementsInMemory) {
+                    spillElement();
+                }
             }
         }
 
@@ -165,26 +219,49 @@ private:
         // 1. the number of entries goes first
         // 2. followed by the values in the table enties in order
         // @arg writer the writer to actual write to the storage
+        // If the spill file cannot be read back, the table is left short
+        // and hasIOError() returns true.
         void write(MPEG4Writer *writer) const {
             CHECK_EQ(mNumValuesInCurrEntry % mEntryCapacity, 0);
             uint32_t nEntries = mTotalNumTableEntries;
             writer->writeInt32(nEntries);
             for (typename List<TYPE *>::iterator it = mTableEntryList.begin();
                 it != mTableEntryList.end(); ++it) {
-                CHECK_GT(nEntries, 0);
-                if (nEntries >= mElementCapacity) {
-                    writer->write(*it, sizeof(TYPE) * mEntryCapacity, mElementCapacity);
-                    nEntries -= mElementCapacity;
-                } else {
-                    writer->write(*it, sizeof(TYPE) * mEntryCapacity, nEntries);
+                if (!writeElement(writer, *it, &nEntries)) {
                     break;
                 }
+
+                // The spilled elements come right after the first one.
+                if (it == mTableEntryList.begin() && mNumSpilledElements > 0) {
+                    const size_t elementSize =
+                        sizeof(TYPE) * mEntryCapacity * mElementCapacity;
+                    TYPE *element = new TYPE[mEntryCapacity * mElementCapacity];
+                    for (uint32_t i = 0; i < mNumSpilledElements; ++i) {
+                        if (pread64(mSpillFd, element, elementSize,
+                                    (off64_t)i * elementSize)
+                                != (ssize_t)elementSize) {
+                            ALOGE("Failed to read spilled sample table (%s)",
+                                    strerror(errno));
+                            mIOError = true;
+                            break;
+                        }
+                        writeElement(writer, element, &nEntries);
+                    }
+                    delete[] element;
+                    element = NULL;
+                    if (mIOError) {
+                        break;
+                    }
+                }
             }
         }
 
         // Return the number of entries in the table.
         uint32_t count() const { return mTotalNumTableEntries; }
 
+        // Return whether reading or updating the spill file failed.
+        bool hasIOError() const { return mIOError; }
+
     private:
         uint32_t         mElementCapacity;  // # entries in an element
         uint32_t         mEntryCapacity;    // # of values in each entry
@@ -193,6 +270,87 @@ private:
         TYPE             *mCurrTableEntriesElement;
         mutable List<TYPE *>     mTableEntryList;
 
+        int              mSpillFd;
+        bool             mSpillFailed;
+        uint32_t         mNumSpilledElements;  // Elements 1 to N are spilled
+        mutable bool     mIOError;
+
+        // Writes out the entries of a single element, and returns
+        // whether there are entries left after it.
+        bool writeElement(
+                MPEG4Writer *writer, const TYPE *element, uint32_t *nEntries) const {
+            CHECK_GT(*nEntries, 0);
+            if (*nEntries >= mElementCapacity) {
+                writer->write(element, sizeof(TYPE) * mEntryCapacity, mElementCapacity);
+                *nEntries -= mElementCapacity;
+                return *nEntries > 0;
+            }
+            writer->write(element, sizeof(TYPE) * mEntryCapacity, *nEntries);
+            *nEntries = 0;
+            return false;
+        }
+
+        // Finds the value at the given position, either in an element
+        // in memory, in which case the index in *element is returned,
+        // or in the spill file, in which case *element is NULL.
+        uint32_t locate(uint32_t pos, TYPE **element, off64_t *spillOffset) const {
+            const uint32_t valuesPerElement = mElementCapacity * mEntryCapacity;
+            uint32_t iterations = pos / valuesPerElement;
+            uint32_t index = pos % valuesPerElement;
+
+            if (iterations > 0 && iterations <= mNumSpilledElements) {
+                *element = NULL;
+                *spillOffset = ((off64_t)(iterations - 1) * valuesPerElement
+                        + index) * sizeof(TYPE);
+                return index;
+            }
+            if (iterations > mNumSpilledElements) {
+                iterations -= mNumSpilledElements;
+            }
+
+            typename List<TYPE *>::iterator it = mTableEntryList.begin();
+            while (it != mTableEntryList.end() && iterations > 0) {
+                ++it;
+                --iterations;
+            }
+            CHECK(it != mTableEntryList.end());
+            CHECK_EQ(iterations, 0);
+
+            *element = *it;
+            return index;
+        }
+
+        // Moves the oldest full element other than the first one, which
+        // is still updated when the track header is written, to the
+        // spill file. Tables stay in memory if that is not possible.
+        void spillElement() {
+            if (mSpillFailed) {
+                return;
+            }
+            if (mSpillFd < 0) {
+                mSpillFd = openTableSpillFile();
+                if (mSpillFd < 0) {
+                    mSpillFailed = true;
+                    return;
+                }
+            }
+
+            typename List<TYPE *>::iterator it = ++mTableEntryList.begin();
+            const size_t elementSize =
+                sizeof(TYPE) * mEntryCapacity * mElementCapacity;
+            if (pwrite64(mSpillFd, *it, elementSize,
+                         (off64_t)mNumSpilledElements * elementSize)
+                    != (ssize_t)elementSize) {
+                ALOGW("Failed to spill sample table (%s)", strerror(errno));
+                mSpillFailed = true;
+                return;
+            }
+
+            delete[] (*it);
+            mTableEntryList.erase(it);
+            ++mNumSpilledElements;
+        }
+
         DISALLOW_EVIL_CONSTRUCTORS(ListTableEntries);
     };
 
@@ -220,8 +378,12 @@ private:
 
 
     List<MediaBuffer *> mChunkSamples;
+    List<FragmentSample> mFragmentSamples;  // Fragmented files only
+    uint32_t            mNumSamples;
+    uint32_t            mNumSyncSamples;
 
     bool                mSamplesHaveSameSize;
+    uint32_t            mSampleSize;  // Of all samples if they have the same size
     ListTableEntries<uint32_t> *mStszTableEntries;
 
     ListTableEntries<uint32_t> *mStcoTableEntries;
@@ -348,7 +510,11 @@ MPEG4Writer::MPEG4Writer(const char *filename)
       mLatitudex10000(0),
       mLongitudex10000(0),
       mAreGeoTagsAvailable(false),
-      mStartTimeOffsetMs(-1) {
+      mStartTimeOffsetMs(-1),
+      mFragmented(false),
+      mFragmentDurationUs(0),
+      mMoovWritten(false),
+      mFragmentSequenceNumber(0) {
 
     mFd = open(filename, O_CREAT | O_LARGEFILE | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
     if (mFd >= 0) {
@@ -373,7 +539,11 @@ MPEG4Writer::MPEG4Writer(int fd)
       mLatitudex10000(0),
       mLongitudex10000(0),
       mAreGeoTagsAvailable(false),
-      mStartTimeOffsetMs(-1) {
+      mStartTimeOffsetMs(-1),
+      mFragmented(false),
+      mFragmentDurationUs(0),
+      mMoovWritten(false),
+      mFragmentSequenceNumber(0) {
 }
 
 MPEG4Writer::~MPEG4Writer() {
@@ -415,7 +585,7 @@ status_t MPEG4Writer::Track::dump(
     snprintf(buffer, SIZE, "       reached EOS: %s\n",
             mReachedEOS? "true": "false");
     result.append(buffer);
-    snprintf(buffer, SIZE, "       frames encoded : %d\n", mStszTableEntries->count());
+    snprintf(buffer, SIZE, "       frames encoded : %d\n", mNumSamples);
     result.append(buffer);
     snprintf(buffer, SIZE, "       duration encoded : %lld us\n", mTrackDurationUs);
     result.append(buffer);
@@ -602,6 +772,15 @@ status_t MPEG4Writer::start(MetaData *param) {
         mIsRealTimeRecording = isRealTimeRecording;
     }
 
+    int64_t fragmentDurationUs;
+    if (!mStarted && param &&
+        param->findInt64(kKeyFragmentDurationUs, &fragmentDurationUs) &&
+        fragmentDurationUs > 0) {
+        mFragmented = true;
+        mFragmentDurationUs = fragmentDurationUs;
+        ALOGV("fragment duration: %lld us", mFragmentDurationUs);
+    }
+
     mStartTimestampUs = -1;
 
     if (mStarted) {
@@ -626,7 +805,8 @@ status_t MPEG4Writer::start(MetaData *param) {
      * whether the actual recorded file is streamable or not.
      */
     mStreamableFile =
-        (mMaxFileSizeLimitBytes != 0 &&
+        (!mFragmented &&
+         mMaxFileSizeLimitBytes != 0 &&
          mMaxFileSizeLimitBytes >= kMinStreamableFileSizeInBytes);
 
     /*
@@ -693,10 +873,13 @@ status_t MPEG4Writer::start(MetaData *param) {
 
     mOffset = mMdatOffset;
     lseek64(mFd, mMdatOffset, SEEK_SET);
-    if (mUse32BitOffset) {
-        write("????mdat", 8);
-    } else {
-        write("\x00\x00\x00\x01mdat????????", 16);
+    // Fragmented files write an mdat box along with each fragment instead.
+    if (!mFragmented) {
+        if (mUse32BitOffset) {
+            write("????mdat", 8);
+        } else {
+            write("\x00\x00\x00\x01mdat????????", 16);
+        }
     }
 
     status_t err = startWriterThread();
@@ -857,6 +1040,19 @@ status_t MPEG4Writer::reset() {
         return err;
     }
 
+    if (mFragmented) {
+        // The moov box is normally written along with the first fragment.
+        if (!mMoovWritten) {
+            writeMoovBox(0);
+            mMoovWritten = true;
+        }
+        writeMfraBox();
+        CHECK(mBoxes.empty());
+
+        release();
+        return err;
+    }
+
     // Fix up the size of the 'mdat' chunk.
     if (mUse32BitOffset) {
         lseek64(mFd, mMdatOffset, SEEK_SET);
@@ -882,6 +1078,16 @@ status_t MPEG4Writer::reset() {
     }
     writeMoovBox(maxDurationUs);
 
+    // The sample tables may have been partially lost if a spill file
+    // could not be read back, the file is unusable then.
+    for (List<Track *>::iterator it = mTracks.begin();
+         it != mTracks.end(); ++it) {
+        if ((*it)->hasTableIOError()) {
+            trackProgressStatus((*it)->getTrackId(), -1, ERROR_IO);
+            err = ERROR_IO;
+        }
+    }
+
     // mWriteMoovBoxToMemory could be set to false in
     // MPEG4Writer::write() method
     if (mWriteMoovBoxToMemory) {
@@ -962,9 +1168,73 @@ void MPEG4Writer::writeMoovBox(int64_t durationUs) {
         it != mTracks.end(); ++it, ++id) {
         (*it)->writeTrackHeader(mUse32BitOffset);
     }
+    if (mFragmented) {
+        writeMvexBox();
+    }
     endBox();  // moov
 }
 
+void MPEG4Writer::writeMvexBox() {
+    beginBox("mvex");
+    for (List<Track *>::iterator it = mTracks.begin();
+        it != mTracks.end(); ++it) {
+        beginBox("trex");
+        writeInt32(0);             // version=0, flags=0
+        writeInt32((*it)->getTrackId());
+        writeInt32(1);             // default sample description index
+        writeInt32(0);             // default sample duration
+        writeInt32(0);             // default sample size
+        writeInt32(0);             // default sample flags
+        endBox();  // trex
+    }
+    endBox();  // mvex
+}
+
+void MPEG4Writer::writeMfraBox() {
+    off64_t mfraOffset = mOffset;
+    beginBox("mfra");
+    for (List<Track *>::iterator it = mTracks.begin();
+        it != mTracks.end(); ++it) {
+        beginBox("tfra");
+        writeInt32(0x01000000);    // version=1, flags=0
+        writeInt32((*it)->getTrackId());
+        writeInt32(0);             // 1-byte traf, trun and sample numbers
+
+        uint32_t count = 0;
+        for (List<FragmentEntry>::iterator entryIt = mFragmentEntries.begin();
+            entryIt != mFragmentEntries.end(); ++entryIt) {
+            if (entryIt->mTrack == *it) {
+                ++count;
+            }
+        }
+        writeInt32(count);
+
+        for (List<FragmentEntry>::iterator entryIt = mFragmentEntries.begin();
+            entryIt != mFragmentEntries.end(); ++entryIt) {
+            if (entryIt->mTrack != *it) {
+                continue;
+            }
+            // Each moof box has a single traf box with a single trun box,
+            // and each fragment starts with a sync sample.
+            uint8_t entry[19];
+            uint64_t time = hton64(entryIt->mTimeTicks);
+            uint64_t moofOffset = hton64(entryIt->mMoofOffset);
+            memcpy(&entry[0], &time, 8);
+            memcpy(&entry[8], &moofOffset, 8);
+            entry[16] = 1;         // traf number
+            entry[17] = 1;         // trun number
+            entry[18] = 1;         // sample number
+            write(entry, sizeof(entry));
+        }
+        endBox();  // tfra
+    }
+    beginBox("mfro");
+    writeInt32(0);                 // version=0, flags=0
+    writeInt32(mOffset + 4 - mfraOffset);
+    endBox();  // mfro
+    endBox();  // mfra
+}
+
 void MPEG4Writer::writeFtypBox(MetaData *param) {
     beginBox("ftyp");
 
@@ -1025,6 +1295,46 @@ void MPEG4Writer::unlock() {
     mLock.unlock();
 }
 
+// Writes out "count" vectors at the current file position, in as few
+// system calls as IOV_MAX allows.
+void MPEG4Writer::writeVectors_l(struct iovec *iov, size_t count) {
+    while (count > 0) {
+        size_t n = count < IOV_MAX ? count : IOV_MAX;
+
+        size_t expected = 0;
+        for (size_t i = 0; i < n; ++i) {
+            expected += iov[i].iov_len;
+        }
+
+        ssize_t written = ::writev(mFd, iov, n);
+        if (written != (ssize_t)expected) {
+            ALOGE("writev returned %d instead of %d (%s)",
+                  written, expected, strerror(errno));
+        }
+
+        iov += n;
+        count -= n;
+    }
+}
+
+// Fills in the NAL length prefix of an AVC sample of "length" bytes,
+// returns the size of the prefix.
+size_t MPEG4Writer::makeNalLengthPrefix(size_t length, uint8_t *prefix) const {
+    if (mUse4ByteNalLength) {
+        prefix[0] = length >> 24;
+        prefix[1] = (length >> 16) & 0xff;
+        prefix[2] = (length >> 8) & 0xff;
+        prefix[3] = length & 0xff;
+        return 4;
+    }
+
+    CHECK_LT(length, 65536);
+
+    prefix[0] = length >> 8;
+    prefix[1] = length & 0xff;
+    return 2;
+}
+
 off64_t MPEG4Writer::addSample_l(MediaBuffer *buffer) {
     off64_t old_offset = mOffset;
 
@@ -1056,31 +1366,15 @@ off64_t MPEG4Writer::addLengthPrefixedSample_l(MediaBuffer *buffer) {
 
     size_t length = buffer->range_length();
 
-    if (mUse4ByteNalLength) {
-        uint8_t x = length >> 24;
-        ::write(mFd, &x, 1);
-        x = (length >> 16) & 0xff;
-        ::write(mFd, &x, 1);
-        x = (length >> 8) & 0xff;
-        ::write(mFd, &x, 1);
-        x = length & 0xff;
-        ::write(mFd, &x, 1);
-
-        ::write(mFd,
-              (const uint8_t *)buffer->data() + buffer->range_offset(),
-              length);
-
-        mOffset += length + 4;
-    } else {
-        CHECK_LT(length, 65536);
+    uint8_t prefix[4];
+    struct iovec iov[2];
+    iov[0].iov_base = prefix;
+    iov[0].iov_len = makeNalLengthPrefix(length, prefix);
+    iov[1].iov_base = (uint8_t *)buffer->data() + buffer->range_offset();
+    iov[1].iov_len = length;
 
-        uint8_t x = length >> 8;
-        ::write(mFd, &x, 1);
-        x = length & 0xff;
-        ::write(mFd, &x, 1);
-        ::write(mFd, (const uint8_t *)buffer->data() + buffer->range_offset(), length);
-        mOffset += length + 2;
-    }
+    writeVectors_l(iov, 2);
+    mOffset += iov[0].iov_len + length;
 
     return old_offset;
 }
@@ -1342,7 +1636,10 @@ MPEG4Writer::Track::Track(
       mTrackId(trackId),
       mTrackDurationUs(0),
       mEstimatedTrackSizeBytes(0),
+      mNumSamples(0),
+      mNumSyncSamples(0),
       mSamplesHaveSameSize(true),
+      mSampleSize(0),
       mStszTableEntries(new ListTableEntries<uint32_t>(1000, 1)),
       mStcoTableEntries(new ListTableEntries<uint32_t>(1000, 1)),
       mCo64TableEntries(new ListTableEntries<off64_t>(1000, 1)),
@@ -1413,7 +1710,8 @@ void MPEG4Writer::Track::addOneSttsTableEntry(
 void MPEG4Writer::Track::addOneCttsTableEntry(
         size_t sampleCount, int32_t duration) {
 
-    if (mIsAudio) {
+    // Fragmented files carry the offsets in their trun boxes instead.
+    if (mIsAudio || mOwner->isFragmented()) {
         return;
     }
     mCttsTableEntries->add(htonl(sampleCount));
@@ -1552,24 +1850,168 @@ void MPEG4Writer::writeChunkToFile(Chunk* chunk) {
     ALOGV("writeChunkToFile: %lld from %s track",
         chunk->mTimeStampUs, chunk->mTrack->isAudio()? "audio": "video");
 
-    int32_t isFirstSample = true;
-    while (!chunk->mSamples.empty()) {
-        List<MediaBuffer *>::iterator it = chunk->mSamples.begin();
+    if (chunk->mSamples.empty()) {
+        return;
+    }
 
-        off64_t offset = chunk->mTrack->isAvc()
-                                ? addLengthPrefixedSample_l(*it)
-                                : addSample_l(*it);
+    if (mFragmented) {
+        writeFragment(chunk);
+        return;
+    }
 
-        if (isFirstSample) {
-            chunk->mTrack->addChunkOffset(offset);
-            isFirstSample = false;
+    chunk->mTrack->addChunkOffset(mOffset);
+    writeChunkSamples_l(chunk);
+}
+
+// Writes out and releases the samples of the given chunk at the current
+// file position, returns the number of bytes written.
+size_t MPEG4Writer::writeChunkSamples_l(Chunk *chunk) {
+    // The whole chunk, including the NAL length prefixes of AVC samples,
+    // goes out with a single writev() unless it has more than IOV_MAX
+    // vectors.
+    size_t numSamples = chunk->mSamples.size();
+    bool isAvc = chunk->mTrack->isAvc();
+
+    uint8_t *prefixes = isAvc ? new uint8_t[4 * numSamples] : NULL;
+    struct iovec *iov = new struct iovec[2 * numSamples];
+    size_t iovCount = 0;
+    size_t chunkSize = 0;
+
+    size_t i = 0;
+    for (List<MediaBuffer *>::iterator it = chunk->mSamples.begin();
+         it != chunk->mSamples.end(); ++it, ++i) {
+        size_t length = (*it)->range_length();
+
+        if (isAvc) {
+            uint8_t *prefix = &prefixes[4 * i];
+            iov[iovCount].iov_base = prefix;
+            iov[iovCount].iov_len = makeNalLengthPrefix(length, prefix);
+            chunkSize += iov[iovCount].iov_len;
+            ++iovCount;
         }
 
+        iov[iovCount].iov_base = (uint8_t *)(*it)->data() + (*it)->range_offset();
+        iov[iovCount].iov_len = length;
+        chunkSize += length;
+        ++iovCount;
+    }
+
+    writeVectors_l(iov, iovCount);
+    mOffset += chunkSize;
+
+    delete[] iov;
+    iov = NULL;
+    delete[] prefixes;
+    prefixes = NULL;
+
+    while (!chunk->mSamples.empty()) {
+        List<MediaBuffer *>::iterator it = chunk->mSamples.begin();
         (*it)->release();
         (*it) = NULL;
         chunk->mSamples.erase(it);
     }
-    chunk->mSamples.clear();
+
+    return chunkSize;
+}
+
+void MPEG4Writer::writeFragment(Chunk* chunk) {
+    // Every track has buffered a fragment or reached EOS by now, so all the
+    // codec specific data needed for the moov box is known.
+    if (!mMoovWritten) {
+        writeMoovBox(0);
+        mMoovWritten = true;
+    }
+
+    Track *track = chunk->mTrack;
+    CHECK_EQ(chunk->mSamples.size(), chunk->mFragmentSamples.size());
+    const FragmentSample &first = *chunk->mFragmentSamples.begin();
+    bool hasCompositionOffsets = !track->isAudio();
+
+    enum {
+        kDataOffsetPresent                  = 0x01,
+        kSampleDurationPresent              = 0x100,
+        kSampleSizePresent                  = 0x200,
+        kSampleFlagsPresent                 = 0x400,
+        kSampleCompositionTimeOffsetPresent = 0x800,
+    };
+    uint32_t trunFlags = kDataOffsetPresent | kSampleDurationPresent
+            | kSampleSizePresent | kSampleFlagsPresent;
+    if (hasCompositionOffsets) {
+        trunFlags |= kSampleCompositionTimeOffsetPresent;
+    }
+
+    // Version 0 of the trun box only has unsigned composition offsets.
+    uint32_t trunVersion = 0;
+
+    // The per-sample entries of the trun box go out in a single write.
+    size_t valuesPerSample = hasCompositionOffsets ? 4 : 3;
+    uint32_t *entries =
+        new uint32_t[valuesPerSample * chunk->mFragmentSamples.size()];
+    uint32_t *entry = entries;
+    size_t mdatSize = 0;
+    for (List<FragmentSample>::iterator it = chunk->mFragmentSamples.begin();
+         it != chunk->mFragmentSamples.end(); ++it) {
+        *entry++ = htonl(it->mDurationTicks);
+        *entry++ = htonl(it->mSize);
+        // sample_depends_on and sample_is_non_sync_sample
+        *entry++ = htonl(it->mIsSync ? 0x02000000 : 0x01010000);
+        if (hasCompositionOffsets) {
+            *entry++ = htonl((uint32_t)it->mCompositionOffsetTicks);
+            if (it->mCompositionOffsetTicks < 0) {
+                trunVersion = 1;
+            }
+        }
+        mdatSize += it->mSize;
+    }
+
+    off64_t moofOffset = mOffset;
+    beginBox("moof");
+        beginBox("mfhd");
+        writeInt32(0);             // version=0, flags=0
+        writeInt32(++mFragmentSequenceNumber);
+        endBox();  // mfhd
+        beginBox("traf");
+            beginBox("tfhd");
+            writeInt32(0);         // version=0, flags=0: data offsets from moof
+            writeInt32(track->getTrackId());
+            endBox();  // tfhd
+            beginBox("tfdt");
+            writeInt32(0x01000000);  // version=1, flags=0
+            writeInt64(chunk->mDecodingTimeTicks);
+            endBox();  // tfdt
+            beginBox("trun");
+            writeInt32((trunVersion << 24) | trunFlags);
+            writeInt32(chunk->mFragmentSamples.size());
+            off64_t dataOffsetOffset = mOffset;
+            writeInt32(0);           // data offset, fixed up below
+            write(entries, (entry - entries) * sizeof(uint32_t));
+            endBox();  // trun
+        endBox();  // traf
+    endBox();  // moof
+
+    delete[] entries;
+    entries = NULL;
+
+    // The samples follow the 8-byte header of the mdat box.
+    lseek64(mFd, dataOffsetOffset, SEEK_SET);
+    writeInt32(mOffset - moofOffset + 8);
+    mOffset -= 4;
+    lseek64(mFd, mOffset, SEEK_SET);
+
+    CHECK_LE(mdatSize + 8, 0xffffffffULL);
+    writeInt32(mdatSize + 8);
+    writeFourcc("mdat");
+    size_t written = writeChunkSamples_l(chunk);
+    CHECK_EQ(written, mdatSize);
+
+    if (first.mIsSync) {
+        FragmentEntry fragmentEntry;
+        fragmentEntry.mTrack = track;
+        fragmentEntry.mTimeTicks =
+            chunk->mDecodingTimeTicks + first.mCompositionOffsetTicks;
+        fragmentEntry.mMoofOffset = moofOffset;
+        mFragmentEntries.push_back(fragmentEntry);
+    }
 }
 
 void MPEG4Writer::writeAllChunks() {
@@ -1609,6 +2051,16 @@ bool MPEG4Writer::findChunkToWrite(Chunk *chunk) {
     }
 
     if (mIsFirstChunk) {
+        // The first fragment brings the moov box along, which needs
+        // every track to have received its codec specific data.
+        if (mFragmented && !mDone) {
+            for (List<ChunkInfo>::iterator it = mChunkInfos.begin();
+                 it != mChunkInfos.end(); ++it) {
+                if (it->mChunks.empty() && !it->mTrack->reachedEOS()) {
+                    return false;
+                }
+            }
+        }
         mIsFirstChunk = false;
     }
 
@@ -2074,9 +2526,9 @@ status_t MPEG4Writer::Track::threadEntry() {
     int64_t currDurationTicks = 0;    // Timescale based ticks
     int64_t lastDurationTicks = 0;    // Timescale based ticks
     int32_t sampleCount = 1;          // Sample count in the current stts table entry
-    uint32_t previousSampleSize = 0;  // Size of the previous sample
     int64_t previousPausedDurationUs = 0;
     int64_t timestampUs = 0;
+    const int64_t fragmentDurationUs = mOwner->fragmentDuration();
     int64_t cttsOffsetTimeUs = 0;
     int64_t currCttsOffsetTimeTicks = 0;   // Timescale based ticks
     int64_t lastCttsOffsetTimeTicks = -1;  // Timescale based ticks
@@ -2183,7 +2635,7 @@ status_t MPEG4Writer::Track::threadEntry() {
         CHECK(meta_data->findInt64(kKeyTime, &timestampUs));
 
 ////////////////////////////////////////////////////////////////////////////////
-        if (mStszTableEntries->count() == 0) {
+        if (mNumSamples == 0) {
             mFirstSampleTimeRealUs = systemTime() / 1000;
             mStartTimestampUs = timestampUs;
             mOwner->setStartTimestampUs(mStartTimestampUs);
@@ -2221,7 +2673,7 @@ status_t MPEG4Writer::Track::threadEntry() {
             currCttsOffsetTimeTicks =
                     (cttsOffsetTimeUs * mTimeScale + 500000LL) / 1000000LL;
             CHECK_LE(currCttsOffsetTimeTicks, 0x0FFFFFFFFLL);
-            if (mStszTableEntries->count() == 0) {
+            if (mNumSamples == 0) {
                 // Force the first ctts table entry to have one single entry
                 // so that we can do adjustment for the initial track start
                 // time offset easily in writeCttsBox().
@@ -2239,7 +2691,7 @@ status_t MPEG4Writer::Track::threadEntry() {
             }
 
             // Update ctts time offset range
-            if (mStszTableEntries->count() == 0) {
+            if (mNumSamples == 0) {
                 mMinCttsOffsetTimeUs = currCttsOffsetTimeTicks;
                 mMaxCttsOffsetTimeUs = currCttsOffsetTimeTicks;
             } else {
@@ -2279,12 +2731,64 @@ status_t MPEG4Writer::Track::threadEntry() {
             return UNKNOWN_ERROR;
         }
 
-        mStszTableEntries->add(htonl(sampleSize));
-        if (mStszTableEntries->count() > 2) {
+        ++mNumSamples;
+        if (isSync != 0) {
+            ++mNumSyncSamples;
+        }
+
+        if (mOwner->isFragmented()) {
+            if (!mFragmentSamples.empty()) {
+                // The duration of the previous sample is only known now.
+                (*--mFragmentSamples.end()).mDurationTicks = currDurationTicks;
+
+                // Cut fragments at sync samples so that each one can be
+                // decoded on its own, but don't let sparse sync samples
+                // grow a fragment without bound.
+                int64_t bufferedUs = timestampUs - chunkTimestampUs;
+                if ((bufferedUs >= fragmentDurationUs &&
+                        (mIsAudio || isSync != 0))
+                        || bufferedUs >= 2 * fragmentDurationUs) {
+                    bufferFragment(chunkTimestampUs);
+                }
+            }
+            if (mFragmentSamples.empty()) {
+                chunkTimestampUs = timestampUs;
+            }
+
+            // Negative offsets are kept, writeFragment() switches to a
+            // version 1 trun box for them.
+            int64_t compositionOffsetTicks = 0;
+            if (!mIsAudio) {
+                compositionOffsetTicks = currCttsOffsetTimeTicks -
+                    (kMaxCttsOffsetTimeUs * mTimeScale + 500000LL) / 1000000LL;
+            }
+
+            FragmentSample sample;
+            sample.mSize = sampleSize;
+            sample.mDurationTicks = 0;
+            sample.mCompositionOffsetTicks = compositionOffsetTicks;
+            sample.mIsSync = mIsAudio || isSync != 0;
+            mFragmentSamples.push_back(sample);
+            mChunkSamples.push_back(copy);
+
+            lastDurationUs = timestampUs - lastTimestampUs;
+            lastDurationTicks = currDurationTicks;
+            lastTimestampUs = timestampUs;
+
+            if (mTrackingProgressStatus) {
+                if (mPreviousTrackTimeUs <= 0) {
+                    mPreviousTrackTimeUs = mStartTimestampUs;
+                }
+                trackProgressStatus(timestampUs);
+            }
+            continue;
+        }
+
+        if (mNumSamples > 2) {
 
             // Force the first sample to have its own stts entry so that
             // we can adjust its value later to maintain the A/V sync.
-            if (mStszTableEntries->count() == 3 || currDurationTicks != lastDurationTicks) {
+            if (mNumSamples == 3 || currDurationTicks != lastDurationTicks) {
                 addOneSttsTableEntry(sampleCount, lastDurationTicks);
                 sampleCount = 1;
             } else {
@@ -2292,11 +2796,19 @@ status_t MPEG4Writer::Track::threadEntry() {
             }
 
         }
+        // The stsz table stays empty as long as all samples have the
+        // same size, which is then written once in writeStszBox().
         if (mSamplesHaveSameSize) {
-            if (mStszTableEntries->count() >= 2 && previousSampleSize != sampleSize) {
+            if (mNumSamples >= 2 && mSampleSize != sampleSize) {
                 mSamplesHaveSameSize = false;
+                for (uint32_t i = 1; i < mNumSamples; ++i) {
+                    mStszTableEntries->add(htonl(mSampleSize));
+                }
+                mStszTableEntries->add(htonl(sampleSize));
             }
-            previousSampleSize = sampleSize;
+            mSampleSize = sampleSize;
+        } else {
+            mStszTableEntries->add(htonl(sampleSize));
         }
         ALOGV("%s timestampUs/lastTimestampUs: %lld/%lld",
                 mIsAudio? "Audio": "Video", timestampUs, lastTimestampUs);
@@ -2305,7 +2817,7 @@ status_t MPEG4Writer::Track::threadEntry() {
         lastTimestampUs = timestampUs;
 
         if (isSync != 0) {
-            addOneStssTableEntry(mStszTableEntries->count());
+            addOneStssTableEntry(mNumSamples);
         }
 
         if (mTrackingProgressStatus) {
@@ -2363,38 +2875,50 @@ status_t MPEG4Writer::Track::threadEntry() {
 
     mOwner->trackProgressStatus(mTrackId, -1, err);
 
-    // Last chunk
-    if (!hasMultipleTracks) {
-        addOneStscTableEntry(1, mStszTableEntries->count());
-    } else if (!mChunkSamples.empty()) {
-        addOneStscTableEntry(++nChunks, mChunkSamples.size());
-        bufferChunk(timestampUs);
-    }
-
-    // We don't really know how long the last frame lasts, since
-    // there is no frame time after it, just repeat the previous
-    // frame's duration.
-    if (mStszTableEntries->count() == 1) {
-        lastDurationUs = 0;  // A single sample's duration
-        lastDurationTicks = 0;
+    if (mOwner->isFragmented()) {
+        // As below, the last sample lasts as long as the previous one.
+        if (mNumSamples == 1) {
+            lastDurationUs = 0;
+            lastDurationTicks = 0;
+        }
+        if (!mFragmentSamples.empty()) {
+            (*--mFragmentSamples.end()).mDurationTicks = lastDurationTicks;
+            bufferFragment(chunkTimestampUs);
+        }
     } else {
-        ++sampleCount;  // Count for the last sample
-    }
+        // Last chunk
+        if (!hasMultipleTracks) {
+            addOneStscTableEntry(1, mNumSamples);
+        } else if (!mChunkSamples.empty()) {
+            addOneStscTableEntry(++nChunks, mChunkSamples.size());
+            bufferChunk(timestampUs);
+        }
 
-    if (mStszTableEntries->count() <= 2) {
-        addOneSttsTableEntry(1, lastDurationTicks);
-        if (sampleCount - 1 > 0) {
-            addOneSttsTableEntry(sampleCount - 1, lastDurationTicks);
+        // We don't really know how long the last frame lasts, since
+        // there is no frame time after it, just repeat the previous
+        // frame's duration.
+        if (mNumSamples == 1) {
+            lastDurationUs = 0;  // A single sample's duration
+            lastDurationTicks = 0;
+        } else {
+            ++sampleCount;  // Count for the last sample
         }
-    } else {
-        addOneSttsTableEntry(sampleCount, lastDurationTicks);
-    }
 
-    // The last ctts box may not have been written yet, and this
-    // is to make sure that we write out the last ctts box.
-    if (currCttsOffsetTimeTicks == lastCttsOffsetTimeTicks) {
-        if (cttsSampleCount > 0) {
-            addOneCttsTableEntry(cttsSampleCount, lastCttsOffsetTimeTicks);
+        if (mNumSamples <= 2) {
+            addOneSttsTableEntry(1, lastDurationTicks);
+            if (sampleCount - 1 > 0) {
+                addOneSttsTableEntry(sampleCount - 1, lastDurationTicks);
+            }
+        } else {
+            addOneSttsTableEntry(sampleCount, lastDurationTicks);
+        }
+
+        // The last ctts box may not have been written yet, and this
+        // is to make sure that we write out the last ctts box.
+        if (currCttsOffsetTimeTicks == lastCttsOffsetTimeTicks) {
+            if (cttsSampleCount > 0) {
+                addOneCttsTableEntry(cttsSampleCount, lastCttsOffsetTimeTicks);
+            }
         }
     }
 
@@ -2404,7 +2928,7 @@ status_t MPEG4Writer::Track::threadEntry() {
     sendTrackSummary(hasMultipleTracks);
 
     ALOGI("Received total/0-length (%d/%d) buffers and encoded %d frames. - %s",
-            count, nZeroLengthFrames, mStszTableEntries->count(), mIsAudio? "audio": "video");
+            count, nZeroLengthFrames, mNumSamples, mIsAudio? "audio": "video");
     if (mIsAudio) {
         ALOGI("Audio track drift time: %lld us", mOwner->getDriftTimeUs());
     }
@@ -2415,13 +2939,23 @@ status_t MPEG4Writer::Track::threadEntry() {
     return err;
 }
 
+bool MPEG4Writer::Track::hasTableIOError() const {
+    return mStszTableEntries->hasIOError() ||
+           mStcoTableEntries->hasIOError() ||
+           mCo64TableEntries->hasIOError() ||
+           mStscTableEntries->hasIOError() ||
+           mStssTableEntries->hasIOError() ||
+           mSttsTableEntries->hasIOError() ||
+           mCttsTableEntries->hasIOError();
+}
+
 bool MPEG4Writer::Track::isTrackMalFormed() const {
-    if (mStszTableEntries->count() == 0) {                      // no samples written
+    if (mNumSamples == 0) {                                     // no samples written
         ALOGE("The number of recorded samples is 0");
         return true;
     }
 
-    if (!mIsAudio && mStssTableEntries->count() == 0) {  // no sync frames for video
+    if (!mIsAudio && mNumSyncSamples == 0) {             // no sync frames for video
         ALOGE("There are no sync frames for video track");
         return true;
     }
@@ -2452,7 +2986,7 @@ void MPEG4Writer::Track::sendTrackSummary(bool hasMultipleTracks) {
 
     mOwner->notify(MEDIA_RECORDER_TRACK_EVENT_INFO,
                     trackNum | MEDIA_RECORDER_TRACK_INFO_ENCODED_FRAMES,
-                    mStszTableEntries->count());
+                    mNumSamples);
 
     {
         // The system delay time excluding the requested initial delay that
@@ -2554,6 +3088,19 @@ void MPEG4Writer::Track::bufferChunk(int64_t timestampUs) {
     mChunkSamples.clear();
 }
 
+void MPEG4Writer::Track::bufferFragment(int64_t timestampUs) {
+    ALOGV("bufferFragment");
+
+    Chunk chunk(this, timestampUs, mChunkSamples);
+    chunk.mDecodingTimeTicks =
+        (timestampUs * mTimeScale + 500000LL) / 1000000LL +
+        getStartTimeOffsetScaledTime();
+    chunk.mFragmentSamples = mFragmentSamples;
+    mOwner->bufferChunk(chunk);
+    mChunkSamples.clear();
+    mFragmentSamples.clear();
+}
+
 int64_t MPEG4Writer::Track::getDurationUs() const {
     return mTrackDurationUs;
 }
@@ -2620,7 +3167,7 @@ void MPEG4Writer::Track::writeStblBox(bool use32BitOffset) {
     mOwner->endBox();  // stsd
     writeSttsBox();
     writeCttsBox();
-    if (!mIsAudio) {
+    if (!mIsAudio && !mOwner->isFragmented()) {
         writeStssBox();
     }
     writeStszBox();
@@ -2811,7 +3358,7 @@ void MPEG4Writer::Track::writeTkhdBox(uint32_t now) {
     mOwner->writeInt32(now);           // modification time
     mOwner->writeInt32(mTrackId);      // track id starts with 1
     mOwner->writeInt32(0);             // reserved
-    int64_t trakDurationUs = getDurationUs();
+    int64_t trakDurationUs = mOwner->isFragmented()? 0: getDurationUs();
     int32_t mvhdTimeScale = mOwner->getTimeScale();
     int32_t tkhdDuration =
         (trakDurationUs * mvhdTimeScale + 5E5) / 1E6;
@@ -2872,7 +3419,7 @@ void MPEG4Writer::Track::writeHdlrBox() {
 }
 
 void MPEG4Writer::Track::writeMdhdBox(uint32_t now) {
-    int64_t trakDurationUs = getDurationUs();
+    int64_t trakDurationUs = mOwner->isFragmented()? 0: getDurationUs();
     mOwner->beginBox("mdhd");
     mOwner->writeInt32(0);             // version=0, flags=0
     mOwner->writeInt32(now);           // creation time
@@ -2966,10 +3513,14 @@ int32_t MPEG4Writer::Track::getStartTimeOffsetScaledTime() const {
 void MPEG4Writer::Track::writeSttsBox() {
     mOwner->beginBox("stts");
     mOwner->writeInt32(0);  // version=0, flags=0
-    uint32_t duration;
-    CHECK(mSttsTableEntries->get(duration, 1));
-    duration = htonl(duration);  // Back to host byte order
-    mSttsTableEntries->set(htonl(duration + getStartTimeOffsetScaledTime()), 1);
+    // The sample tables of fragmented files are empty, the tfdt box of
+    // each fragment accounts for the track start time offset.
+    if (!mOwner->isFragmented()) {
+        uint32_t duration;
+        CHECK(mSttsTableEntries->get(duration, 1));
+        duration = htonl(duration);  // Back to host byte order
+        mSttsTableEntries->set(htonl(duration + getStartTimeOffsetScaledTime()), 1);
+    }
     mSttsTableEntries->write(mOwner);
     mOwner->endBox();  // stts
 }
@@ -3012,8 +3563,13 @@ void MPEG4Writer::Track::writeStssBox() {
 void MPEG4Writer::Track::writeStszBox() {
     mOwner->beginBox("stsz");
     mOwner->writeInt32(0);  // version=0, flags=0
-    mOwner->writeInt32(0);
-    mStszTableEntries->write(mOwner);
+    if (mSamplesHaveSameSize && !mOwner->isFragmented() && mNumSamples > 0) {
+        mOwner->writeInt32(mSampleSize);
+        mOwner->writeInt32(mNumSamples);
+    } else {
+        mOwner->writeInt32(0);
+        mStszTableEntries->write(mOwner);
+    }
     mOwner->endBox();  // stsz
 }
 
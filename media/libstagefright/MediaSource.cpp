@@ -32,6 +32,8 @@ void MediaSource::ReadOptions::reset() {
     mOptions = 0;
     mSeekTimeUs = 0;
     mLatenessUs = 0;
+    mTargetData = NULL;
+    mTargetSize = 0;
 }
 
 void MediaSource::ReadOptions::setSeekTo(int64_t time_us, SeekMode mode) {
@@ -61,4 +63,23 @@ int64_t MediaSource::ReadOptions::getLateBy() const {
     return mLatenessUs;
 }
 
+void MediaSource::ReadOptions::setTargetBuffer(void *data, size_t size) {
+    mOptions |= kTargetBuffer_Option;
+    mTargetData = data;
+    mTargetSize = size;
+}
+
+void MediaSource::ReadOptions::clearTargetBuffer() {
+    mOptions &= ~kTargetBuffer_Option;
+    mTargetData = NULL;
+    mTargetSize = 0;
+}
+
+bool MediaSource::ReadOptions::getTargetBuffer(
+        void **data, size_t *size) const {
+    *data = mTargetData;
+    *size = mTargetSize;
+    return (mOptions & kTargetBuffer_Option) != 0;
+}
+
 }  // namespace android
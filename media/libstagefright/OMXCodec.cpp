@@ -3129,9 +3129,19 @@ bool OMXCodec::drainInputBuffer(BufferInfo *info) {
     size_t offset = 0;
     int32_t n = 0;
 
+    // Let the source read straight into the input buffer whenever the data
+    // would simply be copied there.
+    bool readInPlace = !mIsEncoder && info != NULL && info->mData != NULL
+            && !(mFlags & (kUseSecureInputBuffers | kStoreMetaDataInVideoBuffers))
+            && strcasecmp(MEDIA_MIMETYPE_AUDIO_VORBIS, mMIME);
 
     for (;;) {
         MediaBuffer *srcBuffer;
+        void *target = NULL;
+        if (readInPlace) {
+            target = (uint8_t *)info->mData + offset;
+        }
+
         if (mSeekTimeUs >= 0) {
             if (mLeftOverBuffer) {
                 mLeftOverBuffer->release();
@@ -3140,6 +3150,9 @@ bool OMXCodec::drainInputBuffer(BufferInfo *info) {
 
             MediaSource::ReadOptions options;
             options.setSeekTo(mSeekTimeUs, mSeekMode);
+            if (target != NULL) {
+                options.setTargetBuffer(target, info->mSize - offset);
+            }
 
             mSeekTimeUs = -1;
             mSeekMode = ReadOptions::SEEK_CLOSEST_SYNC;
@@ -3163,6 +3176,11 @@ bool OMXCodec::drainInputBuffer(BufferInfo *info) {
             mLeftOverBuffer = NULL;
 
             err = OK;
+        } else if (target != NULL) {
+            MediaSource::ReadOptions options;
+            options.setTargetBuffer(target, info->mSize - offset);
+
+            err = mSource->read(&srcBuffer, &options);
         } else {
             err = mSource->read(&srcBuffer);
         }
@@ -3213,6 +3231,9 @@ bool OMXCodec::drainInputBuffer(BufferInfo *info) {
 
                 CHECK(info->mMediaBuffer == NULL);
                 info->mMediaBuffer = srcBuffer;
+        } else if (target != NULL && srcBuffer->data() == target
+                && srcBuffer->range_offset() == 0) {
+                // The source read the data in place.
         } else {
                 OMX_PARAM_PORTDEFINITIONTYPE def;
                 InitOMXParams(&def);
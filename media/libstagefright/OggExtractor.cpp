@@ -19,6 +19,7 @@
 #include <utils/Log.h>
 
 #include "include/OggExtractor.h"
+#include "include/ExtractorIndexCache.h"
 
 #include <cutils/properties.h>
 #include <media/stagefright/foundation/ADebug.h>
@@ -31,6 +32,10 @@
 #include <media/stagefright/MetaData.h>
 #include <media/stagefright/Utils.h>
 #include <utils/String8.h>
+#include <utils/threads.h>
+
+#include <pthread.h>
+#include <sys/prctl.h>
 
 extern "C" {
     #include <Tremolo/codec_internal.h>
@@ -113,10 +118,24 @@ private:
     sp<MetaData> mMeta;
     sp<MetaData> mFileMeta;
 
+    // Size of the file if seeking within it is cheap, -1 otherwise.
+    off64_t mFileSize;
+
+    // The table of contents is built by mThread while playback proceeds,
+    // seekToTime() bisects the part of the file not yet covered by it.
+    Mutex mLock;
     Vector<TOCEntry> mTableOfContents;
+    size_t mTOCStride;
+    bool mTOCComplete;
+    bool mStopBuildingTOC;
+    bool mThreadStarted;
+    pthread_t mThread;
 
     ssize_t readPage(off64_t offset, Page *page);
     status_t findNextPage(off64_t startOffset, off64_t *pageOffset);
+    status_t findPageForTime(
+            int64_t timeUs, off64_t startOffset, off64_t endOffset,
+            off64_t *pageOffset);
 
     status_t verifyHeader(
             MediaBuffer *buffer, uint8_t type);
@@ -125,7 +144,10 @@ private:
 
     status_t findPrevGranulePosition(off64_t pageOffset, uint64_t *granulePos);
 
+    static void *ThreadWrapper(void *me);
     void buildTableOfContents();
+    bool loadTableOfContents(off64_t size);
+    void addTOCEntry_l(off64_t pageOffset, int64_t timeUs);
 
     MyVorbisExtractor(const MyVorbisExtractor &);
     MyVorbisExtractor &operator=(const MyVorbisExtractor &);
@@ -212,7 +234,12 @@ MyVorbisExtractor::MyVorbisExtractor(const sp<DataSource> &source)
       mFirstPacketInPage(true),
       mCurrentPageSamples(0),
       mNextLaceIndex(0),
-      mFirstDataOffset(-1) {
+      mFirstDataOffset(-1),
+      mFileSize(-1),
+      mTOCStride(1),
+      mTOCComplete(false),
+      mStopBuildingTOC(false),
+      mThreadStarted(false) {
     mCurrentPage.mNumSegments = 0;
 
     vorbis_info_init(&mVi);
@@ -220,6 +247,16 @@ MyVorbisExtractor::MyVorbisExtractor(const sp<DataSource> &source)
 }
 
 MyVorbisExtractor::~MyVorbisExtractor() {
+    if (mThreadStarted) {
+        {
+            Mutex::Autolock autoLock(mLock);
+            mStopBuildingTOC = true;
+        }
+
+        void *dummy;
+        pthread_join(mThread, &dummy);
+    }
+
     vorbis_comment_clear(&mVc);
     vorbis_info_clear(&mVi);
 }
@@ -230,28 +267,49 @@ sp<MetaData> MyVorbisExtractor::getFormat() const {
 
 status_t MyVorbisExtractor::findNextPage(
         off64_t startOffset, off64_t *pageOffset) {
-    *pageOffset = startOffset;
+    // The data is read by blocks and searched for the capture pattern,
+    // rather than read 4 bytes at a time at every offset.
+    static const size_t kPageScanSize = 64 * 1024;
+
+    uint8_t *buffer = new uint8_t[kPageScanSize];
 
+    off64_t offset = startOffset;
     for (;;) {
-        char signature[4];
-        ssize_t n = mSource->readAt(*pageOffset, &signature, 4);
+        ssize_t n = mSource->readAt(offset, buffer, kPageScanSize);
 
         if (n < 4) {
+            delete[] buffer;
+            buffer = NULL;
+
             *pageOffset = 0;
 
             return (n < 0) ? n : (status_t)ERROR_END_OF_STREAM;
         }
 
-        if (!memcmp(signature, "OggS", 4)) {
-            if (*pageOffset > startOffset) {
-                ALOGV("skipped %lld bytes of junk to reach next frame",
-                     *pageOffset - startOffset);
+        const uint8_t *ptr = buffer;
+        const uint8_t *end = buffer + n - 3;    // last possible "OggS"
+        while (ptr < end
+                && (ptr = (const uint8_t *)memchr(ptr, 'O', end - ptr))
+                        != NULL) {
+            if (!memcmp(ptr, "OggS", 4)) {
+                *pageOffset = offset + (ptr - buffer);
+
+                delete[] buffer;
+                buffer = NULL;
+
+                if (*pageOffset > startOffset) {
+                    ALOGV("skipped %lld bytes of junk to reach next frame",
+                         *pageOffset - startOffset);
+                }
+
+                return OK;
             }
 
-            return OK;
+            ++ptr;
         }
 
-        ++*pageOffset;
+        // The last 3 bytes may start a pattern completed by the next block.
+        offset += n - 3;
     }
 }
 
@@ -310,7 +368,7 @@ status_t MyVorbisExtractor::findPrevGranulePosition(
 }
 
 status_t MyVorbisExtractor::seekToTime(int64_t timeUs) {
-    if (mTableOfContents.isEmpty()) {
+    if (mFileSize < 0) {
         // Perform approximate seeking based on avg. bitrate.
 
         off64_t pos = timeUs * approxBitrate() / 8000000ll;
@@ -319,29 +377,120 @@ status_t MyVorbisExtractor::seekToTime(int64_t timeUs) {
         return seekToOffset(pos);
     }
 
-    size_t left = 0;
-    size_t right = mTableOfContents.size();
-    while (left < right) {
-        size_t center = left / 2 + right / 2 + (left & right & 1);
+    // Narrow down the range of the file to search using the table of
+    // contents built so far. The page we are looking for is the first one
+    // ending at or after timeUs, it follows "startOffset" and is at or
+    // before "endOffset".
+    off64_t startOffset = mFirstDataOffset;
+    off64_t endOffset = mFileSize;
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        size_t left = 0;
+        size_t right = mTableOfContents.size();
+        while (left < right) {
+            size_t center = left / 2 + right / 2 + (left & right & 1);
+
+            if (mTableOfContents.itemAt(center).mTimeUs < timeUs) {
+                left = center + 1;
+            } else {
+                right = center;
+            }
+        }
+
+        if (left > 0) {
+            startOffset = mTableOfContents.itemAt(left - 1).mPageOffset;
+        }
+
+        if (left < mTableOfContents.size()) {
+            endOffset = mTableOfContents.itemAt(left).mPageOffset;
+        } else if (mTOCComplete && left > 0) {
+            // Past the end of the content, stay on the last page.
+            endOffset = startOffset;
+        }
+
+        ALOGV("searching entries %d / %d, offsets %lld to %lld",
+             left, mTableOfContents.size(), startOffset, endOffset);
+    }
+
+    off64_t pageOffset;
+    status_t err = findPageForTime(timeUs, startOffset, endOffset, &pageOffset);
+    if (err != OK) {
+        return err;
+    }
+
+    ALOGV("seeking to offset %lld", pageOffset);
+
+    return seekToOffset(pageOffset);
+}
+
+// Finds the first page ending at or after "timeUs", given that it follows
+// the page at "startOffset" and starts no later than "endOffset". The range
+// is bisected on the granule positions of the pages found in it until it is
+// small enough to be scanned page by page.
+status_t MyVorbisExtractor::findPageForTime(
+        int64_t timeUs, off64_t startOffset, off64_t endOffset,
+        off64_t *pageOffset) {
+    static const off64_t kMaxScanSize = 64 * 1024;
 
-        const TOCEntry &entry = mTableOfContents.itemAt(center);
+    if (mVi.rate == 0) {
+        return ERROR_MALFORMED;
+    }
+
+    // Offset of a page known to end at or after timeUs, if any.
+    off64_t matchOffset = (endOffset < mFileSize) ? endOffset : -1;
+
+    Page page;
+    while (endOffset - startOffset > kMaxScanSize) {
+        off64_t mid = startOffset + (endOffset - startOffset) / 2;
+
+        off64_t offset;
+        ssize_t n;
+        if (findNextPage(mid, &offset) != OK
+                || offset >= endOffset
+                || (n = readPage(offset, &page)) <= 0) {
+            endOffset = mid;
+            continue;
+        }
 
-        if (timeUs < entry.mTimeUs) {
-            right = center;
-        } else if (timeUs > entry.mTimeUs) {
-            left = center + 1;
+        if (page.mGranulePosition == (uint64_t)-1
+                || (int64_t)(page.mGranulePosition * 1000000ll / mVi.rate)
+                        < timeUs) {
+            // No packet ends on a page with an unset granule position,
+            // so it cannot be the one we are looking for either.
+            startOffset = offset;
         } else {
-            left = right = center;
-            break;
+            endOffset = offset;
+            matchOffset = offset;
         }
     }
 
-    const TOCEntry &entry = mTableOfContents.itemAt(left);
+    *pageOffset = startOffset;
+
+    off64_t offset = startOffset;
+    while (offset < endOffset) {
+        ssize_t n = readPage(offset, &page);
+        if (n <= 0) {
+            break;
+        }
+
+        *pageOffset = offset;
+
+        if (page.mGranulePosition != (uint64_t)-1
+                && (int64_t)(page.mGranulePosition * 1000000ll / mVi.rate)
+                        >= timeUs) {
+            return OK;
+        }
+
+        offset += n;
+    }
 
-    ALOGV("seeking to entry %d / %d at offset %lld",
-         left, mTableOfContents.size(), entry.mPageOffset);
+    if (matchOffset >= 0) {
+        *pageOffset = matchOffset;
+    }
 
-    return seekToOffset(entry.mPageOffset);
+    return OK;
 }
 
 status_t MyVorbisExtractor::seekToOffset(off64_t offset) {
@@ -581,6 +730,16 @@ status_t MyVorbisExtractor::readNextPacket(MediaBuffer **out) {
     }
 }
 
+// Building the table of contents requires reading every page of the file,
+// so it is kept in the persistent index cache. Bump the last character of
+// the tag if the layout of TOCEntry or the way it is built changes.
+static const uint32_t kTOCCacheTag = FOURCC('o', 'g', 'g', '2');
+
+// Limit the maximum amount of RAM we spend on the table of contents.
+static const size_t kMaxTOCSize = 8192;
+static const size_t kMaxNumTOCEntries =
+    kMaxTOCSize / (sizeof(off64_t) + sizeof(int64_t));
+
 status_t MyVorbisExtractor::init() {
     mMeta = new MetaData;
     mMeta->setCString(kKeyMIMEType, MEDIA_MIMETYPE_AUDIO_VORBIS);
@@ -637,49 +796,125 @@ status_t MyVorbisExtractor::init() {
 
         mMeta->setInt64(kKeyDuration, durationUs);
 
-        buildTableOfContents();
+        mFileSize = size;
+
+        if (!loadTableOfContents(size)) {
+            // Don't hold up opening the file while every page is read,
+            // until the table is complete seeking bisects the file instead.
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+            mThreadStarted =
+                pthread_create(&mThread, &attr, ThreadWrapper, this) == 0;
+            pthread_attr_destroy(&attr);
+        }
     }
 
     return OK;
 }
 
+bool MyVorbisExtractor::loadTableOfContents(off64_t size) {
+    sp<ExtractorIndexCache::Entry> cached =
+        ExtractorIndexCache::Lookup(mSource, kTOCCacheTag);
+
+    if (cached == NULL || cached->size() % sizeof(TOCEntry) != 0) {
+        return false;
+    }
+
+    const TOCEntry *entries = (const TOCEntry *)cached->data();
+    size_t numEntries = cached->size() / sizeof(TOCEntry);
+
+    // The entries must be usable by seekToTime() as is.
+    for (size_t i = 0; i < numEntries; ++i) {
+        if (entries[i].mPageOffset < mFirstDataOffset
+                || entries[i].mPageOffset >= size
+                || (i > 0 && entries[i].mTimeUs < entries[i - 1].mTimeUs)) {
+            ALOGW("ignoring invalid cached table of contents");
+            return false;
+        }
+    }
+
+    Mutex::Autolock autoLock(mLock);
+    mTableOfContents.clear();
+    mTableOfContents.appendArray(entries, numEntries);
+    mTOCComplete = true;
+
+    ALOGV("loaded %d table of contents entries from cache", numEntries);
+
+    return true;
+}
+
+// static
+void *MyVorbisExtractor::ThreadWrapper(void *me) {
+    prctl(PR_SET_NAME, (unsigned long)"OggTOCBuilder", 0, 0, 0);
+    androidSetThreadPriority(0, ANDROID_PRIORITY_BACKGROUND);
+
+    static_cast<MyVorbisExtractor *>(me)->buildTableOfContents();
+
+    return NULL;
+}
+
 void MyVorbisExtractor::buildTableOfContents() {
     off64_t offset = mFirstDataOffset;
+    size_t pageIndex = 0;
     Page page;
     ssize_t pageSize;
     while ((pageSize = readPage(offset, &page)) > 0) {
-        mTableOfContents.push();
+        Mutex::Autolock autoLock(mLock);
 
-        TOCEntry &entry =
-            mTableOfContents.editItemAt(mTableOfContents.size() - 1);
+        if (mStopBuildingTOC) {
+            return;
+        }
 
-        entry.mPageOffset = offset;
-        entry.mTimeUs = page.mGranulePosition * 1000000ll / mVi.rate;
+        // Pages on which no packet ends carry no timestamp.
+        if (page.mGranulePosition != (uint64_t)-1
+                && (pageIndex++ % mTOCStride) == 0) {
+            addTOCEntry_l(offset, page.mGranulePosition * 1000000ll / mVi.rate);
+        }
 
         offset += (size_t)pageSize;
     }
 
-    // Limit the maximum amount of RAM we spend on the table of contents,
-    // if necessary thin out the table evenly to trim it down to maximum
-    // size.
+    Vector<TOCEntry> tableOfContents;
+    {
+        Mutex::Autolock autoLock(mLock);
+        mTOCComplete = true;
+        tableOfContents = mTableOfContents;
+    }
 
-    static const size_t kMaxTOCSize = 8192;
-    static const size_t kMaxNumTOCEntries = kMaxTOCSize / sizeof(TOCEntry);
+    ALOGV("built table of contents with %d entries, stride %d",
+         tableOfContents.size(), mTOCStride);
 
-    size_t numerator = mTableOfContents.size();
+    ExtractorIndexCache::Store(
+            mSource, kTOCCacheTag, tableOfContents.array(),
+            tableOfContents.size() * sizeof(TOCEntry));
+}
 
-    if (numerator > kMaxNumTOCEntries) {
-        size_t denom = numerator - kMaxNumTOCEntries;
+// The table keeps every mTOCStride-th page. Once it is full, every other
+// entry is dropped and the stride doubled, which thins out the table
+// evenly without knowing the number of pages in advance.
+void MyVorbisExtractor::addTOCEntry_l(off64_t pageOffset, int64_t timeUs) {
+    if (!mTableOfContents.isEmpty()
+            && timeUs < mTableOfContents.top().mTimeUs) {
+        // Keep the table sorted for seekToTime(), even if the granule
+        // positions in the file are not.
+        return;
+    }
 
-        size_t accum = 0;
-        for (ssize_t i = mTableOfContents.size() - 1; i >= 0; --i) {
-            accum += denom;
-            if (accum >= numerator) {
-                mTableOfContents.removeAt(i);
-                accum -= numerator;
-            }
+    if (mTableOfContents.size() >= kMaxNumTOCEntries) {
+        size_t j = 0;
+        for (size_t i = 0; i < mTableOfContents.size(); i += 2) {
+            mTableOfContents.editItemAt(j++) = mTableOfContents.itemAt(i);
         }
+        mTableOfContents.removeItemsAt(j, mTableOfContents.size() - j);
+        mTOCStride *= 2;
     }
+
+    TOCEntry entry;
+    entry.mPageOffset = pageOffset;
+    entry.mTimeUs = timeUs;
+    mTableOfContents.push(entry);
 }
 
 status_t MyVorbisExtractor::verifyHeader(
@@ -105,6 +105,72 @@ uint32_t SampleTable::CompositionDeltaLookup::getCompositionTimeOffset(
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Struct-of-arrays index of all samples of a track, so that the metadata of
+// any sample can be found without reading from the data source.
+// Sample offsets are stored as 32-bit deltas from the offset of the first
+// sample of each group of 2^kGroupShift samples.
+struct SampleTable::SampleIndex {
+    SampleIndex();
+    ~SampleIndex();
+
+    enum {
+        kGroupShift = 4,
+    };
+
+    uint32_t mNumSamples;
+    off64_t *mGroupOffsets;
+    uint32_t *mOffsetDeltas;
+    uint32_t *mSizes;               // NULL if all samples have mDefaultSize
+    uint32_t mDefaultSize;
+    uint32_t *mDecodeTimes;
+    uint32_t *mCompositionOffsets;  // NULL if there is no 'ctts'
+    uint32_t *mSyncBits;            // NULL if all samples are sync samples
+    size_t mMaxSampleSize;
+
+    off64_t offset(uint32_t i) const {
+        return mGroupOffsets[i >> kGroupShift] + mOffsetDeltas[i];
+    }
+
+    size_t size(uint32_t i) const {
+        return mSizes != NULL ? mSizes[i] : mDefaultSize;
+    }
+
+    uint32_t compositionTime(uint32_t i) const {
+        return mDecodeTimes[i]
+            + (mCompositionOffsets != NULL ? mCompositionOffsets[i] : 0);
+    }
+
+    bool isSyncSample(uint32_t i) const {
+        return mSyncBits == NULL || (mSyncBits[i >> 5] & (1u << (i & 31)));
+    }
+
+private:
+    DISALLOW_EVIL_CONSTRUCTORS(SampleIndex);
+};
+
+SampleTable::SampleIndex::SampleIndex()
+    : mNumSamples(0),
+      mGroupOffsets(NULL),
+      mOffsetDeltas(NULL),
+      mSizes(NULL),
+      mDefaultSize(0),
+      mDecodeTimes(NULL),
+      mCompositionOffsets(NULL),
+      mSyncBits(NULL),
+      mMaxSampleSize(0) {
+}
+
+SampleTable::SampleIndex::~SampleIndex() {
+    delete[] mGroupOffsets;
+    delete[] mOffsetDeltas;
+    delete[] mSizes;
+    delete[] mDecodeTimes;
+    delete[] mCompositionOffsets;
+    delete[] mSyncBits;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 SampleTable::SampleTable(const sp<DataSource> &source)
     : mDataSource(source),
       mChunkOffsetOffset(-1),
@@ -126,11 +192,16 @@ SampleTable::SampleTable(const sp<DataSource> &source)
       mNumSyncSamples(0),
       mSyncSamples(NULL),
       mLastSyncSampleIndex(0),
-      mSampleToChunkEntries(NULL) {
+      mSampleToChunkEntries(NULL),
+      mSampleIndex(NULL),
+      mSampleIndexTried(false) {
     mSampleIterator = new SampleIterator(this);
 }
 
 SampleTable::~SampleTable() {
+    delete mSampleIndex;
+    mSampleIndex = NULL;
+
     delete[] mSampleToChunkEntries;
     mSampleToChunkEntries = NULL;
 
@@ -188,12 +259,13 @@ status_t SampleTable::setChunkOffsetParams(
 
     mNumChunkOffsets = U32_AT(&header[4]);
 
+    // 64 bit math, a 32 bit product wraps for large counts.
     if (mChunkOffsetType == kChunkOffsetType32) {
-        if (data_size < 8 + mNumChunkOffsets * 4) {
+        if ((uint64_t)data_size < 8 + (uint64_t)mNumChunkOffsets * 4) {
             return ERROR_MALFORMED;
         }
     } else {
-        if (data_size < 8 + mNumChunkOffsets * 8) {
+        if ((uint64_t)data_size < 8 + (uint64_t)mNumChunkOffsets * 8) {
             return ERROR_MALFORMED;
         }
     }
@@ -226,7 +298,7 @@ status_t SampleTable::setSampleToChunkParams(
 
     mNumSampleToChunkOffsets = U32_AT(&header[4]);
 
-    if (data_size < 8 + mNumSampleToChunkOffsets * 12) {
+    if ((uint64_t)data_size < 8 + (uint64_t)mNumSampleToChunkOffsets * 12) {
         return ERROR_MALFORMED;
     }
 
@@ -287,7 +359,7 @@ status_t SampleTable::setSampleSizeParams(
             return OK;
         }
 
-        if (data_size < 12 + mNumSampleSizes * 4) {
+        if ((uint64_t)data_size < 12 + (uint64_t)mNumSampleSizes * 4) {
             return ERROR_MALFORMED;
         }
     } else {
@@ -304,7 +376,8 @@ status_t SampleTable::setSampleSizeParams(
             return ERROR_MALFORMED;
         }
 
-        if (data_size < 12 + (mNumSampleSizes * mSampleSizeFieldSize + 4) / 8) {
+        if ((uint64_t)data_size <
+                12 + ((uint64_t)mNumSampleSizes * mSampleSizeFieldSize + 4) / 8) {
             return ERROR_MALFORMED;
         }
     }
@@ -390,6 +463,8 @@ status_t SampleTable::setCompositionTimeToSampleParams(
     mCompositionDeltaLookup->setEntries(
             mCompositionTimeDeltaEntries, mNumCompositionTimeDeltaEntries);
 
+    invalidateSampleIndex();
+
     return OK;
 }
 
@@ -428,6 +503,8 @@ status_t SampleTable::setSyncSampleParams(off64_t data_offset, size_t data_size)
         mSyncSamples[i] = ntohl(mSyncSamples[i]) - 1;
     }
 
+    invalidateSampleIndex();
+
     return OK;
 }
 
@@ -444,20 +521,45 @@ status_t SampleTable::getMaxSampleSize(size_t *max_size) {
 
     *max_size = 0;
 
-    for (uint32_t i = 0; i < mNumSampleSizes; ++i) {
-        size_t sample_size;
-        status_t err = getSampleSize_l(i, &sample_size);
+    if (ensureSampleIndex_l()) {
+        *max_size = mSampleIndex->mMaxSampleSize;
+        return OK;
+    }
+
+    if (mSampleSizeOffset < 0) {
+        return OK;
+    }
 
+    if (mDefaultSampleSize > 0) {
+        *max_size = mDefaultSampleSize;
+        return OK;
+    }
+
+    // Scan the sample sizes by blocks rather than one read per sample.
+    static const uint32_t kNumSamplesPerBlock = 4096;
+    uint32_t *sizes = new uint32_t[kNumSamplesPerBlock];
+
+    status_t err = OK;
+    for (uint32_t i = 0; i < mNumSampleSizes; i += kNumSamplesPerBlock) {
+        uint32_t n = mNumSampleSizes - i;
+        if (n > kNumSamplesPerBlock) {
+            n = kNumSamplesPerBlock;
+        }
+
+        err = readSampleSizes_l(i, n, sizes);
         if (err != OK) {
-            return err;
+            break;
         }
 
-        if (sample_size > *max_size) {
-            *max_size = sample_size;
+        for (uint32_t j = 0; j < n; ++j) {
+            if (sizes[j] > *max_size) {
+                *max_size = sizes[j];
+            }
         }
     }
+    delete[] sizes;
 
-    return OK;
+    return err;
 }
 
 uint32_t abs_difference(uint32_t time1, uint32_t time2) {
@@ -487,6 +589,28 @@ void SampleTable::buildSampleEntriesTable() {
 
     mSampleTimeEntries = new SampleTimeEntry[mNumSampleSizes];
 
+    if (ensureSampleIndex_l()) {
+        // Without reordered frames the entries are already in increasing
+        // time order, which saves sorting long tables.
+        bool sorted = true;
+        for (uint32_t i = 0; i < mNumSampleSizes; ++i) {
+            mSampleTimeEntries[i].mSampleIndex = i;
+            mSampleTimeEntries[i].mCompositionTime =
+                mSampleIndex->compositionTime(i);
+
+            if (i > 0 && mSampleTimeEntries[i].mCompositionTime
+                    < mSampleTimeEntries[i - 1].mCompositionTime) {
+                sorted = false;
+            }
+        }
+
+        if (!sorted) {
+            qsort(mSampleTimeEntries, mNumSampleSizes, sizeof(SampleTimeEntry),
+                  CompareIncreasingTime);
+        }
+        return;
+    }
+
     uint32_t sampleIndex = 0;
     uint32_t sampleTime = 0;
 
@@ -651,25 +775,33 @@ status_t SampleTable::findSyncSampleNear(
 
         // our sample lies between sync samples x and y.
 
-        status_t err = mSampleIterator->seekTo(start_sample_index);
-        if (err != OK) {
-            return err;
-        }
+        uint32_t sample_time, x_time, y_time;
+        if (ensureSampleIndex_l() && start_sample_index < mNumSampleSizes
+                && x < mNumSampleSizes && y < mNumSampleSizes) {
+            sample_time = mSampleIndex->compositionTime(start_sample_index);
+            x_time = mSampleIndex->compositionTime(x);
+            y_time = mSampleIndex->compositionTime(y);
+        } else {
+            status_t err = mSampleIterator->seekTo(start_sample_index);
+            if (err != OK) {
+                return err;
+            }
 
-        uint32_t sample_time = mSampleIterator->getSampleTime();
+            sample_time = mSampleIterator->getSampleTime();
 
-        err = mSampleIterator->seekTo(x);
-        if (err != OK) {
-            return err;
-        }
-        uint32_t x_time = mSampleIterator->getSampleTime();
+            err = mSampleIterator->seekTo(x);
+            if (err != OK) {
+                return err;
+            }
+            x_time = mSampleIterator->getSampleTime();
 
-        err = mSampleIterator->seekTo(y);
-        if (err != OK) {
-            return err;
-        }
+            err = mSampleIterator->seekTo(y);
+            if (err != OK) {
+                return err;
+            }
 
-        uint32_t y_time = mSampleIterator->getSampleTime();
+            y_time = mSampleIterator->getSampleTime();
+        }
 
         if (abs_difference(x_time, sample_time)
                 > abs_difference(y_time, sample_time)) {
@@ -769,6 +901,15 @@ status_t SampleTable::findThumbnailSample(uint32_t *sample_index) {
 
 status_t SampleTable::getSampleSize_l(
         uint32_t sampleIndex, size_t *sampleSize) {
+    if (ensureSampleIndex_l()) {
+        if (sampleIndex >= mNumSampleSizes) {
+            *sampleSize = 0;
+            return ERROR_OUT_OF_RANGE;
+        }
+        *sampleSize = mSampleIndex->size(sampleIndex);
+        return OK;
+    }
+
     return mSampleIterator->getSampleSizeDirect(
             sampleIndex, sampleSize);
 }
@@ -781,6 +922,30 @@ status_t SampleTable::getMetaDataForSample(
         bool *isSyncSample) {
     Mutex::Autolock autoLock(mLock);
 
+    if (ensureSampleIndex_l()) {
+        if (sampleIndex >= mNumSampleSizes) {
+            return ERROR_END_OF_STREAM;
+        }
+
+        if (offset) {
+            *offset = mSampleIndex->offset(sampleIndex);
+        }
+
+        if (size) {
+            *size = mSampleIndex->size(sampleIndex);
+        }
+
+        if (compositionTime) {
+            *compositionTime = mSampleIndex->compositionTime(sampleIndex);
+        }
+
+        if (isSyncSample) {
+            *isSyncSample = mSampleIndex->isSyncSample(sampleIndex);
+        }
+
+        return OK;
+    }
+
     status_t err;
     if ((err = mSampleIterator->seekTo(sampleIndex)) != OK) {
         return err;
@@ -823,6 +988,243 @@ status_t SampleTable::getMetaDataForSample(
     return OK;
 }
 
+status_t SampleTable::readSampleSizes_l(
+        uint32_t firstSample, uint32_t numSamples, uint32_t *sizes) {
+    CHECK(mDefaultSampleSize == 0);
+    CHECK((firstSample & 1) == 0);  // 4-bit sizes are packed by pairs
+    CHECK(firstSample + numSamples <= mNumSampleSizes);
+
+    off64_t offset =
+        mSampleSizeOffset + 12
+            + ((uint64_t)firstSample * mSampleSizeFieldSize) / 8;
+
+    if (mSampleSizeFieldSize == 32) {
+        size_t size = numSamples * sizeof(uint32_t);
+        if (mDataSource->readAt(offset, sizes, size) < (ssize_t)size) {
+            return ERROR_IO;
+        }
+        for (uint32_t i = 0; i < numSamples; ++i) {
+            sizes[i] = ntohl(sizes[i]);
+        }
+        return OK;
+    }
+
+    size_t size = ((uint64_t)numSamples * mSampleSizeFieldSize + 7) / 8;
+    uint8_t *data = new uint8_t[size];
+    if (mDataSource->readAt(offset, data, size) < (ssize_t)size) {
+        delete[] data;
+        return ERROR_IO;
+    }
+    for (uint32_t i = 0; i < numSamples; ++i) {
+        switch (mSampleSizeFieldSize) {
+            case 16:
+                sizes[i] = U16_AT(&data[2 * i]);
+                break;
+            case 8:
+                sizes[i] = data[i];
+                break;
+            default:
+                CHECK_EQ(mSampleSizeFieldSize, 4u);
+                sizes[i] = (i & 1) ? data[i / 2] & 0x0f : data[i / 2] >> 4;
+                break;
+        }
+    }
+    delete[] data;
+
+    return OK;
+}
+
+bool SampleTable::ensureSampleIndex_l() {
+    if (mSampleIndexTried) {
+        return mSampleIndex != NULL;
+    }
+
+    if (!isValid()) {
+        // Not all tables have been parsed yet, try again later.
+        return false;
+    }
+    mSampleIndexTried = true;
+
+    // Large tables, or ones too large to be genuine, are read on demand
+    // by the sample iterator instead.
+    if (mNumSampleSizes == 0 || mNumSampleSizes > kMaxIndexedSamples
+            || mNumChunkOffsets > kMaxIndexedSamples) {
+        return false;
+    }
+
+    SampleIndex *index = new SampleIndex;
+    status_t err = buildSampleIndex_l(index);
+    if (err != OK) {
+        // The sample iterator reports the error, if any, for the
+        // offending sample only.
+        ALOGW("not indexing %u samples (%d)", mNumSampleSizes, err);
+        delete index;
+        return false;
+    }
+
+    ALOGV("indexed %u samples", mNumSampleSizes);
+    mSampleIndex = index;
+    return true;
+}
+
+// The index holds the sync flags and composition offsets of every sample,
+// so it has to be rebuilt if stss or ctts is parsed after it was built.
+void SampleTable::invalidateSampleIndex() {
+    Mutex::Autolock autoLock(mLock);
+
+    delete mSampleIndex;
+    mSampleIndex = NULL;
+    mSampleIndexTried = false;
+}
+
+status_t SampleTable::buildSampleIndex_l(SampleIndex *index) {
+    const uint32_t numSamples = mNumSampleSizes;
+    index->mNumSamples = numSamples;
+
+    // Sample sizes, read with a single request.
+    if (mDefaultSampleSize > 0) {
+        index->mDefaultSize = mDefaultSampleSize;
+        index->mMaxSampleSize = mDefaultSampleSize;
+    } else {
+        index->mSizes = new uint32_t[numSamples];
+
+        status_t err = readSampleSizes_l(0, numSamples, index->mSizes);
+        if (err != OK) {
+            return err;
+        }
+
+        for (uint32_t i = 0; i < numSamples; ++i) {
+            if (index->mSizes[i] > index->mMaxSampleSize) {
+                index->mMaxSampleSize = index->mSizes[i];
+            }
+        }
+    }
+
+    // Chunk offsets, also read with a single request, then walked
+    // through the sample-to-chunk table.
+    if (mNumChunkOffsets == 0) {
+        return ERROR_MALFORMED;
+    }
+    size_t entrySize = (mChunkOffsetType == kChunkOffsetType32) ? 4 : 8;
+    size_t size = mNumChunkOffsets * entrySize;
+    uint8_t *chunkOffsets = new uint8_t[size];
+    if (mDataSource->readAt(mChunkOffsetOffset + 8, chunkOffsets, size)
+            < (ssize_t)size) {
+        delete[] chunkOffsets;
+        return ERROR_IO;
+    }
+
+    uint32_t numGroups =
+        (numSamples + (1 << SampleIndex::kGroupShift) - 1)
+            >> SampleIndex::kGroupShift;
+    index->mGroupOffsets = new off64_t[numGroups];
+    index->mOffsetDeltas = new uint32_t[numSamples];
+
+    status_t err = OK;
+    uint32_t sampleIndex = 0;
+    for (uint32_t i = 0;
+            i < mNumSampleToChunkOffsets && sampleIndex < numSamples
+                && err == OK; ++i) {
+        const SampleToChunkEntry &entry = mSampleToChunkEntries[i];
+        uint32_t stopChunk = (i + 1 < mNumSampleToChunkOffsets)
+            ? mSampleToChunkEntries[i + 1].startChunk : mNumChunkOffsets;
+
+        if (stopChunk < entry.startChunk || stopChunk > mNumChunkOffsets) {
+            err = ERROR_MALFORMED;
+            break;
+        }
+
+        for (uint32_t chunk = entry.startChunk;
+                chunk < stopChunk && sampleIndex < numSamples; ++chunk) {
+            off64_t offset = (entrySize == 4)
+                ? (off64_t)U32_AT(&chunkOffsets[4 * chunk])
+                : (off64_t)U64_AT(&chunkOffsets[8 * chunk]);
+
+            for (uint32_t j = 0;
+                    j < entry.samplesPerChunk && sampleIndex < numSamples;
+                    ++j, ++sampleIndex) {
+                uint32_t group = sampleIndex >> SampleIndex::kGroupShift;
+                if ((sampleIndex & ((1 << SampleIndex::kGroupShift) - 1)) == 0) {
+                    index->mGroupOffsets[group] = offset;
+                }
+
+                off64_t delta = offset - index->mGroupOffsets[group];
+                if (delta < 0 || delta > 0xffffffffll) {
+                    // Chunks out of order, or too far apart.
+                    err = ERROR_UNSUPPORTED;
+                    break;
+                }
+                index->mOffsetDeltas[sampleIndex] = (uint32_t)delta;
+
+                offset += index->size(sampleIndex);
+            }
+
+            if (err != OK) {
+                break;
+            }
+        }
+    }
+    delete[] chunkOffsets;
+
+    if (err != OK) {
+        return err;
+    }
+    if (sampleIndex < numSamples) {
+        return ERROR_MALFORMED;
+    }
+
+    // Decode times, expanded from the time-to-sample table.
+    index->mDecodeTimes = new uint32_t[numSamples];
+    sampleIndex = 0;
+    uint32_t sampleTime = 0;
+    for (uint32_t i = 0;
+            i < mTimeToSampleCount && sampleIndex < numSamples; ++i) {
+        uint32_t n = mTimeToSample[2 * i];
+        uint32_t delta = mTimeToSample[2 * i + 1];
+
+        for (uint32_t j = 0; j < n && sampleIndex < numSamples; ++j) {
+            index->mDecodeTimes[sampleIndex++] = sampleTime;
+            sampleTime += delta;
+        }
+    }
+    if (sampleIndex < numSamples) {
+        return ERROR_MALFORMED;
+    }
+
+    // Composition time offsets, 0 for samples beyond the 'ctts' table.
+    if (mCompositionTimeDeltaEntries != NULL) {
+        index->mCompositionOffsets = new uint32_t[numSamples];
+        memset(index->mCompositionOffsets, 0, numSamples * sizeof(uint32_t));
+
+        sampleIndex = 0;
+        for (size_t i = 0; i < mNumCompositionTimeDeltaEntries
+                && sampleIndex < numSamples; ++i) {
+            uint32_t n = mCompositionTimeDeltaEntries[2 * i];
+            uint32_t delta = mCompositionTimeDeltaEntries[2 * i + 1];
+
+            for (uint32_t j = 0; j < n && sampleIndex < numSamples; ++j) {
+                index->mCompositionOffsets[sampleIndex++] = delta;
+            }
+        }
+    }
+
+    // Sync samples as a bit vector.
+    if (mSyncSampleOffset >= 0) {
+        size_t numWords = (numSamples + 31) / 32;
+        index->mSyncBits = new uint32_t[numWords];
+        memset(index->mSyncBits, 0, numWords * sizeof(uint32_t));
+
+        for (uint32_t i = 0; i < mNumSyncSamples; ++i) {
+            uint32_t x = mSyncSamples[i];
+            if (x < numSamples) {
+                index->mSyncBits[x >> 5] |= 1u << (x & 31);
+            }
+        }
+    }
+
+    return OK;
+}
+
 uint32_t SampleTable::getCompositionTimeOffset(uint32_t sampleIndex) {
     return mCompositionDeltaLookup->getCompositionTimeOffset(sampleIndex);
 }
@@ -25,6 +25,7 @@
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/MediaErrors.h>
 #include <media/stagefright/MetaData.h>
 #include <media/stagefright/MediaDefs.h>
 #include <media/AudioSystem.h>
@@ -216,6 +217,78 @@ status_t convertMetaDataToMessage(
         buffer->meta()->setInt32("csd", true);
         buffer->meta()->setInt64("timeUs", 0);
         msg->setBuffer("csd-1", buffer);
+    } else if (meta->findData(kKeyHVCC, &type, &data, &size)) {
+        // Parse the HEVCDecoderConfigurationRecord, all parameter sets
+        // go into csd-0.
+
+        const uint8_t *ptr = (const uint8_t *)data;
+
+        if (size < 23 || ptr[0] != 1) {  // configurationVersion == 1
+            return ERROR_MALFORMED;
+        }
+
+        size_t numArrays = ptr[22];
+
+        ptr += 23;
+        size -= 23;
+
+        // First pass validates the arrays and sizes the output, every NAL
+        // unit gets a 4 byte start code prepended.
+        size_t csdSize = 0;
+        const uint8_t *scan = ptr;
+        size_t remaining = size;
+
+        for (size_t i = 0; i < numArrays; ++i) {
+            if (remaining < 3) {
+                return ERROR_MALFORMED;
+            }
+            size_t numNalus = U16_AT(&scan[1]);
+
+            scan += 3;
+            remaining -= 3;
+
+            for (size_t j = 0; j < numNalus; ++j) {
+                if (remaining < 2) {
+                    return ERROR_MALFORMED;
+                }
+                size_t length = U16_AT(scan);
+
+                scan += 2;
+                remaining -= 2;
+
+                if (remaining < length) {
+                    return ERROR_MALFORMED;
+                }
+
+                csdSize += 4 + length;
+
+                scan += length;
+                remaining -= length;
+            }
+        }
+
+        sp<ABuffer> buffer = new ABuffer(csdSize);
+        buffer->setRange(0, 0);
+
+        for (size_t i = 0; i < numArrays; ++i) {
+            size_t numNalus = U16_AT(&ptr[1]);
+            ptr += 3;
+
+            for (size_t j = 0; j < numNalus; ++j) {
+                size_t length = U16_AT(ptr);
+                ptr += 2;
+
+                memcpy(buffer->data() + buffer->size(), "\x00\x00\x00\x01", 4);
+                memcpy(buffer->data() + buffer->size() + 4, ptr, length);
+                buffer->setRange(0, buffer->size() + 4 + length);
+
+                ptr += length;
+            }
+        }
+
+        buffer->meta()->setInt32("csd", true);
+        buffer->meta()->setInt64("timeUs", 0);
+        msg->setBuffer("csd-0", buffer);
     } else if (meta->findData(kKeyESDS, &type, &data, &size)) {
         ESDS esds((const char *)data, size);
         CHECK_EQ(esds.InitCheck(), (status_t)OK);
@@ -212,9 +212,10 @@ status_t getNextNALUnit(
     size_t startOffset = offset;
 
     for (;;) {
-        while (offset < size && data[offset] != 0x01) {
-            ++offset;
-        }
+        const uint8_t *next =
+            (const uint8_t *)memchr(&data[offset], 0x01, size - offset);
+
+        offset = (next != NULL) ? next - data : size;
 
         if (offset == size) {
             if (startCodeFollows) {
@@ -251,6 +252,30 @@ status_t getNextNALUnit(
     return OK;
 }
 
+ssize_t findNextStartCode(const uint8_t *data, size_t size, size_t offset) {
+    // Look for the 0x01 byte with memchr(), which examines many bytes at a
+    // time, rather than comparing 3 bytes at every offset.
+    size_t pos = offset + 2;
+    while (pos < size) {
+        const uint8_t *next =
+            (const uint8_t *)memchr(&data[pos], 0x01, size - pos);
+
+        if (next == NULL) {
+            break;
+        }
+
+        pos = next - data;
+
+        if (data[pos - 1] == 0x00 && data[pos - 2] == 0x00) {
+            return pos - 2;
+        }
+
+        ++pos;
+    }
+
+    return -1;
+}
+
 static sp<ABuffer> FindNAL(
         const uint8_t *data, size_t size, unsigned nalType,
         size_t *stopOffset) {
@@ -375,6 +400,180 @@ sp<MetaData> MakeAVCCodecSpecificData(const sp<ABuffer> &accessUnit) {
     return meta;
 }
 
+static sp<ABuffer> FindHEVCNAL(
+        const uint8_t *data, size_t size, unsigned nalType) {
+    const uint8_t *nalStart;
+    size_t nalSize;
+    while (getNextNALUnit(&data, &size, &nalStart, &nalSize, true) == OK) {
+        if (nalSize >= 2 && ((nalStart[0] >> 1) & 0x3f) == nalType) {
+            sp<ABuffer> buffer = new ABuffer(nalSize);
+            memcpy(buffer->data(), nalStart, nalSize);
+            return buffer;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the RBSP of a NAL unit, i.e. without its emulation prevention
+// bytes.
+static sp<ABuffer> GetRBSP(const sp<ABuffer> &nal) {
+    const uint8_t *data = nal->data();
+    size_t size = nal->size();
+
+    sp<ABuffer> rbsp = new ABuffer(size);
+    uint8_t *out = rbsp->data();
+
+    size_t numZeros = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (numZeros >= 2 && data[i] == 0x03) {
+            numZeros = 0;
+            continue;
+        }
+
+        numZeros = (data[i] == 0x00) ? numZeros + 1 : 0;
+        *out++ = data[i];
+    }
+
+    rbsp->setRange(0, out - rbsp->data());
+
+    return rbsp;
+}
+
+sp<MetaData> MakeHEVCCodecSpecificData(const sp<ABuffer> &accessUnit) {
+    const uint8_t *data = accessUnit->data();
+    size_t size = accessUnit->size();
+
+    enum {
+        kNALTypeVPS = 32,
+        kNALTypeSPS = 33,
+        kNALTypePPS = 34,
+    };
+
+    sp<ABuffer> vps = FindHEVCNAL(data, size, kNALTypeVPS);
+    sp<ABuffer> sps = FindHEVCNAL(data, size, kNALTypeSPS);
+    sp<ABuffer> pps = FindHEVCNAL(data, size, kNALTypePPS);
+
+    if (vps == NULL || sps == NULL || pps == NULL) {
+        return NULL;
+    }
+
+    // 2 bytes of NAL unit header, 1 byte of sps_video_parameter_set_id,
+    // sps_max_sub_layers_minus1 and sps_temporal_id_nesting_flag, followed
+    // by the 12 bytes of the general profile, tier and level.
+    sp<ABuffer> rbsp = GetRBSP(sps);
+    if (rbsp->size() < 16) {
+        return NULL;
+    }
+
+    const uint8_t *generalProfileTierLevel = rbsp->data() + 3;
+
+    ABitReader br(rbsp->data() + 2, rbsp->size() - 2);
+    br.skipBits(4);  // sps_video_parameter_set_id
+    unsigned maxSubLayersMinus1 = br.getBits(3);
+    unsigned temporalIdNesting = br.getBits(1);
+
+    br.skipBits(96);  // general profile, tier and level
+
+    bool subLayerProfilePresent[8];
+    bool subLayerLevelPresent[8];
+    for (unsigned i = 0; i < maxSubLayersMinus1; ++i) {
+        subLayerProfilePresent[i] = br.getBits(1);
+        subLayerLevelPresent[i] = br.getBits(1);
+    }
+
+    if (maxSubLayersMinus1 > 0) {
+        br.skipBits(2 * (8 - maxSubLayersMinus1));  // reserved_zero_2bits
+    }
+
+    for (unsigned i = 0; i < maxSubLayersMinus1; ++i) {
+        if (subLayerProfilePresent[i]) {
+            br.skipBits(88);
+        }
+        if (subLayerLevelPresent[i]) {
+            br.skipBits(8);
+        }
+    }
+
+    parseUE(&br);  // sps_seq_parameter_set_id
+    unsigned chromaFormatIdc = parseUE(&br);
+    if (chromaFormatIdc == 3) {
+        br.skipBits(1);  // separate_colour_plane_flag
+    }
+
+    int32_t width = parseUE(&br);
+    int32_t height = parseUE(&br);
+
+    if (br.getBits(1)) {  // conformance_window_flag
+        int32_t subWidthC = (chromaFormatIdc == 1 || chromaFormatIdc == 2) ? 2 : 1;
+        int32_t subHeightC = (chromaFormatIdc == 1) ? 2 : 1;
+
+        int32_t left = parseUE(&br);
+        int32_t right = parseUE(&br);
+        int32_t top = parseUE(&br);
+        int32_t bottom = parseUE(&br);
+
+        width -= subWidthC * (left + right);
+        height -= subHeightC * (top + bottom);
+    }
+
+    unsigned bitDepthLumaMinus8 = parseUE(&br);
+    unsigned bitDepthChromaMinus8 = parseUE(&br);
+
+    const sp<ABuffer> paramSets[3] = { vps, sps, pps };
+
+    size_t csdSize = 23;
+    for (size_t i = 0; i < 3; ++i) {
+        csdSize += 3 + 2 + paramSets[i]->size();
+    }
+
+    sp<ABuffer> csd = new ABuffer(csdSize);
+    uint8_t *out = csd->data();
+
+    *out++ = 0x01;  // configurationVersion
+    memcpy(out, generalProfileTierLevel, 12);
+    out += 12;
+    *out++ = 0xf0;  // min_spatial_segmentation_idc == 0
+    *out++ = 0x00;
+    *out++ = 0xfc;  // parallelismType == 0 (unknown)
+    *out++ = 0xfc | (chromaFormatIdc & 3);
+    *out++ = 0xf8 | (bitDepthLumaMinus8 & 7);
+    *out++ = 0xf8 | (bitDepthChromaMinus8 & 7);
+    *out++ = 0x00;  // avgFrameRate == 0 (unspecified)
+    *out++ = 0x00;
+    *out++ = ((maxSubLayersMinus1 + 1) << 3)  // numTemporalLayers
+                | (temporalIdNesting << 2)
+                | 3;  // lengthSizeMinusOne
+    *out++ = 3;  // numOfArrays
+
+    for (size_t i = 0; i < 3; ++i) {
+        const sp<ABuffer> &nal = paramSets[i];
+
+        *out++ = 0x80 | ((nal->data()[0] >> 1) & 0x3f);  // array_completeness
+        *out++ = 0;
+        *out++ = 1;  // numNalus
+        *out++ = nal->size() >> 8;
+        *out++ = nal->size() & 0xff;
+        memcpy(out, nal->data(), nal->size());
+        out += nal->size();
+    }
+
+    unsigned profile = generalProfileTierLevel[0] & 0x1f;
+    unsigned level = generalProfileTierLevel[11];
+
+    ALOGI("found HEVC codec config (%d x %d, profile %u level %u.%u)",
+         width, height, profile, level / 30, (level % 30) / 3);
+
+    sp<MetaData> meta = new MetaData;
+    meta->setCString(kKeyMIMEType, MEDIA_MIMETYPE_VIDEO_HEVC);
+
+    meta->setData(kKeyHVCC, kTypeHVCC, csd->data(), csd->size());
+    meta->setInt32(kKeyWidth, width);
+    meta->setInt32(kKeyHeight, height);
+
+    return meta;
+}
+
 bool IsIDR(const sp<ABuffer> &buffer) {
     const uint8_t *data = buffer->data();
     size_t size = buffer->size();
@@ -397,6 +596,98 @@ bool IsIDR(const sp<ABuffer> &buffer) {
     return foundIDR;
 }
 
+// Like parseUE(), but fails instead of reading past the end of the data,
+// for parsing access units that have not been validated yet.
+static bool parseUEChecked(ABitReader *br, unsigned *x) {
+    unsigned numZeroes = 0;
+    for (;;) {
+        if (br->numBitsLeft() == 0) {
+            return false;
+        }
+        if (br->getBits(1)) {
+            break;
+        }
+        ++numZeroes;
+    }
+
+    if (numZeroes > 31 || br->numBitsLeft() < numZeroes) {
+        return false;
+    }
+
+    *x = br->getBits(numZeroes) + (1u << numZeroes) - 1;
+    return true;
+}
+
+// Whether the SEI NAL unit (header byte excluded) holds a recovery point
+// message, see H.264 7.3.2.3.1 and D.1.7.
+static bool hasRecoveryPointSEI(const uint8_t *data, size_t size) {
+    size_t offset = 0;
+    while (offset < size && data[offset] != 0x80) {  // rbsp trailing bits
+        unsigned payloadType = 0;
+        while (offset < size && data[offset] == 0xff) {
+            payloadType += 0xff;
+            ++offset;
+        }
+        if (offset >= size) {
+            return false;
+        }
+        payloadType += data[offset++];
+
+        size_t payloadSize = 0;
+        while (offset < size && data[offset] == 0xff) {
+            payloadSize += 0xff;
+            ++offset;
+        }
+        if (offset >= size) {
+            return false;
+        }
+        payloadSize += data[offset++];
+
+        if (payloadType == 6) {
+            return true;
+        }
+
+        offset += payloadSize;
+    }
+
+    return false;
+}
+
+bool IsAVCRandomAccessPoint(const sp<ABuffer> &accessUnit) {
+    const uint8_t *data = accessUnit->data();
+    size_t size = accessUnit->size();
+
+    const uint8_t *nalStart;
+    size_t nalSize;
+    while (getNextNALUnit(&data, &size, &nalStart, &nalSize, true) == OK) {
+        CHECK_GT(nalSize, 0u);
+
+        unsigned nalType = nalStart[0] & 0x1f;
+
+        if (nalType == 5) {
+            return true;
+        } else if (nalType == 6) {
+            if (hasRecoveryPointSEI(nalStart + 1, nalSize - 1)) {
+                return true;
+            }
+        } else if (nalType == 1) {
+            // The first slice decides, the leading fields of the slice
+            // header are too short to contain emulation prevention bytes.
+            ABitReader br(nalStart + 1, nalSize - 1);
+            unsigned firstMbInSlice, sliceType;
+            if (!parseUEChecked(&br, &firstMbInSlice)
+                    || !parseUEChecked(&br, &sliceType)) {
+                return false;
+            }
+
+            return sliceType == 2 || sliceType == 7     // I
+                || sliceType == 4 || sliceType == 9;    // SI
+        }
+    }
+
+    return false;
+}
+
 bool IsAVCReferenceFrame(const sp<ABuffer> &accessUnit) {
     const uint8_t *data = accessUnit->data();
     size_t size = accessUnit->size();
@@ -734,15 +734,10 @@ status_t PlaylistFetcher::extractAndQueueAccessUnits(
             mNextPTSTimeUs = -1ll;
         }
 
-        size_t offset = 0;
-        while (offset < buffer->size()) {
-            status_t err = mTSParser->feedTSPacket(buffer->data() + offset, 188);
+        status_t err = mTSParser->feedTSPackets(buffer->data(), buffer->size());
 
-            if (err != OK) {
-                return err;
-            }
-
-            offset += 188;
+        if (err != OK) {
+            return err;
         }
 
         for (size_t i = mPacketSources.size(); i-- > 0;) {
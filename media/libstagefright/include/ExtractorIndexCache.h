@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EXTRACTOR_INDEX_CACHE_H_
+
+#define EXTRACTOR_INDEX_CACHE_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/Errors.h>
+#include <utils/RefBase.h>
+
+namespace android {
+
+class DataSource;
+
+// Persistent cache of the seek indices built by the extractors, so that
+// reopening the same file does not require scanning it again.
+//
+// Entries are stored one per file in the directory given by the property
+// "media.stagefright.index-cache" (kDefaultDirectory if unset, disabled if
+// set to an empty string), and are keyed by the identity of the source as
+// returned by DataSource::getFileIdentity() and a tag chosen by the
+// extractor. Any change to the size or modification time of the source
+// changes its identity, which makes stale entries unreachable; they are
+// eventually removed when the cache grows past kMaxEntries.
+//
+// The payload format is private to each extractor, which should include a
+// version in its tag and validate the payload before use.
+struct ExtractorIndexCache {
+    static const char *kDefaultDirectory;
+
+    enum {
+        kMaxEntries     = 256,
+        kMaxPayloadSize = 1024 * 1024,
+    };
+
+    // A payload mapped read-only from the cache, valid for the lifetime of
+    // the Entry.
+    struct Entry : public RefBase {
+        const void *data() const { return mData; }
+        size_t size() const { return mSize; }
+
+    protected:
+        virtual ~Entry();
+
+    private:
+        friend struct ExtractorIndexCache;
+
+        Entry(void *mapping, size_t mappingSize,
+              const void *data, size_t size);
+
+        void *mMapping;
+        size_t mMappingSize;
+        const void *mData;
+        size_t mSize;
+
+        DISALLOW_EVIL_CONSTRUCTORS(Entry);
+    };
+
+    // Returns NULL if there is no valid entry for "source" and "tag".
+    static sp<Entry> Lookup(const sp<DataSource> &source, uint32_t tag);
+
+    // Replaces the entry for "source" and "tag", if any.
+    static status_t Store(
+            const sp<DataSource> &source, uint32_t tag,
+            const void *data, size_t size);
+
+private:
+    ExtractorIndexCache();
+};
+
+}  // namespace android
+
+#endif  // EXTRACTOR_INDEX_CACHE_H_
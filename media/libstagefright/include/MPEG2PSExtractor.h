@@ -22,6 +22,7 @@
 #include <media/stagefright/MediaExtractor.h>
 #include <utils/threads.h>
 #include <utils/KeyedVector.h>
+#include <utils/Vector.h>
 
 namespace android {
 
@@ -60,8 +61,31 @@ private:
     bool mProgramStreamMapValid;
     KeyedVector<unsigned, unsigned> mStreamTypeByESID;
 
+    // Offsets of pack headers, about kSeekIndexIntervalUs apart, recorded
+    // as the file is read. Reading resumes elsewhere after a seek, the
+    // points following such a gap are marked and seekTo() bisects on the
+    // SCRs in the gap, as it does beyond the last point.
+    struct SeekPoint {
+        int64_t mTimeUs;
+        off64_t mOffset;
+        bool mAfterGap;
+    };
+    Vector<SeekPoint> mSeekIndex;
+    off64_t mSeekIndexEnd;  // end of the last chunk parsed
+    bool mSeekIndexGap;     // whether data after the last point was skipped
+
+    // Only local files of known size can be seeked in.
+    off64_t mFileSize;
+
     status_t feedMore();
 
+    bool isSeekable() const;
+    void addSeekPoint_l(off64_t offset, const uint8_t *pack);
+    status_t findPack_l(
+            off64_t offset, off64_t limit,
+            off64_t *packOffset, int64_t *timeUs);
+    status_t seekTo(int64_t seekTimeUs);
+
     status_t dequeueChunk();
     ssize_t dequeuePack();
     ssize_t dequeueSystemHeader();
@@ -56,9 +56,38 @@ private:
 
     off64_t mOffset;
 
+    // Offsets of packets carrying a PCR, about kSeekIndexIntervalUs apart,
+    // recorded as the file is read. Reading resumes elsewhere after a seek,
+    // the points following such a gap are marked and seekTo() bisects on
+    // the PCRs in the gap, as it does beyond the last point.
+    struct SeekPoint {
+        int64_t mTimeUs;
+        off64_t mOffset;
+        bool mAfterGap;
+    };
+    Vector<SeekPoint> mSeekIndex;
+    off64_t mSeekIndexEnd;  // end of the last packet read
+    bool mSeekIndexGap;     // whether data after the last point was skipped
+
+    // PID carrying the PCRs used for seeking, -1 until one is found.
+    int32_t mPCRPID;
+    uint64_t mFirstPCR;
+
+    // Only local files of known size can be seeked in.
+    off64_t mFileSize;
+
     void init();
     status_t feedMore();
 
+    bool isSeekable() const;
+    int64_t getPCRTimeUs(uint64_t PCR) const;
+    void addSeekPoint_l(const uint8_t *packet, off64_t offset);
+    void estimateDuration_l();
+    status_t findPCR_l(
+            off64_t offset, off64_t limit,
+            off64_t *pcrOffset, int64_t *timeUs);
+    status_t seekTo(int64_t seekTimeUs);
+
     DISALLOW_EVIL_CONSTRUCTORS(MPEG2TSExtractor);
 };
 
@@ -39,6 +39,12 @@ struct SidxEntry {
     uint32_t mDurationUs;
 };
 
+// Start of a movie fragment, for seeking in fragmented files.
+struct FragmentEntry {
+    off64_t mMoofOffset;
+    uint64_t mTime;     // in the timescale of the track
+};
+
 class MPEG4Extractor : public MediaExtractor {
 public:
     // Extractor assumes ownership of "source".
@@ -64,11 +70,21 @@ private:
         uint32_t datalen;
         uint8_t *data;
     };
+    // Location of a sample table box whose parsing was deferred until the
+    // track is actually used, see materializeSampleTable().
+    struct SampleTableBox {
+        uint32_t type;
+        off64_t offset;
+        size_t size;
+    };
+
     struct Track {
         Track *next;
         sp<MetaData> meta;
         uint32_t timescale;
         sp<SampleTable> sampleTable;
+        Vector<SampleTableBox> sampleTableBoxes;
+        Vector<FragmentEntry> fragments;
         bool includes_expensive_metadata;
         bool skipTrack;
     };
@@ -82,6 +98,7 @@ private:
     sp<DataSource> mDataSource;
     status_t mInitCheck;
     bool mHasVideo;
+    bool mLazySampleTables;
     uint32_t mHeaderTimescale;
 
     Track *mFirstTrack, *mLastTrack;
@@ -101,6 +118,7 @@ private:
             const void *esds_data, size_t esds_size);
 
     static status_t verifyTrack(Track *track);
+    status_t materializeSampleTable(Track *track);
 
     struct SINF {
         SINF *next;
@@ -118,6 +136,8 @@ private:
     status_t parseTrackHeader(off64_t data_offset, off64_t data_size);
 
     status_t parseSegmentIndex(off64_t data_offset, size_t data_size);
+    status_t parseMovieFragmentRandomAccess();
+    status_t parseTrackFragmentRandomAccess(off64_t data_offset, off64_t data_size);
 
     Track *findTrackByMimePrefix(const char *mimePrefix);
 
@@ -87,6 +87,11 @@ protected:
 
 private:
     struct CompositionDeltaLookup;
+    struct SampleIndex;
+
+    // Tables with more samples or chunks than this are never indexed in
+    // memory, see ensureSampleIndex_l().
+    static const uint32_t kMaxIndexedSamples = 1 << 20;
 
     static const uint32_t kChunkOffsetType32;
     static const uint32_t kChunkOffsetType64;
@@ -135,8 +140,20 @@ private:
     };
     SampleToChunkEntry *mSampleToChunkEntries;
 
+    // In-memory index of all samples, built on first use if the table is
+    // small enough and well-formed; NULL otherwise, in which case samples are
+    // looked up through mSampleIterator.
+    SampleIndex *mSampleIndex;
+    bool mSampleIndexTried;
+
     friend struct SampleIterator;
 
+    bool ensureSampleIndex_l();
+    void invalidateSampleIndex();
+    status_t buildSampleIndex_l(SampleIndex *index);
+    status_t readSampleSizes_l(
+            uint32_t firstSample, uint32_t numSamples, uint32_t *sizes);
+
     status_t getSampleSize_l(uint32_t sample_index, size_t *sample_size);
     uint32_t getCompositionTimeOffset(uint32_t sampleIndex);
 
@@ -49,10 +49,22 @@ status_t getNextNALUnit(
         const uint8_t **nalStart, size_t *nalSize,
         bool startCodeFollows = false);
 
+// Returns the offset of the first 0x00 0x00 0x01 startcode prefix at or
+// after "offset", or -1 if there is none.
+ssize_t findNextStartCode(const uint8_t *data, size_t size, size_t offset);
+
 struct MetaData;
 sp<MetaData> MakeAVCCodecSpecificData(const sp<ABuffer> &accessUnit);
 
+// Builds an HEVCDecoderConfigurationRecord from the first VPS, SPS and PPS
+// found in "accessUnit", returns NULL if there aren't any.
+sp<MetaData> MakeHEVCCodecSpecificData(const sp<ABuffer> &accessUnit);
+
 bool IsIDR(const sp<ABuffer> &accessUnit);
+
+// Whether decoding can start at "accessUnit": an IDR picture, a picture
+// preceded by a recovery point SEI message, or an I picture.
+bool IsAVCRandomAccessPoint(const sp<ABuffer> &accessUnit);
 bool IsAVCReferenceFrame(const sp<ABuffer> &accessUnit);
 
 const char *AVCProfileToString(uint8_t profile);
@@ -35,9 +35,25 @@
 
 namespace android {
 
+// Reads through a window of the source, so that the many small reads
+// issued while parsing are served from memory. The window is refilled with
+// a whole cluster at a time when the caller announces one with prefetch(),
+// and with kReadAheadSize bytes otherwise.
 struct DataSourceReader : public mkvparser::IMkvReader {
     DataSourceReader(const sp<DataSource> &source)
-        : mSource(source) {
+        : mSource(source),
+          mUseCount(0) {
+        // Reading ahead of what the parser needs could block on live
+        // streams until more data arrives.
+        off64_t size;
+        mReadAhead = mSource->getSize(&size) == OK;
+    }
+
+    virtual ~DataSourceReader() {
+        for (size_t i = 0; i < kNumWindows; ++i) {
+            delete[] mWindows[i].mBuffer;
+            mWindows[i].mBuffer = NULL;
+        }
     }
 
     virtual int Read(long long position, long length, unsigned char* buffer) {
@@ -48,6 +64,22 @@ struct DataSourceReader : public mkvparser::IMkvReader {
             return 0;
         }
 
+        Mutex::Autolock autoLock(mLock);
+
+        Window *window = findWindow_l(position, length);
+        if (window == NULL && mReadAhead && length < kReadAheadSize) {
+            window = fill_l(position, kReadAheadSize);
+            if (!window->contains(position, length)) {
+                window = NULL;
+            }
+        }
+
+        if (window != NULL) {
+            memcpy(buffer, window->mBuffer + (position - window->mOffset),
+                   length);
+            return 0;
+        }
+
         ssize_t n = mSource->readAt(position, buffer, length);
 
         if (n <= 0) {
@@ -77,8 +109,132 @@ struct DataSourceReader : public mkvparser::IMkvReader {
         return 0;
     }
 
+    // Reads the given range, typically a cluster, with a single request.
+    void prefetch(long long position, long long size) {
+        if (!mReadAhead || size <= 0) {
+            return;
+        }
+        if (size > kMaxPrefetchSize) {
+            size = kMaxPrefetchSize;
+        }
+
+        Mutex::Autolock autoLock(mLock);
+
+        if (findWindow_l(position, size) == NULL) {
+            fill_l(position, size);
+        }
+    }
+
 private:
+    enum {
+        kReadAheadSize   = 64 * 1024,
+        kMaxPrefetchSize = 2 * 1024 * 1024,
+        // Each track's BlockIterator walks its own cluster, so that the
+        // tracks read from different places when they are not interleaved
+        // closely. Enough windows for audio, video and a subtitle track
+        // plus the parser's own reads keep them from evicting each other.
+        kNumWindows      = 4,
+        // But at most two of them, e.g. for audio and video, may hold a
+        // cluster at a time. The least recently used buffers are released
+        // to stay below this.
+        kMaxBufferedSize = 2 * kMaxPrefetchSize + 2 * kReadAheadSize,
+    };
+
+    struct Window {
+        Window()
+            : mBuffer(NULL),
+              mCapacity(0),
+              mOffset(0),
+              mSize(0),
+              mLastUse(0) {
+        }
+
+        bool contains(long long position, long long length) const {
+            return position >= mOffset
+                && position + length <= mOffset + (long long)mSize;
+        }
+
+        uint8_t *mBuffer;
+        size_t mCapacity;
+        long long mOffset;
+        size_t mSize;
+        uint64_t mLastUse;
+    };
+
+    Mutex mLock;
     sp<DataSource> mSource;
+    bool mReadAhead;
+
+    Window mWindows[kNumWindows];
+    uint64_t mUseCount;
+
+    Window *findWindow_l(long long position, long long length) {
+        for (size_t i = 0; i < kNumWindows; ++i) {
+            if (mWindows[i].contains(position, length)) {
+                mWindows[i].mLastUse = ++mUseCount;
+                return &mWindows[i];
+            }
+        }
+        return NULL;
+    }
+
+    // Refills the least recently used window.
+    Window *fill_l(long long position, size_t size) {
+        Window *window = &mWindows[0];
+        for (size_t i = 1; i < kNumWindows; ++i) {
+            if (mWindows[i].mLastUse < window->mLastUse) {
+                window = &mWindows[i];
+            }
+        }
+
+        // A buffer much larger than needed, e.g. left over from a cluster
+        // prefetch, is given back rather than kept around.
+        if (size > window->mCapacity || size <= window->mCapacity / 2) {
+            delete[] window->mBuffer;
+            window->mBuffer = NULL;
+            window->mCapacity = 0;
+            window->mSize = 0;
+
+            release_l(size);
+
+            window->mBuffer = new uint8_t[size];
+            window->mCapacity = size;
+        }
+
+        ssize_t n = mSource->readAt(position, window->mBuffer, size);
+
+        window->mOffset = position;
+        window->mSize = n > 0 ? n : 0;
+        window->mLastUse = ++mUseCount;
+
+        return window;
+    }
+
+    // Frees the buffers of the least recently used windows until "size"
+    // more bytes fit in kMaxBufferedSize.
+    void release_l(size_t size) {
+        for (;;) {
+            size_t total = size;
+            Window *victim = NULL;
+            for (size_t i = 0; i < kNumWindows; ++i) {
+                total += mWindows[i].mCapacity;
+                if (mWindows[i].mBuffer != NULL
+                        && (victim == NULL
+                            || mWindows[i].mLastUse < victim->mLastUse)) {
+                    victim = &mWindows[i];
+                }
+            }
+
+            if (total <= kMaxBufferedSize || victim == NULL) {
+                return;
+            }
+
+            delete[] victim->mBuffer;
+            victim->mBuffer = NULL;
+            victim->mCapacity = 0;
+            victim->mSize = 0;
+        }
+    }
 
     DataSourceReader(const DataSourceReader &);
     DataSourceReader &operator=(const DataSourceReader &);
@@ -110,6 +266,7 @@ private:
     long mBlockEntryIndex;
 
     void advance_l();
+    bool seekWithCues_l(int64_t seekTimeNs);
 
     BlockIterator(const BlockIterator &);
     BlockIterator &operator=(const BlockIterator &);
@@ -275,6 +432,7 @@ void BlockIterator::advance_l() {
             CHECK(!nextCluster->EOS());
 
             mCluster = nextCluster;
+            mExtractor->enterCluster_l(mCluster);
 
             res = mCluster->Parse(pos, len);
             ALOGV("Parse (2) returned %ld", res);
@@ -301,6 +459,10 @@ void BlockIterator::reset() {
     mBlockEntry = NULL;
     mBlockEntryIndex = 0;
 
+    if (mCluster != NULL && !mCluster->EOS()) {
+        mExtractor->enterCluster_l(mCluster);
+    }
+
     do {
         advance_l();
     } while (!eos() && block()->GetTrackNumber() != mTrackNum);
@@ -331,6 +493,43 @@ void BlockIterator::seek(
 
     ALOGV("Seeking to: %lld", seekTimeUs);
 
+    if (!seekWithCues_l(seekTimeNs)) {
+        // Without cues, start from the last cluster beginning before the
+        // requested time, and look for a key frame from there.
+        ALOGV("Seeking without Cues");
+        mCluster = mExtractor->findCluster_l(seekTimeNs);
+        mBlockEntryIndex = 0;
+
+        if (mCluster == NULL) {
+            ALOGE("No cluster to seek to");
+            return;
+        }
+    }
+
+    for (;;) {
+        advance_l();
+
+        if (eos()) break;
+
+        if (block()->GetTrackNumber() != mTrackNum) {
+            continue;
+        }
+
+        if (isAudio || block()->IsKey()) {
+            // Accept the first key frame
+            *actualFrameTimeUs = (block()->GetTime(mCluster) + 500LL) / 1000LL;
+            ALOGV("Requested seek point: %lld actual: %lld",
+                  seekTimeUs, actualFrameTimeUs);
+            break;
+        }
+    }
+}
+
+// Positions the iterator just before the block pointed at by the cue for
+// "seekTimeNs", returns false if the file has no usable cues.
+bool BlockIterator::seekWithCues_l(int64_t seekTimeNs) {
+    mkvparser::Segment* const pSegment = mExtractor->mSegment;
+
     // If the Cues have not been located then find them.
     const mkvparser::Cues* pCues = pSegment->GetCues();
     const mkvparser::SeekHead* pSH = pSegment->GetSeekHead();
@@ -350,15 +549,11 @@ void BlockIterator::seek(
                 break;
             }
         }
-
-        if (!pCues) {
-            ALOGE("No Cues in file");
-            return;
-        }
     }
-    else if (!pSH) {
-        ALOGE("No SeekHead");
-        return;
+
+    if (!pCues) {
+        ALOGV("No Cues in file");
+        return false;
     }
 
     const mkvparser::CuePoint* pCP;
@@ -385,11 +580,10 @@ void BlockIterator::seek(
 
     // Always *search* based on the video track, but finalize based on mTrackNum
     const mkvparser::CuePoint::TrackPosition* pTP;
-    if (pTrack && pTrack->GetType() == 1) {
-        pCues->Find(seekTimeNs, pTrack, pCP, pTP);
-    } else {
-        ALOGE("Did not locate the video track for seeking");
-        return;
+    if (!pTrack || pTrack->GetType() != 1
+            || !pCues->Find(seekTimeNs, pTrack, pCP, pTP)) {
+        ALOGV("Did not locate the video track for seeking");
+        return false;
     }
 
     mCluster = pSegment->FindOrPreloadCluster(pTP->m_pos);
@@ -397,23 +591,13 @@ void BlockIterator::seek(
     CHECK(mCluster);
     CHECK(!mCluster->EOS());
 
+    mExtractor->enterCluster_l(mCluster);
+
     // mBlockEntryIndex starts at 0 but m_block starts at 1
     CHECK_GT(pTP->m_block, 0);
     mBlockEntryIndex = pTP->m_block - 1;
 
-    for (;;) {
-        advance_l();
-
-        if (eos()) break;
-
-        if (isAudio || block()->IsKey()) {
-            // Accept the first key frame
-            *actualFrameTimeUs = (block()->GetTime(mCluster) + 500LL) / 1000LL;
-            ALOGV("Requested seek point: %lld actual: %lld",
-                  seekTimeUs, actualFrameTimeUs);
-            break;
-        }
-    }
+    return true;
 }
 
 const mkvparser::Block *BlockIterator::block() const {
@@ -685,6 +869,90 @@ MatroskaExtractor::~MatroskaExtractor() {
     mReader = NULL;
 }
 
+// Called with mLock held whenever a cluster is about to be read.
+void MatroskaExtractor::enterCluster_l(const mkvparser::Cluster *cluster) {
+    mReader->prefetch(cluster->m_element_start, cluster->GetElementSize());
+
+    ClusterInfo info;
+    info.mTimeNs = cluster->GetTime();
+    info.mCluster = cluster;
+
+    size_t left = 0;
+    size_t right = mClusterIndex.size();
+    while (left < right) {
+        size_t center = left + (right - left) / 2;
+        if (mClusterIndex[center].mTimeNs <= info.mTimeNs) {
+            left = center + 1;
+        } else {
+            right = center;
+        }
+    }
+
+    if (left > 0 && mClusterIndex[left - 1].mCluster == cluster) {
+        return;
+    }
+
+    mClusterIndex.insertAt(info, left);
+}
+
+// Returns the last cluster starting at or before "timeNs", reading only the
+// headers of the clusters not yet in mClusterIndex.
+const mkvparser::Cluster *MatroskaExtractor::findCluster_l(long long timeNs) {
+    const mkvparser::Cluster *cluster = NULL;
+
+    size_t left = 0;
+    size_t right = mClusterIndex.size();
+    while (left < right) {
+        size_t center = left + (right - left) / 2;
+        if (mClusterIndex[center].mTimeNs <= timeNs) {
+            left = center + 1;
+        } else {
+            right = center;
+        }
+    }
+
+    if (left > 0) {
+        cluster = mClusterIndex[left - 1].mCluster;
+        if (left < mClusterIndex.size()) {
+            // The next cluster is known to start after timeNs.
+            return cluster;
+        }
+    } else {
+        cluster = mSegment->GetFirst();
+        if (cluster == NULL || cluster->EOS()) {
+            return NULL;
+        }
+    }
+
+    for (;;) {
+        const mkvparser::Cluster *next;
+        long long pos;
+        long len;
+        if (mSegment->ParseNext(cluster, next, pos, len) != 0
+                || next == NULL || next->EOS()) {
+            break;
+        }
+
+        ClusterInfo info;
+        info.mTimeNs = next->GetTime();
+        info.mCluster = next;
+        if (mClusterIndex.isEmpty()
+                || mClusterIndex.top().mTimeNs <= info.mTimeNs) {
+            mClusterIndex.push(info);
+        }
+
+        if (info.mTimeNs > timeNs) {
+            break;
+        }
+
+        cluster = next;
+    }
+
+    mReader->prefetch(cluster->m_element_start, cluster->GetElementSize());
+
+    return cluster;
+}
+
 size_t MatroskaExtractor::countTracks() {
     return mTracks.size();
 }
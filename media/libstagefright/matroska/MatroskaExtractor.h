@@ -24,6 +24,7 @@
 
 namespace mkvparser {
 struct Segment;
+struct Cluster;
 };
 
 namespace android {
@@ -60,9 +61,18 @@ private:
         sp<MetaData> mMeta;
     };
 
+    // Start time of a cluster, for seeking without cues.
+    struct ClusterInfo {
+        long long mTimeNs;
+        const mkvparser::Cluster *mCluster;
+    };
+
     Mutex mLock;
     Vector<TrackInfo> mTracks;
 
+    // The clusters found so far, sorted by time. Protected by mLock.
+    Vector<ClusterInfo> mClusterIndex;
+
     sp<DataSource> mDataSource;
     DataSourceReader *mReader;
     mkvparser::Segment *mSegment;
@@ -73,6 +83,9 @@ private:
     void addTracks();
     void findThumbnails();
 
+    void enterCluster_l(const mkvparser::Cluster *cluster);
+    const mkvparser::Cluster *findCluster_l(long long timeNs);
+
     bool isLiveStreaming() const;
 
     MatroskaExtractor(const MatroskaExtractor &);
@@ -50,10 +50,7 @@ struct ATSParser::Program : public RefBase {
     bool parsePSISection(
             unsigned pid, ABitReader *br, status_t *err);
 
-    bool parsePID(
-            unsigned pid, unsigned continuity_counter,
-            unsigned payload_unit_start_indicator,
-            ABitReader *br, status_t *err);
+    sp<Stream> getStream(unsigned pid);
 
     void signalDiscontinuity(
             DiscontinuityType type, const sp<AMessage> &extra);
@@ -117,6 +114,9 @@ struct ATSParser::Stream : public RefBase {
 
     sp<MediaSource> getSource(SourceType type);
 
+    // Whether the payload of this stream is used at all.
+    bool isParsed() const { return mQueue != NULL; }
+
 protected:
     virtual ~Stream();
 
@@ -127,21 +127,43 @@ private:
     unsigned mPCR_PID;
     int32_t mExpectedContinuityCounter;
 
+    struct PESHeader {
+        unsigned mStreamID;
+        unsigned mPacketLength;
+        unsigned mHeaderDataLength;
+        unsigned mPTS_DTS_flags;
+        uint64_t mPTS;
+        uint64_t mDTS;
+    };
+
     sp<ABuffer> mBuffer;
     sp<AnotherPacketSource> mSource;
     bool mPayloadStarted;
 
+    // Once the header of the PES packet being assembled has been parsed,
+    // it is removed from mBuffer, which then only holds the payload.
+    bool mPESHeaderParsed;
+    PESHeader mPESHeader;
+
     uint64_t mPrevPTS;
 
     ElementaryStreamQueue *mQueue;
 
     status_t flush();
     status_t parsePES(ABitReader *br);
+    status_t parsePESHeader(ABitReader *br, PESHeader *header);
+    void parsePESHeaderIfComplete();
 
     void onPayloadData(
             unsigned PTS_DTS_flags, uint64_t PTS, uint64_t DTS,
             const uint8_t *data, size_t size);
 
+    void onPayloadBuffer(
+            unsigned PTS_DTS_flags, uint64_t PTS, uint64_t DTS,
+            sp<ABuffer> *buffer);
+
+    void dequeueAccessUnits();
+
     void extractAACFrames(const sp<ABuffer> &buffer);
 
     bool isAudio() const;
@@ -196,21 +218,13 @@ bool ATSParser::Program::parsePSISection(
     return true;
 }
 
-bool ATSParser::Program::parsePID(
-        unsigned pid, unsigned continuity_counter,
-        unsigned payload_unit_start_indicator,
-        ABitReader *br, status_t *err) {
-    *err = OK;
-
+sp<ATSParser::Stream> ATSParser::Program::getStream(unsigned pid) {
     ssize_t index = mStreams.indexOfKey(pid);
     if (index < 0) {
-        return false;
+        return NULL;
     }
 
-    *err = mStreams.editValueAt(index)->parse(
-            continuity_counter, payload_unit_start_indicator, br);
-
-    return true;
+    return mStreams.editValueAt(index);
 }
 
 void ATSParser::Program::signalDiscontinuity(
@@ -472,6 +486,7 @@ ATSParser::Stream::Stream(
       mPCR_PID(PCR_PID),
       mExpectedContinuityCounter(-1),
       mPayloadStarted(false),
+      mPESHeaderParsed(false),
       mPrevPTS(0),
       mQueue(NULL) {
     switch (mStreamType) {
@@ -481,6 +496,10 @@ ATSParser::Stream::Stream(
                     (mProgram->parserFlags() & ALIGNED_VIDEO_DATA)
                         ? ElementaryStreamQueue::kFlag_AlignedData : 0);
             break;
+        case STREAMTYPE_H265:
+            mQueue = new ElementaryStreamQueue(
+                    ElementaryStreamQueue::HEVC);
+            break;
         case STREAMTYPE_MPEG2_AUDIO_ADTS:
             mQueue = new ElementaryStreamQueue(ElementaryStreamQueue::AAC);
             break;
@@ -535,6 +554,7 @@ status_t ATSParser::Stream::parse(
         ALOGI("discontinuity on stream pid 0x%04x", mElementaryPID);
 
         mPayloadStarted = false;
+        mPESHeaderParsed = false;
         mBuffer->setRange(0, 0);
         mExpectedContinuityCounter = -1;
 
@@ -592,12 +612,17 @@ status_t ATSParser::Stream::parse(
     memcpy(mBuffer->data() + mBuffer->size(), br->data(), payloadSizeBits / 8);
     mBuffer->setRange(0, mBuffer->size() + payloadSizeBits / 8);
 
+    if (!mPESHeaderParsed) {
+        parsePESHeaderIfComplete();
+    }
+
     return OK;
 }
 
 bool ATSParser::Stream::isVideo() const {
     switch (mStreamType) {
         case STREAMTYPE_H264:
+        case STREAMTYPE_H265:
         case STREAMTYPE_MPEG1_VIDEO:
         case STREAMTYPE_MPEG2_VIDEO:
         case STREAMTYPE_MPEG4_VIDEO:
@@ -630,6 +655,7 @@ void ATSParser::Stream::signalDiscontinuity(
     }
 
     mPayloadStarted = false;
+    mPESHeaderParsed = false;
     mBuffer->setRange(0, 0);
 
     bool clearFormat = false;
@@ -658,7 +684,7 @@ void ATSParser::Stream::signalDiscontinuity(
         }
     }
 
-    if (mSource != NULL) {
+    if (mSource != NULL && type != DISCONTINUITY_NONE) {
         mSource->queueDiscontinuity(type, extra);
     }
 }
@@ -669,7 +695,22 @@ void ATSParser::Stream::signalEOS(status_t finalResult) {
     }
 }
 
-status_t ATSParser::Stream::parsePES(ABitReader *br) {
+// Returns true if PES packets with this stream_id have the optional
+// header carrying the timestamps.
+static bool HasOptionalPESHeader(unsigned stream_id) {
+    return stream_id != 0xbc  // program_stream_map
+            && stream_id != 0xbe  // padding_stream
+            && stream_id != 0xbf  // private_stream_2
+            && stream_id != 0xf0  // ECM
+            && stream_id != 0xf1  // EMM
+            && stream_id != 0xff  // program_stream_directory
+            && stream_id != 0xf2  // DSMCC
+            && stream_id != 0xf8;  // H.222.1 type E
+}
+
+// Parses the PES packet header up to the start of its payload.
+status_t ATSParser::Stream::parsePESHeader(
+        ABitReader *br, PESHeader *header) {
     unsigned packet_startcode_prefix = br->getBits(24);
 
     ALOGV("packet_startcode_prefix = 0x%08x", packet_startcode_prefix);
@@ -689,14 +730,14 @@ status_t ATSParser::Stream::parsePES(ABitReader *br) {
     unsigned PES_packet_length = br->getBits(16);
     ALOGV("PES_packet_length = %u", PES_packet_length);
 
-    if (stream_id != 0xbc  // program_stream_map
-            && stream_id != 0xbe  // padding_stream
-            && stream_id != 0xbf  // private_stream_2
-            && stream_id != 0xf0  // ECM
-            && stream_id != 0xf1  // EMM
-            && stream_id != 0xff  // program_stream_directory
-            && stream_id != 0xf2  // DSMCC
-            && stream_id != 0xf8) {  // H.222.1 type E
+    header->mStreamID = stream_id;
+    header->mPacketLength = PES_packet_length;
+    header->mHeaderDataLength = 0;
+    header->mPTS_DTS_flags = 0;
+    header->mPTS = 0;
+    header->mDTS = 0;
+
+    if (HasOptionalPESHeader(stream_id)) {
         CHECK_EQ(br->getBits(2), 2u);
 
         MY_LOGV("PES_scrambling_control = %u", br->getBits(2));
@@ -796,6 +837,31 @@ status_t ATSParser::Stream::parsePES(ABitReader *br) {
 
         br->skipBits(optional_bytes_remaining * 8);
 
+        header->mHeaderDataLength = PES_header_data_length;
+        header->mPTS_DTS_flags = PTS_DTS_flags;
+        header->mPTS = PTS;
+        header->mDTS = DTS;
+    }
+
+    return OK;
+}
+
+status_t ATSParser::Stream::parsePES(ABitReader *br) {
+    PESHeader header;
+    status_t err = parsePESHeader(br, &header);
+
+    if (err != OK) {
+        return err;
+    }
+
+    unsigned stream_id = header.mStreamID;
+    unsigned PES_packet_length = header.mPacketLength;
+    unsigned PES_header_data_length = header.mHeaderDataLength;
+    unsigned PTS_DTS_flags = header.mPTS_DTS_flags;
+    uint64_t PTS = header.mPTS;
+    uint64_t DTS = header.mDTS;
+
+    if (HasOptionalPESHeader(stream_id)) {
         // ES data follows.
 
         if (PES_packet_length != 0) {
@@ -841,11 +907,49 @@ status_t ATSParser::Stream::parsePES(ABitReader *br) {
 
 status_t ATSParser::Stream::flush() {
     if (mBuffer->size() == 0) {
+        mPESHeaderParsed = false;
         return OK;
     }
 
     ALOGV("flushing stream 0x%04x size = %d", mElementaryPID, mBuffer->size());
 
+    if (mPESHeaderParsed) {
+        mPESHeaderParsed = false;
+
+        if (mPESHeader.mPacketLength != 0) {
+            CHECK_GE(mPESHeader.mPacketLength,
+                     mPESHeader.mHeaderDataLength + 3);
+
+            unsigned dataLength =
+                mPESHeader.mPacketLength - 3 - mPESHeader.mHeaderDataLength;
+
+            if (mBuffer->size() < dataLength) {
+                ALOGE("PES packet does not carry enough data to contain "
+                     "payload. (numBitsLeft = %d, required = %d)",
+                     mBuffer->size() * 8, dataLength * 8);
+
+                mBuffer->setRange(0, 0);
+
+                return ERROR_MALFORMED;
+            }
+
+            mBuffer->setRange(0, dataLength);
+        }
+
+        size_t capacity = mBuffer->capacity();
+
+        onPayloadBuffer(
+                mPESHeader.mPTS_DTS_flags, mPESHeader.mPTS, mPESHeader.mDTS,
+                &mBuffer);
+
+        if (mBuffer == NULL) {
+            mBuffer = new ABuffer(capacity);
+        }
+        mBuffer->setRange(0, 0);
+
+        return OK;
+    }
+
     ABitReader br(mBuffer->data(), mBuffer->size());
 
     status_t err = parsePES(&br);
@@ -855,6 +959,40 @@ status_t ATSParser::Stream::flush() {
     return err;
 }
 
+// Parses the header of the PES packet being assembled as soon as it has
+// been received in full, and drops it from mBuffer so that the payload can
+// later be handed over to the queue without being copied again.
+// Packets not starting with a complete, well formed header are left
+// for parsePES() to deal with.
+void ATSParser::Stream::parsePESHeaderIfComplete() {
+    const uint8_t *data = mBuffer->data();
+    size_t size = mBuffer->size();
+
+    if (size < 9) {
+        return;
+    }
+
+    if (data[0] != 0x00 || data[1] != 0x00 || data[2] != 0x01
+            || !HasOptionalPESHeader(data[3])) {
+        return;
+    }
+
+    size_t headerSize = 9 + data[8];
+    if (size < headerSize) {
+        return;
+    }
+
+    ABitReader br(data, headerSize);
+    if (parsePESHeader(&br, &mPESHeader) != OK) {
+        return;
+    }
+
+    memmove(mBuffer->data(), data + headerSize, size - headerSize);
+    mBuffer->setRange(0, size - headerSize);
+
+    mPESHeaderParsed = true;
+}
+
 void ATSParser::Stream::onPayloadData(
         unsigned PTS_DTS_flags, uint64_t PTS, uint64_t DTS,
         const uint8_t *data, size_t size) {
@@ -879,6 +1017,31 @@ void ATSParser::Stream::onPayloadData(
         return;
     }
 
+    dequeueAccessUnits();
+}
+
+// Same as onPayloadData() for the payload held in "*buffer", which the
+// queue may keep, see ElementaryStreamQueue::appendBuffer().
+void ATSParser::Stream::onPayloadBuffer(
+        unsigned PTS_DTS_flags, uint64_t PTS, uint64_t DTS,
+        sp<ABuffer> *buffer) {
+    ALOGV("onPayloadBuffer mStreamType=0x%02x", mStreamType);
+
+    int64_t timeUs = 0ll;  // no presentation timestamp available.
+    if (PTS_DTS_flags == 2 || PTS_DTS_flags == 3) {
+        timeUs = mProgram->convertPTSToTimestamp(PTS);
+    }
+
+    status_t err = mQueue->appendBuffer(buffer, timeUs);
+
+    if (err != OK) {
+        return;
+    }
+
+    dequeueAccessUnits();
+}
+
+void ATSParser::Stream::dequeueAccessUnits() {
     sp<ABuffer> accessUnit;
     while ((accessUnit = mQueue->dequeueAccessUnit()) != NULL) {
         if (mSource == NULL) {
@@ -939,6 +1102,8 @@ ATSParser::ATSParser(uint32_t flags)
       mNumTSPacketsParsed(0),
       mNumPCRs(0) {
     mPSISections.add(0 /* PID */, new PSISection);
+
+    clearPIDTable();
 }
 
 ATSParser::~ATSParser() {
@@ -947,8 +1112,30 @@ ATSParser::~ATSParser() {
 status_t ATSParser::feedTSPacket(const void *data, size_t size) {
     CHECK_EQ(size, kTSPacketSize);
 
-    ABitReader br((const uint8_t *)data, kTSPacketSize);
-    return parseTS(&br);
+    return parseTS((const uint8_t *)data);
+}
+
+status_t ATSParser::feedTSPackets(const void *data, size_t size) {
+    CHECK_EQ(size % kTSPacketSize, 0u);
+
+    const uint8_t *packet = (const uint8_t *)data;
+    const uint8_t *end = packet + size;
+    while (packet < end) {
+        status_t err = parseTS(packet);
+
+        if (err != OK) {
+            return err;
+        }
+
+        packet += kTSPacketSize;
+    }
+
+    return OK;
+}
+
+void ATSParser::clearPIDTable() {
+    memset(mPIDTypes, PID_UNKNOWN, sizeof(mPIDTypes));
+    memset(mStreamsByPID, 0, sizeof(mStreamsByPID));
 }
 
 void ATSParser::signalDiscontinuity(
@@ -1081,6 +1268,9 @@ status_t ATSParser::parsePID(
 
         ABitReader sectionBits(section->data(), section->size());
 
+        // Tables may add or move streams, look their PIDs up again.
+        clearPIDTable();
+
         if (PID == 0) {
             parseProgramAssociationTable(&sectionBits);
         } else {
@@ -1113,56 +1303,53 @@ status_t ATSParser::parsePID(
         return OK;
     }
 
-    bool handled = false;
     for (size_t i = 0; i < mPrograms.size(); ++i) {
-        status_t err;
-        if (mPrograms.editItemAt(i)->parsePID(
-                    PID, continuity_counter, payload_unit_start_indicator,
-                    br, &err)) {
-            if (err != OK) {
-                return err;
-            }
+        sp<Stream> stream = mPrograms.editItemAt(i)->getStream(PID);
 
-            handled = true;
-            break;
+        if (stream == NULL) {
+            continue;
         }
-    }
 
-    if (!handled) {
-        ALOGV("PID 0x%04x not handled.", PID);
+        // The stream is owned by its program until the next table update,
+        // which clears the PID table.
+        mPIDTypes[PID] = stream->isParsed() ? PID_STREAM : PID_IGNORED;
+        mStreamsByPID[PID] = stream.get();
+
+        return stream->parse(
+                continuity_counter, payload_unit_start_indicator, br);
     }
 
+    ALOGV("PID 0x%04x not handled.", PID);
+    mPIDTypes[PID] = PID_IGNORED;
+
     return OK;
 }
 
-void ATSParser::parseAdaptationField(ABitReader *br, unsigned PID) {
-    unsigned adaptation_field_length = br->getBits(8);
+// Returns the size of the adaptation field starting at "data".
+size_t ATSParser::parseAdaptationField(const uint8_t *data, unsigned PID) {
+    unsigned adaptation_field_length = data[0];
 
     if (adaptation_field_length > 0) {
-        unsigned discontinuity_indicator = br->getBits(1);
+        unsigned discontinuity_indicator = data[1] >> 7;
 
         if (discontinuity_indicator) {
             ALOGV("PID 0x%04x: discontinuity_indicator = 1 (!!!)", PID);
         }
 
-        br->skipBits(2);
-        unsigned PCR_flag = br->getBits(1);
-
-        size_t numBitsRead = 4;
+        unsigned PCR_flag = (data[1] >> 4) & 1;
 
         if (PCR_flag) {
-            br->skipBits(4);
-            uint64_t PCR_base = br->getBits(32);
-            PCR_base = (PCR_base << 1) | br->getBits(1);
+            CHECK_GE(adaptation_field_length, 7u);
+
+            uint64_t PCR_base =
+                ((uint64_t)U32_AT(&data[2]) << 1) | (data[6] >> 7);
 
-            br->skipBits(6);
-            unsigned PCR_ext = br->getBits(9);
+            unsigned PCR_ext = ((data[6] & 1) << 8) | data[7];
 
             // The number of bytes from the start of the current
             // MPEG2 transport stream packet up and including
             // the final byte of this PCR_ext field.
-            size_t byteOffsetFromStartOfTSPacket =
-                (188 - br->numBitsLeft() / 8);
+            size_t byteOffsetFromStartOfTSPacket = 4 + 8;
 
             uint64_t PCR = PCR_base * 300 + PCR_ext;
 
@@ -1177,54 +1364,70 @@ void ATSParser::parseAdaptationField(ABitReader *br, unsigned PID) {
             for (size_t i = 0; i < mPrograms.size(); ++i) {
                 updatePCR(PID, PCR, byteOffsetFromStart);
             }
-
-            numBitsRead += 52;
         }
-
-        CHECK_GE(adaptation_field_length * 8, numBitsRead);
-
-        br->skipBits(adaptation_field_length * 8 - numBitsRead);
     }
+
+    return 1 + adaptation_field_length;
 }
 
-status_t ATSParser::parseTS(ABitReader *br) {
+// The header fields are extracted with plain byte operations, and the PID
+// table lets the payload of known streams go straight to them and that of
+// streams nobody uses be skipped, the (rare) other packets take the
+// slower path through parsePID().
+status_t ATSParser::parseTS(const uint8_t *packet) {
     ALOGV("---");
 
-    unsigned sync_byte = br->getBits(8);
+    unsigned sync_byte = packet[0];
     CHECK_EQ(sync_byte, 0x47u);
 
-    if (br->getBits(1)) {  // transport_error_indicator
+    if (packet[1] & 0x80) {  // transport_error_indicator
         // silently ignore.
         return OK;
     }
 
-    unsigned payload_unit_start_indicator = br->getBits(1);
+    unsigned payload_unit_start_indicator = (packet[1] >> 6) & 1;
     ALOGV("payload_unit_start_indicator = %u", payload_unit_start_indicator);
 
-    MY_LOGV("transport_priority = %u", br->getBits(1));
-
-    unsigned PID = br->getBits(13);
+    unsigned PID = ((packet[1] & 0x1f) << 8) | packet[2];
     ALOGV("PID = 0x%04x", PID);
 
-    MY_LOGV("transport_scrambling_control = %u", br->getBits(2));
-
-    unsigned adaptation_field_control = br->getBits(2);
+    unsigned adaptation_field_control = (packet[3] >> 4) & 3;
     ALOGV("adaptation_field_control = %u", adaptation_field_control);
 
-    unsigned continuity_counter = br->getBits(4);
+    unsigned continuity_counter = packet[3] & 0x0f;
     ALOGV("PID = 0x%04x, continuity_counter = %u", PID, continuity_counter);
 
-    // ALOGI("PID = 0x%04x, continuity_counter = %u", PID, continuity_counter);
+    size_t offset = 4;
 
     if (adaptation_field_control == 2 || adaptation_field_control == 3) {
-        parseAdaptationField(br, PID);
+        offset += parseAdaptationField(&packet[offset], PID);
+        CHECK_LE(offset, kTSPacketSize);
     }
 
     status_t err = OK;
 
     if (adaptation_field_control == 1 || adaptation_field_control == 3) {
-        err = parsePID(
-                br, PID, continuity_counter, payload_unit_start_indicator);
+        switch (mPIDTypes[PID]) {
+            case PID_IGNORED:
+                break;
+
+            case PID_STREAM:
+            {
+                ABitReader br(&packet[offset], kTSPacketSize - offset);
+                err = mStreamsByPID[PID]->parse(
+                        continuity_counter, payload_unit_start_indicator, &br);
+                break;
+            }
+
+            default:
+            {
+                ABitReader br(&packet[offset], kTSPacketSize - offset);
+                err = parsePID(
+                        &br, PID, continuity_counter,
+                        payload_unit_start_indicator);
+                break;
+            }
+        }
     }
 
     ++mNumTSPacketsParsed;
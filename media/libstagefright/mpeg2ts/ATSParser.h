@@ -65,6 +65,12 @@ struct ATSParser : public RefBase {
 
     status_t feedTSPacket(const void *data, size_t size);
 
+    // Same as calling feedTSPacket() for each of the 188 byte packets in
+    // "data", "size" must be a multiple of the packet size.
+    status_t feedTSPackets(const void *data, size_t size);
+
+    // DISCONTINUITY_NONE only drops the partially parsed data, nothing is
+    // queued on the sources.
     void signalDiscontinuity(
             DiscontinuityType type, const sp<AMessage> &extra);
 
@@ -88,6 +94,7 @@ struct ATSParser : public RefBase {
         STREAMTYPE_MPEG2_AUDIO_ADTS     = 0x0f,
         STREAMTYPE_MPEG4_VIDEO          = 0x10,
         STREAMTYPE_H264                 = 0x1b,
+        STREAMTYPE_H265                 = 0x24,
         STREAMTYPE_PCM_AUDIO            = 0x83,
     };
 
@@ -112,6 +119,22 @@ private:
 
     size_t mNumTSPacketsParsed;
 
+    enum {
+        kNumPIDs = 8192,
+    };
+
+    // What to do with the payload of each PID, filled in as packets are
+    // parsed and cleared whenever a table is received.
+    enum PIDType {
+        PID_UNKNOWN,
+        PID_STREAM,     // Handed to mStreamsByPID[PID].
+        PID_IGNORED,    // Payload skipped.
+    };
+    uint8_t mPIDTypes[kNumPIDs];
+    Stream *mStreamsByPID[kNumPIDs];
+
+    void clearPIDTable();
+
     void parseProgramAssociationTable(ABitReader *br);
     void parseProgramMap(ABitReader *br);
     void parsePES(ABitReader *br);
@@ -121,8 +144,8 @@ private:
         unsigned continuity_counter,
         unsigned payload_unit_start_indicator);
 
-    void parseAdaptationField(ABitReader *br, unsigned PID);
-    status_t parseTS(ABitReader *br);
+    size_t parseAdaptationField(const uint8_t *data, unsigned PID);
+    status_t parseTS(const uint8_t *packet);
 
     void updatePCR(unsigned PID, uint64_t PCR, size_t byteOffsetFromStart);
 
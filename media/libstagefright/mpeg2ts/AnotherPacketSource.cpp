@@ -160,13 +160,15 @@ void AnotherPacketSource::queueAccessUnit(const sp<ABuffer> &buffer) {
     mCondition.signal();
 }
 
-void AnotherPacketSource::clear() {
+void AnotherPacketSource::clear(bool clearFormat) {
     Mutex::Autolock autoLock(mLock);
 
     mBuffers.clear();
     mEOSResult = OK;
 
-    mFormat = NULL;
+    if (clearFormat) {
+        mFormat = NULL;
+    }
 }
 
 void AnotherPacketSource::queueDiscontinuity(
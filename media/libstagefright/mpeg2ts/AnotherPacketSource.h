@@ -41,7 +41,9 @@ struct AnotherPacketSource : public MediaSource {
     virtual status_t read(
             MediaBuffer **buffer, const ReadOptions *options = NULL);
 
-    void clear();
+    // Drops all queued buffers and the EOS status, and the format unless
+    // "clearFormat" is false.
+    void clear(bool clearFormat = true);
 
     bool hasBufferAvailable(status_t *finalResult);
 
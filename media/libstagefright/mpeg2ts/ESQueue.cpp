@@ -38,6 +38,14 @@ namespace android {
 ElementaryStreamQueue::ElementaryStreamQueue(Mode mode, uint32_t flags)
     : mMode(mode),
       mFlags(flags) {
+    resetNALScan();
+}
+
+void ElementaryStreamQueue::resetNALScan() {
+    mNALs.clear();
+    mNALScanOffset = 0;
+    mNALTotalSize = 0;
+    mNALFoundSlice = false;
 }
 
 sp<MetaData> ElementaryStreamQueue::getFormat() {
@@ -50,6 +58,7 @@ void ElementaryStreamQueue::clear(bool clearFormat) {
     }
 
     mRangeInfos.clear();
+    resetNALScan();
 
     if (clearFormat) {
         mFormat.clear();
@@ -120,146 +129,110 @@ static bool IsSeeminglyValidMPEGAudioHeader(const uint8_t *ptr, size_t size) {
     return true;
 }
 
-status_t ElementaryStreamQueue::appendData(
-        const void *data, size_t size, int64_t timeUs) {
-    if (mBuffer == NULL || mBuffer->size() == 0) {
-        switch (mMode) {
-            case H264:
-            case MPEG_VIDEO:
-            {
-#if 0
-                if (size < 4 || memcmp("\x00\x00\x00\x01", data, 4)) {
-                    return ERROR_MALFORMED;
-                }
-#else
-                uint8_t *ptr = (uint8_t *)data;
-
-                ssize_t startOffset = -1;
-                for (size_t i = 0; i + 3 < size; ++i) {
-                    if (!memcmp("\x00\x00\x00\x01", &ptr[i], 4)) {
-                        startOffset = i;
-                        break;
-                    }
-                }
+// Returns the offset of the first syncword in "data", which is where the
+// queue starts when it is empty, or -1 if there is none.
+ssize_t ElementaryStreamQueue::findStartOffset(
+        const uint8_t *ptr, size_t size) const {
+    ssize_t startOffset = -1;
 
-                if (startOffset < 0) {
-                    return ERROR_MALFORMED;
-                }
-
-                if (startOffset > 0) {
-                    ALOGI("found something resembling an H.264/MPEG syncword "
-                          "at offset %d",
-                          startOffset);
+    switch (mMode) {
+        case H264:
+        case HEVC:
+        case MPEG_VIDEO:
+        {
+            for (size_t i = 0; i + 3 < size; ++i) {
+                if (!memcmp("\x00\x00\x00\x01", &ptr[i], 4)) {
+                    startOffset = i;
+                    break;
                 }
-
-                data = &ptr[startOffset];
-                size -= startOffset;
-#endif
-                break;
             }
 
-            case MPEG4_VIDEO:
-            {
-#if 0
-                if (size < 3 || memcmp("\x00\x00\x01", data, 3)) {
-                    return ERROR_MALFORMED;
-                }
-#else
-                uint8_t *ptr = (uint8_t *)data;
-
-                ssize_t startOffset = -1;
-                for (size_t i = 0; i + 2 < size; ++i) {
-                    if (!memcmp("\x00\x00\x01", &ptr[i], 3)) {
-                        startOffset = i;
-                        break;
-                    }
-                }
-
-                if (startOffset < 0) {
-                    return ERROR_MALFORMED;
-                }
+            if (startOffset > 0) {
+                ALOGI("found something resembling an H.264/HEVC/MPEG syncword "
+                      "at offset %d",
+                      startOffset);
+            }
+            break;
+        }
 
-                if (startOffset > 0) {
-                    ALOGI("found something resembling an H.264/MPEG syncword "
-                          "at offset %d",
-                          startOffset);
+        case MPEG4_VIDEO:
+        {
+            for (size_t i = 0; i + 2 < size; ++i) {
+                if (!memcmp("\x00\x00\x01", &ptr[i], 3)) {
+                    startOffset = i;
+                    break;
                 }
-
-                data = &ptr[startOffset];
-                size -= startOffset;
-#endif
-                break;
             }
 
-            case AAC:
-            {
-                uint8_t *ptr = (uint8_t *)data;
+            if (startOffset > 0) {
+                ALOGI("found something resembling an H.264/MPEG syncword "
+                      "at offset %d",
+                      startOffset);
+            }
+            break;
+        }
 
-#if 0
-                if (size < 2 || ptr[0] != 0xff || (ptr[1] >> 4) != 0x0f) {
-                    return ERROR_MALFORMED;
-                }
-#else
-                ssize_t startOffset = -1;
-                for (size_t i = 0; i < size; ++i) {
-                    if (IsSeeminglyValidADTSHeader(&ptr[i], size - i)) {
-                        startOffset = i;
-                        break;
-                    }
+        case AAC:
+        {
+            for (size_t i = 0; i < size; ++i) {
+                if (IsSeeminglyValidADTSHeader(&ptr[i], size - i)) {
+                    startOffset = i;
+                    break;
                 }
+            }
 
-                if (startOffset < 0) {
-                    return ERROR_MALFORMED;
-                }
+            if (startOffset > 0) {
+                ALOGI("found something resembling an AAC syncword at "
+                      "offset %d",
+                      startOffset);
+            }
+            break;
+        }
 
-                if (startOffset > 0) {
-                    ALOGI("found something resembling an AAC syncword at "
-                          "offset %d",
-                          startOffset);
+        case MPEG_AUDIO:
+        {
+            for (size_t i = 0; i < size; ++i) {
+                if (IsSeeminglyValidMPEGAudioHeader(&ptr[i], size - i)) {
+                    startOffset = i;
+                    break;
                 }
+            }
 
-                data = &ptr[startOffset];
-                size -= startOffset;
-#endif
-                break;
+            if (startOffset > 0) {
+                ALOGI("found something resembling an MPEG audio "
+                      "syncword at offset %d",
+                      startOffset);
             }
+            break;
+        }
 
-            case MPEG_AUDIO:
-            {
-                uint8_t *ptr = (uint8_t *)data;
-
-                ssize_t startOffset = -1;
-                for (size_t i = 0; i < size; ++i) {
-                    if (IsSeeminglyValidMPEGAudioHeader(&ptr[i], size - i)) {
-                        startOffset = i;
-                        break;
-                    }
-                }
+        case PCM_AUDIO:
+        {
+            startOffset = 0;
+            break;
+        }
 
-                if (startOffset < 0) {
-                    return ERROR_MALFORMED;
-                }
+        default:
+            TRESPASS();
+            break;
+    }
 
-                if (startOffset > 0) {
-                    ALOGI("found something resembling an MPEG audio "
-                          "syncword at offset %d",
-                          startOffset);
-                }
+    return startOffset;
+}
 
-                data = &ptr[startOffset];
-                size -= startOffset;
-                break;
-            }
+status_t ElementaryStreamQueue::appendData(
+        const void *data, size_t size, int64_t timeUs) {
+    if (mBuffer == NULL || mBuffer->size() == 0) {
+        resetNALScan();
 
-            case PCM_AUDIO:
-            {
-                break;
-            }
+        ssize_t startOffset = findStartOffset((const uint8_t *)data, size);
 
-            default:
-                TRESPASS();
-                break;
+        if (startOffset < 0) {
+            return ERROR_MALFORMED;
         }
+
+        data = (const uint8_t *)data + startOffset;
+        size -= startOffset;
     }
 
     size_t neededSize = (mBuffer == NULL ? 0 : mBuffer->size()) + size;
@@ -297,6 +270,32 @@ status_t ElementaryStreamQueue::appendData(
     return OK;
 }
 
+status_t ElementaryStreamQueue::appendBuffer(
+        sp<ABuffer> *buffer, int64_t timeUs) {
+    const sp<ABuffer> &data = *buffer;
+
+    if ((mBuffer != NULL && mBuffer->size() > 0)
+            || data->offset() != 0
+            || findStartOffset(data->data(), data->size()) != 0) {
+        return appendData(data->data(), data->size(), timeUs);
+    }
+
+    // The queue is empty and the data starts at a syncword, which is where
+    // appendData() would have copied it to: use the buffer as is.
+    resetNALScan();
+
+    sp<ABuffer> empty = mBuffer;
+    mBuffer = data;
+    *buffer = empty;
+
+    RangeInfo info;
+    info.mLength = mBuffer->size();
+    info.mTimestampUs = timeUs;
+    mRangeInfos.push_back(info);
+
+    return OK;
+}
+
 sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnit() {
     if ((mFlags & kFlag_AlignedData) && mMode == H264) {
         if (mRangeInfos.empty()) {
@@ -326,6 +325,8 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnit() {
     switch (mMode) {
         case H264:
             return dequeueAccessUnitH264();
+        case HEVC:
+            return dequeueAccessUnitHEVC();
         case AAC:
             return dequeueAccessUnitAAC();
         case MPEG_VIDEO:
@@ -526,24 +527,78 @@ int64_t ElementaryStreamQueue::fetchTimestamp(size_t size) {
     return timeUs;
 }
 
-struct NALPosition {
-    size_t nalOffset;
-    size_t nalSize;
-};
+// Returns the access unit made of the NAL units in mNALs, separated by
+// 0x00 0x00 0x00 0x01 startcodes, and removes them from mBuffer.
+sp<ABuffer> ElementaryStreamQueue::dequeueNALAccessUnit() {
+    size_t auSize = 4 * mNALs.size() + mNALTotalSize;
+    sp<ABuffer> accessUnit = new ABuffer(auSize);
 
-sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitH264() {
-    const uint8_t *data = mBuffer->data();
+#if !LOG_NDEBUG
+    AString out;
+#endif
 
-    size_t size = mBuffer->size();
-    Vector<NALPosition> nals;
+    size_t dstOffset = 0;
+    for (size_t i = 0; i < mNALs.size(); ++i) {
+        const NALPosition &pos = mNALs.itemAt(i);
 
-    size_t totalSize = 0;
+#if !LOG_NDEBUG
+        char tmp[128];
+        sprintf(tmp, "0x%02x", mBuffer->data()[pos.nalOffset]);
+        if (i > 0) {
+            out.append(", ");
+        }
+        out.append(tmp);
+#endif
+
+        memcpy(accessUnit->data() + dstOffset, "\x00\x00\x00\x01", 4);
+
+        memcpy(accessUnit->data() + dstOffset + 4,
+               mBuffer->data() + pos.nalOffset,
+               pos.nalSize);
+
+        dstOffset += pos.nalSize + 4;
+    }
+
+    ALOGV("accessUnit contains nal headers %s", out.c_str());
+
+    const NALPosition &pos = mNALs.itemAt(mNALs.size() - 1);
+    size_t nextScan = pos.nalOffset + pos.nalSize;
+
+    memmove(mBuffer->data(),
+            mBuffer->data() + nextScan,
+            mBuffer->size() - nextScan);
+
+    mBuffer->setRange(0, mBuffer->size() - nextScan);
+
+    // The NAL unit that started the next access unit is scanned again by
+    // the next call.
+    resetNALScan();
+
+    int64_t timeUs = fetchTimestamp(nextScan);
+    CHECK_GE(timeUs, 0ll);
+
+    accessUnit->meta()->setInt64("timeUs", timeUs);
+
+    return accessUnit;
+}
+
+sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitH264() {
+    // Resume scanning after the last complete NAL unit found by a previous
+    // call, its trailing zeros and the following startcode are still in
+    // the buffer.
+    const uint8_t *data = mBuffer->data() + mNALScanOffset;
+    size_t size = mBuffer->size() - mNALScanOffset;
+
+    Vector<NALPosition> &nals = mNALs;
+    size_t &totalSize = mNALTotalSize;
+    bool &foundSlice = mNALFoundSlice;
 
     status_t err;
     const uint8_t *nalStart;
     size_t nalSize;
-    bool foundSlice = false;
     while ((err = getNextNALUnit(&data, &size, &nalStart, &nalSize)) == OK) {
+        mNALScanOffset = nalStart + nalSize - mBuffer->data();
+
         if (nalSize == 0) continue;
 
         unsigned nalType = nalStart[0] & 0x1f;
@@ -570,58 +625,67 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitH264() {
         }
 
         if (flush) {
-            // The access unit will contain all nal units up to, but excluding
-            // the current one, separated by 0x00 0x00 0x00 0x01 startcodes.
+            sp<ABuffer> accessUnit = dequeueNALAccessUnit();
 
-            size_t auSize = 4 * nals.size() + totalSize;
-            sp<ABuffer> accessUnit = new ABuffer(auSize);
-
-#if !LOG_NDEBUG
-            AString out;
-#endif
+            if (mFormat == NULL) {
+                mFormat = MakeAVCCodecSpecificData(accessUnit);
+            }
 
-            size_t dstOffset = 0;
-            for (size_t i = 0; i < nals.size(); ++i) {
-                const NALPosition &pos = nals.itemAt(i);
+            return accessUnit;
+        }
 
-                unsigned nalType = mBuffer->data()[pos.nalOffset] & 0x1f;
+        NALPosition pos;
+        pos.nalOffset = nalStart - mBuffer->data();
+        pos.nalSize = nalSize;
 
-#if !LOG_NDEBUG
-                char tmp[128];
-                sprintf(tmp, "0x%02x", nalType);
-                if (i > 0) {
-                    out.append(", ");
-                }
-                out.append(tmp);
-#endif
+        nals.push(pos);
 
-                memcpy(accessUnit->data() + dstOffset, "\x00\x00\x00\x01", 4);
+        totalSize += nalSize;
+    }
+    CHECK_EQ(err, (status_t)-EAGAIN);
 
-                memcpy(accessUnit->data() + dstOffset + 4,
-                       mBuffer->data() + pos.nalOffset,
-                       pos.nalSize);
+    return NULL;
+}
 
-                dstOffset += pos.nalSize + 4;
-            }
+sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitHEVC() {
+    // Same incremental scan as dequeueAccessUnitH264(), only the rules
+    // that detect the first NAL unit of an access unit differ.
+    const uint8_t *data = mBuffer->data() + mNALScanOffset;
+    size_t size = mBuffer->size() - mNALScanOffset;
 
-            ALOGV("accessUnit contains nal types %s", out.c_str());
+    status_t err;
+    const uint8_t *nalStart;
+    size_t nalSize;
+    while ((err = getNextNALUnit(&data, &size, &nalStart, &nalSize)) == OK) {
+        mNALScanOffset = nalStart + nalSize - mBuffer->data();
 
-            const NALPosition &pos = nals.itemAt(nals.size() - 1);
-            size_t nextScan = pos.nalOffset + pos.nalSize;
+        if (nalSize < 2) continue;
 
-            memmove(mBuffer->data(),
-                    mBuffer->data() + nextScan,
-                    mBuffer->size() - nextScan);
+        unsigned nalType = (nalStart[0] >> 1) & 0x3f;
+        bool flush = false;
 
-            mBuffer->setRange(0, mBuffer->size() - nextScan);
+        if (nalType < 32) {
+            // VCL NAL unit, first_slice_segment_in_pic_flag starts a new
+            // picture.
+            if (mNALFoundSlice && nalSize >= 3 && (nalStart[2] & 0x80)) {
+                flush = true;
+            }
 
-            int64_t timeUs = fetchTimestamp(nextScan);
-            CHECK_GE(timeUs, 0ll);
+            mNALFoundSlice = true;
+        } else if (mNALFoundSlice
+                && ((nalType >= 32 && nalType <= 35)  // VPS, SPS, PPS, AUD
+                    || nalType == 39                  // prefix SEI
+                    || (nalType >= 41 && nalType <= 44)
+                    || (nalType >= 48 && nalType <= 55))) {
+            // These are associated with the next picture.
+            flush = true;
+        }
 
-            accessUnit->meta()->setInt64("timeUs", timeUs);
+        if (flush) {
+            sp<ABuffer> accessUnit = dequeueNALAccessUnit();
 
             if (mFormat == NULL) {
-                mFormat = MakeAVCCodecSpecificData(accessUnit);
+                mFormat = MakeHEVCCodecSpecificData(accessUnit);
             }
 
             return accessUnit;
@@ -631,9 +695,9 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitH264() {
         pos.nalOffset = nalStart - mBuffer->data();
         pos.nalSize = nalSize;
 
-        nals.push(pos);
+        mNALs.push(pos);
 
-        totalSize += nalSize;
+        mNALTotalSize += nalSize;
     }
     CHECK_EQ(err, (status_t)-EAGAIN);
 
@@ -755,7 +819,12 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitMPEGVideo() {
     size_t offset = 0;
     while (offset + 3 < size) {
         if (memcmp(&data[offset], "\x00\x00\x01", 3)) {
-            ++offset;
+            ssize_t next = findNextStartCode(data, size, offset);
+            if (next < 0) {
+                break;
+            }
+
+            offset = next;
             continue;
         }
 
@@ -862,16 +931,9 @@ static ssize_t getNextChunkSize(
         TRESPASS();
     }
 
-    size_t offset = 3;
-    while (offset + 2 < size) {
-        if (!memcmp(&data[offset], kStartCode, 3)) {
-            return offset;
-        }
-
-        ++offset;
-    }
+    ssize_t offset = findNextStartCode(data, size, 3);
 
-    return -EAGAIN;
+    return offset < 0 ? -EAGAIN : offset;
 }
 
 sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitMPEG4Video() {
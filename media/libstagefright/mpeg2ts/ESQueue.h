@@ -22,6 +22,7 @@
 #include <utils/Errors.h>
 #include <utils/List.h>
 #include <utils/RefBase.h>
+#include <utils/Vector.h>
 
 namespace android {
 
@@ -31,6 +32,7 @@ struct MetaData;
 struct ElementaryStreamQueue {
     enum Mode {
         H264,
+        HEVC,
         AAC,
         MPEG_AUDIO,
         MPEG_VIDEO,
@@ -45,6 +47,12 @@ struct ElementaryStreamQueue {
     ElementaryStreamQueue(Mode mode, uint32_t flags = 0);
 
     status_t appendData(const void *data, size_t size, int64_t timeUs);
+
+    // Same as appendData() for the content of "*buffer", except that an
+    // empty queue may take "*buffer" itself instead of copying its content.
+    // In that case "*buffer" is replaced by the empty buffer previously
+    // used by the queue, possibly NULL, which the caller may reuse.
+    status_t appendBuffer(sp<ABuffer> *buffer, int64_t timeUs);
     void clear(bool clearFormat);
 
     sp<ABuffer> dequeueAccessUnit();
@@ -57,6 +65,11 @@ private:
         size_t mLength;
     };
 
+    struct NALPosition {
+        size_t nalOffset;
+        size_t nalSize;
+    };
+
     Mode mMode;
     uint32_t mFlags;
 
@@ -65,7 +78,21 @@ private:
 
     sp<MetaData> mFormat;
 
+    // State of dequeueAccessUnitH264() and dequeueAccessUnitHEVC() between
+    // calls, so that the NAL units already found in mBuffer are not scanned
+    // again as more data arrives.
+    Vector<NALPosition> mNALs;
+    size_t mNALScanOffset;
+    size_t mNALTotalSize;
+    bool mNALFoundSlice;
+
+    void resetNALScan();
+
+    ssize_t findStartOffset(const uint8_t *data, size_t size) const;
+
+    sp<ABuffer> dequeueNALAccessUnit();
     sp<ABuffer> dequeueAccessUnitH264();
+    sp<ABuffer> dequeueAccessUnitHEVC();
     sp<ABuffer> dequeueAccessUnitAAC();
     sp<ABuffer> dequeueAccessUnitMPEGAudio();
     sp<ABuffer> dequeueAccessUnitMPEGVideo();
@@ -19,6 +19,7 @@
 #include <utils/Log.h>
 
 #include "include/MPEG2PSExtractor.h"
+#include "include/avc_utils.h"
 
 #include "AnotherPacketSource.h"
 #include "ESQueue.h"
@@ -29,6 +30,7 @@
 #include <media/stagefright/foundation/AMessage.h>
 #include <media/stagefright/foundation/hexdump.h>
 #include <media/stagefright/DataSource.h>
+#include <media/stagefright/MediaBuffer.h>
 #include <media/stagefright/MediaDefs.h>
 #include <media/stagefright/MediaErrors.h>
 #include <media/stagefright/MediaSource.h>
@@ -38,6 +40,47 @@
 
 namespace android {
 
+// Minimum distance between two entries of the seek index.
+static const int64_t kSeekIndexIntervalUs = 1000000ll;
+
+// Bisection stops once the range containing the target is this small.
+static const off64_t kSeekBisectThreshold = 256 * 1024;
+
+// Unless seeking to the next sync frame, reading resumes this much before
+// the target, so that the first IDR picture decoded precedes it in most
+// streams.
+static const int64_t kSeekPreRollUs = 1000000ll;
+
+// After a seek, AVC access units are dropped until one decoding can start
+// from, but not beyond this much past the position reading resumed at, i.e.
+// the pre-roll plus one long GOP, in case there is no such access unit.
+static const int64_t kMaxSkipToRandomAccessUs = kSeekPreRollUs + 2000000ll;
+
+// How much data findPack_l() reads at a time, and at most.
+static const size_t kPackScanChunkSize = 64 * 1024;
+static const off64_t kMaxPackScanSize = 1024 * 1024;
+
+// Returns the 90kHz base of the SCR in the MPEG-2 pack header at "pack",
+// which must be at least 10 bytes long.
+static bool ParseSCR(const uint8_t *pack, uint64_t *SCR) {
+    if (memcmp("\x00\x00\x01\xba", pack, 4)
+            || (pack[4] & 0xc4) != 0x44
+            || !(pack[6] & 0x04)
+            || !(pack[8] & 0x04)) {
+        return false;
+    }
+
+    *SCR = ((uint64_t)((pack[4] >> 3) & 7) << 30)
+        | ((uint64_t)(pack[4] & 3) << 28)
+        | ((uint64_t)pack[5] << 20)
+        | ((uint64_t)(pack[6] >> 3) << 15)
+        | ((uint64_t)(pack[6] & 3) << 13)
+        | ((uint64_t)pack[7] << 5)
+        | (pack[8] >> 3);
+
+    return true;
+}
+
 struct MPEG2PSExtractor::Track : public MediaSource {
     Track(MPEG2PSExtractor *extractor,
           unsigned stream_id, unsigned stream_type);
@@ -67,11 +110,15 @@ private:
             uint64_t PTS, uint64_t DTS,
             const uint8_t *data, size_t size);
 
+    void signalSeek();
+
     DISALLOW_EVIL_CONSTRUCTORS(Track);
 };
 
 struct MPEG2PSExtractor::WrappedTrack : public MediaSource {
-    WrappedTrack(const sp<MPEG2PSExtractor> &extractor, const sp<Track> &track);
+    WrappedTrack(
+            const sp<MPEG2PSExtractor> &extractor, const sp<Track> &track,
+            bool seekable);
 
     virtual status_t start(MetaData *params);
     virtual status_t stop();
@@ -87,6 +134,16 @@ private:
     sp<MPEG2PSExtractor> mExtractor;
     sp<MPEG2PSExtractor::Track> mTrack;
 
+    // As in MPEG2TSExtractor, if there are other tracks only the video
+    // tracks seek, the others just follow.
+    bool mSeekable;
+
+    // After a seek an AVC stream resumes at an arbitrary picture, the
+    // access units before the first random access point, or before
+    // mSkipLimitUs, are dropped.
+    bool mSkipToRandomAccess;
+    int64_t mSkipLimitUs;
+
     DISALLOW_EVIL_CONSTRUCTORS(WrappedTrack);
 };
 
@@ -98,7 +155,16 @@ MPEG2PSExtractor::MPEG2PSExtractor(const sp<DataSource> &source)
       mFinalResult(OK),
       mBuffer(new ABuffer(0)),
       mScanning(true),
-      mProgramStreamMapValid(false) {
+      mProgramStreamMapValid(false),
+      mSeekIndexEnd(0),
+      mSeekIndexGap(false),
+      mFileSize(-1) {
+    off64_t size;
+    if (!(mDataSource->flags() & DataSource::kIsCachingDataSource)
+            && mDataSource->getSize(&size) == OK) {
+        mFileSize = size;
+    }
+
     for (size_t i = 0; i < 500; ++i) {
         if (feedMore() != OK) {
             break;
@@ -127,7 +193,18 @@ sp<MediaSource> MPEG2PSExtractor::getTrack(size_t index) {
         return NULL;
     }
 
-    return new WrappedTrack(this, mTracks.valueAt(index));
+    bool seekable = true;
+    if (mTracks.size() > 1) {
+        sp<MetaData> meta = mTracks.valueAt(index)->getFormat();
+        const char *mime;
+        CHECK(meta->findCString(kKeyMIMEType, &mime));
+
+        if (!strncasecmp("audio/", mime, 6)) {
+            seekable = false;
+        }
+    }
+
+    return new WrappedTrack(this, mTracks.valueAt(index), seekable);
 }
 
 sp<MetaData> MPEG2PSExtractor::getTrackMetaData(size_t index, uint32_t flags) {
@@ -146,7 +223,156 @@ sp<MetaData> MPEG2PSExtractor::getMetaData() {
 }
 
 uint32_t MPEG2PSExtractor::flags() const {
-    return CAN_PAUSE;
+    uint32_t flags = CAN_PAUSE;
+
+    if (isSeekable()) {
+        flags |= CAN_SEEK_BACKWARD | CAN_SEEK_FORWARD | CAN_SEEK;
+    }
+
+    return flags;
+}
+
+bool MPEG2PSExtractor::isSeekable() const {
+    return mFileSize > 0 && !mSeekIndex.isEmpty();
+}
+
+void MPEG2PSExtractor::addSeekPoint_l(off64_t offset, const uint8_t *pack) {
+    if (!mSeekIndex.isEmpty() && offset <= mSeekIndex.top().mOffset) {
+        if (offset == mSeekIndex.top().mOffset) {
+            // Reading on from the last point leaves no gap after it.
+            mSeekIndexGap = false;
+        }
+        return;
+    }
+
+    uint64_t SCR;
+    if (!ParseSCR(pack, &SCR)) {
+        return;
+    }
+
+    // Same time base as the access units, see Track::appendPESData().
+    int64_t timeUs = (SCR * 100) / 9;
+
+    if (mSeekIndex.isEmpty()
+            || timeUs >= mSeekIndex.top().mTimeUs + kSeekIndexIntervalUs) {
+        SeekPoint point;
+        point.mTimeUs = timeUs;
+        point.mOffset = offset;
+        point.mAfterGap = mSeekIndexGap;
+        mSeekIndex.push(point);
+
+        mSeekIndexGap = false;
+    }
+}
+
+// Finds the first pack header at or after "offset" and before "limit",
+// giving up after kMaxPackScanSize bytes.
+status_t MPEG2PSExtractor::findPack_l(
+        off64_t offset, off64_t limit, off64_t *packOffset, int64_t *timeUs) {
+    static const size_t kPackHeaderSize = 10;
+
+    sp<ABuffer> buffer = new ABuffer(kPackScanChunkSize);
+
+    off64_t end = offset + kMaxPackScanSize;
+    if (end > limit) {
+        end = limit;
+    }
+
+    while (offset + (off64_t)kPackHeaderSize <= end) {
+        size_t size = kPackScanChunkSize;
+        if (offset + (off64_t)size > end) {
+            size = end - offset;
+        }
+
+        ssize_t n = mDataSource->readAt(offset, buffer->data(), size);
+        if (n < (ssize_t)kPackHeaderSize) {
+            return (n < 0) ? (status_t)n : ERROR_END_OF_STREAM;
+        }
+
+        const uint8_t *data = buffer->data();
+        const uint8_t *ptr = data;
+        // Last position of a start code's 0xba that leaves room for
+        // the rest of the header.
+        const uint8_t *last = data + n - (kPackHeaderSize - 3);
+        while (ptr <= last) {
+            ptr = (const uint8_t *)memchr(ptr, 0xba, last - ptr + 1);
+            if (ptr == NULL) {
+                break;
+            }
+
+            uint64_t SCR;
+            if (ptr >= data + 3 && ParseSCR(ptr - 3, &SCR)) {
+                *packOffset = offset + (ptr - 3 - data);
+                *timeUs = (SCR * 100) / 9;
+                return OK;
+            }
+
+            ++ptr;
+        }
+
+        // The next read overlaps this one by the size of a pack header
+        // less one byte, so headers straddling both aren't missed.
+        offset += n - kPackHeaderSize + 1;
+    }
+
+    return ERROR_END_OF_STREAM;
+}
+
+status_t MPEG2PSExtractor::seekTo(int64_t seekTimeUs) {
+    Mutex::Autolock autoLock(mLock);
+
+    if (!isSeekable()) {
+        return ERROR_UNSUPPORTED;
+    }
+
+    // Find the last seek point at or before the target.
+    size_t lo = 0;
+    size_t hi = mSeekIndex.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (mSeekIndex.itemAt(mid).mTimeUs <= seekTimeUs) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const SeekPoint &start = mSeekIndex.itemAt(lo > 0 ? lo - 1 : 0);
+    off64_t offset = start.mOffset;
+    int64_t timeUs = start.mTimeUs;
+
+    if (lo == mSeekIndex.size() || mSeekIndex.itemAt(lo).mAfterGap) {
+        // The target may be in a part of the file not indexed yet, bisect
+        // on the SCRs in it.
+        off64_t high =
+            lo < mSeekIndex.size() ? mSeekIndex.itemAt(lo).mOffset : mFileSize;
+        while (high - offset > kSeekBisectThreshold) {
+            off64_t mid = offset + (high - offset) / 2;
+
+            off64_t packOffset;
+            int64_t packTimeUs;
+            if (findPack_l(mid, high, &packOffset, &packTimeUs) != OK
+                    || packTimeUs > seekTimeUs) {
+                high = mid;
+            } else {
+                offset = packOffset;
+                timeUs = packTimeUs;
+            }
+        }
+    }
+
+    ALOGV("seeking to %lld us, resuming at offset %lld (%lld us)",
+          seekTimeUs, offset, timeUs);
+
+    mOffset = offset;
+    mBuffer->setRange(0, 0);
+    mFinalResult = OK;
+
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        mTracks.editValueAt(i)->signalSeek();
+    }
+
+    return OK;
 }
 
 status_t MPEG2PSExtractor::feedMore() {
@@ -200,6 +426,9 @@ status_t MPEG2PSExtractor::dequeueChunk() {
 
     unsigned chunkType = mBuffer->data()[3];
 
+    // mBuffer holds the data up to mOffset that hasn't been parsed yet.
+    off64_t chunkOffset = mOffset - mBuffer->size();
+
     ssize_t res;
 
     switch (chunkType) {
@@ -227,6 +456,15 @@ status_t MPEG2PSExtractor::dequeueChunk() {
             return -EAGAIN;
         }
 
+        if (chunkOffset != mSeekIndexEnd) {
+            mSeekIndexGap = true;
+        }
+        mSeekIndexEnd = chunkOffset + res;
+
+        if (chunkType == 0xba && res >= 10) {
+            addSeekPoint_l(chunkOffset, mBuffer->data());
+        }
+
         mBuffer->setRange(mBuffer->offset() + res, mBuffer->size() - res);
         res = OK;
     }
@@ -543,6 +781,9 @@ MPEG2PSExtractor::Track::Track(
         case ATSParser::STREAMTYPE_H264:
             mode = ElementaryStreamQueue::H264;
             break;
+        case ATSParser::STREAMTYPE_H265:
+            mode = ElementaryStreamQueue::HEVC;
+            break;
         case ATSParser::STREAMTYPE_MPEG2_AUDIO_ADTS:
             mode = ElementaryStreamQueue::AAC;
             break;
@@ -663,12 +904,27 @@ status_t MPEG2PSExtractor::Track::appendPESData(
     return OK;
 }
 
+// Drops the data queued before a seek, keeping the format.
+void MPEG2PSExtractor::Track::signalSeek() {
+    if (mQueue != NULL) {
+        mQueue->clear(false /* clearFormat */);
+    }
+
+    if (mSource != NULL) {
+        mSource->clear(false /* clearFormat */);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 MPEG2PSExtractor::WrappedTrack::WrappedTrack(
-        const sp<MPEG2PSExtractor> &extractor, const sp<Track> &track)
+        const sp<MPEG2PSExtractor> &extractor, const sp<Track> &track,
+        bool seekable)
     : mExtractor(extractor),
-      mTrack(track) {
+      mTrack(track),
+      mSeekable(seekable),
+      mSkipToRandomAccess(false),
+      mSkipLimitUs(0) {
 }
 
 MPEG2PSExtractor::WrappedTrack::~WrappedTrack() {
@@ -688,7 +944,56 @@ sp<MetaData> MPEG2PSExtractor::WrappedTrack::getFormat() {
 
 status_t MPEG2PSExtractor::WrappedTrack::read(
         MediaBuffer **buffer, const ReadOptions *options) {
-    return mTrack->read(buffer, options);
+    int64_t seekTimeUs;
+    ReadOptions::SeekMode seekMode;
+    if (mSeekable && options && options->getSeekTo(&seekTimeUs, &seekMode)) {
+        const char *mime;
+        sp<MetaData> meta = mTrack->getFormat();
+        bool isAVC = meta != NULL
+            && meta->findCString(kKeyMIMEType, &mime)
+            && !strcasecmp(mime, MEDIA_MIMETYPE_VIDEO_AVC);
+
+        if (isAVC && seekMode != ReadOptions::SEEK_NEXT_SYNC) {
+            seekTimeUs -= kSeekPreRollUs;
+        }
+
+        status_t err = mExtractor->seekTo(seekTimeUs);
+        if (err != OK) {
+            *buffer = NULL;
+            return err;
+        }
+
+        mSkipToRandomAccess = isAVC;
+        mSkipLimitUs = seekTimeUs + kMaxSkipToRandomAccessUs;
+    }
+
+    for (;;) {
+        status_t err = mTrack->read(buffer, options);
+        if (err != OK || !mSkipToRandomAccess) {
+            return err;
+        }
+
+        sp<ABuffer> accessUnit = new ABuffer(
+                (uint8_t *)(*buffer)->data() + (*buffer)->range_offset(),
+                (*buffer)->range_length());
+
+        if (IsAVCRandomAccessPoint(accessUnit)) {
+            mSkipToRandomAccess = false;
+            return OK;
+        }
+
+        int64_t timeUs = -1;
+        if (!(*buffer)->meta_data()->findInt64(kKeyTime, &timeUs)
+                || timeUs >= mSkipLimitUs) {
+            ALOGW("no random access point found after seeking, "
+                  "resuming at %lld us", timeUs);
+            mSkipToRandomAccess = false;
+            return OK;
+        }
+
+        (*buffer)->release();
+        *buffer = NULL;
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -20,9 +20,12 @@
 
 #include "include/MPEG2TSExtractor.h"
 #include "include/NuCachedSource2.h"
+#include "include/avc_utils.h"
 
+#include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/DataSource.h>
+#include <media/stagefright/MediaBuffer.h>
 #include <media/stagefright/MediaDefs.h>
 #include <media/stagefright/MediaErrors.h>
 #include <media/stagefright/MediaSource.h>
@@ -36,6 +39,50 @@ namespace android {
 
 static const size_t kTSPacketSize = 188;
 
+// Minimum distance between two entries of the seek index.
+static const int64_t kSeekIndexIntervalUs = 1000000ll;
+
+// Bisection stops once the range containing the target is this small.
+static const off64_t kSeekBisectThreshold = kTSPacketSize * 1024;
+
+// Unless seeking to the next sync frame, reading resumes this much before
+// the target, so that the first IDR picture decoded precedes it in most
+// streams.
+static const int64_t kSeekPreRollUs = 1000000ll;
+
+// After a seek, AVC access units are dropped until one decoding can start
+// from, but not beyond this much past the position reading resumed at, i.e.
+// the pre-roll plus one long GOP, in case there is no such access unit.
+static const int64_t kMaxSkipToRandomAccessUs = kSeekPreRollUs + 2000000ll;
+
+// How much data findPCR_l() reads at a time, and at most.
+static const size_t kPCRScanChunkSize = kTSPacketSize * 256;
+static const off64_t kMaxPCRScanSize = kTSPacketSize * 8192;
+
+// Returns the 90kHz base of the PCR in "packet", if it has one.
+static bool ParsePCR(const uint8_t *packet, unsigned *PID, uint64_t *PCR) {
+    if (packet[0] != 0x47) {
+        return false;
+    }
+
+    unsigned adaptation_field_control = (packet[3] >> 4) & 3;
+    if (!(adaptation_field_control & 2)
+            || packet[4] < 7            // adaptation_field_length
+            || !(packet[5] & 0x10)) {   // PCR_flag
+        return false;
+    }
+
+    *PID = ((packet[1] & 0x1f) << 8) | packet[2];
+
+    *PCR = ((uint64_t)packet[6] << 25)
+        | ((uint64_t)packet[7] << 17)
+        | ((uint64_t)packet[8] << 9)
+        | ((uint64_t)packet[9] << 1)
+        | (packet[10] >> 7);
+
+    return true;
+}
+
 struct MPEG2TSSource : public MediaSource {
     MPEG2TSSource(
             const sp<MPEG2TSExtractor> &extractor,
@@ -57,6 +104,12 @@ private:
     // will be seekable, otherwise the single stream will be seekable.
     bool mSeekable;
 
+    // After a seek an AVC stream resumes at an arbitrary picture, the
+    // access units before the first random access point, or before
+    // mSkipLimitUs, are dropped.
+    bool mSkipToRandomAccess;
+    int64_t mSkipLimitUs;
+
     DISALLOW_EVIL_CONSTRUCTORS(MPEG2TSSource);
 };
 
@@ -66,7 +119,9 @@ MPEG2TSSource::MPEG2TSSource(
         bool seekable)
     : mExtractor(extractor),
       mImpl(impl),
-      mSeekable(seekable) {
+      mSeekable(seekable),
+      mSkipToRandomAccess(false),
+      mSkipLimitUs(0) {
 }
 
 status_t MPEG2TSSource::start(MetaData *params) {
@@ -88,22 +143,65 @@ status_t MPEG2TSSource::read(
     int64_t seekTimeUs;
     ReadOptions::SeekMode seekMode;
     if (mSeekable && options && options->getSeekTo(&seekTimeUs, &seekMode)) {
-        return ERROR_UNSUPPORTED;
-    }
+        const char *mime;
+        sp<MetaData> meta = mImpl->getFormat();
+        bool isAVC = meta != NULL
+            && meta->findCString(kKeyMIMEType, &mime)
+            && !strcasecmp(mime, MEDIA_MIMETYPE_VIDEO_AVC);
 
-    status_t finalResult;
-    while (!mImpl->hasBufferAvailable(&finalResult)) {
-        if (finalResult != OK) {
-            return ERROR_END_OF_STREAM;
+        if (isAVC && seekMode != ReadOptions::SEEK_NEXT_SYNC) {
+            seekTimeUs -= kSeekPreRollUs;
         }
 
-        status_t err = mExtractor->feedMore();
+        status_t err = mExtractor->seekTo(seekTimeUs);
         if (err != OK) {
-            mImpl->signalEOS(err);
+            return err;
         }
+
+        mSkipToRandomAccess = isAVC;
+        mSkipLimitUs = seekTimeUs + kMaxSkipToRandomAccessUs;
     }
 
-    return mImpl->read(out, options);
+    for (;;) {
+        status_t finalResult;
+        while (!mImpl->hasBufferAvailable(&finalResult)) {
+            if (finalResult != OK) {
+                return ERROR_END_OF_STREAM;
+            }
+
+            status_t err = mExtractor->feedMore();
+            if (err != OK) {
+                mImpl->signalEOS(err);
+            }
+        }
+
+        status_t err = mImpl->read(out, options);
+        if (err != OK || !mSkipToRandomAccess) {
+            return err;
+        }
+
+        MediaBuffer *buffer = *out;
+        sp<ABuffer> accessUnit = new ABuffer(
+                (uint8_t *)buffer->data() + buffer->range_offset(),
+                buffer->range_length());
+
+        if (IsAVCRandomAccessPoint(accessUnit)) {
+            mSkipToRandomAccess = false;
+            return OK;
+        }
+
+        int64_t timeUs = -1;
+        if (!buffer->meta_data()->findInt64(kKeyTime, &timeUs)
+                || timeUs >= mSkipLimitUs) {
+            ALOGW("no random access point found after seeking, "
+                  "resuming at %lld us", timeUs);
+            mSkipToRandomAccess = false;
+            return OK;
+        }
+
+        buffer->release();
+        *out = NULL;
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -111,7 +209,18 @@ status_t MPEG2TSSource::read(
 MPEG2TSExtractor::MPEG2TSExtractor(const sp<DataSource> &source)
     : mDataSource(source),
       mParser(new ATSParser),
-      mOffset(0) {
+      mOffset(0),
+      mSeekIndexEnd(0),
+      mSeekIndexGap(false),
+      mPCRPID(-1),
+      mFirstPCR(0),
+      mFileSize(-1) {
+    off64_t size;
+    if (!(mDataSource->flags() & DataSource::kIsCachingDataSource)
+            && mDataSource->getSize(&size) == OK) {
+        mFileSize = size;
+    }
+
     init();
 }
 
@@ -191,6 +300,11 @@ void MPEG2TSExtractor::init() {
     }
 
     ALOGI("haveAudio=%d, haveVideo=%d", haveAudio, haveVideo);
+
+    if (isSeekable()) {
+        Mutex::Autolock autoLock(mLock);
+        estimateDuration_l();
+    }
 }
 
 status_t MPEG2TSExtractor::feedMore() {
@@ -203,12 +317,208 @@ status_t MPEG2TSExtractor::feedMore() {
         return (n < 0) ? (status_t)n : ERROR_END_OF_STREAM;
     }
 
+    addSeekPoint_l(packet, mOffset);
+
     mOffset += n;
     return mParser->feedTSPacket(packet, kTSPacketSize);
 }
 
 uint32_t MPEG2TSExtractor::flags() const {
-    return CAN_PAUSE;
+    uint32_t flags = CAN_PAUSE;
+
+    if (isSeekable()) {
+        flags |= CAN_SEEK_BACKWARD | CAN_SEEK_FORWARD | CAN_SEEK;
+    }
+
+    return flags;
+}
+
+bool MPEG2TSExtractor::isSeekable() const {
+    return mFileSize > 0 && mPCRPID >= 0;
+}
+
+// Converts a PCR to media time, relative to the first PCR like the
+// timestamps of the access units are relative to the first PTS.
+int64_t MPEG2TSExtractor::getPCRTimeUs(uint64_t PCR) const {
+    return (((PCR - mFirstPCR) & ((1ull << 33) - 1)) * 100) / 9;
+}
+
+void MPEG2TSExtractor::addSeekPoint_l(const uint8_t *packet, off64_t offset) {
+    if (offset != mSeekIndexEnd) {
+        mSeekIndexGap = true;
+    }
+    mSeekIndexEnd = offset + kTSPacketSize;
+
+    if (!mSeekIndex.isEmpty() && offset <= mSeekIndex.top().mOffset) {
+        if (offset == mSeekIndex.top().mOffset) {
+            // Reading on from the last point leaves no gap after it.
+            mSeekIndexGap = false;
+        }
+        return;
+    }
+
+    unsigned PID;
+    uint64_t PCR;
+    if (!ParsePCR(packet, &PID, &PCR)) {
+        return;
+    }
+
+    if (mPCRPID < 0) {
+        ALOGV("using PCRs on PID 0x%04x for seeking", PID);
+
+        mPCRPID = PID;
+        mFirstPCR = PCR;
+    } else if (PID != (unsigned)mPCRPID) {
+        return;
+    }
+
+    int64_t timeUs = getPCRTimeUs(PCR);
+
+    if (mSeekIndex.isEmpty()
+            || timeUs >= mSeekIndex.top().mTimeUs + kSeekIndexIntervalUs) {
+        SeekPoint point;
+        point.mTimeUs = timeUs;
+        point.mOffset = offset;
+        point.mAfterGap = mSeekIndexGap;
+        mSeekIndex.push(point);
+
+        mSeekIndexGap = false;
+    }
+}
+
+// Finds the first packet at or after "offset" and before "limit" carrying
+// a PCR on mPCRPID, giving up after kMaxPCRScanSize bytes.
+status_t MPEG2TSExtractor::findPCR_l(
+        off64_t offset, off64_t limit, off64_t *pcrOffset, int64_t *timeUs) {
+    sp<ABuffer> buffer = new ABuffer(kPCRScanChunkSize);
+
+    off64_t end = offset + kMaxPCRScanSize;
+    if (end > limit) {
+        end = limit;
+    }
+
+    while (offset + (off64_t)kTSPacketSize <= end) {
+        size_t size = kPCRScanChunkSize;
+        if (offset + (off64_t)size > end) {
+            size = ((end - offset) / kTSPacketSize) * kTSPacketSize;
+        }
+
+        ssize_t n = mDataSource->readAt(offset, buffer->data(), size);
+        if (n < (ssize_t)kTSPacketSize) {
+            return (n < 0) ? (status_t)n : ERROR_END_OF_STREAM;
+        }
+
+        for (ssize_t i = 0; i + (ssize_t)kTSPacketSize <= n;
+                i += kTSPacketSize) {
+            unsigned PID;
+            uint64_t PCR;
+            if (ParsePCR(buffer->data() + i, &PID, &PCR)
+                    && PID == (unsigned)mPCRPID) {
+                *pcrOffset = offset + i;
+                *timeUs = getPCRTimeUs(PCR);
+                return OK;
+            }
+        }
+
+        offset += (n / kTSPacketSize) * kTSPacketSize;
+    }
+
+    return ERROR_END_OF_STREAM;
+}
+
+// The duration is taken from the last PCR in the file.
+void MPEG2TSExtractor::estimateDuration_l() {
+    off64_t offset = 0;
+    if (mFileSize > kMaxPCRScanSize) {
+        offset = ((mFileSize - kMaxPCRScanSize) / kTSPacketSize)
+            * kTSPacketSize;
+    }
+
+    int64_t durationUs = -1;
+    off64_t pcrOffset;
+    int64_t timeUs;
+    while (findPCR_l(offset, mFileSize, &pcrOffset, &timeUs) == OK) {
+        durationUs = timeUs;
+        offset = pcrOffset + kTSPacketSize;
+    }
+
+    if (durationUs <= 0) {
+        return;
+    }
+
+    ALOGV("estimated duration %.2f secs", durationUs / 1E6);
+
+    for (size_t i = 0; i < mSourceImpls.size(); ++i) {
+        sp<MetaData> meta = mSourceImpls.editItemAt(i)->getFormat();
+        if (meta != NULL) {
+            meta->setInt64(kKeyDuration, durationUs);
+        }
+    }
+}
+
+status_t MPEG2TSExtractor::seekTo(int64_t seekTimeUs) {
+    Mutex::Autolock autoLock(mLock);
+
+    if (!isSeekable()) {
+        return ERROR_UNSUPPORTED;
+    }
+
+    // Find the last seek point at or before the target.
+    size_t lo = 0;
+    size_t hi = mSeekIndex.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (mSeekIndex.itemAt(mid).mTimeUs <= seekTimeUs) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    off64_t offset = 0;
+    int64_t timeUs = 0;
+    if (lo > 0) {
+        offset = mSeekIndex.itemAt(lo - 1).mOffset;
+        timeUs = mSeekIndex.itemAt(lo - 1).mTimeUs;
+    }
+
+    if (lo == mSeekIndex.size() || mSeekIndex.itemAt(lo).mAfterGap) {
+        // The target may be in a part of the file not indexed yet, bisect
+        // on the PCRs in it.
+        off64_t high =
+            lo < mSeekIndex.size() ? mSeekIndex.itemAt(lo).mOffset : mFileSize;
+        while (high - offset > kSeekBisectThreshold) {
+            off64_t mid = offset
+                + ((high - offset) / 2 / kTSPacketSize) * kTSPacketSize;
+
+            off64_t pcrOffset;
+            int64_t pcrTimeUs;
+            if (findPCR_l(mid, high, &pcrOffset, &pcrTimeUs) != OK
+                    || pcrTimeUs > seekTimeUs) {
+                high = mid;
+            } else {
+                offset = pcrOffset;
+                timeUs = pcrTimeUs;
+            }
+        }
+    }
+
+    ALOGV("seeking to %lld us, resuming at offset %lld (%lld us)",
+          seekTimeUs, offset, timeUs);
+
+    mOffset = offset;
+
+    // The parser discards partial PES packets and access units, but keeps
+    // its time base, and the queued access units are flushed. No
+    // discontinuity is queued, to the readers of the other tracks the
+    // stream simply resumes at the new position.
+    mParser->signalDiscontinuity(ATSParser::DISCONTINUITY_NONE, NULL);
+
+    for (size_t i = 0; i < mSourceImpls.size(); ++i) {
+        mSourceImpls.editItemAt(i)->clear(false /* clearFormat */);
+    }
+
+    return OK;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
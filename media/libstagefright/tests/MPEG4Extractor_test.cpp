@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MPEG4Extractor_test"
+#include <utils/Log.h>
+
+#include <gtest/gtest.h>
+
+#include <media/stagefright/DataSource.h>
+#include <media/stagefright/MediaBuffer.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/MediaSource.h>
+#include <media/stagefright/MetaData.h>
+#include <utils/Vector.h>
+
+#include "include/MPEG4Extractor.h"
+
+namespace android {
+namespace test {
+
+static const uint32_t kTrackId = 1;
+static const uint32_t kTimescale = 8000;
+static const uint32_t kSampleDuration = 160;   // 20ms
+static const size_t kSampleSize = 32;
+static const size_t kSamplesPerSegment = 4;
+static const size_t kNumSegments = 3;
+
+class MemoryDataSource : public DataSource {
+public:
+    MemoryDataSource(const uint8_t *data, size_t size) :
+        mData(data), mSize(size) {}
+    virtual ~MemoryDataSource() {}
+
+    virtual status_t initCheck() const {
+        return OK;
+    }
+
+    virtual ssize_t readAt(off64_t offset, void *data, size_t size) {
+        if (offset < 0) return -1;
+        if (offset >= (off64_t)mSize) return 0;
+
+        size_t avail = mSize - offset;
+        if (avail > size) {
+            avail = size;
+        }
+        memcpy(data, mData + offset, avail);
+        return avail;
+    }
+
+    virtual status_t getSize(off64_t *size) {
+        *size = mSize;
+        return OK;
+    }
+
+private:
+    const uint8_t *mData;
+    size_t mSize;
+};
+
+// Writes nested boxes, the size of each box is filled in when it is closed.
+class BoxWriter {
+public:
+    void beginBox(const char *type) {
+        mOpenBoxes.push(mData.size());
+        writeUInt32(0);
+        writeFourCC(type);
+    }
+
+    void endBox() {
+        size_t start = mOpenBoxes.top();
+        mOpenBoxes.pop();
+        patchUInt32(start, mData.size() - start);
+    }
+
+    void writeFullBoxHeader(uint8_t version, uint32_t flags) {
+        writeUInt32(((uint32_t)version << 24) | flags);
+    }
+
+    void writeUInt8(uint8_t x) {
+        mData.push(x);
+    }
+
+    void writeUInt16(uint16_t x) {
+        writeUInt8(x >> 8);
+        writeUInt8(x & 0xff);
+    }
+
+    void writeUInt32(uint32_t x) {
+        writeUInt16(x >> 16);
+        writeUInt16(x & 0xffff);
+    }
+
+    void writeFourCC(const char *s) {
+        for (size_t i = 0; i < 4; ++i) {
+            writeUInt8(s[i]);
+        }
+    }
+
+    void writeZeros(size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            writeUInt8(0);
+        }
+    }
+
+    void patchUInt32(size_t offset, uint32_t x) {
+        mData.editItemAt(offset) = x >> 24;
+        mData.editItemAt(offset + 1) = (x >> 16) & 0xff;
+        mData.editItemAt(offset + 2) = (x >> 8) & 0xff;
+        mData.editItemAt(offset + 3) = x & 0xff;
+    }
+
+    size_t size() const {
+        return mData.size();
+    }
+
+    const uint8_t *data() const {
+        return mData.array();
+    }
+
+private:
+    Vector<uint8_t> mData;
+    Vector<size_t> mOpenBoxes;
+};
+
+static uint8_t sampleByte(size_t segment, size_t sample) {
+    return (uint8_t)(segment * kSamplesPerSegment + sample + 1);
+}
+
+// ftyp + moov describing one AMR track whose samples are all in fragments.
+static void writeInitializationSegment(BoxWriter *w) {
+    w->beginBox("ftyp");
+    w->writeFourCC("dash");
+    w->writeUInt32(0);
+    w->writeFourCC("iso6");
+    w->writeFourCC("dash");
+    w->endBox();
+
+    w->beginBox("moov");
+
+    w->beginBox("mvhd");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(0);              // creation time
+    w->writeUInt32(0);              // modification time
+    w->writeUInt32(kTimescale);
+    w->writeUInt32(0);              // duration
+    w->writeUInt32(0x00010000);     // rate
+    w->writeUInt16(0x0100);         // volume
+    w->writeZeros(10 + 36 + 24);    // reserved, matrix, pre_defined
+    w->writeUInt32(kTrackId + 1);   // next track ID
+    w->endBox();
+
+    w->beginBox("trak");
+
+    w->beginBox("tkhd");
+    w->writeFullBoxHeader(0, 7);
+    w->writeUInt32(0);              // creation time
+    w->writeUInt32(0);              // modification time
+    w->writeUInt32(kTrackId);
+    w->writeUInt32(0);              // reserved
+    w->writeUInt32(0);              // duration
+    w->writeZeros(8);               // reserved
+    w->writeUInt16(0);              // layer
+    w->writeUInt16(0);              // alternate group
+    w->writeUInt16(0x0100);         // volume
+    w->writeUInt16(0);              // reserved
+    static const uint32_t kIdentity[9] = {
+        0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000
+    };
+    for (size_t i = 0; i < 9; ++i) {
+        w->writeUInt32(kIdentity[i]);
+    }
+    w->writeUInt32(0);              // width
+    w->writeUInt32(0);              // height
+    w->endBox();
+
+    w->beginBox("mdia");
+
+    w->beginBox("mdhd");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(0);              // creation time
+    w->writeUInt32(0);              // modification time
+    w->writeUInt32(kTimescale);
+    w->writeUInt32(0);              // duration
+    w->writeUInt16(0x55c4);         // "und"
+    w->writeUInt16(0);
+    w->endBox();
+
+    w->beginBox("hdlr");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(0);
+    w->writeFourCC("soun");
+    w->writeZeros(12 + 1);          // reserved, empty name
+    w->endBox();
+
+    w->beginBox("minf");
+
+    w->beginBox("smhd");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(0);
+    w->endBox();
+
+    w->beginBox("stbl");
+
+    w->beginBox("stsd");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(1);
+    w->beginBox("samr");
+    w->writeZeros(6);
+    w->writeUInt16(1);              // data reference index
+    w->writeZeros(8);
+    w->writeUInt16(1);              // channel count
+    w->writeUInt16(16);             // sample size
+    w->writeUInt32(0);
+    w->writeUInt32(kTimescale << 16);
+    w->endBox();
+    w->endBox();
+
+    // The sample tables are empty, the samples are in the fragments.
+    w->beginBox("stts");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(0);
+    w->endBox();
+
+    w->beginBox("stsc");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(0);
+    w->endBox();
+
+    w->beginBox("stsz");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(kSampleSize);
+    w->writeUInt32(0);
+    w->endBox();
+
+    w->beginBox("stco");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(0);
+    w->endBox();
+
+    w->endBox();  // stbl
+    w->endBox();  // minf
+    w->endBox();  // mdia
+    w->endBox();  // trak
+
+    w->beginBox("mvex");
+    w->beginBox("trex");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(kTrackId);
+    w->writeUInt32(1);              // default sample description index
+    w->writeUInt32(0);              // default sample duration
+    w->writeUInt32(0);              // default sample size
+    w->writeUInt32(0);              // default sample flags
+    w->endBox();
+    w->endBox();  // mvex
+
+    w->endBox();  // moov
+}
+
+// styp + sidx [+ prft] + moof + mdat [+ free], as found in DASH streams
+// where the media segments are simply appended to each other.
+static void writeMediaSegment(BoxWriter *w, size_t segment) {
+    w->beginBox("styp");
+    w->writeFourCC("msdh");
+    w->writeUInt32(0);
+    w->writeFourCC("msdh");
+    w->writeFourCC("msix");
+    w->endBox();
+
+    w->beginBox("sidx");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(kTrackId);
+    w->writeUInt32(kTimescale);
+    w->writeUInt32(segment * kSamplesPerSegment * kSampleDuration);
+    w->writeUInt32(0);              // first offset
+    w->writeUInt16(0);              // reserved
+    w->writeUInt16(1);              // reference count
+    size_t referencedSizeOffset = w->size();
+    w->writeUInt32(0);              // referenced size, patched below
+    w->writeUInt32(kSamplesPerSegment * kSampleDuration);
+    w->writeUInt32(0x90000000);     // starts with SAP, type 1
+    w->endBox();
+
+    if (segment % 2) {
+        w->beginBox("prft");
+        w->writeFullBoxHeader(0, 0);
+        w->writeUInt32(kTrackId);
+        w->writeUInt32(0);          // NTP timestamp
+        w->writeUInt32(0);
+        w->writeUInt32(segment * kSamplesPerSegment * kSampleDuration);
+        w->endBox();
+    }
+
+    size_t moofOffset = w->size();
+    w->beginBox("moof");
+
+    w->beginBox("mfhd");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(segment + 1);
+    w->endBox();
+
+    w->beginBox("traf");
+
+    w->beginBox("tfhd");
+    w->writeFullBoxHeader(0, 0);
+    w->writeUInt32(kTrackId);
+    w->endBox();
+
+    w->beginBox("trun");
+    w->writeFullBoxHeader(0, 0x301);  // data offset, durations, sizes
+    w->writeUInt32(kSamplesPerSegment);
+    size_t dataOffsetOffset = w->size();
+    w->writeUInt32(0);              // data offset, patched below
+    for (size_t i = 0; i < kSamplesPerSegment; ++i) {
+        w->writeUInt32(kSampleDuration);
+        w->writeUInt32(kSampleSize);
+    }
+    w->endBox();
+
+    w->endBox();  // traf
+    w->endBox();  // moof
+
+    // The data offset is relative to the start of the moof box.
+    w->patchUInt32(dataOffsetOffset, w->size() - moofOffset + 8);
+
+    w->beginBox("mdat");
+    for (size_t i = 0; i < kSamplesPerSegment; ++i) {
+        for (size_t j = 0; j < kSampleSize; ++j) {
+            w->writeUInt8(sampleByte(segment, i));
+        }
+    }
+    w->endBox();
+
+    w->patchUInt32(referencedSizeOffset, w->size() - moofOffset);
+
+    if (segment % 2 == 0) {
+        w->beginBox("free");
+        w->writeZeros(16);
+        w->endBox();
+    }
+}
+
+class MPEG4ExtractorTest : public testing::Test {
+protected:
+    void SetUp() {
+        writeInitializationSegment(&mFile);
+        for (size_t i = 0; i < kNumSegments; ++i) {
+            writeMediaSegment(&mFile, i);
+        }
+
+        mExtractor = new MPEG4Extractor(
+                new MemoryDataSource(mFile.data(), mFile.size()));
+    }
+
+    BoxWriter mFile;
+    sp<MediaExtractor> mExtractor;
+};
+
+TEST_F(MPEG4ExtractorTest, PlaysAllConcatenatedSegments) {
+    ASSERT_EQ(1u, mExtractor->countTracks());
+
+    sp<MediaSource> source = mExtractor->getTrack(0);
+    ASSERT_TRUE(source != NULL);
+    ASSERT_EQ(OK, source->start());
+
+    size_t numSamples = 0;
+    status_t err;
+    for (;;) {
+        MediaBuffer *buffer;
+        err = source->read(&buffer);
+        if (err != OK) {
+            break;
+        }
+
+        size_t segment = numSamples / kSamplesPerSegment;
+        size_t sample = numSamples % kSamplesPerSegment;
+
+        EXPECT_EQ(kSampleSize, buffer->range_length());
+        const uint8_t *data =
+            (const uint8_t *)buffer->data() + buffer->range_offset();
+        EXPECT_EQ(sampleByte(segment, sample), data[0]);
+        EXPECT_EQ(sampleByte(segment, sample), data[kSampleSize - 1]);
+
+        int64_t timeUs;
+        EXPECT_TRUE(buffer->meta_data()->findInt64(kKeyTime, &timeUs));
+        EXPECT_EQ((int64_t)numSamples * kSampleDuration * 1000000ll / kTimescale,
+                timeUs);
+
+        buffer->release();
+        ++numSamples;
+    }
+
+    EXPECT_EQ(ERROR_END_OF_STREAM, err);
+    EXPECT_EQ(kNumSegments * kSamplesPerSegment, numSamples);
+
+    EXPECT_EQ(OK, source->stop());
+}
+
+}  // namespace test
+}  // namespace android
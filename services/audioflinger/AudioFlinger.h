@@ -50,6 +50,7 @@
 #include <media/AudioBufferProvider.h>
 #include <media/ExtendedAudioBufferProvider.h>
 #include "FastMixer.h"
+#include "FastCapture.h"
 #include <media/nbaio/NBAIO.h>
 #include "AudioWatchdog.h"
 
@@ -66,6 +67,7 @@ class AudioMixer;
 class AudioBuffer;
 class AudioResampler;
 class FastMixer;
+class FastCapture;
 class ServerProxy;
 
 // ----------------------------------------------------------------------------
@@ -26,6 +26,7 @@
 
 #include <utils/Errors.h>
 #include <utils/Log.h>
+#include <utils/Timers.h>
 
 #include <cutils/bitops.h>
 #include <cutils/compiler.h>
@@ -203,6 +204,8 @@ int AudioMixer::getTrackName(audio_channel_mask_t channelMask, int sessionId)
         t->format = 16;
         t->channelMask = AUDIO_CHANNEL_OUT_STEREO;
         t->sessionId = sessionId;
+        t->cpuNs = 0;
+        t->quality = AudioResampler::DEFAULT_QUALITY;
         // setBufferProvider(name, AudioBufferProvider *) is required before enable(name)
         t->bufferProvider = NULL;
         t->buffer.raw = NULL;
@@ -487,6 +490,12 @@ void AudioMixer::setParameter(int name, int target, int param, void *value)
             track.sampleRate = mSampleRate;
             invalidateState(1 << name);
             break;
+        case QUALITY:
+            if (track.setResamplerQuality(valueInt, mSampleRate)) {
+                ALOGV("setParameter(RESAMPLE, QUALITY, %d)", valueInt);
+                invalidateState(1 << name);
+            }
+            break;
         default:
             LOG_FATAL("bad param");
         }
@@ -552,23 +561,7 @@ bool AudioMixer::track_t::setResampler(uint32_t value, uint32_t devSampleRate)
             sampleRate = value;
             if (resampler == NULL) {
                 ALOGV("creating resampler from track %d Hz to device %d Hz", value, devSampleRate);
-                AudioResampler::src_quality quality;
-                // force lowest quality level resampler if use case isn't music or video
-                // FIXME this is flawed for dynamic sample rates, as we choose the resampler
-                // quality level based on the initial ratio, but that could change later.
-                // Should have a way to distinguish tracks with static ratios vs. dynamic ratios.
-                if (!((value == 44100 && devSampleRate == 48000) ||
-                      (value == 48000 && devSampleRate == 44100))) {
-                    quality = AudioResampler::LOW_QUALITY;
-                } else {
-                    quality = AudioResampler::DEFAULT_QUALITY;
-                }
-                resampler = AudioResampler::create(
-                        format,
-                        // the resampler sees the number of channels after the downmixer, if any
-                        downmixerBufferProvider != NULL ? MAX_NUM_CHANNELS : channelCount,
-                        devSampleRate, quality);
-                resampler->setLocalTimeFreq(sLocalTimeFreq);
+                createResampler(devSampleRate);
             }
             return true;
         }
@@ -576,6 +569,56 @@ bool AudioMixer::track_t::setResampler(uint32_t value, uint32_t devSampleRate)
     return false;
 }
 
+bool AudioMixer::track_t::setResamplerQuality(int32_t value, uint32_t devSampleRate)
+{
+    if (quality == value) {
+        return false;
+    }
+    quality = value;
+    if (resampler == NULL) {
+        // applied when the resampler is created
+        return false;
+    }
+    AudioResampler::src_quality q = resamplerQuality(devSampleRate);
+    if (q != AudioResampler::DEFAULT_QUALITY && q == resampler->getQuality()) {
+        return false;
+    }
+    // same as REMOVE: frames held but not released by the old resampler are obtained again
+    // by the new one, but the filter state is lost, so don't toggle this every mix cycle
+    ALOGV("re-creating resampler at quality %d", value);
+    delete resampler;
+    resampler = NULL;
+    createResampler(devSampleRate);
+    return true;
+}
+
+AudioResampler::src_quality AudioMixer::track_t::resamplerQuality(uint32_t devSampleRate) const
+{
+    // an explicitly requested quality level takes precedence.
+    // Otherwise force lowest quality level resampler if use case isn't music or video.
+    // FIXME this is flawed for dynamic sample rates, as we choose the resampler
+    // quality level based on the initial ratio, but that could change later.
+    // Should have a way to distinguish tracks with static ratios vs. dynamic ratios.
+    if (quality != AudioResampler::DEFAULT_QUALITY) {
+        return (AudioResampler::src_quality) quality;
+    }
+    if (!((sampleRate == 44100 && devSampleRate == 48000) ||
+          (sampleRate == 48000 && devSampleRate == 44100))) {
+        return AudioResampler::LOW_QUALITY;
+    }
+    return AudioResampler::DEFAULT_QUALITY;
+}
+
+void AudioMixer::track_t::createResampler(uint32_t devSampleRate)
+{
+    resampler = AudioResampler::create(
+            format,
+            // the resampler sees the number of channels after the downmixer, if any
+            downmixerBufferProvider != NULL ? MAX_NUM_CHANNELS : channelCount,
+            devSampleRate, resamplerQuality(devSampleRate));
+    resampler->setLocalTimeFreq(sLocalTimeFreq);
+}
+
 inline
 void AudioMixer::track_t::adjustVolumeRamp(bool aux)
 {
@@ -604,6 +647,15 @@ size_t AudioMixer::getUnreleasedFrames(int name) const
     return 0;
 }
 
+uint32_t AudioMixer::getTrackCpuNs(int name)
+{
+    name -= TRACK0;
+    ALOG_ASSERT(uint32_t(name) < MAX_NUM_TRACKS, "bad track name %d", name);
+    uint32_t ns = mState.tracks[name].cpuNs;
+    mState.tracks[name].cpuNs = 0;
+    return ns;
+}
+
 void AudioMixer::setBufferProvider(int name, AudioBufferProvider* bufferProvider)
 {
     name -= TRACK0;
@@ -1246,8 +1298,10 @@ void AudioMixer::process__genericResampling(state_t* state, int64_t pts)
             // acquire/release the buffers because it's done by
             // the resampler.
             if ((t.needs & NEEDS_RESAMPLE__MASK) == NEEDS_RESAMPLE_ENABLED) {
+                const nsecs_t startNs = systemTime();
                 t.resampler->setPTS(pts);
                 t.hook(&t, outTemp, numFrames, state->resampleTemp, aux);
+                t.cpuNs += uint32_t(systemTime() - startNs);
             } else {
 
                 size_t outFrames = 0;
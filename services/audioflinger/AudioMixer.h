@@ -89,6 +89,10 @@ public:
                                   // This clears out the resampler's input buffer.
         REMOVE          = 0x4102, // Remove the sample rate converter on this track name;
                                   // the track is restored to the mix sample rate.
+        QUALITY         = 0x4103, // Request a sample rate converter quality for this track name;
+                                  // parameter 'value' is an AudioResampler::src_quality.
+                                  // DEFAULT_QUALITY restores the mixer's own choice.
+                                  // An existing sample rate converter is re-created if needed.
         // for target RAMP_VOLUME and VOLUME (8 channels max)
         VOLUME0         = 0x4200,
         VOLUME1         = 0x4201,
@@ -117,6 +121,11 @@ public:
 
     size_t      getUnreleasedFrames(int name) const;
 
+    // Returns the time in nanoseconds spent resampling and mixing this track since the
+    // previous call, and resets the count.  Only tracks mixed by the resampling path are
+    // accounted for; tracks mixed by the other process hooks always return 0.
+    uint32_t    getTrackCpuNs(int name);
+
 private:
 
     enum {
@@ -201,11 +210,15 @@ private:
 
         int32_t     sessionId;
 
-        int32_t     padding[2];
+        uint32_t    cpuNs;          // resampling time since last getTrackCpuNs(), see above
+        int32_t     quality;        // requested AudioResampler::src_quality, or DEFAULT_QUALITY
 
         // 16-byte boundary
 
         bool        setResampler(uint32_t sampleRate, uint32_t devSampleRate);
+        bool        setResamplerQuality(int32_t quality, uint32_t devSampleRate);
+        AudioResampler::src_quality resamplerQuality(uint32_t devSampleRate) const;
+        void        createResampler(uint32_t devSampleRate);
         bool        doesResample() const { return resampler != NULL; }
         void        resetResampler() { if (resampler != NULL) resampler->reset(); }
         void        adjustVolumeRamp(bool aux);
@@ -315,6 +315,10 @@ public:
     // At least one non offloadable effect in the chain is enabled
     bool isNonOffloadableEnabled();
 
+    // time in nanoseconds spent processing effects since the previous call,
+    // must be called by the thread calling process_l()
+    int64_t getCpuNs() { int64_t ns = mCpuNs; mCpuNs = 0; return ns; }
+
 
     void dump(int fd, const Vector<String16>& args);
 
@@ -370,4 +374,5 @@ protected:
     // timeLow fields among effect type UUIDs.
     // Updated by updateSuspendedSessions_l() only.
     KeyedVector< int, sp<SuspendedEffectDesc> > mSuspendedEffects;
+    int64_t mCpuNs;             // time spent in process_l() since last getCpuNs()
 };
@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// <IMPORTANT_WARNING>
+// Design rules for threadLoop() are given in the comments at section "Fast mixer thread" of
+// StateQueue.h.  In particular, avoid library and system calls except at well-known points.
+// The design rules are only for threadLoop(), and don't apply to FastCaptureDumpState methods.
+// </IMPORTANT_WARNING>
+
+#define LOG_TAG "FastCapture"
+//#define LOG_NDEBUG 0
+
+#define ATRACE_TAG ATRACE_TAG_AUDIO
+
+#include "Configuration.h"
+#include <sys/atomics.h>
+#include <time.h>
+#include <utils/Log.h>
+#include <utils/Trace.h>
+#include <media/AudioBufferProvider.h>
+#include "FastCapture.h"
+
+#define FAST_HOT_IDLE_NS     1000000L   // 1 ms: time to sleep while hot idling
+#define FAST_DEFAULT_NS    999999999L   // ~1 sec: default time to sleep
+
+namespace android {
+
+// Fast capture thread
+bool FastCapture::threadLoop()
+{
+    static const FastCaptureState initial;
+    const FastCaptureState *previous = &initial, *current = &initial;
+    FastCaptureState preIdle; // copy of state before we went into idle
+    long sleepNs = -1;  // -1: busy wait, 0: sched_yield, > 0: nanosleep
+    NBAIO_Source *inputSource = NULL;
+    int inputSourceGen = 0;
+    NBAIO_Sink *pipeSink = NULL;
+    int pipeSinkGen = 0;
+    short *readBuffer = NULL;
+    ssize_t readBufferFrames = 0;   // number of valid frames in readBuffer, not yet written
+    NBAIO_Format format = Format_Invalid;
+    unsigned sampleRate = 0;
+    long periodNs = 0;      // expected period; the time required to capture one read buffer
+    FastCaptureDumpState dummyDumpState, *dumpState = &dummyDumpState;
+    unsigned coldGen = 0;   // last observed mColdGen
+    NBLog::Writer dummyLogWriter, *logWriter = &dummyLogWriter;
+    uint32_t totalNativeFramesRead = 0; // copied to dumpState->mFramesRead
+
+    for (;;) {
+
+        // either nanosleep, sched_yield, or busy wait
+        if (sleepNs >= 0) {
+            if (sleepNs > 0) {
+                ALOG_ASSERT(sleepNs < 1000000000);
+                const struct timespec req = {0, sleepNs};
+                nanosleep(&req, NULL);
+            } else {
+                sched_yield();
+            }
+        }
+        // default to long sleep for next cycle
+        sleepNs = FAST_DEFAULT_NS;
+
+        // poll for state change
+        const FastCaptureState *next = mSQ.poll();
+        if (next == NULL) {
+            // continue to use the default initial state until a real state is available
+            ALOG_ASSERT(current == &initial && previous == &initial);
+            next = current;
+        }
+
+        FastCaptureState::Command command = next->mCommand;
+        if (next != current) {
+
+            // As soon as possible of learning of a new dump area, start using it
+            dumpState = next->mDumpState != NULL ? next->mDumpState : &dummyDumpState;
+            logWriter = next->mNBLogWriter != NULL ? next->mNBLogWriter : &dummyLogWriter;
+
+            // See FastMixer::threadLoop() for why a copy of the last non-idle state is kept
+            if (!(current->mCommand & FastCaptureState::IDLE)) {
+                if (command & FastCaptureState::IDLE) {
+                    preIdle = *current;
+                    current = &preIdle;
+                }
+                previous = current;
+            }
+            current = next;
+        }
+#if !LOG_NDEBUG
+        next = NULL;    // not referenced again
+#endif
+
+        dumpState->mCommand = command;
+
+        switch (command) {
+        case FastCaptureState::INITIAL:
+        case FastCaptureState::HOT_IDLE:
+            sleepNs = FAST_HOT_IDLE_NS;
+            continue;
+        case FastCaptureState::COLD_IDLE:
+            // only perform a cold idle command once
+            if (current->mColdGen != coldGen) {
+                int32_t *coldFutexAddr = current->mColdFutexAddr;
+                ALOG_ASSERT(coldFutexAddr != NULL);
+                int32_t old = android_atomic_dec(coldFutexAddr);
+                if (old <= 0) {
+                    __futex_syscall4(coldFutexAddr, FUTEX_WAIT_PRIVATE, old - 1, NULL);
+                }
+                int policy = sched_getscheduler(0);
+                if (!(policy == SCHED_FIFO || policy == SCHED_RR)) {
+                    ALOGE("did not receive expected priority boost");
+                }
+                // data captured before the idle is stale
+                readBufferFrames = 0;
+                sleepNs = -1;
+                coldGen = current->mColdGen;
+            } else {
+                sleepNs = FAST_HOT_IDLE_NS;
+            }
+            continue;
+        case FastCaptureState::EXIT:
+            delete[] readBuffer;
+            return false;
+        case FastCaptureState::READ:
+        case FastCaptureState::WRITE:
+        case FastCaptureState::READ_WRITE:
+            break;
+        default:
+            LOG_FATAL("bad command %d", command);
+        }
+
+        // there is a non-idle state available to us; did the state change?
+        size_t frameCount = current->mFrameCount;
+        if (current != previous) {
+
+            // check for change in input HAL configuration
+            NBAIO_Format previousFormat = format;
+            if (current->mInputSourceGen != inputSourceGen) {
+                inputSource = current->mInputSource;
+                inputSourceGen = current->mInputSourceGen;
+                if (inputSource == NULL) {
+                    format = Format_Invalid;
+                    sampleRate = 0;
+                } else {
+                    format = inputSource->format();
+                    sampleRate = Format_sampleRate(format);
+                }
+                dumpState->mSampleRate = sampleRate;
+            }
+
+            if (current->mPipeSinkGen != pipeSinkGen) {
+                pipeSink = current->mPipeSink;
+                pipeSinkGen = current->mPipeSinkGen;
+            }
+
+            if ((format != previousFormat) || (frameCount != previous->mFrameCount)) {
+                // FIXME to avoid priority inversion, don't delete here
+                delete[] readBuffer;
+                readBuffer = NULL;
+                readBufferFrames = 0;
+                if (frameCount > 0 && sampleRate > 0) {
+                    // FIXME new may block for unbounded time at internal mutex of the heap
+                    //       implementation; it would be better to have RecordThread allocate for us
+                    //       to avoid blocking here and to prevent possible priority inversion
+                    readBuffer = new short[frameCount * Format_channelCount(format)];
+                    periodNs = (frameCount * 1000000000LL) / sampleRate;    // 1.00
+                } else {
+                    periodNs = 0;
+                }
+                dumpState->mFrameCount = frameCount;
+            }
+
+            // only process state change once
+            previous = current;
+        }
+
+        // do work using current state here
+        if ((command & FastCaptureState::READ) && (inputSource != NULL) && (readBuffer != NULL)) {
+            // the HAL read() blocks for one period, which paces this loop
+            dumpState->mReadSequence++;
+            ATRACE_BEGIN("read");
+            ssize_t framesRead = inputSource->read(readBuffer, frameCount,
+                    AudioBufferProvider::kInvalidPTS);
+            ATRACE_END();
+            dumpState->mReadSequence++;
+            if (framesRead >= 0) {
+                ALOG_ASSERT((size_t) framesRead <= frameCount);
+                totalNativeFramesRead += framesRead;
+                dumpState->mFramesRead = totalNativeFramesRead;
+                readBufferFrames = framesRead;
+                sleepNs = -1;
+            } else {
+                dumpState->mReadErrors++;
+                readBufferFrames = 0;
+                // avoid spinning on a failing input
+                sleepNs = periodNs;
+            }
+        }
+
+        if ((command & FastCaptureState::WRITE) && (pipeSink != NULL) && (readBufferFrames > 0)) {
+            // the pipe is non-blocking, and overwrites data not yet consumed by RecordThread
+            ssize_t framesWritten = pipeSink->write(readBuffer, readBufferFrames);
+            ALOG_ASSERT(framesWritten == readBufferFrames);
+            (void) framesWritten;
+            readBufferFrames = 0;
+        }
+
+    }   // for (;;)
+
+    // never return 'true'; Thread::_threadLoop() locks mutex which can result in priority inversion
+}
+
+FastCaptureDumpState::FastCaptureDumpState() :
+    mCommand(FastCaptureState::INITIAL), mReadSequence(0), mFramesRead(0), mReadErrors(0),
+    mSampleRate(0), mFrameCount(0)
+{
+}
+
+FastCaptureDumpState::~FastCaptureDumpState()
+{
+}
+
+void FastCaptureDumpState::dump(int fd) const
+{
+    if (mCommand == FastCaptureState::INITIAL) {
+        fdprintf(fd, "FastCapture not initialized\n");
+        return;
+    }
+#define COMMAND_MAX 32
+    char string[COMMAND_MAX];
+    switch (mCommand) {
+    case FastCaptureState::INITIAL:
+        strcpy(string, "INITIAL");
+        break;
+    case FastCaptureState::HOT_IDLE:
+        strcpy(string, "HOT_IDLE");
+        break;
+    case FastCaptureState::COLD_IDLE:
+        strcpy(string, "COLD_IDLE");
+        break;
+    case FastCaptureState::EXIT:
+        strcpy(string, "EXIT");
+        break;
+    case FastCaptureState::READ:
+        strcpy(string, "READ");
+        break;
+    case FastCaptureState::WRITE:
+        strcpy(string, "WRITE");
+        break;
+    case FastCaptureState::READ_WRITE:
+        strcpy(string, "READ_WRITE");
+        break;
+    default:
+        snprintf(string, COMMAND_MAX, "%d", mCommand);
+        break;
+    }
+    double periodSec = mSampleRate != 0 ? (double) mFrameCount / (double) mSampleRate : 0.0;
+    fdprintf(fd, "FastCapture command=%s readSequence=%u framesRead=%u readErrors=%u\n"
+                 "            sampleRate=%u frameCount=%zu readPeriod=%.2f ms\n",
+                 string, mReadSequence, mFramesRead, mReadErrors,
+                 mSampleRate, mFrameCount, periodSec * 1e3);
+}
+
+}   // namespace android
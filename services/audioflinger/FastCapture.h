@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_AUDIO_FAST_CAPTURE_H
+#define ANDROID_AUDIO_FAST_CAPTURE_H
+
+#include <utils/Thread.h>
+extern "C" {
+#include "../private/bionic_futex.h"
+}
+#include "StateQueue.h"
+#include "FastCaptureState.h"
+
+namespace android {
+
+typedef StateQueue<FastCaptureState> FastCaptureStateQueue;
+
+// The fast capture thread reads from the input HAL with a small buffer size,
+// and writes into a non-blocking pipe that is consumed by the normal RecordThread.
+// It follows the same design rules as FastMixer; see StateQueue.h.
+class FastCapture : public Thread {
+
+public:
+            FastCapture() : Thread(false /*canCallJava*/) { }
+    virtual ~FastCapture() { }
+
+            FastCaptureStateQueue* sq() { return &mSQ; }
+
+private:
+    virtual bool                threadLoop();
+            FastCaptureStateQueue mSQ;
+
+};  // class FastCapture
+
+// The FastCaptureDumpState keeps a cache of FastCapture statistics that can be logged by dumpsys.
+// Each individual native word-sized field is accessed atomically.  But the
+// overall structure is non-atomic, that is there may be an inconsistency between fields.
+// No barriers or locks are used for either writing or reading.
+// Only POD types are permitted, and the contents shouldn't be trusted (i.e. do range checks).
+// It has a different lifetime than the FastCapture, and so it can't be a member of FastCapture.
+struct FastCaptureDumpState {
+    FastCaptureDumpState();
+    /*virtual*/ ~FastCaptureDumpState();
+
+    void dump(int fd) const;    // should only be called on a stable copy, not the original
+
+    FastCaptureState::Command mCommand; // current command
+    uint32_t mReadSequence;     // incremented before and after each read()
+    uint32_t mFramesRead;       // total number of frames read successfully
+    uint32_t mReadErrors;       // total number of read() errors
+    uint32_t mSampleRate;
+    size_t   mFrameCount;
+};
+
+}   // namespace android
+
+#endif  // ANDROID_AUDIO_FAST_CAPTURE_H
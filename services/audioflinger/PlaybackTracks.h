@@ -136,6 +136,9 @@ protected:
     size_t              mPresentationCompleteFrames; // number of frames written to the
                                     // audio HAL when this track will be fully rendered
                                     // zero means not monitoring
+    String8             mOffloadParameters; // offloaded tracks only: HAL parameters received
+                                    // while another track was rendered, sent to the HAL by
+                                    // OffloadThread on the gapless transition to this track
 private:
     IAudioFlinger::track_flags_t mFlags;
 
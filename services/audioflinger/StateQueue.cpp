@@ -33,21 +33,30 @@ void StateQueueObserverDump::dump(int fd)
 
 void StateQueueMutatorDump::dump(int fd)
 {
-    fdprintf(fd, "State queue mutator: pushDirty=%u pushAck=%u blockedSequence=%u\n",
-            mPushDirty, mPushAck, mBlockedSequence);
+    fdprintf(fd, "State queue mutator: pushDirty=%u pushAck=%u coalesced=%u blockedSequence=%u\n",
+            mPushDirty, mPushAck, mCoalesced, mBlockedSequence);
 }
 #endif
 
 // Constructor and destructor
 
-template<typename T> StateQueue<T>::StateQueue() :
-    mNext(NULL), mAck(NULL), mCurrent(NULL),
-    mMutating(&mStates[0]), mExpecting(NULL),
+template<typename T> StateQueue<T>::StateQueue(unsigned observers) :
+    mObservers(observers), mNext(NULL),
+    mMutating(&mStates[0]), mExpecting(NULL), mPushed(NULL),
     mInMutation(false), mIsDirty(false), mIsInitialized(false)
 #ifdef STATE_QUEUE_DUMP
-    , mObserverDump(&mObserverDummyDump), mMutatorDump(&mMutatorDummyDump)
+    , mMutatorDump(&mMutatorDummyDump)
 #endif
 {
+    LOG_ALWAYS_FATAL_IF(observers < 1 || observers > kMaxObservers,
+            "unsupported number of observers %u", observers);
+    for (unsigned i = 0; i < kMaxObservers; ++i) {
+        mAck[i] = NULL;
+        mCurrent[i] = NULL;
+#ifdef STATE_QUEUE_DUMP
+        mObserverDump[i] = &mObserverDummyDump;
+#endif
+    }
 }
 
 template<typename T> StateQueue<T>::~StateQueue()
@@ -56,14 +65,15 @@ template<typename T> StateQueue<T>::~StateQueue()
 
 // Observer APIs
 
-template<typename T> const T* StateQueue<T>::poll()
+template<typename T> const T* StateQueue<T>::poll(unsigned observer)
 {
+    ALOG_ASSERT(observer < mObservers, "poll() called by unknown observer %u", observer);
     const T *next = (const T *) android_atomic_acquire_load((volatile int32_t *) &mNext);
-    if (next != mCurrent) {
-        mAck = next;    // no additional barrier needed
-        mCurrent = next;
+    if (next != mCurrent[observer]) {
+        mAck[observer] = next;    // no additional barrier needed
+        mCurrent[observer] = next;
 #ifdef STATE_QUEUE_DUMP
-        mObserverDump->mStateChanges++;
+        mObserverDump[observer]->mStateChanges++;
 #endif
     }
     return next;
@@ -83,12 +93,33 @@ template<typename T> void StateQueue<T>::end(bool didModify)
     ALOG_ASSERT(mInMutation, "end() called when not in a mutation");
     ALOG_ASSERT(mIsInitialized || didModify, "first end() must modify for initialization");
     if (didModify) {
+#ifdef STATE_QUEUE_DUMP
+        if (mIsDirty) {
+            mMutatorDump->mCoalesced++;
+        }
+#endif
         mIsDirty = true;
         mIsInitialized = true;
     }
     mInMutation = false;
 }
 
+template<typename T> bool StateQueue<T>::isAcked(unsigned observer) const
+{
+    ALOG_ASSERT(observer < mObservers, "isAcked() called for unknown observer %u", observer);
+    return (const T *) mAck[observer] == mPushed;   // no additional barrier needed
+}
+
+template<typename T> bool StateQueue<T>::isAckedByAll(const T *state) const
+{
+    for (unsigned i = 0; i < mObservers; ++i) {
+        if ((const T *) mAck[i] != state) {     // no additional barrier needed
+            return false;
+        }
+    }
+    return true;
+}
+
 template<typename T> bool StateQueue<T>::push(StateQueue<T>::block_t block)
 {
 #define PUSH_BLOCK_ACK_NS    3000000L   // 3 ms: time between checks for ack in push()
@@ -115,8 +146,7 @@ template<typename T> bool StateQueue<T>::push(StateQueue<T>::block_t block)
             unsigned count = 0;
 #endif
             for (;;) {
-                const T *ack = (const T *) mAck;    // no additional barrier needed
-                if (ack == mExpecting) {
+                if (isAckedByAll(mExpecting)) {
                     // unnecessary as we're about to rewrite
                     //mExpecting = NULL;
                     break;
@@ -142,6 +172,7 @@ template<typename T> bool StateQueue<T>::push(StateQueue<T>::block_t block)
         // publish
         android_atomic_release_store((int32_t) mMutating, (volatile int32_t *) &mNext);
         mExpecting = mMutating;
+        mPushed = mMutating;
 
         // copy with circular wraparound
         if (++mMutating >= &mStates[kN]) {
@@ -159,8 +190,7 @@ template<typename T> bool StateQueue<T>::push(StateQueue<T>::block_t block)
             unsigned count = 0;
 #endif
             for (;;) {
-                const T *ack = (const T *) mAck;    // no additional barrier needed
-                if (ack == mExpecting) {
+                if (isAckedByAll(mExpecting)) {
                     mExpecting = NULL;
                     break;
                 }
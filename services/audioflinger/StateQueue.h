@@ -66,7 +66,14 @@
 
 // Solution:
 //  Let's call the fast mixer thread the "observer" and normal mixer thread the "mutator".
-//  We assume there is only a single observer and a single mutator; this is critical.
+//  We assume there is only a single mutator; this is critical.
+//  There may be several observers (up to kMaxObservers), for example a fast mixer and a fast
+//  capture thread driven by the same normal thread.  The number of observers is fixed at
+//  construction, and each observer identifies itself by its index when polling.
+//  Each observer acknowledges states independently, and the mutator only reuses a slot
+//  once every observer has acknowledged the state that followed it.  As each observer
+//  has to acknowledge the next state before another one is pushed, the observers are never
+//  more than one state apart, and the same depth of queue is sufficient.
 //  Each state is of type <T>, and should contain only POD (Plain Old Data) and raw pointers, as
 //  memcpy() may be used to copy state, and the destructors are run in unpredictable order.
 //  The states in chronological order are: previous, current, next, and mutating:
@@ -108,10 +115,12 @@ struct StateQueueObserverDump {
 };
 
 struct StateQueueMutatorDump {
-    StateQueueMutatorDump() : mPushDirty(0), mPushAck(0), mBlockedSequence(0) { }
+    StateQueueMutatorDump() : mPushDirty(0), mPushAck(0), mCoalesced(0), mBlockedSequence(0) { }
     /*virtual*/ ~StateQueueMutatorDump() { }
     unsigned    mPushDirty;       // incremented each time push() is called with a dirty state
     unsigned    mPushAck;         // incremented each time push(BLOCK_UNTIL_ACKED) is called
+    unsigned    mCoalesced;       // incremented each time a modification is squashed into a
+                                  // dirty state that has not been pushed yet
     unsigned    mBlockedSequence; // incremented before and after each time that push()
                                   // blocks for more than one PUSH_BLOCK_ACK_NS;
                                   // if odd, then mutator is currently blocked inside push()
@@ -123,9 +132,14 @@ struct StateQueueMutatorDump {
 template<typename T> class StateQueue {
 
 public:
-            StateQueue();
+    static const unsigned kMaxObservers = 4;
+
+    // The number of observers must be in the range 1 to kMaxObservers.
+            StateQueue(unsigned observers = 1);
     virtual ~StateQueue();
 
+    unsigned observers() const { return mObservers; }
+
     // Observer APIs
 
     // Poll for a state change.  Returns a pointer to a read-only state,
@@ -134,7 +148,9 @@ public:
     // then the returned pointer will be unchanged.
     // The previous state pointer is guaranteed to still be valid;
     // this allows the observer to diff the previous and new states.
-    const T* poll();
+    // Parameter 'observer' is the index of the calling observer, in range 0 to observers() - 1.
+    // Each observer must be a single thread, and must always use the same index.
+    const T* poll(unsigned observer = 0);
 
     // Mutator APIs
 
@@ -158,6 +174,9 @@ public:
     // For BLOCK_UNTIL_PUSHED and BLOCK_UNTIL_ACKED, always returns true.
     // No-op if there are no pending modifications (not dirty), except
     //      for BLOCK_UNTIL_ACKED it will wait until a prior push has been acknowledged.
+    // A push is acknowledged once all observers have polled it.
+    // Modifications made while a push is blocked (BLOCK_NEVER returned false) are coalesced
+    // into the pending state, so that a slow observer sees a batch of mutations as one state.
     // Must not be called in the middle of a mutation.
     enum block_t {
         BLOCK_NEVER,        // do not block
@@ -169,10 +188,14 @@ public:
     // Return whether the current state is dirty (modified and not pushed).
     bool    isDirty() const { return mIsDirty; }
 
+    // Return whether the specified observer has acknowledged the most recently pushed state.
+    // Returns true if no state has been pushed yet.
+    bool    isAcked(unsigned observer) const;
+
 #ifdef STATE_QUEUE_DUMP
     // Register location of observer dump area
-    void    setObserverDump(StateQueueObserverDump *dump)
-            { mObserverDump = dump != NULL ? dump : &mObserverDummyDump; }
+    void    setObserverDump(StateQueueObserverDump *dump, unsigned observer = 0)
+            { mObserverDump[observer] = dump != NULL ? dump : &mObserverDummyDump; }
 
     // Register location of mutator dump area
     void    setMutatorDump(StateQueueMutatorDump *dump)
@@ -183,23 +206,31 @@ private:
     static const unsigned kN = 4;       // values < 4 are not supported by this code
     T                 mStates[kN];      // written by mutator, read by observer
 
+    const unsigned    mObservers;       // number of observers
+
     // "volatile" is meaningless with SMP, but here it indicates that we're using atomic ops
-    volatile const T* mNext; // written by mutator to advance next, read by observer
-    volatile const T* mAck;  // written by observer to acknowledge advance of next, read by mutator
+    volatile const T* mNext; // written by mutator to advance next, read by observers
+    volatile const T* mAck[kMaxObservers];  // written by each observer to acknowledge
+                                            // advance of next, read by mutator
 
-    // only used by observer
-    const T*          mCurrent;         // most recent value returned by poll()
+    // only used by observers, indexed by observer
+    const T*          mCurrent[kMaxObservers];  // most recent value returned by poll()
 
     // only used by mutator
     T*                mMutating;        // where updates by mutator are done in place
-    const T*          mExpecting;       // what the mutator expects mAck to be set to
+    const T*          mExpecting;       // what the mutator expects all mAck to be set to
+    const T*          mPushed;          // most recently pushed state, or NULL if none
     bool              mInMutation;      // whether we're currently in the middle of a mutation
     bool              mIsDirty;         // whether mutating state has been modified since last push
     bool              mIsInitialized;   // whether mutating state has been initialized yet
 
+    // whether all observers have acknowledged the specified state
+    bool              isAckedByAll(const T *state) const;
+
 #ifdef STATE_QUEUE_DUMP
     StateQueueObserverDump  mObserverDummyDump; // default area for observer dump if not set
-    StateQueueObserverDump* mObserverDump;      // pointer to active observer dump, always non-NULL
+    StateQueueObserverDump* mObserverDump[kMaxObservers]; // pointers to active observer dumps,
+                                                          // always non-NULL
     StateQueueMutatorDump   mMutatorDummyDump;  // default area for mutator dump if not set
     StateQueueMutatorDump*  mMutatorDump;       // pointer to active mutator dump, always non-NULL
 #endif
@@ -16,6 +16,7 @@
 
 #include "Configuration.h"
 #include "FastMixerState.h"
+#include "FastCaptureState.h"
 #include "StateQueue.h"
 
 // FIXME hack for gcc
@@ -23,5 +24,6 @@
 namespace android {
 
 template class StateQueue<FastMixerState>;  // typedef FastMixerStateQueue
+template class StateQueue<FastCaptureState>;    // typedef FastCaptureStateQueue
 
 }
@@ -36,6 +36,7 @@
 #include <audio_utils/primitives.h>
 
 // NBAIO implementations
+#include <media/nbaio/AudioStreamInSource.h>
 #include <media/nbaio/AudioStreamOutSink.h>
 #include <media/nbaio/MonoPipe.h>
 #include <media/nbaio/MonoPipeReader.h>
@@ -129,9 +130,35 @@ static const enum {
     //  up large writes into smaller ones, and the wrapper would need to deal with scheduler.
 } kUseFastMixer = FastMixer_Static;
 
+// Whether to use fast capture
+static const enum {
+    FastCapture_Never,  // never initialize or use: for debugging only
+    FastCapture_Always, // always initialize and use, even if not needed: for debugging only
+    FastCapture_Static, // initialize if needed, then use all the time if initialized
+} kUseFastCapture = FastCapture_Static;
+
+// fast capture is needed if the HAL input buffer is shorter than this, expressed in milliseconds
+static const uint32_t kMinNormalCaptureBufferSizeMs = 12;
+
+// depth of the pipe between fast capture and RecordThread, in HAL input buffers;
+// this compensates for scheduling latency of the normal RecordThread
+static const size_t kFastCapturePipeDepth = 8;
+
+// maximum number of attempts by RecordThread to read a full buffer from the fast capture pipe,
+// each separated by half a fast capture period
+static const int kMaxFastCaptureReadRetries = 8;
+
+// duration of the window over which the normal mixer measures CPU load per session
+static const nsecs_t kCpuLoadWindowNs = seconds(1);
+// normal mixer CPU load, as a percentage of wall clock time, above which low priority sessions
+// are resampled at reduced quality, and below which they are restored to their normal quality
+static const uint32_t kCpuLoadHighPercent = 50;
+static const uint32_t kCpuLoadLowPercent = 25;
+
 // Priorities for requestPriority
 static const int kPriorityAudioApp = 2;
 static const int kPriorityFastMixer = 3;
+static const int kPriorityFastCapture = 3;
 
 // IAudioFlinger::createTrack() reports back to client the total size of shared memory area
 // for the track.  The client then sub-divides this into smaller buffers for its use.
@@ -2449,7 +2476,9 @@ AudioFlinger::MixerThread::MixerThread(const sp<AudioFlinger>& audioFlinger, Aud
     :   PlaybackThread(audioFlinger, output, id, device, type),
         // mAudioMixer below
         // mFastMixer below
-        mFastMixerFutex(0)
+        mFastMixerFutex(0),
+        mMixerCpuNs(0), mEffectCpuNs(0), mCpuLoadWindowStartNs(0),
+        mCpuLoadPercent(0), mShedLoad(false), mCpuLoadDumpCount(0)
         // mOutputSink below
         // mPipeSink below
         // mNormalSink below
@@ -2763,7 +2792,9 @@ void AudioFlinger::MixerThread::threadLoop_mix()
     }
 
     // mix buffers...
+    nsecs_t startNs = systemTime();
     mAudioMixer->process(pts);
+    mMixerCpuNs += systemTime() - startNs;
     mCurrentWriteLength = mixBufferSize;
     // increase sleep time progressively when application underrun condition clears.
     // Only increase sleep time if the mixer is ready for two consecutive times to avoid
@@ -2806,11 +2837,26 @@ void AudioFlinger::MixerThread::threadLoop_sleepTime()
     // TODO add standby time extension fct of effect tail
 }
 
+// streams whose tracks can be resampled at reduced quality when the mixer is overloaded
+static bool isLowPriorityStream(audio_stream_type_t stream)
+{
+    switch (stream) {
+    case AUDIO_STREAM_VOICE_CALL:
+    case AUDIO_STREAM_MUSIC:
+    case AUDIO_STREAM_BLUETOOTH_SCO:
+        return false;
+    default:
+        return true;
+    }
+}
+
 // prepareTracks_l() must be called with ThreadBase::mLock held
 AudioFlinger::PlaybackThread::mixer_state AudioFlinger::MixerThread::prepareTracks_l(
         Vector< sp<Track> > *tracksToRemove)
 {
 
+    updateCpuLoad_l();
+
     mixer_state mixerStatus = MIXER_IDLE;
     // find out which tracks need to be processed
     size_t count = mActiveTracks.size();
@@ -3181,6 +3227,12 @@ AudioFlinger::PlaybackThread::mixer_state AudioFlinger::MixerThread::prepareTrac
                 AudioMixer::RESAMPLE,
                 AudioMixer::SAMPLE_RATE,
                 (void *)reqSampleRate);
+            mAudioMixer->setParameter(
+                name,
+                AudioMixer::RESAMPLE,
+                AudioMixer::QUALITY,
+                (void *)((mShedLoad && isLowPriorityStream(track->streamType())) ?
+                        AudioResampler::LOW_QUALITY : AudioResampler::DEFAULT_QUALITY));
             mAudioMixer->setParameter(
                 name,
                 AudioMixer::TRACK,
@@ -3463,6 +3515,77 @@ bool AudioFlinger::MixerThread::checkForNewParameters_l()
     return reconfig;
 }
 
+// updateCpuLoad_l() must be called with ThreadBase::mLock held, from the thread loop only
+void AudioFlinger::MixerThread::updateCpuLoad_l()
+{
+    nsecs_t now = systemTime();
+    if (mCpuLoadWindowStartNs == 0) {
+        mCpuLoadWindowStartNs = now;
+    }
+
+    // collect the cost of the previous mix cycle per session
+    size_t count = mActiveTracks.size();
+    for (size_t i = 0; i < count; i++) {
+        const sp<Track> t = mActiveTracks[i].promote();
+        if (t == 0 || t->isFastTrack()) {
+            continue;
+        }
+        uint32_t ns = mAudioMixer->getTrackCpuNs(t->name());
+        ssize_t index = mSessionCpuLoad.indexOfKey(t->sessionId());
+        if (index < 0) {
+            index = mSessionCpuLoad.add(t->sessionId(), SessionCpuLoad());
+        }
+        mSessionCpuLoad.editValueAt(index).mMixNs += ns;
+    }
+    int64_t effectNs = 0;
+    for (size_t i = 0; i < mEffectChains.size(); i++) {
+        int64_t ns = mEffectChains[i]->getCpuNs();
+        if (ns == 0) {
+            continue;
+        }
+        ssize_t index = mSessionCpuLoad.indexOfKey(mEffectChains[i]->sessionId());
+        if (index < 0) {
+            index = mSessionCpuLoad.add(mEffectChains[i]->sessionId(), SessionCpuLoad());
+        }
+        mSessionCpuLoad.editValueAt(index).mEffectNs += ns;
+        effectNs += ns;
+    }
+    mEffectCpuNs += effectNs;
+
+    nsecs_t windowNs = now - mCpuLoadWindowStartNs;
+    if (windowNs < kCpuLoadWindowNs) {
+        return;
+    }
+
+    // the window has elapsed: evaluate the load and start a new window
+    mCpuLoadPercent = (uint32_t) (((mMixerCpuNs + mEffectCpuNs) * 100) / windowNs);
+    if (!mShedLoad && mCpuLoadPercent > kCpuLoadHighPercent) {
+        ALOGW("mixer load %u%% above %u%%, reducing quality of low priority sessions",
+                mCpuLoadPercent, kCpuLoadHighPercent);
+        mShedLoad = true;
+    } else if (mShedLoad && mCpuLoadPercent < kCpuLoadLowPercent) {
+        ALOGI("mixer load %u%% below %u%%, restoring quality of low priority sessions",
+                mCpuLoadPercent, kCpuLoadLowPercent);
+        mShedLoad = false;
+    }
+
+    size_t n = mSessionCpuLoad.size();
+    if (n > kMaxCpuLoadDumpSessions) {
+        n = kMaxCpuLoadDumpSessions;
+    }
+    for (size_t i = 0; i < n; i++) {
+        const SessionCpuLoad& load = mSessionCpuLoad.valueAt(i);
+        mCpuLoadDump[i].mSessionId = mSessionCpuLoad.keyAt(i);
+        mCpuLoadDump[i].mMixPermille = (uint32_t) ((load.mMixNs * 1000) / windowNs);
+        mCpuLoadDump[i].mEffectPermille = (uint32_t) ((load.mEffectNs * 1000) / windowNs);
+    }
+    mCpuLoadDumpCount = n;
+
+    mSessionCpuLoad.clear();
+    mMixerCpuNs = 0;
+    mEffectCpuNs = 0;
+    mCpuLoadWindowStartNs = now;
+}
 
 void AudioFlinger::MixerThread::dumpInternals(int fd, const Vector<String16>& args)
 {
@@ -3474,6 +3597,19 @@ void AudioFlinger::MixerThread::dumpInternals(int fd, const Vector<String16>& ar
 
     snprintf(buffer, SIZE, "AudioMixer tracks: %08x\n", mAudioMixer->trackNames());
     result.append(buffer);
+    // not locked, so the per-session values may be from different windows
+    snprintf(buffer, SIZE, "Mixer CPU load: %u%%%s\n", mCpuLoadPercent,
+            mShedLoad ? " (reduced quality for low priority sessions)" : "");
+    result.append(buffer);
+    size_t n = mCpuLoadDumpCount;
+    if (n > 0) {
+        result.append("  Session Resampler Effects (per mille)\n");
+        for (size_t i = 0; i < n && i < kMaxCpuLoadDumpSessions; i++) {
+            snprintf(buffer, SIZE, "  %7d %9u %7u\n", mCpuLoadDump[i].mSessionId,
+                    mCpuLoadDump[i].mMixPermille, mCpuLoadDump[i].mEffectPermille);
+            result.append(buffer);
+        }
+    }
     write(fd, result.string(), result.size());
 
     // Make a non-atomic copy of fast mixer dump state so it won't change underneath us
@@ -4048,13 +4184,27 @@ AudioFlinger::PlaybackThread::mixer_state AudioFlinger::OffloadThread::prepareTr
                         // flush data already sent to the DSP if changing audio session as audio
                         // comes from a different source. Also invalidate previous track to force a
                         // seek when resuming.
-                        if (previousTrack->sessionId() != track->sessionId()) {
+                        // A previous track that was stopped at end of stream is being played out
+                        // by the DSP and the new track is a gapless continuation of it: keep the
+                        // HAL running instead of discarding the tail of the previous stream.
+                        if (previousTrack->sessionId() != track->sessionId() &&
+                                !previousTrack->isStopping() &&
+                                previousTrack->mState != TrackBase::STOPPED) {
                             previousTrack->invalidate();
                             mFlushPending = true;
                         }
                     }
                 }
                 mPreviousTrack = track;
+                if (!track->mOffloadParameters.isEmpty()) {
+                    // codec parameters (encoder delay, padding...) queued while another track
+                    // was rendered must reach the HAL before the first buffer of this track
+                    ALOGV("OffloadThread: gapless transition to track %d, parameters %s",
+                          track->name(), track->mOffloadParameters.string());
+                    mOutput->stream->common.set_parameters(&mOutput->stream->common,
+                                                           track->mOffloadParameters.string());
+                    track->mOffloadParameters.clear();
+                }
                 // reset retry count
                 track->mRetryCount = kMaxTrackRetriesOffload;
                 mActiveTrack = t;
@@ -4149,6 +4299,26 @@ void AudioFlinger::OffloadThread::flushOutput_l()
     mFlushPending = true;
 }
 
+status_t AudioFlinger::OffloadThread::setTrackParameters(Track *track,
+                                                          const String8& keyValuePairs)
+{
+    {
+        Mutex::Autolock _l(mLock);
+        sp<Track> previousTrack = mPreviousTrack.promote();
+        if (previousTrack != 0 && previousTrack.get() != track &&
+                mActiveTracks.indexOf(previousTrack) >= 0) {
+            // Another track still owns the compressed stream in the HAL: queue the parameters
+            // with the track and apply them in prepareTracks_l() when switching to it.
+            if (!track->mOffloadParameters.isEmpty()) {
+                track->mOffloadParameters.append(";");
+            }
+            track->mOffloadParameters.append(keyValuePairs);
+            return NO_ERROR;
+        }
+    }
+    return setParameters(keyValuePairs);
+}
+
 // must be called with thread mutex locked
 bool AudioFlinger::OffloadThread::waitingAsyncCallback_l()
 {
@@ -4381,9 +4551,12 @@ AudioFlinger::RecordThread::RecordThread(const sp<AudioFlinger>& audioFlinger,
     mInput(input), mResampler(NULL), mRsmpOutBuffer(NULL), mRsmpInBuffer(NULL),
     // mRsmpInIndex and mBufferSize set by readInputParameters()
     mReqChannelCount(popcount(channelMask)),
-    mReqSampleRate(sampleRate)
+    mReqSampleRate(sampleRate),
     // mBytesRead is only meaningful while active, and so is cleared in start()
     // (but might be better to also clear here for dump?)
+    mFastCapture(NULL),
+    mFastCaptureFutex(0)
+    // mInputSource, mPipeSink and mPipeSource below
 #ifdef TEE_SINK
     , mTeeSink(teeSink)
 #endif
@@ -4391,11 +4564,62 @@ AudioFlinger::RecordThread::RecordThread(const sp<AudioFlinger>& audioFlinger,
     snprintf(mName, kNameLength, "AudioIn_%X", id);
 
     readInputParameters();
+
+    // initialize fast capture depending on configuration
+    bool initFastCapture;
+    switch (kUseFastCapture) {
+    case FastCapture_Never:
+        initFastCapture = false;
+        break;
+    case FastCapture_Always:
+        initFastCapture = true;
+        break;
+    case FastCapture_Static:
+        initFastCapture = (mBufferSize / mFrameSize) * 1000 <
+                kMinNormalCaptureBufferSizeMs * mSampleRate;
+        break;
+    }
+    // fast capture only supports the formats that RecordThread itself supports
+    if (mFormat != AUDIO_FORMAT_PCM_16_BIT || mChannelCount > FCC_2) {
+        initFastCapture = false;
+    }
+    if (initFastCapture) {
+
+        // create fast capture and configure it initially as cold idle
+        mFastCapture = new FastCapture();
+        mFastCaptureNBLogWriter = audioFlinger->newWriter_l(kFastCaptureLogSize, "FastCapture");
+        configureFastCapture();
+
+        // start the fast capture
+        mFastCapture->run("FastCapture", PRIORITY_URGENT_AUDIO);
+        pid_t tid = mFastCapture->getTid();
+        int err = requestPriority(getpid_cached, tid, kPriorityFastCapture);
+        if (err != 0) {
+            ALOGW("Policy SCHED_FIFO priority %d is unavailable for pid %d tid %d; error %d",
+                    kPriorityFastCapture, getpid_cached, tid, err);
+        }
+    }
 }
 
 
 AudioFlinger::RecordThread::~RecordThread()
 {
+    if (mFastCapture != NULL) {
+        FastCaptureStateQueue *sq = mFastCapture->sq();
+        FastCaptureState *state = sq->begin();
+        if (state->mCommand == FastCaptureState::COLD_IDLE) {
+            int32_t old = android_atomic_inc(&mFastCaptureFutex);
+            if (old == -1) {
+                __futex_syscall3(&mFastCaptureFutex, FUTEX_WAKE_PRIVATE, 1);
+            }
+        }
+        state->mCommand = FastCaptureState::EXIT;
+        sq->end();
+        sq->push(FastCaptureStateQueue::BLOCK_UNTIL_PUSHED);
+        mFastCapture->join();
+        delete mFastCapture;
+    }
+    mAudioFlinger->unregisterWriter(mFastCaptureNBLogWriter);
     delete[] mRsmpInBuffer;
     delete mResampler;
     delete[] mRsmpOutBuffer;
@@ -4538,8 +4762,7 @@ bool AudioFlinger::RecordThread::threadLoop()
                                 readInto = mRsmpInBuffer;
                                 mRsmpInIndex = 0;
                             }
-                            mBytesRead = mInput->stream->read(mInput->stream, readInto,
-                                    mBufferSize);
+                            mBytesRead = readInput(readInto, mBufferSize);
                             if (mBytesRead <= 0) {
                                 if ((mBytesRead < 0) && (mActiveTrack->mState == TrackBase::ACTIVE))
                                 {
@@ -4657,9 +4880,123 @@ void AudioFlinger::RecordThread::standby()
 
 void AudioFlinger::RecordThread::inputStandBy()
 {
+    idleFastCapture();
     mInput->stream->common.standby(&mInput->stream->common);
 }
 
+void AudioFlinger::RecordThread::idleFastCapture()
+{
+    // Idle the fast capture if it's currently running
+    if (mFastCapture != NULL) {
+        FastCaptureStateQueue *sq = mFastCapture->sq();
+        FastCaptureState *state = sq->begin();
+        if (!(state->mCommand & FastCaptureState::IDLE)) {
+            state->mCommand = FastCaptureState::COLD_IDLE;
+            state->mColdFutexAddr = &mFastCaptureFutex;
+            state->mColdGen++;
+            mFastCaptureFutex = 0;
+            sq->end();
+            // BLOCK_UNTIL_PUSHED would be insufficient, as we need it to stop doing I/O now
+            sq->push(FastCaptureStateQueue::BLOCK_UNTIL_ACKED);
+        } else {
+            sq->end(false /*didModify*/);
+        }
+    }
+}
+
+ssize_t AudioFlinger::RecordThread::readInput(void *buffer, size_t bytes)
+{
+    if (mFastCapture == NULL) {
+        return mInput->stream->read(mInput->stream, buffer, bytes);
+    }
+
+    // Start the fast capture if it's not already running
+    FastCaptureStateQueue *sq = mFastCapture->sq();
+    FastCaptureState *state = sq->begin();
+    if (state->mCommand != FastCaptureState::READ_WRITE) {
+        // whatever is left in the pipe was captured before the fast capture was idled
+        ((PipeReader *) mPipeSource.get())->flush();
+        if (state->mCommand == FastCaptureState::COLD_IDLE) {
+            int32_t old = android_atomic_inc(&mFastCaptureFutex);
+            if (old == -1) {
+                __futex_syscall3(&mFastCaptureFutex, FUTEX_WAKE_PRIVATE, 1);
+            }
+        }
+        state->mCommand = FastCaptureState::READ_WRITE;
+        sq->end();
+        sq->push(FastCaptureStateQueue::BLOCK_UNTIL_PUSHED);
+    } else {
+        sq->end(false /*didModify*/);
+    }
+
+    // The pipe is non-blocking, so emulate a blocking HAL read by waiting
+    // for the fast capture to deliver enough frames.
+    size_t framesToRead = bytes / mFrameSize;
+    size_t framesRead = 0;
+    useconds_t sleepUs = (framesToRead * 500000LL) / mSampleRate;  // half a period
+    int retries = 0;
+    while (framesRead < framesToRead) {
+        ssize_t ret = mPipeSource->read((int8_t *) buffer + framesRead * mFrameSize,
+                framesToRead - framesRead, AudioBufferProvider::kInvalidPTS);
+        if (ret > 0) {
+            framesRead += ret;
+        } else if (ret == 0) {
+            if (++retries > kMaxFastCaptureReadRetries || exitPending()) {
+                // fast capture is not delivering: report no data rather than a partial buffer
+                ALOGW("RecordThread: fast capture timeout, %zu frames dropped", framesRead);
+                return 0;
+            }
+            usleep(sleepUs);
+        }
+        // else overrun: the pipe reader has already skipped ahead, so just read again
+    }
+    return framesRead * mFrameSize;
+}
+
+void AudioFlinger::RecordThread::configureFastCapture()
+{
+    // create an NBAIO source for the HAL input stream, and negotiate
+    mInputSource = new AudioStreamInSource(mInput->stream);
+    size_t numCounterOffers = 0;
+    const NBAIO_Format offers[1] = {Format_from_SR_C(mSampleRate, mChannelCount)};
+    ssize_t index = mInputSource->negotiate(offers, 1, NULL, numCounterOffers);
+    ALOG_ASSERT(index == 0);
+
+    // create a Pipe for the fast capture to write to, and a PipeReader for us to read from;
+    // the reader must be released before the pipe it refers to
+    size_t frameCount = mBufferSize / mFrameSize;
+    mPipeSource.clear();
+    Pipe *pipe = new Pipe(frameCount * kFastCapturePipeDepth, mInputSource->format());
+    numCounterOffers = 0;
+    index = pipe->negotiate(offers, 1, NULL, numCounterOffers);
+    ALOG_ASSERT(index == 0);
+    mPipeSink = pipe;
+    PipeReader *pipeReader = new PipeReader(*pipe);
+    numCounterOffers = 0;
+    index = pipeReader->negotiate(offers, 1, NULL, numCounterOffers);
+    ALOG_ASSERT(index == 0);
+    mPipeSource = pipeReader;
+
+    FastCaptureStateQueue *sq = mFastCapture->sq();
+    FastCaptureState *state = sq->begin();
+    state->mInputSource = mInputSource.get();
+    state->mInputSourceGen++;
+    state->mPipeSink = pipe;
+    state->mPipeSinkGen++;
+    state->mFrameCount = frameCount;
+    if (state->mCommand == FastCaptureState::INITIAL) {
+        state->mCommand = FastCaptureState::COLD_IDLE;
+        state->mColdFutexAddr = &mFastCaptureFutex;
+        state->mColdGen++;
+        // already done in constructor initialization list
+        //mFastCaptureFutex = 0;
+    }
+    state->mDumpState = &mFastCaptureDumpState;
+    state->mNBLogWriter = mFastCaptureNBLogWriter.get();
+    sq->end();
+    sq->push(FastCaptureStateQueue::BLOCK_UNTIL_PUSHED);
+}
+
 sp<AudioFlinger::RecordThread::RecordTrack>  AudioFlinger::RecordThread::createRecordTrack_l(
         const sp<AudioFlinger::Client>& client,
         uint32_t sampleRate,
@@ -4975,6 +5312,12 @@ void AudioFlinger::RecordThread::dumpInternals(int fd, const Vector<String16>& a
 
     write(fd, result.string(), result.size());
 
+    if (mFastCapture != NULL) {
+        // Make a non-atomic copy of fast capture dump state so it won't change underneath us
+        const FastCaptureDumpState copy(mFastCaptureDumpState);
+        copy.dump(fd);
+    }
+
     dumpBase(fd, args);
 }
 
@@ -5129,6 +5472,8 @@ bool AudioFlinger::RecordThread::checkForNewParameters_l()
             mAudioSource = (audio_source_t)value;
         }
         if (status == NO_ERROR) {
+            // the fast capture must not read from the HAL while it is being reconfigured
+            idleFastCapture();
             status = mInput->stream->common.set_parameters(&mInput->stream->common,
                     keyValuePair.string());
             if (status == INVALID_OPERATION) {
@@ -5149,6 +5494,11 @@ bool AudioFlinger::RecordThread::checkForNewParameters_l()
                 }
                 if (status == NO_ERROR) {
                     readInputParameters();
+                    if (mFastCapture != NULL) {
+                        // already idled above; this also replaces the pipe, so no
+                        // frames in the old configuration can be read
+                        configureFastCapture();
+                    }
                     sendIoConfigEvent_l(AudioSystem::INPUT_CONFIG_CHANGED);
                 }
             }
@@ -691,6 +691,34 @@ private:
                 //          mFastMixer->sq()    // for mutating and pushing state
                 int32_t     mFastMixerFutex;    // for cold idle
 
+                // Per-session CPU accounting of the normal mixer and effect chains.
+                // When the load is too high, tracks of low priority streams are resampled at
+                // LOW_QUALITY until it drops again, see updateCpuLoad_l().
+                void        updateCpuLoad_l();
+
+                struct SessionCpuLoad {
+                    SessionCpuLoad() : mMixNs(0), mEffectNs(0) { }
+                    int64_t mMixNs;         // resampling time in mAudioMixer
+                    int64_t mEffectNs;      // time in the session's effect chain
+                };
+
+                // accessible only within the threadLoop()
+                int64_t     mMixerCpuNs;    // time in mAudioMixer->process() in current window
+                int64_t     mEffectCpuNs;   // time in effect chains in current window
+                nsecs_t     mCpuLoadWindowStartNs;
+                KeyedVector<int, SessionCpuLoad> mSessionCpuLoad;   // current window
+
+                // result of the last complete window, read by dump without locks
+                uint32_t    mCpuLoadPercent;
+                bool        mShedLoad;      // true if low priority sessions are at reduced quality
+                static const size_t kMaxCpuLoadDumpSessions = 8;
+                struct {
+                    int         mSessionId;
+                    uint32_t    mMixPermille;
+                    uint32_t    mEffectPermille;
+                } mCpuLoadDump[kMaxCpuLoadDumpSessions];
+                size_t      mCpuLoadDumpCount;
+
 public:
     virtual     bool        hasFastMixer() const { return mFastMixer != NULL; }
     virtual     FastTrackUnderruns getFastTrackUnderruns(size_t fastIndex) const {
@@ -744,6 +772,10 @@ public:
                         audio_io_handle_t id, uint32_t device);
     virtual                 ~OffloadThread() {};
 
+                // set parameters on behalf of a track: parameters of a track queued behind the
+                // one currently rendered are deferred until the transition to that track
+                status_t    setTrackParameters(Track *track, const String8& keyValuePairs);
+
 protected:
     // threadLoop snippets
     virtual     mixer_state prepareTracks_l(Vector< sp<Track> > *tracksToRemove);
@@ -923,7 +955,7 @@ public:
            void handleSyncStartEvent(const sp<SyncEvent>& event);
 
     virtual size_t      frameCount() const { return mFrameCount; }
-            bool        hasFastRecorder() const { return false; }
+            bool        hasFastRecorder() const { return mFastCapture != NULL; }
 
 private:
             void clearSyncStartEvent();
@@ -931,9 +963,22 @@ private:
             // Enter standby if not already in standby, and set mStandby flag
             void standby();
 
-            // Call the HAL standby method unconditionally, and don't change mStandby flag
+            // Call the HAL standby method unconditionally, and don't change mStandby flag.
+            // Also idles the fast capture thread if there is one.
             void inputStandBy();
 
+            // Put the fast capture thread, if any, into cold idle and wait until it has
+            // stopped reading from the HAL.
+            void idleFastCapture();
+
+            // Read from the HAL input, or from the fast capture pipe if there is a fast capture.
+            // Returns the number of bytes read, or a negative status.
+            ssize_t readInput(void *buffer, size_t bytes);
+
+            // (Re)create the NBAIO input source and pipe for the current input configuration,
+            // and push them to the fast capture. The fast capture must be idle.
+            void configureFastCapture();
+
             AudioStreamIn                       *mInput;
             SortedVector < sp<RecordTrack> >    mTracks;
             // mActiveTrack has dual roles:  it indicates the current active track, and
@@ -959,6 +1004,22 @@ private:
             // not received
             ssize_t                             mFramestoDrop;
 
+            // fast capture, only used when the HAL input buffer is small
+            FastCapture*                        mFastCapture;   // non-NULL if there is a fast
+                                                                // capture thread
+            // contents are not guaranteed to be consistent, no locks required
+            FastCaptureDumpState                mFastCaptureDumpState;
+            // accessible only within the threadLoop(), no locks required
+            //          mFastCapture->sq()      // for mutating and pushing state
+            int32_t                             mFastCaptureFutex;  // for cold idle
+            sp<NBAIO_Source>                    mInputSource;   // HAL input, read by fast capture
+            sp<NBAIO_Sink>                      mPipeSink;      // written by fast capture
+            sp<NBAIO_Source>                    mPipeSource;    // read by RecordThread instead of
+                                                                // the HAL input; must be
+                                                                // destroyed before mPipeSink
+            static const size_t                 kFastCaptureLogSize = 4 * 1024;
+            sp<NBLog::Writer>                   mFastCaptureNBLogWriter;
+
             // For dumpsys
             const sp<NBAIO_Sink>                mTeeSink;
 };
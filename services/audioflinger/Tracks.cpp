@@ -766,8 +766,10 @@ status_t AudioFlinger::PlaybackThread::Track::setParameters(const String8& keyVa
     if (thread == 0) {
         ALOGE("thread is dead");
         return FAILED_TRANSACTION;
-    } else if ((thread->type() == ThreadBase::DIRECT) ||
-                    (thread->type() == ThreadBase::OFFLOAD)) {
+    } else if (thread->type() == ThreadBase::OFFLOAD) {
+        OffloadThread *offloadThread = (OffloadThread *)thread.get();
+        return offloadThread->setTrackParameters(this, keyValuePairs);
+    } else if (thread->type() == ThreadBase::DIRECT) {
         return thread->setParameters(keyValuePairs);
     } else {
         return PERMISSION_DENIED;
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark of StateQueue push() to poll() latency, with one mutator and several observers
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// template definitions, implicitly instantiated below for BenchmarkState
+#include "StateQueue.cpp"
+
+using namespace android;
+
+struct BenchmarkState {
+    BenchmarkState() : mSequence(0), mPushNs(0), mExit(false) { }
+    unsigned    mSequence;  // incremented by each mutation
+    int64_t     mPushNs;    // time of the push, CLOCK_MONOTONIC
+    bool        mExit;      // observers exit when set
+};
+
+typedef StateQueue<BenchmarkState> BenchmarkStateQueue;
+
+static int64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct ObserverStats {
+    ObserverStats() : mQueue(NULL), mIndex(0), mStates(0), mPolls(0),
+            mTotalLatencyNs(0), mMaxLatencyNs(0) { }
+    BenchmarkStateQueue *mQueue;
+    unsigned    mIndex;
+    unsigned    mStates;            // number of distinct states observed
+    unsigned    mPolls;             // number of calls to poll()
+    int64_t     mTotalLatencyNs;
+    int64_t     mMaxLatencyNs;
+};
+
+static void *observerLoop(void *arg)
+{
+    ObserverStats *stats = (ObserverStats *) arg;
+    const BenchmarkState *previous = NULL;
+    for (;;) {
+        const BenchmarkState *current = stats->mQueue->poll(stats->mIndex);
+        stats->mPolls++;
+        if (current == NULL || current == previous) {
+            continue;
+        }
+        if (current->mExit) {
+            break;
+        }
+        int64_t latencyNs = nowNs() - current->mPushNs;
+        stats->mStates++;
+        stats->mTotalLatencyNs += latencyNs;
+        if (latencyNs > stats->mMaxLatencyNs) {
+            stats->mMaxLatencyNs = latencyNs;
+        }
+        previous = current;
+    }
+    return NULL;
+}
+
+static int usage(const char* name) {
+    fprintf(stderr,"Usage: %s [-o observers] [-n pushes] [-p period-us] [-b]\n", name);
+    fprintf(stderr,"    -o    number of observer threads, 1 to %u (default 1)\n",
+            BenchmarkStateQueue::kMaxObservers);
+    fprintf(stderr,"    -n    number of mutations (default 10000)\n");
+    fprintf(stderr,"    -p    mutator period in microseconds (default 1000)\n");
+    fprintf(stderr,"    -b    never block in push(), coalesce mutations instead\n");
+    return -1;
+}
+
+int main(int argc, char* argv[]) {
+
+    const char* const progname = argv[0];
+    unsigned observers = 1;
+    unsigned pushes = 10000;
+    unsigned periodUs = 1000;
+    bool blockNever = false;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "o:n:p:b")) != -1) {
+        switch (ch) {
+        case 'o':
+            observers = atoi(optarg);
+            break;
+        case 'n':
+            pushes = atoi(optarg);
+            break;
+        case 'p':
+            periodUs = atoi(optarg);
+            break;
+        case 'b':
+            blockNever = true;
+            break;
+        case '?':
+        default:
+            usage(progname);
+            return -1;
+        }
+    }
+    if (observers < 1 || observers > BenchmarkStateQueue::kMaxObservers) {
+        usage(progname);
+        return -1;
+    }
+
+    BenchmarkStateQueue *sq = new BenchmarkStateQueue(observers);
+    ObserverStats stats[BenchmarkStateQueue::kMaxObservers];
+    pthread_t threads[BenchmarkStateQueue::kMaxObservers];
+    for (unsigned i = 0; i < observers; i++) {
+        stats[i].mQueue = sq;
+        stats[i].mIndex = i;
+        pthread_create(&threads[i], NULL, observerLoop, &stats[i]);
+    }
+
+    const BenchmarkStateQueue::block_t block = blockNever ?
+            BenchmarkStateQueue::BLOCK_NEVER : BenchmarkStateQueue::BLOCK_UNTIL_PUSHED;
+    unsigned pushed = 0;
+    int64_t totalPushNs = 0;
+    int64_t maxPushNs = 0;
+    for (unsigned i = 0; i < pushes; i++) {
+        BenchmarkState *state = sq->begin();
+        state->mSequence++;
+        state->mPushNs = nowNs();
+        sq->end();
+        int64_t beforeNs = nowNs();
+        if (sq->push(block)) {
+            pushed++;
+        }
+        int64_t pushNs = nowNs() - beforeNs;
+        totalPushNs += pushNs;
+        if (pushNs > maxPushNs) {
+            maxPushNs = pushNs;
+        }
+        if (periodUs > 0) {
+            usleep(periodUs);
+        }
+    }
+
+    BenchmarkState *state = sq->begin();
+    state->mExit = true;
+    sq->end();
+    sq->push(BenchmarkStateQueue::BLOCK_UNTIL_ACKED);
+    for (unsigned i = 0; i < observers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("mutator: %u mutations, %u pushed, push() mean %.1f us, max %.1f us\n",
+            pushes, pushed, pushes > 0 ? totalPushNs * 1e-3 / pushes : 0.0, maxPushNs * 1e-3);
+    for (unsigned i = 0; i < observers; i++) {
+        printf("observer %u: %u states in %u polls, latency mean %.1f us, max %.1f us\n",
+                i, stats[i].mStates, stats[i].mPolls,
+                stats[i].mStates > 0 ? stats[i].mTotalLatencyNs * 1e-3 / stats[i].mStates : 0.0,
+                stats[i].mMaxLatencyNs * 1e-3);
+    }
+
+    delete sq;
+    return 0;
+}